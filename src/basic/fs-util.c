@@ -1088,8 +1088,6 @@ void unlink_tempfilep(char (*p)[]) {
 
 int unlinkat_deallocate(int fd, const char *name, int flags) {
         _cleanup_close_ int truncate_fd = -1;
-        struct stat st;
-        off_t l, bs;
 
         /* Operates like unlinkat() but also deallocates the file contents if it is a regular file and there's no other
          * link to it. This is useful to ensure that other processes that might have the file open for reading won't be
@@ -1129,8 +1127,18 @@ int unlinkat_deallocate(int fd, const char *name, int flags) {
         if (truncate_fd < 0) /* Don't have a file handle, can't do more ☹️ */
                 return 0;
 
-        if (fstat(truncate_fd, &st) < 0) {
-                log_debug_errno(errno, "Failed to stat file '%s' for deallocation, ignoring.", name);
+        return fd_deallocate(truncate_fd);
+}
+
+int fd_deallocate(int fd) {
+        struct stat st;
+        off_t l, bs;
+
+        /* Releases the disk space of a file that was deleted, see unlinkat_deallocate(). This may take a while on
+         * large files, hence is split off, so that callers may do it in a thread of their own. */
+
+        if (fstat(fd, &st) < 0) {
+                log_debug_errno(errno, "Failed to stat file for deallocation, ignoring: %m");
                 return 0;
         }
 
@@ -1143,11 +1151,11 @@ int unlinkat_deallocate(int fd, const char *name, int flags) {
         bs = MAX(st.st_blksize, 512);
         l = DIV_ROUND_UP(st.st_size, bs) * bs; /* Round up to next block size */
 
-        if (fallocate(truncate_fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, 0, l) >= 0)
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, 0, l) >= 0)
                 return 0; /* Successfully punched a hole! 😊 */
 
         /* Fall back to truncation */
-        if (ftruncate(truncate_fd, 0) < 0) {
+        if (ftruncate(fd, 0) < 0) {
                 log_debug_errno(errno, "Failed to truncate file to 0, ignoring: %m");
                 return 0;
         }
@@ -101,5 +101,6 @@ int access_fd(int fd, int mode);
 
 void unlink_tempfilep(char (*p)[]);
 int unlinkat_deallocate(int fd, const char *name, int flags);
+int fd_deallocate(int fd);
 
 int fsync_directory_of_file(int fd);
@@ -14,6 +14,10 @@
  * See COREDUMP_MAX in coredump.c */
 #define ENTRY_SIZE_MAX (1024*1024*770u)
 #define DATA_SIZE_MAX (1024*1024*768u)
+/* journald receives native protocol datagrams in batches. Up to this size they stay in memory that is kept around
+ * between batches, the pages of larger ones are given back after each. Hence clients pass larger entries in a memfd
+ * instead. */
+#define NATIVE_DATAGRAM_SIZE_MAX (128*1024u)
 #define LINE_CHUNK 8*1024u
 
 struct iovec_wrapper {
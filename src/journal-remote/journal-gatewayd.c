@@ -6,6 +6,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#if HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #include "sd-bus.h"
 #include "sd-daemon.h"
@@ -13,6 +16,8 @@
 
 #include "alloc-util.h"
 #include "bus-util.h"
+#include "compress.h"
+#include "extract-word.h"
 #include "fd-util.h"
 #include "fileio.h"
 #include "hostname-util.h"
@@ -22,6 +27,7 @@
 #include "os-util.h"
 #include "parse-util.h"
 #include "sigbus.h"
+#include "string-table.h"
 #include "util.h"
 
 #define JOURNAL_WAIT_TIMEOUT (10*USEC_PER_SEC)
@@ -31,6 +37,19 @@ static char *arg_cert_pem = NULL;
 static char *arg_trust_pem = NULL;
 static char *arg_directory = NULL;
 
+/* Responses are serialized in batches of up to about this size, which are compressed as a whole */
+#define RESPONSE_BATCH_SIZE (64U*1024U)
+
+/* In order of preference: we pick the one that compresses best among those the client accepts */
+typedef enum ResponseEncoding {
+        RESPONSE_ENCODING_IDENTITY,
+        RESPONSE_ENCODING_LZ4,
+        RESPONSE_ENCODING_GZIP,
+        RESPONSE_ENCODING_ZSTD,
+        _RESPONSE_ENCODING_MAX,
+        _RESPONSE_ENCODING_INVALID = -1,
+} ResponseEncoding;
+
 typedef struct RequestMeta {
         sd_journal *journal;
 
@@ -41,8 +60,15 @@ typedef struct RequestMeta {
         uint64_t n_entries;
         bool n_entries_set;
 
-        FILE *tmp;
-        uint64_t delta, size;
+        /* The current batch of serialized items, possibly compressed, not yet passed on to microhttpd */
+        void *buf;
+        size_t buf_allocated, buf_size, buf_pos;
+        bool eof;
+
+        ResponseEncoding encoding;
+#if HAVE_ZLIB
+        z_stream *gzip;
+#endif
 
         int argument_parse_error;
 
@@ -53,6 +79,10 @@ typedef struct RequestMeta {
         bool n_fields_set;
 } RequestMeta;
 
+/* Serializes the next item of a response to f. Returns > 0 if there was one, 0 at the end, and -EAGAIN if there
+ * is none yet while following, which is only waited for if wait is set. */
+typedef int (*RequestSerializer)(RequestMeta *m, FILE *f, bool wait);
+
 static const char* const mime_types[_OUTPUT_MODE_MAX] = {
         [OUTPUT_SHORT] = "text/plain",
         [OUTPUT_JSON] = "application/json",
@@ -60,6 +90,35 @@ static const char* const mime_types[_OUTPUT_MODE_MAX] = {
         [OUTPUT_EXPORT] = "application/vnd.fdo.journal",
 };
 
+static const char* const response_encoding_table[_RESPONSE_ENCODING_MAX] = {
+        [RESPONSE_ENCODING_IDENTITY] = "identity",
+        [RESPONSE_ENCODING_LZ4] = "lz4",
+        [RESPONSE_ENCODING_GZIP] = "gzip",
+        [RESPONSE_ENCODING_ZSTD] = "zstd",
+};
+
+DEFINE_PRIVATE_STRING_TABLE_LOOKUP(response_encoding, ResponseEncoding);
+
+static bool response_encoding_supported(ResponseEncoding e) {
+        switch (e) {
+
+        case RESPONSE_ENCODING_IDENTITY:
+                return true;
+
+        case RESPONSE_ENCODING_LZ4:
+                return HAVE_LZ4;
+
+        case RESPONSE_ENCODING_GZIP:
+                return HAVE_ZLIB;
+
+        case RESPONSE_ENCODING_ZSTD:
+                return HAVE_ZSTD;
+
+        default:
+                return false;
+        }
+}
+
 static RequestMeta *request_meta(void **connection_cls) {
         RequestMeta *m;
 
@@ -88,8 +147,14 @@ static void request_meta_free(
 
         sd_journal_close(m->journal);
 
-        safe_fclose(m->tmp);
+#if HAVE_ZLIB
+        if (m->gzip) {
+                deflateEnd(m->gzip);
+                free(m->gzip);
+        }
+#endif
 
+        free(m->buf);
         free(m->cursor);
         free(m);
 }
@@ -106,147 +171,269 @@ static int open_journal(RequestMeta *m) {
                 return sd_journal_open(&m->journal, SD_JOURNAL_LOCAL_ONLY|SD_JOURNAL_SYSTEM);
 }
 
-static int request_meta_ensure_tmp(RequestMeta *m) {
-        assert(m);
+#if HAVE_ZLIB
+static int request_deflate(RequestMeta *m, const void *data, size_t size) {
+        int r;
 
-        if (m->tmp)
-                rewind(m->tmp);
-        else {
-                int fd;
+        assert(m);
 
-                fd = open_tmpfile_unlinkable("/tmp", O_RDWR|O_CLOEXEC);
-                if (fd < 0)
-                        return fd;
+        if (!m->gzip) {
+                m->gzip = new0(z_stream, 1);
+                if (!m->gzip)
+                        return -ENOMEM;
 
-                m->tmp = fdopen(fd, "w+");
-                if (!m->tmp) {
-                        safe_close(fd);
-                        return -errno;
+                r = deflateInit2(m->gzip, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+                if (r != Z_OK) {
+                        m->gzip = mfree(m->gzip);
+                        return -EIO;
                 }
         }
 
+        m->gzip->next_in = (void*) data;
+        m->gzip->avail_in = size;
+        m->buf_size = 0;
+
+        /* Each batch is flushed completely, so that followers see entries as soon as they are written */
+        do {
+                if (!GREEDY_REALLOC(m->buf, m->buf_allocated, m->buf_size + MAX(size / 2, 4096U)))
+                        return -ENOMEM;
+
+                m->gzip->next_out = (uint8_t*) m->buf + m->buf_size;
+                m->gzip->avail_out = m->buf_allocated - m->buf_size;
+
+                r = deflate(m->gzip, m->eof ? Z_FINISH : Z_SYNC_FLUSH);
+                if (!IN_SET(r, Z_OK, Z_STREAM_END))
+                        return -EIO;
+
+                m->buf_size = m->buf_allocated - m->gzip->avail_out;
+        } while (m->eof ? r != Z_STREAM_END : m->gzip->avail_out == 0);
+
         return 0;
 }
+#endif
 
-static ssize_t request_reader_entries(
-                void *cls,
-                uint64_t pos,
-                char *buf,
-                size_t max) {
+static int request_encode(RequestMeta *m, char **data, size_t size) {
+        assert(m);
+        assert(data);
 
-        RequestMeta *m = cls;
+        m->buf_pos = 0;
+
+        switch (m->encoding) {
+
+        case RESPONSE_ENCODING_IDENTITY:
+                free_and_replace(m->buf, *data);
+                m->buf_allocated = m->buf_size = size;
+                return 0;
+
+        case RESPONSE_ENCODING_LZ4:
+                return compress_frame(OBJECT_COMPRESSED_LZ4, *data, size, &m->buf, &m->buf_allocated, &m->buf_size);
+
+        case RESPONSE_ENCODING_ZSTD:
+                return compress_frame(OBJECT_COMPRESSED_ZSTD, *data, size, &m->buf, &m->buf_allocated, &m->buf_size);
+
+#if HAVE_ZLIB
+        case RESPONSE_ENCODING_GZIP:
+                return request_deflate(m, *data, size);
+#endif
+
+        default:
+                return -EPROTONOSUPPORT;
+        }
+}
+
+static int request_fill_buffer(RequestMeta *m, RequestSerializer serialize) {
+        _cleanup_free_ char *data = NULL;
+        _cleanup_fclose_ FILE *f = NULL;
+        size_t size = 0;
+        off_t sz = 0;
         int r;
-        size_t n, k;
 
         assert(m);
-        assert(buf);
-        assert(max > 0);
-        assert(pos >= m->delta);
+        assert(serialize);
 
-        pos -= m->delta;
+        /* Serializes items into memory until the batch is full, or no more are available right away, and
+         * encodes them. Returns -EAGAIN if there's nothing to send yet. */
 
-        while (pos >= m->size) {
-                off_t sz;
+        f = open_memstream(&data, &size);
+        if (!f)
+                return -ENOMEM;
 
-                /* End of this entry, so let's serialize the next
-                 * one */
+        while (!m->eof && (uint64_t) sz < RESPONSE_BATCH_SIZE) {
+                r = serialize(m, f, sz == 0);
+                if (r == -EAGAIN)
+                        break;
+                if (r < 0)
+                        return r;
+                if (r == 0)
+                        m->eof = true;
 
-                if (m->n_entries_set &&
-                    m->n_entries <= 0)
-                        return MHD_CONTENT_READER_END_OF_STREAM;
+                sz = ftello(f);
+                if (sz < 0)
+                        return -errno;
+        }
 
-                if (m->n_skip < 0)
-                        r = sd_journal_previous_skip(m->journal, (uint64_t) -m->n_skip + 1);
-                else if (m->n_skip > 0)
-                        r = sd_journal_next_skip(m->journal, (uint64_t) m->n_skip + 1);
-                else
-                        r = sd_journal_next(m->journal);
+        r = fflush_and_check(f);
+        if (r < 0)
+                return r;
 
-                if (r < 0) {
-                        log_error_errno(r, "Failed to advance journal pointer: %m");
-                        return MHD_CONTENT_READER_END_WITH_ERROR;
-                } else if (r == 0) {
+        f = safe_fclose(f);
 
-                        if (m->follow) {
-                                r = sd_journal_wait(m->journal, (uint64_t) JOURNAL_WAIT_TIMEOUT);
-                                if (r < 0) {
-                                        log_error_errno(r, "Couldn't wait for journal event: %m");
-                                        return MHD_CONTENT_READER_END_WITH_ERROR;
-                                }
-                                if (r == SD_JOURNAL_NOP)
-                                        break;
+        /* gzip needs to be told about the end, everything else just stops */
+        if (size == 0 && !(m->eof && m->encoding == RESPONSE_ENCODING_GZIP)) {
+                m->buf_size = m->buf_pos = 0;
+                return m->eof ? 0 : -EAGAIN;
+        }
 
-                                continue;
-                        }
+        return request_encode(m, &data, size);
+}
 
-                        return MHD_CONTENT_READER_END_OF_STREAM;
-                }
+static ssize_t request_reader(RequestMeta *m, RequestSerializer serialize, char *buf, size_t max) {
+        size_t n;
+        int r;
 
-                if (m->discrete) {
-                        assert(m->cursor);
+        assert(m);
+        assert(buf);
+        assert(max > 0);
 
-                        r = sd_journal_test_cursor(m->journal, m->cursor);
-                        if (r < 0) {
-                                log_error_errno(r, "Failed to test cursor: %m");
-                                return MHD_CONTENT_READER_END_WITH_ERROR;
-                        }
+        while (m->buf_pos >= m->buf_size) {
+                if (m->eof)
+                        return MHD_CONTENT_READER_END_OF_STREAM;
 
-                        if (r == 0)
-                                return MHD_CONTENT_READER_END_OF_STREAM;
+                r = request_fill_buffer(m, serialize);
+                if (r == -EAGAIN)
+                        return 0;
+                if (r < 0) {
+                        log_error_errno(r, "Failed to prepare response: %m");
+                        return MHD_CONTENT_READER_END_WITH_ERROR;
                 }
+        }
+
+        n = MIN(m->buf_size - m->buf_pos, max);
+        memcpy(buf, (uint8_t*) m->buf + m->buf_pos, n);
+        m->buf_pos += n;
 
-                pos -= m->size;
-                m->delta += m->size;
+        return (ssize_t) n;
+}
 
-                if (m->n_entries_set)
-                        m->n_entries -= 1;
+static int request_advance(RequestMeta *m) {
+        int r;
 
+        assert(m);
+
+        if (m->n_skip < 0)
+                r = sd_journal_previous_skip(m->journal, (uint64_t) -m->n_skip + 1);
+        else if (m->n_skip > 0)
+                r = sd_journal_next_skip(m->journal, (uint64_t) m->n_skip + 1);
+        else
+                r = sd_journal_next(m->journal);
+        if (r > 0)
                 m->n_skip = 0;
 
-                r = request_meta_ensure_tmp(m);
-                if (r < 0) {
-                        log_error_errno(r, "Failed to create temporary file: %m");
-                        return MHD_CONTENT_READER_END_WITH_ERROR;
-                }
+        return r;
+}
 
-                r = show_journal_entry(m->tmp, m->journal, m->mode, 0, OUTPUT_FULL_WIDTH,
-                                   NULL, NULL, NULL);
-                if (r < 0) {
-                        log_error_errno(r, "Failed to serialize item: %m");
-                        return MHD_CONTENT_READER_END_WITH_ERROR;
-                }
+static int request_serialize_entry(RequestMeta *m, FILE *f, bool wait) {
+        int r;
 
-                sz = ftello(m->tmp);
-                if (sz == (off_t) -1) {
-                        log_error_errno(errno, "Failed to retrieve file position: %m");
-                        return MHD_CONTENT_READER_END_WITH_ERROR;
-                }
+        assert(m);
+        assert(f);
+
+        if (m->n_entries_set &&
+            m->n_entries <= 0)
+                return 0;
 
-                m->size = (uint64_t) sz;
+        for (;;) {
+                r = request_advance(m);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to advance journal pointer: %m");
+                if (r > 0)
+                        break;
+
+                if (!m->follow)
+                        return 0;
+                if (!wait)
+                        return -EAGAIN;
+
+                r = sd_journal_wait(m->journal, (uint64_t) JOURNAL_WAIT_TIMEOUT);
+                if (r < 0)
+                        return log_error_errno(r, "Couldn't wait for journal event: %m");
+                if (r == SD_JOURNAL_NOP)
+                        return -EAGAIN;
         }
 
-        if (m->tmp == NULL && m->follow)
-                return 0;
+        if (m->discrete) {
+                assert(m->cursor);
 
-        if (fseeko(m->tmp, pos, SEEK_SET) < 0) {
-                log_error_errno(errno, "Failed to seek to position: %m");
-                return MHD_CONTENT_READER_END_WITH_ERROR;
+                r = sd_journal_test_cursor(m->journal, m->cursor);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to test cursor: %m");
+                if (r == 0)
+                        return 0;
         }
 
-        n = m->size - pos;
-        if (n < 1)
-                return 0;
-        if (n > max)
-                n = max;
-
-        errno = 0;
-        k = fread(buf, 1, n, m->tmp);
-        if (k != n) {
-                log_error("Failed to read from file: %s", errno ? strerror(errno) : "Premature EOF");
-                return MHD_CONTENT_READER_END_WITH_ERROR;
+        if (m->n_entries_set)
+                m->n_entries -= 1;
+
+        r = show_journal_entry(f, m->journal, m->mode, 0, OUTPUT_FULL_WIDTH,
+                               NULL, NULL, NULL);
+        if (r < 0)
+                return log_error_errno(r, "Failed to serialize item: %m");
+
+        return 1;
+}
+
+static ssize_t request_reader_entries(
+                void *cls,
+                uint64_t pos,
+                char *buf,
+                size_t max) {
+
+        return request_reader(cls, request_serialize_entry, buf, max);
+}
+
+static int request_find_next_cursor(RequestMeta *m, char **ret) {
+        _cleanup_free_ char *first = NULL, *next = NULL;
+        uint64_t i;
+        int r;
+
+        assert(m);
+        assert(m->n_entries_set);
+        assert(ret);
+
+        /* Looks up the entry following the last one of this response, so that its cursor can be passed on
+         * in a header, i.e. before the response itself, and then returns to the first one. Only the entry
+         * objects are looked at on the way, but none of the data. */
+
+        r = request_advance(m);
+        if (r <= 0) {
+                *ret = NULL;
+                return r;
+        }
+
+        r = sd_journal_get_cursor(m->journal, &first);
+        if (r < 0)
+                return r;
+
+        for (i = 0; i < m->n_entries; i++) {
+                r = sd_journal_next(m->journal);
+                if (r < 0)
+                        return r;
+                if (r == 0)
+                        break;
+        }
+
+        if (i >= m->n_entries) {
+                r = sd_journal_get_cursor(m->journal, &next);
+                if (r < 0)
+                        return r;
         }
 
-        return (ssize_t) k;
+        r = sd_journal_seek_cursor(m->journal, first);
+        if (r < 0)
+                return r;
+
+        *ret = TAKE_PTR(next);
+        return 0;
 }
 
 static int request_parse_accept(
@@ -274,6 +461,48 @@ static int request_parse_accept(
         return 0;
 }
 
+static int request_parse_accept_encoding(
+                RequestMeta *m,
+                struct MHD_Connection *connection) {
+
+        const char *header;
+        int r;
+
+        assert(m);
+        assert(connection);
+
+        header = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Accept-Encoding");
+        if (!header)
+                return 0;
+
+        for (;;) {
+                _cleanup_free_ char *word = NULL;
+                ResponseEncoding e;
+                char *q;
+
+                r = extract_first_word(&header, &word, ",", 0);
+                if (r < 0)
+                        return r;
+                if (r == 0)
+                        break;
+
+                /* Other quality values are not distinguished, only "not at all" */
+                q = strchr(word, ';');
+                if (q) {
+                        *(q++) = 0;
+                        q = strstrip(q);
+                        if (startswith(q, "q=0") && !strpbrk(q + 3, "123456789"))
+                                continue;
+                }
+
+                e = response_encoding_from_string(strstrip(word));
+                if (e > m->encoding && response_encoding_supported(e))
+                        m->encoding = e;
+        }
+
+        return 0;
+}
+
 static int request_parse_range(
                 RequestMeta *m,
                 struct MHD_Connection *connection) {
@@ -447,10 +676,21 @@ static int request_parse_arguments(
         return m->argument_parse_error;
 }
 
+static void request_add_encoding_headers(RequestMeta *m, struct MHD_Response *response) {
+        assert(m);
+        assert(response);
+
+        if (m->encoding != RESPONSE_ENCODING_IDENTITY)
+                MHD_add_response_header(response, "Content-Encoding", response_encoding_to_string(m->encoding));
+
+        MHD_add_response_header(response, "Vary", "Accept-Encoding");
+}
+
 static int request_handler_entries(
                 struct MHD_Connection *connection,
                 void *connection_cls) {
 
+        _cleanup_free_ char *next_cursor = NULL;
         struct MHD_Response *response;
         RequestMeta *m = connection_cls;
         int r;
@@ -465,6 +705,9 @@ static int request_handler_entries(
         if (request_parse_accept(m, connection) < 0)
                 return mhd_respond(connection, MHD_HTTP_BAD_REQUEST, "Failed to parse Accept header.");
 
+        if (request_parse_accept_encoding(m, connection) < 0)
+                return mhd_respond(connection, MHD_HTTP_BAD_REQUEST, "Failed to parse Accept-Encoding header.");
+
         if (request_parse_range(m, connection) < 0)
                 return mhd_respond(connection, MHD_HTTP_BAD_REQUEST, "Failed to parse Range header.");
 
@@ -488,11 +731,21 @@ static int request_handler_entries(
         if (r < 0)
                 return mhd_respond(connection, MHD_HTTP_BAD_REQUEST, "Failed to seek in journal.");
 
+        /* For paging through the journal, the response to a limited request tells where the next page starts */
+        if (m->n_entries_set && !m->follow && !m->discrete) {
+                r = request_find_next_cursor(m, &next_cursor);
+                if (r < 0)
+                        return mhd_respondf(connection, r, MHD_HTTP_INTERNAL_SERVER_ERROR, "Failed to look ahead in journal: %m");
+        }
+
         response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 4*1024, request_reader_entries, m, NULL);
         if (!response)
                 return respond_oom(connection);
 
         MHD_add_response_header(response, "Content-Type", mime_types[m->mode]);
+        request_add_encoding_headers(m, response);
+        if (next_cursor)
+                MHD_add_response_header(response, "Next-Cursor", next_cursor);
 
         r = MHD_queue_response(connection, MHD_HTTP_OK, response);
         MHD_destroy_response(response);
@@ -522,86 +775,41 @@ static int output_field(FILE *f, OutputMode m, const char *d, size_t l) {
         return 0;
 }
 
-static ssize_t request_reader_fields(
-                void *cls,
-                uint64_t pos,
-                char *buf,
-                size_t max) {
-
-        RequestMeta *m = cls;
+static int request_serialize_field(RequestMeta *m, FILE *f, bool wait) {
+        const void *d;
+        size_t l;
         int r;
-        size_t n, k;
 
         assert(m);
-        assert(buf);
-        assert(max > 0);
-        assert(pos >= m->delta);
-
-        pos -= m->delta;
-
-        while (pos >= m->size) {
-                off_t sz;
-                const void *d;
-                size_t l;
-
-                /* End of this field, so let's serialize the next
-                 * one */
-
-                if (m->n_fields_set &&
-                    m->n_fields <= 0)
-                        return MHD_CONTENT_READER_END_OF_STREAM;
-
-                r = sd_journal_enumerate_unique(m->journal, &d, &l);
-                if (r < 0) {
-                        log_error_errno(r, "Failed to advance field index: %m");
-                        return MHD_CONTENT_READER_END_WITH_ERROR;
-                } else if (r == 0)
-                        return MHD_CONTENT_READER_END_OF_STREAM;
+        assert(f);
 
-                pos -= m->size;
-                m->delta += m->size;
-
-                if (m->n_fields_set)
-                        m->n_fields -= 1;
-
-                r = request_meta_ensure_tmp(m);
-                if (r < 0) {
-                        log_error_errno(r, "Failed to create temporary file: %m");
-                        return MHD_CONTENT_READER_END_WITH_ERROR;
-                }
-
-                r = output_field(m->tmp, m->mode, d, l);
-                if (r < 0) {
-                        log_error_errno(r, "Failed to serialize item: %m");
-                        return MHD_CONTENT_READER_END_WITH_ERROR;
-                }
+        if (m->n_fields_set &&
+            m->n_fields <= 0)
+                return 0;
 
-                sz = ftello(m->tmp);
-                if (sz == (off_t) -1) {
-                        log_error_errno(errno, "Failed to retrieve file position: %m");
-                        return MHD_CONTENT_READER_END_WITH_ERROR;
-                }
+        r = sd_journal_enumerate_unique(m->journal, &d, &l);
+        if (r < 0)
+                return log_error_errno(r, "Failed to advance field index: %m");
+        if (r == 0)
+                return 0;
 
-                m->size = (uint64_t) sz;
-        }
+        if (m->n_fields_set)
+                m->n_fields -= 1;
 
-        if (fseeko(m->tmp, pos, SEEK_SET) < 0) {
-                log_error_errno(errno, "Failed to seek to position: %m");
-                return MHD_CONTENT_READER_END_WITH_ERROR;
-        }
+        r = output_field(f, m->mode, d, l);
+        if (r < 0)
+                return log_error_errno(r, "Failed to serialize item: %m");
 
-        n = m->size - pos;
-        if (n > max)
-                n = max;
+        return 1;
+}
 
-        errno = 0;
-        k = fread(buf, 1, n, m->tmp);
-        if (k != n) {
-                log_error("Failed to read from file: %s", errno ? strerror(errno) : "Premature EOF");
-                return MHD_CONTENT_READER_END_WITH_ERROR;
-        }
+static ssize_t request_reader_fields(
+                void *cls,
+                uint64_t pos,
+                char *buf,
+                size_t max) {
 
-        return (ssize_t) k;
+        return request_reader(cls, request_serialize_field, buf, max);
 }
 
 static int request_handler_fields(
@@ -623,6 +831,9 @@ static int request_handler_fields(
         if (request_parse_accept(m, connection) < 0)
                 return mhd_respond(connection, MHD_HTTP_BAD_REQUEST, "Failed to parse Accept header.");
 
+        if (request_parse_accept_encoding(m, connection) < 0)
+                return mhd_respond(connection, MHD_HTTP_BAD_REQUEST, "Failed to parse Accept-Encoding header.");
+
         r = sd_journal_query_unique(m->journal, field);
         if (r < 0)
                 return mhd_respond(connection, MHD_HTTP_BAD_REQUEST, "Failed to query unique fields.");
@@ -632,6 +843,7 @@ static int request_handler_fields(
                 return respond_oom(connection);
 
         MHD_add_response_header(response, "Content-Type", mime_types[m->mode == OUTPUT_JSON ? OUTPUT_JSON : OUTPUT_SHORT]);
+        request_add_encoding_headers(m, response);
 
         r = MHD_queue_response(connection, MHD_HTTP_OK, response);
         MHD_destroy_response(response);
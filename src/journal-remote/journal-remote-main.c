@@ -9,6 +9,7 @@
 #include "def.h"
 #include "fd-util.h"
 #include "fileio.h"
+#include "fs-util.h"
 #include "journal-remote-write.h"
 #include "journal-remote.h"
 #include "process-util.h"
@@ -22,6 +23,19 @@
 #define CERT_FILE     CERTIFICATE_ROOT "/certs/journal-remote.pem"
 #define TRUST_FILE    CERTIFICATE_ROOT "/ca/trusted.pem"
 
+/* The Content-Encodings we can decode, advertised to clients that might want to compress uploads */
+static const char accept_encoding[] =
+#if HAVE_ZSTD
+        "zstd, "
+#endif
+#if HAVE_LZ4
+        "lz4, "
+#endif
+        "identity";
+
+/* Unless configured otherwise, we use a writer thread per CPU, but no more than this */
+#define WRITER_THREADS_DEFAULT_MAX 16
+
 static char* arg_url = NULL;
 static char* arg_getter = NULL;
 static char* arg_listen_raw = NULL;
@@ -35,6 +49,7 @@ static char** arg_gnutls_log = NULL;
 
 static JournalWriteSplitMode arg_split_mode = _JOURNAL_WRITE_SPLIT_INVALID;
 static char* arg_output = NULL;
+static unsigned arg_writer_threads = (unsigned) -1;
 
 static char *arg_key = NULL;
 static char *arg_cert = NULL;
@@ -135,19 +150,28 @@ static int dispatch_http_event(sd_event_source *event,
                                uint32_t revents,
                                void *userdata);
 
-static int request_meta(void **connection_cls, int fd, char *hostname) {
+static int request_meta(void **connection_cls, int fd, char *hostname, bool replica) {
+        _cleanup_(unlink_and_freep) char *replica_path = NULL;
+        _cleanup_close_ int replica_fd = -1;
         RemoteSource *source;
-        Writer *writer;
+        Writer *writer = NULL;
         int r;
 
         assert(connection_cls);
         if (*connection_cls)
                 return 0;
 
-        r = journal_remote_get_writer(journal_remote_server_global, hostname, &writer);
-        if (r < 0)
-                return log_warning_errno(r, "Failed to get writer for source %s: %m",
-                                         hostname);
+        if (replica) {
+                r = journal_remote_open_replica(journal_remote_server_global, hostname,
+                                                &replica_fd, &replica_path);
+                if (r < 0)
+                        return r;
+        } else {
+                r = journal_remote_get_writer(journal_remote_server_global, hostname, &writer);
+                if (r < 0)
+                        return log_warning_errno(r, "Failed to get writer for source %s: %m",
+                                                 hostname);
+        }
 
         source = source_new(fd, true, hostname, writer);
         if (!source) {
@@ -155,6 +179,10 @@ static int request_meta(void **connection_cls, int fd, char *hostname) {
                 return log_oom();
         }
 
+        source->replica_fd = TAKE_FD(replica_fd);
+        source->replica_path = TAKE_PTR(replica_path);
+        source->replica_size_max = journal_remote_server_global->replica_size_max;
+
         log_debug("Added RemoteSource as connection metadata %p", source);
 
         *connection_cls = source;
@@ -183,7 +211,7 @@ static int process_http_upload(
                 size_t *upload_data_size,
                 RemoteSource *source) {
 
-        bool finished = false;
+        bool finished;
         size_t remaining;
         int r;
 
@@ -192,35 +220,32 @@ static int process_http_upload(
         log_trace("%s: connection %p, %zu bytes",
                   __func__, connection, *upload_data_size);
 
-        if (*upload_data_size) {
+        finished = *upload_data_size == 0;
+        if (!finished)
                 log_trace("Received %zu bytes", *upload_data_size);
 
-                r = journal_importer_push_data(&source->importer,
-                                               upload_data, *upload_data_size);
-                if (r < 0)
-                        return mhd_respond_oom(connection);
-
-                *upload_data_size = 0;
-        } else
-                finished = true;
-
-        for (;;) {
-                r = process_source(source,
-                                   journal_remote_server_global->compress,
-                                   journal_remote_server_global->seal);
-                if (r == -EAGAIN)
-                        break;
-                else if (r < 0) {
-                        log_warning("Failed to process data for connection %p", connection);
-                        if (r == -E2BIG)
-                                return mhd_respondf(connection,
-                                                    r, MHD_HTTP_PAYLOAD_TOO_LARGE,
-                                                    "Entry is too large, maximum is " STRINGIFY(DATA_SIZE_MAX) " bytes.");
-                        else
-                                return mhd_respondf(connection,
-                                                    r, MHD_HTTP_UNPROCESSABLE_ENTITY,
-                                                    "Processing failed: %m.");
-                }
+        r = process_source_data(source,
+                                upload_data, *upload_data_size,
+                                journal_remote_server_global->compress,
+                                journal_remote_server_global->seal);
+        *upload_data_size = 0;
+        if (r == -ENOMEM)
+                return mhd_respond_oom(connection);
+        else if (r < 0) {
+                log_warning("Failed to process data for connection %p", connection);
+                if (r == -E2BIG)
+                        return mhd_respondf(connection,
+                                            r, MHD_HTTP_PAYLOAD_TOO_LARGE,
+                                            "Entry is too large, maximum is " STRINGIFY(DATA_SIZE_MAX) " bytes.");
+                else if (r == -EFBIG)
+                        return mhd_respondf(connection,
+                                            r, MHD_HTTP_PAYLOAD_TOO_LARGE,
+                                            "Journal file is too large, maximum is %"PRIu64" bytes.",
+                                            journal_remote_server_global->replica_size_max);
+                else
+                        return mhd_respondf(connection,
+                                            r, MHD_HTTP_UNPROCESSABLE_ENTITY,
+                                            "Processing failed: %m.");
         }
 
         if (!finished)
@@ -228,6 +253,31 @@ static int process_http_upload(
 
         /* The upload is finished */
 
+        if (source->decompressor && decompressor_in_frame(source->decompressor)) {
+                log_warning("Premature EOF in compressed data.");
+                return mhd_respond(connection, MHD_HTTP_EXPECTATION_FAILED,
+                                   "Premature EOF. Compressed data is truncated.");
+        }
+
+        if (source->replica_fd >= 0) {
+                r = journal_remote_add_replica(journal_remote_server_global, source->importer.name,
+                                               source->replica_fd, source->replica_path);
+                if (r == -EFBIG)
+                        return mhd_respond(connection, MHD_HTTP_PAYLOAD_TOO_LARGE,
+                                           "Journal file is larger than the maximum file size.");
+                if (r < 0)
+                        return mhd_respondf(connection,
+                                            r, MHD_HTTP_UNPROCESSABLE_ENTITY,
+                                            "Not a valid archived journal file: %m.");
+                if (r == 0)
+                        return mhd_respond_with_header(connection, MHD_HTTP_OK,
+                                                       "Accept-Encoding", accept_encoding, "Already present.");
+
+                source->replica_path = mfree(source->replica_path);
+                return mhd_respond_with_header(connection, MHD_HTTP_CREATED,
+                                               "Accept-Encoding", accept_encoding, "Added.");
+        }
+
         remaining = journal_importer_bytes_remaining(&source->importer);
         if (remaining > 0) {
                 log_warning("Premature EOF byte. %zu bytes lost.", remaining);
@@ -237,7 +287,15 @@ static int process_http_upload(
                                     remaining);
         }
 
-        return mhd_respond(connection, MHD_HTTP_ACCEPTED, "OK.");
+        /* With writer threads, entries might still be queued. Only acknowledge them once they are written. */
+        r = writer_sync(source->writer, &source->writer_status);
+        if (r < 0)
+                return mhd_respondf(connection,
+                                    r, MHD_HTTP_INTERNAL_SERVER_ERROR,
+                                    "Failed to write entries: %m.");
+
+        return mhd_respond_with_header(connection, MHD_HTTP_ACCEPTED,
+                                       "Accept-Encoding", accept_encoding, "OK.");
 };
 
 static int request_handler(
@@ -252,7 +310,9 @@ static int request_handler(
 
         const char *header;
         int r, code, fd;
+        bool replica;
         _cleanup_free_ char *hostname = NULL;
+        _cleanup_(decompressor_freep) Decompressor *decompressor = NULL;
 
         assert(connection);
         assert(connection_cls);
@@ -274,10 +334,29 @@ static int request_handler(
 
         header = MHD_lookup_connection_value(connection,
                                              MHD_HEADER_KIND, "Content-Type");
-        if (!header || !streq(header, "application/vnd.fdo.journal"))
+        if (!header || !STR_IN_SET(header, "application/vnd.fdo.journal", "application/vnd.fdo.journal-file"))
                 return mhd_respond(connection, MHD_HTTP_UNSUPPORTED_MEDIA_TYPE,
                                    "Content-Type: application/vnd.fdo.journal is required.");
 
+        /* Archived journal files may also be uploaded whole, and are then stored as they are */
+        replica = streq(header, "application/vnd.fdo.journal-file");
+
+        /* Uploads may be sent as a sequence of compressed frames. The uploader learns what we can decode from
+         * the Accept-Encoding header of our responses. */
+        header = MHD_lookup_connection_value(connection,
+                                             MHD_HEADER_KIND, "Content-Encoding");
+        if (header && !streq(header, "identity")) {
+                r = content_encoding_from_string(header);
+                if (r >= 0)
+                        r = decompressor_new(r, &decompressor);
+                if (r == -ENOMEM)
+                        return respond_oom(connection);
+                if (r < 0)
+                        return mhd_respond_with_header(connection, MHD_HTTP_UNSUPPORTED_MEDIA_TYPE,
+                                                       "Accept-Encoding", accept_encoding,
+                                                       "Unsupported Content-Encoding.");
+        }
+
         {
                 const union MHD_ConnectionInfo *ci;
 
@@ -306,13 +385,14 @@ static int request_handler(
 
         assert(hostname);
 
-        r = request_meta(connection_cls, fd, hostname);
+        r = request_meta(connection_cls, fd, hostname, replica);
         if (r == -ENOMEM)
                 return respond_oom(connection);
         else if (r < 0)
                 return mhd_respondf(connection, r, MHD_HTTP_INTERNAL_SERVER_ERROR, "%m");
 
         hostname = NULL;
+        ((RemoteSource*) *connection_cls)->decompressor = TAKE_PTR(decompressor);
         return MHD_YES;
 }
 
@@ -551,10 +631,20 @@ static int create_remoteserver(
                 const char* cert,
                 const char* trust) {
 
+        unsigned n_replicas = 0;
         int r, n, fd;
         char **file;
 
-        r = journal_remote_server_init(s, arg_output, arg_split_mode, arg_compress, arg_seal);
+        /* Each host is written by one thread, hence more than one only helps when splitting by host */
+        if (arg_writer_threads == (unsigned) -1) {
+                long n_cpus;
+
+                n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                arg_writer_threads = arg_split_mode == JOURNAL_WRITE_SPLIT_HOST ?
+                        (unsigned) CLAMP(n_cpus, 1L, (long) WRITER_THREADS_DEFAULT_MAX) : 1;
+        }
+
+        r = journal_remote_server_init(s, arg_output, arg_split_mode, arg_compress, arg_seal, arg_writer_threads);
         if (r < 0)
                 return r;
 
@@ -668,6 +758,7 @@ static int create_remoteserver(
 
         STRV_FOREACH(file, arg_files) {
                 const char *output_name;
+                bool replica = false;
 
                 if (streq(*file, "-")) {
                         log_debug("Using standard input as source.");
@@ -681,6 +772,20 @@ static int create_remoteserver(
                         if (fd < 0)
                                 return log_error_errno(errno, "Failed to open %s: %m", *file);
                         output_name = *file;
+
+                        /* Journal files are copied as they are, rather than exported and imported again */
+                        replica = journal_remote_is_journal_file(fd);
+                }
+
+                if (replica) {
+                        safe_close(fd);
+
+                        r = journal_remote_replicate_file(s, *file);
+                        if (r < 0)
+                                return r;
+
+                        n_replicas++;
+                        continue;
                 }
 
                 r = journal_remote_add_source(s, fd, (char*) output_name, false);
@@ -689,6 +794,9 @@ static int create_remoteserver(
         }
 
         if (s->active == 0) {
+                if (n_replicas > 0)
+                        return 0;
+
                 log_error("Zero sources specified");
                 return -EINVAL;
         }
@@ -724,6 +832,7 @@ static int parse_config(void) {
         const ConfigTableItem items[] = {
                 { "Remote",  "Seal",                   config_parse_bool,             0, &arg_seal       },
                 { "Remote",  "SplitMode",              config_parse_write_split_mode, 0, &arg_split_mode },
+                { "Remote",  "WriterThreads",          config_parse_unsigned,         0, &arg_writer_threads },
                 { "Remote",  "ServerKeyFile",          config_parse_path,             0, &arg_key        },
                 { "Remote",  "ServerCertificateFile",  config_parse_path,             0, &arg_cert       },
                 { "Remote",  "TrustedCertificateFile", config_parse_path,             0, &arg_trust      },
@@ -757,6 +866,7 @@ static void help(void) {
                "     --gnutls-log=CATEGORY...\n"
                "                            Specify a list of gnutls logging categories\n"
                "     --split-mode=none|host How many output files to create\n"
+               "     --writer-threads=N     How many threads to write output files with\n"
                "\n"
                "Note: file descriptors from sd_listen_fds() will be consumed, too.\n"
                , program_invocation_short_name);
@@ -771,6 +881,7 @@ static int parse_argv(int argc, char *argv[]) {
                 ARG_LISTEN_HTTPS,
                 ARG_GETTER,
                 ARG_SPLIT_MODE,
+                ARG_WRITER_THREADS,
                 ARG_COMPRESS,
                 ARG_SEAL,
                 ARG_KEY,
@@ -789,6 +900,7 @@ static int parse_argv(int argc, char *argv[]) {
                 { "listen-https", required_argument, NULL, ARG_LISTEN_HTTPS },
                 { "output",       required_argument, NULL, 'o'              },
                 { "split-mode",   required_argument, NULL, ARG_SPLIT_MODE   },
+                { "writer-threads", required_argument, NULL, ARG_WRITER_THREADS },
                 { "compress",     optional_argument, NULL, ARG_COMPRESS     },
                 { "seal",         optional_argument, NULL, ARG_SEAL         },
                 { "key",          required_argument, NULL, ARG_KEY          },
@@ -929,6 +1041,14 @@ static int parse_argv(int argc, char *argv[]) {
                         }
                         break;
 
+                case ARG_WRITER_THREADS:
+                        r = safe_atou(optarg, &arg_writer_threads);
+                        if (r < 0 || arg_writer_threads == (unsigned) -1) {
+                                log_error("Invalid number of writer threads: %s", optarg);
+                                return -EINVAL;
+                        }
+                        break;
+
                 case ARG_COMPRESS:
                         if (optarg) {
                                 r = parse_boolean(optarg);
@@ -1130,6 +1250,9 @@ int main(int argc, char **argv) {
                 }
         }
 
+        /* Make sure the count below is complete */
+        writer_pool_flush(s.writer_pool);
+
         sd_notifyf(false,
                    "STOPPING=1\n"
                    "STATUS=Shutting down after writing %" PRIu64 " entries...", s.event_count);
@@ -2,19 +2,37 @@
 
 #include "alloc-util.h"
 #include "fd-util.h"
+#include "fs-util.h"
+#include "io-util.h"
 #include "journal-remote-parse.h"
 #include "journald-native.h"
 #include "parse-util.h"
 #include "string-util.h"
 
 void source_free(RemoteSource *source) {
+        int r;
+
         if (!source)
                 return;
 
+        /* Entries still queued refer to the source, hence wait for them */
+        if (source->writer) {
+                r = writer_sync(source->writer, &source->writer_status);
+                if (r < 0)
+                        log_warning_errno(r, "Some entries from %s could not be written: %m",
+                                          strna(source->importer.name));
+        }
+
         journal_importer_cleanup(&source->importer);
+        decompressor_free(source->decompressor);
 
-        log_debug("Writer ref count %i", source->writer->n_ref);
-        writer_unref(source->writer);
+        safe_close(source->replica_fd);
+        unlink_and_free(source->replica_path);
+
+        if (source->writer) {
+                log_debug("Writer ref count %i", source->writer->n_ref);
+                writer_unref(source->writer);
+        }
 
         sd_event_source_unref(source->event);
         sd_event_source_unref(source->buffer_event);
@@ -25,6 +43,7 @@ void source_free(RemoteSource *source) {
 /**
  * Initialize zero-filled source with given values. On success, takes
  * ownership of fd, name, and writer, otherwise does not touch them.
+ * Writer may be NULL for sources that receive a replica.
  */
 RemoteSource* source_new(int fd, bool passive_fd, char *name, Writer *writer) {
         RemoteSource *source;
@@ -43,6 +62,7 @@ RemoteSource* source_new(int fd, bool passive_fd, char *name, Writer *writer) {
         source->importer.name = name;
 
         source->writer = writer;
+        source->replica_fd = -1;
 
         return source;
 }
@@ -68,7 +88,8 @@ int process_source(RemoteSource *source, bool compress, bool seal) {
 
         assert(source->importer.iovw.iovec);
 
-        r = writer_write(source->writer, &source->importer.iovw, &source->importer.ts, compress, seal);
+        r = writer_write(source->writer, &source->importer.iovw, &source->importer.ts, compress, seal,
+                         &source->writer_status);
         if (r == -EBADMSG) {
                 log_error_errno(r, "Entry is invalid, ignoring.");
                 r = 0;
@@ -82,3 +103,56 @@ int process_source(RemoteSource *source, bool compress, bool seal) {
         journal_importer_drop_iovw(&source->importer);
         return r;
 }
+
+static int push_and_process(RemoteSource *source, const void *data, size_t size, bool compress, bool seal) {
+        int r;
+
+        if (source->replica_fd >= 0) {
+                if (size > source->replica_size_max - source->replica_size)
+                        return -EFBIG;
+
+                source->replica_size += size;
+                return loop_write(source->replica_fd, data, size, false);
+        }
+
+        if (size > 0) {
+                r = journal_importer_push_data(&source->importer, data, size);
+                if (r < 0)
+                        return r;
+        }
+
+        do
+                r = process_source(source, compress, seal);
+        while (r >= 0);
+
+        return r == -EAGAIN ? 0 : r;
+}
+
+int process_source_data(RemoteSource *source, const void *data, size_t size, bool compress, bool seal) {
+        int r;
+
+        assert(source);
+        assert(data || size == 0);
+
+        /* Feeds data received from elsewhere to the source, and writes out all entries that are complete. */
+
+        if (!source->decompressor)
+                return push_and_process(source, data, size, compress, seal);
+
+        /* Decompressed data is fed to the importer and processed in pieces of a bounded size, so that memory
+         * use is limited by the size of the largest entry, no matter how well the input compresses. */
+        for (;;) {
+                const void *p;
+                size_t n;
+
+                r = decompressor_run(source->decompressor, &data, &size, &p, &n);
+                if (r < 0)
+                        return r;
+                if (n == 0)
+                        return 0;
+
+                r = push_and_process(source, p, n, compress, seal);
+                if (r < 0)
+                        return r;
+        }
+}
@@ -3,6 +3,7 @@
 
 #include "sd-event.h"
 
+#include "compress.h"
 #include "journal-importer.h"
 #include "journal-remote-write.h"
 
@@ -10,6 +11,17 @@ typedef struct RemoteSource {
         JournalImporter importer;
 
         Writer *writer;
+        WriterStatus writer_status;
+
+        /* Set if the data arrives compressed, see process_source_data() */
+        Decompressor *decompressor;
+
+        /* Set if the data is a whole journal file, which is stored as it is instead of being parsed into
+         * entries, see journal_remote_add_replica(). Uploads larger than replica_size_max are refused. */
+        int replica_fd;
+        char *replica_path;
+        uint64_t replica_size;
+        uint64_t replica_size_max;
 
         sd_event_source *event;
         sd_event_source *buffer_event;
@@ -18,3 +30,4 @@ typedef struct RemoteSource {
 RemoteSource* source_new(int fd, bool passive_fd, char *name, Writer *writer);
 void source_free(RemoteSource *source);
 int process_source(RemoteSource *source, bool compress, bool seal);
+int process_source_data(RemoteSource *source, const void *data, size_t size, bool compress, bool seal);
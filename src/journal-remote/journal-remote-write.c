@@ -1,10 +1,54 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 
+#include <pthread.h>
+#include <signal.h>
+
 #include "alloc-util.h"
+#include "compress.h"
+#include "io-util.h"
 #include "journal-remote.h"
 
+/* How many entries and payload bytes each writer thread buffers before the receiving side has to wait, and how
+ * many entries it takes off its queue at once */
+#define WRITER_QUEUE_MAX 4096U
+#define WRITER_QUEUE_BYTES_MAX (16U*1024U*1024U)
+#define WRITER_BATCH_MAX 256U
+
+typedef struct WriterEntry {
+        Writer *writer;
+        WriterStatus *status;
+        dual_timestamp ts;
+        bool compress:1;
+        bool seal:1;
+        size_t size;
+        size_t n_iovec;
+        struct iovec iovec[];
+} WriterEntry;
+
+struct WriterThread {
+        pthread_t thread;
+        pthread_mutex_t mutex;
+        pthread_cond_t work; /* signalled when an entry was queued, or we shall quit */
+        pthread_cond_t idle; /* signalled when queue space was freed, or a batch was written */
+
+        WriterEntry *queue[WRITER_QUEUE_MAX];
+        size_t head;
+        size_t n_queued;
+        size_t queued_bytes;
+
+        bool busy; /* a batch is being written */
+        bool quit;
+
+        unsigned n_writers; /* only used by the event loop */
+};
+
+struct WriterPool {
+        size_t n_threads;
+        WriterThread *threads[];
+};
+
 static int do_rotate(JournalFile **f, bool compress, bool seal) {
-        int r = journal_file_rotate(f, compress, (uint64_t) -1, seal, NULL);
+        int r = journal_file_rotate(f, compress ? DEFAULT_COMPRESSION : 0, (uint64_t) -1, seal, NULL);
         if (r < 0) {
                 if (*f)
                         log_error_errno(r, "Failed to rotate %s: %m", (*f)->path);
@@ -15,6 +59,364 @@ static int do_rotate(JournalFile **f, bool compress, bool seal) {
         return r;
 }
 
+static int writer_write_now(Writer *w,
+                            struct iovec_wrapper *iovw,
+                            dual_timestamp *ts,
+                            bool compress,
+                            bool seal) {
+        int r;
+
+        assert(w);
+        assert(iovw);
+        assert(iovw->count > 0);
+
+        if (journal_file_rotate_suggested(w->journal, 0)) {
+                log_info("%s: Journal header limits reached or header out-of-date, rotating",
+                         w->journal->path);
+                r = do_rotate(&w->journal, compress, seal);
+                if (r < 0)
+                        return r;
+        }
+
+        r = journal_file_append_entry(w->journal, ts, NULL,
+                                      iovw->iovec, iovw->count,
+                                      &w->seqnum, NULL, NULL);
+        if (r >= 0) {
+                if (w->server)
+                        __sync_add_and_fetch(&w->server->event_count, 1);
+                return 0;
+        } else if (r == -EBADMSG)
+                return r;
+
+        log_debug_errno(r, "%s: Write failed, rotating: %m", w->journal->path);
+        r = do_rotate(&w->journal, compress, seal);
+        if (r < 0)
+                return r;
+        else
+                log_debug("%s: Successfully rotated journal", w->journal->path);
+
+        log_debug("Retrying write.");
+        r = journal_file_append_entry(w->journal, ts, NULL,
+                                      iovw->iovec, iovw->count,
+                                      &w->seqnum, NULL, NULL);
+        if (r < 0)
+                return r;
+
+        if (w->server)
+                __sync_add_and_fetch(&w->server->event_count, 1);
+        return 0;
+}
+
+static void* writer_thread(void *arg) {
+        WriterEntry *batch[WRITER_BATCH_MAX];
+        int results[WRITER_BATCH_MAX];
+        WriterThread *t = arg;
+
+        (void) pthread_setname_np(pthread_self(), "journal-writer");
+
+        assert_se(pthread_mutex_lock(&t->mutex) == 0);
+
+        for (;;) {
+                size_t n = 0, i;
+
+                while (!t->quit && t->n_queued == 0)
+                        assert_se(pthread_cond_wait(&t->work, &t->mutex) == 0);
+
+                /* When asked to quit, we still write out everything that has been queued so far */
+                if (t->n_queued == 0)
+                        break;
+
+                while (n < WRITER_BATCH_MAX && t->n_queued > 0) {
+                        batch[n] = TAKE_PTR(t->queue[t->head]);
+                        t->queued_bytes -= batch[n]->size;
+                        t->head = (t->head + 1) % WRITER_QUEUE_MAX;
+                        t->n_queued--;
+                        n++;
+                }
+
+                t->busy = true;
+                assert_se(pthread_cond_broadcast(&t->idle) == 0);
+                assert_se(pthread_mutex_unlock(&t->mutex) == 0);
+
+                for (i = 0; i < n; i++) {
+                        struct iovec_wrapper iovw = {
+                                .iovec = batch[i]->iovec,
+                                .count = batch[i]->n_iovec,
+                        };
+
+                        results[i] = writer_write_now(batch[i]->writer, &iovw, &batch[i]->ts, batch[i]->compress, batch[i]->seal);
+                        if (results[i] == -EBADMSG) {
+                                log_error_errno(results[i], "Entry is invalid, ignoring.");
+                                results[i] = 0;
+                        } else if (results[i] < 0)
+                                log_error_errno(results[i], "Failed to write entry of %zu bytes: %m", batch[i]->size);
+                }
+
+                assert_se(pthread_mutex_lock(&t->mutex) == 0);
+
+                /* Only now the writers may be freed, and the sources learn what became of their entries */
+                for (i = 0; i < n; i++) {
+                        batch[i]->writer->n_queued--;
+                        batch[i]->status->n_queued--;
+                        if (results[i] < 0 && batch[i]->status->error == 0)
+                                batch[i]->status->error = results[i];
+                        free(batch[i]);
+                }
+
+                t->busy = false;
+                assert_se(pthread_cond_broadcast(&t->idle) == 0);
+        }
+
+        assert_se(pthread_mutex_unlock(&t->mutex) == 0);
+
+        return NULL;
+}
+
+static WriterThread* writer_thread_free(WriterThread *t) {
+        size_t i;
+
+        if (!t)
+                return NULL;
+
+        assert(t->n_writers == 0);
+
+        assert_se(pthread_mutex_lock(&t->mutex) == 0);
+        t->quit = true;
+        assert_se(pthread_cond_signal(&t->work) == 0);
+        assert_se(pthread_mutex_unlock(&t->mutex) == 0);
+
+        assert_se(pthread_join(t->thread, NULL) == 0);
+
+        for (i = 0; i < WRITER_QUEUE_MAX; i++)
+                free(t->queue[i]);
+
+        pthread_cond_destroy(&t->idle);
+        pthread_cond_destroy(&t->work);
+        pthread_mutex_destroy(&t->mutex);
+
+        return mfree(t);
+}
+
+static int writer_thread_new(WriterThread **ret) {
+        _cleanup_free_ WriterThread *t = NULL;
+        sigset_t ss, saved_ss;
+        int r;
+
+        assert(ret);
+
+        t = new0(WriterThread, 1);
+        if (!t)
+                return -ENOMEM;
+
+        assert_se(pthread_mutex_init(&t->mutex, NULL) == 0);
+        assert_se(pthread_cond_init(&t->work, NULL) == 0);
+        assert_se(pthread_cond_init(&t->idle, NULL) == 0);
+
+        /* Signals are handled by the event loop, except for SIGBUS, which is synchronous and must reach the
+         * thread that touched the mapping */
+        if (sigfillset(&ss) < 0 ||
+            sigdelset(&ss, SIGBUS) < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        r = pthread_sigmask(SIG_BLOCK, &ss, &saved_ss);
+        if (r > 0) {
+                r = -r;
+                goto fail;
+        }
+
+        r = pthread_create(&t->thread, NULL, writer_thread, t);
+
+        (void) pthread_sigmask(SIG_SETMASK, &saved_ss, NULL);
+        if (r > 0) {
+                r = -r;
+                goto fail;
+        }
+
+        *ret = TAKE_PTR(t);
+        return 0;
+
+fail:
+        pthread_cond_destroy(&t->idle);
+        pthread_cond_destroy(&t->work);
+        pthread_mutex_destroy(&t->mutex);
+        return r;
+}
+
+static bool writer_thread_is_full(WriterThread *t, size_t size) {
+        assert(t);
+
+        if (t->n_queued >= WRITER_QUEUE_MAX)
+                return true;
+
+        /* Always accept a single entry, however large */
+        return t->n_queued > 0 && t->queued_bytes + size > WRITER_QUEUE_BYTES_MAX;
+}
+
+static int writer_enqueue(Writer *w,
+                          struct iovec_wrapper *iovw,
+                          dual_timestamp *ts,
+                          bool compress,
+                          bool seal,
+                          WriterStatus *status) {
+        WriterThread *t;
+        WriterEntry *e;
+        size_t size, i;
+        uint8_t *p;
+        int r;
+
+        assert(w);
+        assert(w->thread);
+        assert(iovw);
+        assert(ts);
+        assert(status);
+
+        /* The entry is copied, so that the parser may reuse its buffer right away */
+        size = IOVEC_TOTAL_SIZE(iovw->iovec, iovw->count);
+
+        e = malloc(offsetof(WriterEntry, iovec) + iovw->count * sizeof(struct iovec) + size);
+        if (!e)
+                return -ENOMEM;
+
+        e->writer = w;
+        e->status = status;
+        e->ts = *ts;
+        e->compress = compress;
+        e->seal = seal;
+        e->size = size;
+        e->n_iovec = iovw->count;
+
+        p = (uint8_t*) (e->iovec + iovw->count);
+        for (i = 0; i < iovw->count; i++) {
+                e->iovec[i] = IOVEC_MAKE(p, iovw->iovec[i].iov_len);
+                p = mempcpy(p, iovw->iovec[i].iov_base, iovw->iovec[i].iov_len);
+        }
+
+        t = w->thread;
+
+        assert_se(pthread_mutex_lock(&t->mutex) == 0);
+
+        /* Rather than dropping entries we stop receiving until the thread caught up, and let the kernel buffer
+         * things for us meanwhile */
+        while (writer_thread_is_full(t, size))
+                assert_se(pthread_cond_wait(&t->idle, &t->mutex) == 0);
+
+        /* If an earlier entry of the source couldn't be written, the source fails, as it would have
+         * without threads */
+        r = status->error;
+        if (r < 0) {
+                status->error = 0;
+                assert_se(pthread_mutex_unlock(&t->mutex) == 0);
+                free(e);
+                return r;
+        }
+
+        t->queue[(t->head + t->n_queued) % WRITER_QUEUE_MAX] = e;
+        t->n_queued++;
+        t->queued_bytes += size;
+        w->n_queued++;
+        status->n_queued++;
+
+        assert_se(pthread_cond_signal(&t->work) == 0);
+        assert_se(pthread_mutex_unlock(&t->mutex) == 0);
+
+        return 0;
+}
+
+static void writer_drain(Writer *w) {
+        WriterThread *t;
+
+        assert(w);
+
+        /* Waits until the thread wrote everything queued for the writer, after which the event loop owns the
+         * journal file again */
+
+        t = w->thread;
+        if (!t)
+                return;
+
+        assert_se(pthread_mutex_lock(&t->mutex) == 0);
+
+        while (w->n_queued > 0)
+                assert_se(pthread_cond_wait(&t->idle, &t->mutex) == 0);
+
+        assert_se(pthread_mutex_unlock(&t->mutex) == 0);
+}
+
+int writer_pool_new(unsigned n_threads, WriterPool **ret) {
+        WriterPool *p;
+        int r = 0;
+
+        assert(n_threads > 0);
+        assert(ret);
+
+        p = malloc0(offsetof(WriterPool, threads) + n_threads * sizeof(WriterThread*));
+        if (!p)
+                return -ENOMEM;
+
+        for (; p->n_threads < n_threads; p->n_threads++) {
+                r = writer_thread_new(p->threads + p->n_threads);
+                if (r < 0) {
+                        writer_pool_free(p);
+                        return r;
+                }
+        }
+
+        *ret = p;
+        return 0;
+}
+
+WriterPool* writer_pool_free(WriterPool *p) {
+        size_t i;
+
+        if (!p)
+                return NULL;
+
+        /* Writes out whatever is still queued */
+        for (i = 0; i < p->n_threads; i++)
+                writer_thread_free(p->threads[i]);
+
+        return mfree(p);
+}
+
+void writer_pool_flush(WriterPool *p) {
+        size_t i;
+
+        /* Waits until everything queued so far has been written */
+
+        if (!p)
+                return;
+
+        for (i = 0; i < p->n_threads; i++) {
+                WriterThread *t = p->threads[i];
+
+                assert_se(pthread_mutex_lock(&t->mutex) == 0);
+
+                while (t->busy || t->n_queued > 0)
+                        assert_se(pthread_cond_wait(&t->idle, &t->mutex) == 0);
+
+                assert_se(pthread_mutex_unlock(&t->mutex) == 0);
+        }
+}
+
+static WriterThread* writer_pool_pick(WriterPool *p) {
+        WriterThread *t = NULL;
+        size_t i;
+
+        if (!p)
+                return NULL;
+
+        /* Hosts are spread over threads as evenly as we can, each being written by a single thread only, so
+         * that its entries stay in order */
+        for (i = 0; i < p->n_threads; i++)
+                if (!t || p->threads[i]->n_writers < t->n_writers)
+                        t = p->threads[i];
+
+        t->n_writers++;
+        return t;
+}
+
 Writer* writer_new(RemoteServer *server) {
         Writer *w;
 
@@ -31,6 +433,9 @@ Writer* writer_new(RemoteServer *server) {
         w->n_ref = 1;
         w->server = server;
 
+        if (server)
+                w->thread = writer_pool_pick(server->writer_pool);
+
         return w;
 }
 
@@ -38,6 +443,11 @@ Writer* writer_free(Writer *w) {
         if (!w)
                 return NULL;
 
+        writer_drain(w);
+
+        if (w->thread)
+                w->thread->n_writers--;
+
         if (w->journal) {
                 log_debug("Closing journal file %s.", w->journal->path);
                 journal_file_close(w->journal);
@@ -72,46 +482,44 @@ int writer_write(Writer *w,
                  struct iovec_wrapper *iovw,
                  dual_timestamp *ts,
                  bool compress,
-                 bool seal) {
-        int r;
+                 bool seal,
+                 WriterStatus *status) {
 
         assert(w);
         assert(iovw);
         assert(iovw->count > 0);
 
-        if (journal_file_rotate_suggested(w->journal, 0)) {
-                log_info("%s: Journal header limits reached or header out-of-date, rotating",
-                         w->journal->path);
-                r = do_rotate(&w->journal, compress, seal);
-                if (r < 0)
-                        return r;
-        }
+        /* With a writer thread, the entry is only queued. Failures to write it are recorded in status, and
+         * returned by the next call for the same status, or by writer_sync(). */
+        if (w->thread)
+                return writer_enqueue(w, iovw, ts, compress, seal, status);
 
-        r = journal_file_append_entry(w->journal, ts, NULL,
-                                      iovw->iovec, iovw->count,
-                                      &w->seqnum, NULL, NULL);
-        if (r >= 0) {
-                if (w->server)
-                        w->server->event_count += 1;
+        return writer_write_now(w, iovw, ts, compress, seal);
+}
+
+int writer_sync(Writer *w, WriterStatus *status) {
+        WriterThread *t;
+        int r;
+
+        assert(w);
+        assert(status);
+
+        /* Waits until everything queued with status has been written. Returns the first error since the
+         * last call, if any entry couldn't be written. */
+
+        t = w->thread;
+        if (!t)
                 return 0;
-        } else if (r == -EBADMSG)
-                return r;
 
-        log_debug_errno(r, "%s: Write failed, rotating: %m", w->journal->path);
-        r = do_rotate(&w->journal, compress, seal);
-        if (r < 0)
-                return r;
-        else
-                log_debug("%s: Successfully rotated journal", w->journal->path);
+        assert_se(pthread_mutex_lock(&t->mutex) == 0);
 
-        log_debug("Retrying write.");
-        r = journal_file_append_entry(w->journal, ts, NULL,
-                                      iovw->iovec, iovw->count,
-                                      &w->seqnum, NULL, NULL);
-        if (r < 0)
-                return r;
+        while (status->n_queued > 0)
+                assert_se(pthread_cond_wait(&t->idle, &t->mutex) == 0);
 
-        if (w->server)
-                w->server->event_count += 1;
-        return 0;
+        r = status->error;
+        status->error = 0;
+
+        assert_se(pthread_mutex_unlock(&t->mutex) == 0);
+
+        return r;
 }
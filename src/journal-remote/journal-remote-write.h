@@ -5,6 +5,14 @@
 #include "journal-importer.h"
 
 typedef struct RemoteServer RemoteServer;
+typedef struct WriterThread WriterThread;
+typedef struct WriterPool WriterPool;
+
+/* Tracks the entries one source handed to a writer thread, so that it learns whether they were written */
+typedef struct WriterStatus {
+        size_t n_queued; /* protected by the thread's mutex */
+        int error;       /* ditto, the first error since the last writer_sync() */
+} WriterStatus;
 
 typedef struct Writer {
         JournalFile *journal;
@@ -16,9 +24,18 @@ typedef struct Writer {
 
         uint64_t seqnum;
 
+        /* If set, entries are appended by this thread, which owns the journal file and the fields above
+         * while any are queued */
+        WriterThread *thread;
+        size_t n_queued; /* protected by the thread's mutex */
+
         int n_ref;
 } Writer;
 
+int writer_pool_new(unsigned n_threads, WriterPool **ret);
+WriterPool* writer_pool_free(WriterPool *p);
+void writer_pool_flush(WriterPool *p);
+
 Writer* writer_new(RemoteServer* server);
 Writer* writer_free(Writer *w);
 
@@ -31,7 +48,9 @@ int writer_write(Writer *s,
                  struct iovec_wrapper *iovw,
                  dual_timestamp *ts,
                  bool compress,
-                 bool seal);
+                 bool seal,
+                 WriterStatus *status);
+int writer_sync(Writer *w, WriterStatus *status);
 
 typedef enum JournalWriteSplitMode {
         JOURNAL_WRITE_SPLIT_NONE,
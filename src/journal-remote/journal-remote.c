@@ -7,20 +7,29 @@
 #include <string.h>
 #include <sys/prctl.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <stdint.h>
 
 #include "sd-daemon.h"
 
 #include "alloc-util.h"
+#include "compress.h"
+#include "copy.h"
 #include "def.h"
 #include "escape.h"
 #include "fd-util.h"
+#include "fileio.h"
+#include "fs-util.h"
 #include "journal-file.h"
 #include "journal-remote-write.h"
 #include "journal-remote.h"
+#include "journal-time-index.h"
+#include "journal-vacuum.h"
+#include "journal-verify.h"
 #include "journald-native.h"
 #include "macro.h"
 #include "parse-util.h"
+#include "path-util.h"
 #include "process-util.h"
 #include "socket-util.h"
 #include "stdio-util.h"
@@ -31,14 +40,17 @@
 
 #define filename_escape(s) xescape((s), "/ ")
 
-static int open_output(RemoteServer *s, Writer *w, const char* host) {
-        _cleanup_free_ char *_filename = NULL;
-        const char *filename;
-        int r;
+static int output_path(RemoteServer *s, const char *host, char **ret) {
+        char *filename;
+
+        assert(s);
+        assert(ret);
 
         switch (s->split_mode) {
         case JOURNAL_WRITE_SPLIT_NONE:
-                filename = s->output;
+                filename = strdup(s->output);
+                if (!filename)
+                        return log_oom();
                 break;
 
         case JOURNAL_WRITE_SPLIT_HOST: {
@@ -50,11 +62,8 @@ static int open_output(RemoteServer *s, Writer *w, const char* host) {
                 if (!name)
                         return log_oom();
 
-                r = asprintf(&_filename, "%s/remote-%s.journal", s->output, name);
-                if (r < 0)
+                if (asprintf(&filename, "%s/remote-%s.journal", s->output, name) < 0)
                         return log_oom();
-
-                filename = _filename;
                 break;
         }
 
@@ -62,9 +71,21 @@ static int open_output(RemoteServer *s, Writer *w, const char* host) {
                 assert_not_reached("what?");
         }
 
+        *ret = filename;
+        return 0;
+}
+
+static int open_output(RemoteServer *s, Writer *w, const char* host) {
+        _cleanup_free_ char *filename = NULL;
+        int r;
+
+        r = output_path(s, host, &filename);
+        if (r < 0)
+                return r;
+
         r = journal_file_open_reliably(filename,
                                        O_RDWR|O_CREAT, 0640,
-                                       s->compress, (uint64_t) -1, s->seal,
+                                       s->compress ? DEFAULT_COMPRESSION : 0, (uint64_t) -1, s->seal,
                                        &w->metrics,
                                        w->mmap, NULL,
                                        NULL, &w->journal);
@@ -142,6 +163,263 @@ int journal_remote_get_writer(RemoteServer *s, const char *host, Writer **writer
         return 0;
 }
 
+/**********************************************************************
+ **********************************************************************
+ **********************************************************************/
+
+/* Archived journal files never change, hence they may be replicated as they are, instead of being taken apart
+ * into entries by the sender and put together again by us. A replica is stored under the name the file was
+ * archived with on its origin, next to where the entries of the same host go. That name is derived from the
+ * sequence number ID and the first sequence number, hence the same file is never stored twice.
+ *
+ * The header comes from the peer though, hence when all hosts share one output file, the name of the peer (as
+ * verified by the certificate, or the address it connected from) is made part of the name too. That way one
+ * host can't make replicas of another host appear as "already present". */
+
+static int replica_path(RemoteServer *s, const char *host, const Header *h, char **ret) {
+        _cleanup_free_ char *base = NULL, *name = NULL;
+        char *p;
+        int r;
+
+        assert(s);
+        assert(h);
+        assert(ret);
+
+        r = output_path(s, host, &base);
+        if (r < 0)
+                return r;
+
+        assert(endswith(base, ".journal"));
+
+        if (host && s->split_mode == JOURNAL_WRITE_SPLIT_NONE) {
+                name = filename_escape(host);
+                if (!name)
+                        return log_oom();
+        }
+
+        if (asprintf(&p, "%.*s%s%s@" SD_ID128_FORMAT_STR "-%016"PRIx64"-%016"PRIx64".journal",
+                     (int) strlen(base) - 8, base,
+                     name ? "-" : "", strempty(name),
+                     SD_ID128_FORMAT_VAL(h->seqnum_id),
+                     le64toh(h->head_entry_seqnum),
+                     le64toh(h->head_entry_realtime)) < 0)
+                return log_oom();
+
+        *ret = p;
+        return 0;
+}
+
+static int read_archived_header(int fd, Header *ret) {
+        ssize_t n;
+
+        assert(fd >= 0);
+        assert(ret);
+
+        n = pread(fd, ret, sizeof(Header), 0);
+        if (n < 0)
+                return -errno;
+        if ((size_t) n < offsetof(Header, n_data) ||
+            memcmp(ret->signature, HEADER_SIGNATURE, 8) != 0)
+                return -EBADMSG;
+
+        /* Files that are still online or only offline might see more entries later */
+        if (ret->state != STATE_ARCHIVED || le64toh(ret->n_entries) == 0)
+                return -EBUSY;
+
+        return 0;
+}
+
+int journal_remote_open_replica(RemoteServer *s, const char *host, int *ret_fd, char **ret_tmp_path) {
+        _cleanup_free_ char *base = NULL, *tmp = NULL;
+        int r, fd;
+
+        assert(s);
+        assert(ret_fd);
+        assert(ret_tmp_path);
+
+        /* Returns a temporary file next to where the replica will be stored, which is to be passed to
+         * journal_remote_add_replica() once filled with the journal file */
+
+        r = output_path(s, host, &base);
+        if (r < 0)
+                return r;
+
+        /* Not O_TMPFILE, since journal files that aren't linked anywhere are refused by journal_file_open() */
+        r = tempfn_random(base, NULL, &tmp);
+        if (r < 0)
+                return log_oom();
+
+        fd = open(tmp, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC|O_NOCTTY, 0640);
+        if (fd < 0)
+                return log_error_errno(errno, "Failed to create temporary file %s: %m", tmp);
+
+        *ret_fd = fd;
+        *ret_tmp_path = TAKE_PTR(tmp);
+        return 0;
+}
+
+static void vacuum_replicas(const char *target, const JournalMetrics *metrics) {
+        _cleanup_free_ char *dir = NULL;
+        int r;
+
+        assert(target);
+        assert(metrics);
+
+        /* Replicas take up space just like the files rotated by the writers, hence the directory is kept
+         * within the same limits, like journald does after rotating */
+
+        dir = dirname_malloc(target);
+        if (!dir) {
+                log_oom();
+                return;
+        }
+
+        r = journal_directory_vacuum(dir, metrics->max_use, metrics->n_max_files, 0, NULL, false);
+        if (r < 0 && r != -ENOENT)
+                log_warning_errno(r, "Failed to vacuum %s, ignoring: %m", dir);
+}
+
+int journal_remote_add_replica(RemoteServer *s, const char *host, int fd, const char *tmp_path) {
+        _cleanup_free_ char *target = NULL;
+        _cleanup_close_ int verify_fd = -1;
+        JournalMetrics metrics;
+        JournalFile *f = NULL;
+        struct stat st;
+        Header h;
+        int r;
+
+        assert(s);
+        assert(fd >= 0);
+
+        /* Validates the journal file in the temporary file returned by journal_remote_open_replica(), and
+         * moves it in place. Returns > 0 if it was added, 0 if it was already there. */
+
+        r = read_archived_header(fd, &h);
+        if (r < 0)
+                return log_warning_errno(r, "Not an archived journal file, refusing: %m");
+
+        r = replica_path(s, host, &h, &target);
+        if (r < 0)
+                return r;
+
+        /* The writers never let a file grow beyond max_size, hence neither may a replica */
+        metrics = s->replica_metrics;
+        journal_default_metrics(&metrics, fd);
+
+        if (fstat(fd, &st) < 0)
+                return log_error_errno(errno, "Failed to stat %s: %m", tmp_path);
+        if (metrics.max_size > 0 && (uint64_t) st.st_size > metrics.max_size) {
+                log_warning("Journal file for %s is larger than %"PRIu64" bytes, refusing.", target, metrics.max_size);
+                return -EFBIG;
+        }
+
+        if (access(target, F_OK) >= 0) {
+                log_debug("%s is already present, skipping.", target);
+                return 0;
+        }
+
+        /* Since the file is used as it is, every object in it is checked, like "journalctl --verify" does.
+         * The JournalFile takes possession of the fd it is opened with, hence it gets its own. */
+        verify_fd = fcntl(fd, F_DUPFD_CLOEXEC, 3);
+        if (verify_fd < 0)
+                return log_error_errno(errno, "Failed to duplicate fd: %m");
+
+        r = journal_file_open(verify_fd, NULL, O_RDONLY, 0, 0, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &f);
+        if (r < 0)
+                return log_warning_errno(r, "Failed to open journal file for %s: %m", target);
+        verify_fd = -1;
+
+        r = journal_file_verify(f, NULL, NULL, NULL, NULL, false);
+        (void) journal_file_close(f);
+        if (r < 0)
+                return log_warning_errno(r, "Journal file for %s failed verification: %m", target);
+
+        if (fsync(fd) < 0)
+                return log_error_errno(errno, "Failed to sync %s: %m", target);
+
+        r = link_tmpfile(fd, tmp_path, target);
+        if (r == -EEXIST)
+                return 0;
+        if (r < 0)
+                return log_error_errno(r, "Failed to move %s in place: %m", target);
+
+        r = journal_time_index_add(target, &(JournalTimeRange) {
+                        .head_realtime = le64toh(h.head_entry_realtime),
+                        .tail_realtime = le64toh(h.tail_entry_realtime),
+                });
+        if (r < 0)
+                log_debug_errno(r, "Failed to add %s to time index, ignoring: %m", target);
+
+        log_info("Added replica %s with %"PRIu64" entries.", target, le64toh(h.n_entries));
+
+        vacuum_replicas(target, &metrics);
+        return 1;
+}
+
+int journal_remote_replicate_file(RemoteServer *s, const char *path) {
+        _cleanup_(unlink_and_freep) char *tmp_path = NULL;
+        _cleanup_free_ char *target = NULL;
+        _cleanup_close_ int fd = -1, rfd = -1;
+        struct stat st;
+        Header h;
+        int r;
+
+        assert(s);
+        assert(path);
+
+        /* Replicates a local archived journal file, letting the kernel do the copying. Files that are already
+         * present aren't even copied. */
+
+        fd = open(path, O_RDONLY|O_CLOEXEC|O_NOCTTY);
+        if (fd < 0)
+                return log_error_errno(errno, "Failed to open %s: %m", path);
+
+        if (fstat(fd, &st) < 0)
+                return log_error_errno(errno, "Failed to stat %s: %m", path);
+        if ((uint64_t) st.st_size > s->replica_size_max) {
+                log_error("%s is larger than %"PRIu64" bytes, refusing.", path, s->replica_size_max);
+                return -EFBIG;
+        }
+
+        r = read_archived_header(fd, &h);
+        if (r < 0)
+                return log_error_errno(r, "%s is not an archived journal file: %m", path);
+
+        r = replica_path(s, NULL, &h, &target);
+        if (r < 0)
+                return r;
+
+        if (access(target, F_OK) >= 0) {
+                log_info("%s is already present as %s, skipping.", path, target);
+                return 0;
+        }
+
+        r = journal_remote_open_replica(s, NULL, &rfd, &tmp_path);
+        if (r < 0)
+                return r;
+
+        r = copy_bytes(fd, rfd, (uint64_t) -1, COPY_REFLINK);
+        if (r < 0)
+                return log_error_errno(r, "Failed to copy %s: %m", path);
+
+        r = journal_remote_add_replica(s, NULL, rfd, tmp_path);
+        if (r < 0)
+                return r;
+        if (r > 0)
+                tmp_path = mfree(tmp_path);
+
+        return r;
+}
+
+bool journal_remote_is_journal_file(int fd) {
+        char signature[8];
+
+        assert(fd >= 0);
+
+        return pread(fd, signature, sizeof(signature), 0) == sizeof(signature) &&
+                memcmp(signature, HEADER_SIGNATURE, sizeof(signature)) == 0;
+}
+
 /**********************************************************************
  **********************************************************************
  **********************************************************************/
@@ -304,7 +582,8 @@ int journal_remote_server_init(
                 const char *output,
                 JournalWriteSplitMode split_mode,
                 bool compress,
-                bool seal) {
+                bool seal,
+                unsigned n_writer_threads) {
 
         int r;
 
@@ -316,6 +595,8 @@ int journal_remote_server_init(
         s->split_mode = split_mode;
         s->compress = compress;
         s->seal = seal;
+        s->replica_size_max = REPLICA_SIZE_MAX;
+        memset(&s->replica_metrics, 0xFF, sizeof(s->replica_metrics));
 
         if (output)
                 s->output = output;
@@ -334,6 +615,15 @@ int journal_remote_server_init(
         if (r < 0)
                 return r;
 
+        /* Without threads, entries are written right away, from the thread that parsed them */
+        if (n_writer_threads > 0) {
+                r = writer_pool_new(n_writer_threads, &s->writer_pool);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to start writer threads: %m");
+
+                log_debug("Writing entries from %u threads.", n_writer_threads);
+        }
+
         return 0;
 }
 
@@ -361,6 +651,9 @@ RemoteServer* journal_remote_server_destroy(RemoteServer *s) {
         writer_unref(s->_single_writer);
         hashmap_free(s->writers);
 
+        /* Only after all writers are gone */
+        writer_pool_free(s->writer_pool);
+
         sd_event_source_unref(s->sigterm_event);
         sd_event_source_unref(s->sigint_event);
         sd_event_source_unref(s->listen_event);
@@ -21,6 +21,9 @@ struct MHDDaemonWrapper {
 };
 #endif
 
+/* Archived journal files that are uploaded whole are refused beyond this size */
+#define REPLICA_SIZE_MAX (1024ULL*1024ULL*1024ULL) /* 1 GiB */
+
 struct RemoteServer {
         RemoteSource **sources;
         size_t sources_size;
@@ -31,12 +34,15 @@ struct RemoteServer {
 
         Hashmap *writers;
         Writer *_single_writer;
+        WriterPool *writer_pool;
         uint64_t event_count;
 
 #if HAVE_MICROHTTPD
         Hashmap *daemons;
 #endif
         const char *output;                    /* either the output file or directory */
+        uint64_t replica_size_max;
+        JournalMetrics replica_metrics;        /* unset ones are filled in from the file system of the output */
 
         JournalWriteSplitMode split_mode;
         bool compress;
@@ -50,10 +56,16 @@ int journal_remote_server_init(
                 const char *output,
                 JournalWriteSplitMode split_mode,
                 bool compress,
-                bool seal);
+                bool seal,
+                unsigned n_writer_threads);
 
 int journal_remote_get_writer(RemoteServer *s, const char *host, Writer **writer);
 
+int journal_remote_open_replica(RemoteServer *s, const char *host, int *ret_fd, char **ret_tmp_path);
+int journal_remote_add_replica(RemoteServer *s, const char *host, int fd, const char *tmp_path);
+int journal_remote_replicate_file(RemoteServer *s, const char *path);
+bool journal_remote_is_journal_file(int fd);
+
 int journal_remote_add_source(RemoteServer *s, int fd, char* name, bool own_name);
 int journal_remote_add_raw_socket(RemoteServer *s, int fd);
 int journal_remote_handle_raw_source(
@@ -9,12 +9,15 @@
 #include "sd-daemon.h"
 
 #include "alloc-util.h"
+#include "compress.h"
 #include "conf-parser.h"
 #include "def.h"
+#include "extract-word.h"
 #include "fd-util.h"
 #include "fileio.h"
 #include "format-util.h"
 #include "glob-util.h"
+#include "journal-def.h"
 #include "journal-upload.h"
 #include "log.h"
 #include "mkdir.h"
@@ -30,6 +33,20 @@
 #define TRUST_FILE    CERTIFICATE_ROOT "/ca/trusted.pem"
 #define DEFAULT_PORT  19532
 
+/* Uploads are compressed with this unless configured otherwise, provided the server can decode it. zstd is
+ * preferred, since it compresses typical log data much better than LZ4, at a speed that still keeps up with
+ * the network. */
+#if HAVE_ZSTD
+#  define DEFAULT_UPLOAD_COMPRESSION OBJECT_COMPRESSED_ZSTD
+#elif HAVE_LZ4
+#  define DEFAULT_UPLOAD_COMPRESSION OBJECT_COMPRESSED_LZ4
+#else
+#  define DEFAULT_UPLOAD_COMPRESSION 0
+#endif
+
+/* How much input to collect into a single compressed frame at most */
+#define UPLOAD_BATCH_SIZE (256U*1024U)
+
 static const char* arg_url = NULL;
 static const char *arg_key = NULL;
 static const char *arg_cert = NULL;
@@ -43,6 +60,7 @@ static const char *arg_machine = NULL;
 static bool arg_merge = false;
 static int arg_follow = -1;
 static const char *arg_save_state = NULL;
+static int arg_compression = DEFAULT_UPLOAD_COMPRESSION;
 
 static void close_fd_input(Uploader *u);
 
@@ -82,6 +100,79 @@ static size_t output_callback(char *buf,
         return size * nmemb;
 }
 
+static size_t header_callback(char *buf,
+                              size_t size,
+                              size_t nmemb,
+                              void *userp) {
+        _cleanup_free_ char *h = NULL;
+        Uploader *u = userp;
+        char *v;
+
+        assert(u);
+
+        h = strndup(buf, size*nmemb);
+        if (!h)
+                return 0;
+
+        v = startswith_no_case(h, "Accept-Encoding:");
+        if (v) {
+                if (free_and_strdup(&u->accept_encoding, strstrip(v)) < 0)
+                        return 0;
+        }
+
+        return size * nmemb;
+}
+
+static size_t compressed_input_callback(void *buf, size_t size, size_t nmemb, void *userp) {
+        Uploader *u = userp;
+        size_t n;
+        int r;
+
+        assert(u);
+        assert(nmemb <= SSIZE_MAX / size);
+
+        /* Collects the output of the actual input callback into batches, and passes each batch on as a self
+         * contained compressed frame. Each call of the input callback yields a batch, which is as much as
+         * the journal has to offer right now, or as much as could be read from the input fd at once. */
+
+        if (u->frame_pos >= u->frame_size) {
+                if (u->input_ended)
+                        return 0;
+
+                if (!u->batch) {
+                        u->batch = malloc(UPLOAD_BATCH_SIZE);
+                        if (!u->batch) {
+                                log_oom();
+                                return CURL_READFUNC_ABORT;
+                        }
+                }
+
+                n = u->input_callback(u->batch, 1, UPLOAD_BATCH_SIZE, u->input_userdata);
+                if (n == CURL_READFUNC_ABORT)
+                        return n;
+                if (n == 0) {
+                        u->input_ended = true;
+                        return 0;
+                }
+
+                r = compress_frame(u->compression, u->batch, n,
+                                   &u->frame, &u->frame_allocated, &u->frame_size);
+                if (r < 0) {
+                        log_error_errno(r, "Failed to compress batch of %zu bytes: %m", n);
+                        return CURL_READFUNC_ABORT;
+                }
+
+                log_debug("Compressed batch of %zu bytes to %zu bytes.", n, u->frame_size);
+                u->frame_pos = 0;
+        }
+
+        n = MIN(size * nmemb, u->frame_size - u->frame_pos);
+        memcpy(buf, (uint8_t*) u->frame + u->frame_pos, n);
+        u->frame_pos += n;
+
+        return n;
+}
+
 static int check_cursor_updating(Uploader *u) {
         _cleanup_free_ char *temp_path = NULL;
         _cleanup_fclose_ FILE *f = NULL;
@@ -176,7 +267,9 @@ int start_upload(Uploader *u,
         if (!u->header) {
                 struct curl_slist *h;
 
-                h = curl_slist_append(NULL, "Content-Type: application/vnd.fdo.journal");
+                h = curl_slist_append(NULL,
+                                      u->input_journal_file ? "Content-Type: application/vnd.fdo.journal-file"
+                                                            : "Content-Type: application/vnd.fdo.journal");
                 if (!h)
                         return log_oom();
 
@@ -192,6 +285,17 @@ int start_upload(Uploader *u,
                         return log_oom();
                 }
 
+                if (u->compression > 0) {
+                        const char *e;
+
+                        e = strjoina("Content-Encoding: ", content_encoding_to_string(u->compression));
+                        h = curl_slist_append(h, e);
+                        if (!h) {
+                                curl_slist_free_all(h);
+                                return log_oom();
+                        }
+                }
+
                 u->header = h;
         }
 
@@ -218,15 +322,11 @@ int start_upload(Uploader *u,
                 easy_setopt(curl, CURLOPT_WRITEDATA, data,
                             LOG_ERR, return -EXFULL);
 
-                /* set where to read from */
-                easy_setopt(curl, CURLOPT_READFUNCTION, input_callback,
+                /* look for the encodings the server accepts */
+                easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_callback,
                             LOG_ERR, return -EXFULL);
 
-                easy_setopt(curl, CURLOPT_READDATA, data,
-                            LOG_ERR, return -EXFULL);
-
-                /* use our special own mime type and chunked transfer */
-                easy_setopt(curl, CURLOPT_HTTPHEADER, u->header,
+                easy_setopt(curl, CURLOPT_HEADERDATA, u,
                             LOG_ERR, return -EXFULL);
 
                 if (DEBUG_LOGGING)
@@ -264,6 +364,27 @@ int start_upload(Uploader *u,
                 u->answer = 0;
         }
 
+        /* set where to read from */
+        if (u->compression > 0) {
+                u->input_callback = input_callback;
+                u->input_userdata = data;
+                u->input_ended = false;
+                u->frame_pos = u->frame_size = 0;
+
+                input_callback = compressed_input_callback;
+                data = u;
+        }
+
+        easy_setopt(u->easy, CURLOPT_READFUNCTION, input_callback,
+                    LOG_ERR, return -EXFULL);
+
+        easy_setopt(u->easy, CURLOPT_READDATA, data,
+                    LOG_ERR, return -EXFULL);
+
+        /* use our special own mime type and chunked transfer */
+        easy_setopt(u->easy, CURLOPT_HTTPHEADER, u->header,
+                    LOG_ERR, return -EXFULL);
+
         /* upload to this place */
         code = curl_easy_setopt(u->easy, CURLOPT_URL, u->url);
         if (code) {
@@ -340,7 +461,15 @@ static int dispatch_fd_input(sd_event_source *event,
         return start_upload(u, fd_input_callback, u);
 }
 
+static bool is_journal_file(int fd) {
+        char signature[8];
+
+        return pread(fd, signature, sizeof(signature), 0) == sizeof(signature) &&
+                memcmp(signature, HEADER_SIGNATURE, sizeof(signature)) == 0;
+}
+
 static int open_file_for_upload(Uploader *u, const char *filename) {
+        bool journal_file = false;
         int fd, r = 0;
 
         if (streq(filename, "-"))
@@ -349,10 +478,26 @@ static int open_file_for_upload(Uploader *u, const char *filename) {
                 fd = open(filename, O_RDONLY|O_CLOEXEC|O_NOCTTY);
                 if (fd < 0)
                         return log_error_errno(errno, "Failed to open %s: %m", filename);
+
+                journal_file = is_journal_file(fd);
         }
 
         u->input = fd;
 
+        if (journal_file != u->input_journal_file) {
+                /* The Content-Type differs, hence the headers are set up again */
+                curl_slist_free_all(u->header);
+                u->header = NULL;
+                u->input_journal_file = journal_file;
+        }
+
+        /* Archived journal files are uploaded whole, and stored as they are by the receiver. They don't
+         * change anymore, hence there's nothing to follow. */
+        if (journal_file) {
+                log_debug("%s is a journal file, uploading it as it is.", filename);
+                return start_upload(u, fd_input_callback, u);
+        }
+
         if (arg_follow) {
                 r = sd_event_add_io(u->events, &u->input_event,
                                     fd, EPOLLIN, dispatch_fd_input, u);
@@ -455,6 +600,10 @@ static void destroy_uploader(Uploader *u) {
         curl_slist_free_all(u->header);
         free(u->answer);
 
+        free(u->batch);
+        free(u->frame);
+        free(u->accept_encoding);
+
         free(u->last_cursor);
         free(u->current_cursor);
 
@@ -470,11 +619,11 @@ static void destroy_uploader(Uploader *u) {
         sd_event_unref(u->events);
 }
 
-static int perform_upload(Uploader *u) {
+static int perform_request(Uploader *u, long *ret_status) {
         CURLcode code;
-        long status;
 
         assert(u);
+        assert(ret_status);
 
         u->watchdog_timestamp = now(CLOCK_MONOTONIC);
         code = curl_easy_perform(u->easy);
@@ -488,36 +637,166 @@ static int perform_upload(Uploader *u) {
                 return -EIO;
         }
 
-        code = curl_easy_getinfo(u->easy, CURLINFO_RESPONSE_CODE, &status);
+        code = curl_easy_getinfo(u->easy, CURLINFO_RESPONSE_CODE, ret_status);
         if (code) {
                 log_error("Failed to retrieve response code: %s",
                           curl_easy_strerror(code));
                 return -EUCLEAN;
         }
 
-        if (status >= 300) {
+        if (*ret_status >= 300) {
                 log_error("Upload to %s failed with code %ld: %s",
-                          u->url, status, strna(u->answer));
+                          u->url, *ret_status, strna(u->answer));
                 return -EIO;
-        } else if (status < 200) {
+        } else if (*ret_status < 200) {
                 log_error("Upload to %s finished with unexpected code %ld: %s",
-                          u->url, status, strna(u->answer));
+                          u->url, *ret_status, strna(u->answer));
                 return -EIO;
-        } else
-                log_debug("Upload finished successfully with code %ld: %s",
-                          status, strna(u->answer));
+        }
+
+        return 0;
+}
+
+static int perform_upload(Uploader *u) {
+        long status;
+        int r;
+
+        assert(u);
+
+        r = perform_request(u, &status);
+        if (r < 0)
+                return r;
+
+        log_debug("Upload finished successfully with code %ld: %s",
+                  status, strna(u->answer));
 
         free_and_replace(u->last_cursor, u->current_cursor);
 
         return update_cursor_state(u);
 }
 
+static size_t empty_input_callback(void *buf, size_t size, size_t nmemb, void *userp) {
+        Uploader *u = userp;
+
+        assert(u);
+
+        u->uploading = false;
+        return 0;
+}
+
+static bool encoding_accepted(const char *accept_encoding, const char *encoding) {
+        const char *p = accept_encoding;
+
+        for (;;) {
+                _cleanup_free_ char *word = NULL;
+
+                if (extract_first_word(&p, &word, ",", 0) <= 0)
+                        return false;
+
+                word[strcspn(word, ";")] = '\0';
+                if (strcaseeq(strstrip(word), encoding))
+                        return true;
+        }
+}
+
+static int negotiate_compression(Uploader *u) {
+        const char *encoding;
+        long status;
+        int r;
+
+        assert(u);
+        assert(u->compression > 0);
+
+        /* Servers that can decode compressed uploads say so in an Accept-Encoding header of their responses,
+         * see RFC 7694. An empty upload gets us such a response, and is fine with any server. */
+
+        encoding = content_encoding_to_string(u->compression);
+        u->compression = 0;
+
+        r = start_upload(u, empty_input_callback, u);
+        if (r < 0)
+                return r;
+
+        u->accept_encoding = mfree(u->accept_encoding);
+
+        r = perform_request(u, &status);
+        if (r < 0)
+                return r;
+
+        if (!u->accept_encoding || !encoding_accepted(u->accept_encoding, encoding)) {
+                log_notice("%s does not accept %s compressed uploads, uploading uncompressed data.",
+                           u->url, encoding);
+                return 0;
+        }
+
+        log_debug("%s accepts %s compressed uploads.", u->url, encoding);
+
+        u->compression = content_encoding_from_string(encoding);
+
+        /* The headers are set up again, with Content-Encoding, on the next upload */
+        curl_slist_free_all(u->header);
+        u->header = NULL;
+
+        return 0;
+}
+
+static int parse_compression(const char *s) {
+        int r;
+
+        r = parse_boolean(s);
+        if (r == 0)
+                return 0;
+        if (r > 0)
+                r = DEFAULT_UPLOAD_COMPRESSION;
+        else
+                r = content_encoding_from_string(s);
+        if (r < 0)
+                return -EINVAL;
+
+        if ((r == OBJECT_COMPRESSED_LZ4 && !HAVE_LZ4) ||
+            (r == OBJECT_COMPRESSED_ZSTD && !HAVE_ZSTD) ||
+            r == 0)
+                return -EOPNOTSUPP;
+
+        return r;
+}
+
+static int config_parse_compression(
+                const char* unit,
+                const char *filename,
+                unsigned line,
+                const char *section,
+                unsigned section_line,
+                const char *lvalue,
+                int ltype,
+                const char *rvalue,
+                void *data,
+                void *userdata) {
+
+        int *compression = data, c;
+
+        assert(compression);
+
+        c = parse_compression(rvalue);
+        if (c == -EOPNOTSUPP)
+                log_syntax(unit, LOG_WARNING, filename, line, c,
+                           "Compression %s is not supported by this build, ignoring.", rvalue);
+        else if (c < 0)
+                log_syntax(unit, LOG_ERR, filename, line, c,
+                           "Failed to parse %s= value, ignoring: %s", lvalue, rvalue);
+        else
+                *compression = c;
+
+        return 0;
+}
+
 static int parse_config(void) {
         const ConfigTableItem items[] = {
-                { "Upload",  "URL",                    config_parse_string, 0, &arg_url    },
-                { "Upload",  "ServerKeyFile",          config_parse_path,   0, &arg_key    },
-                { "Upload",  "ServerCertificateFile",  config_parse_path,   0, &arg_cert   },
-                { "Upload",  "TrustedCertificateFile", config_parse_path,   0, &arg_trust  },
+                { "Upload",  "URL",                    config_parse_string,      0, &arg_url         },
+                { "Upload",  "ServerKeyFile",          config_parse_path,        0, &arg_key         },
+                { "Upload",  "ServerCertificateFile",  config_parse_path,        0, &arg_cert        },
+                { "Upload",  "TrustedCertificateFile", config_parse_path,        0, &arg_trust       },
+                { "Upload",  "Compression",            config_parse_compression, 0, &arg_compression },
                 {}};
 
         return config_parse_many_nulstr(PKGSYSCONFDIR "/journal-upload.conf",
@@ -550,6 +829,8 @@ static void help(void) {
                "     --follow[=BOOL]        Do [not] wait for input\n"
                "     --save-state[=FILE]    Save uploaded cursors (default \n"
                "                            " STATE_FILE ")\n"
+               "     --compress=zstd|lz4|BOOL\n"
+               "                            Compress uploads, if the server supports it\n"
                , program_invocation_short_name);
 }
 
@@ -566,6 +847,7 @@ static int parse_argv(int argc, char *argv[]) {
                 ARG_AFTER_CURSOR,
                 ARG_FOLLOW,
                 ARG_SAVE_STATE,
+                ARG_COMPRESS,
         };
 
         static const struct option options[] = {
@@ -585,6 +867,7 @@ static int parse_argv(int argc, char *argv[]) {
                 { "after-cursor", required_argument, NULL, ARG_AFTER_CURSOR   },
                 { "follow",       optional_argument, NULL, ARG_FOLLOW         },
                 { "save-state",   optional_argument, NULL, ARG_SAVE_STATE     },
+                { "compress",     required_argument, NULL, ARG_COMPRESS       },
                 {}
         };
 
@@ -713,6 +996,20 @@ static int parse_argv(int argc, char *argv[]) {
                         arg_save_state = optarg ?: STATE_FILE;
                         break;
 
+                case ARG_COMPRESS:
+                        r = parse_compression(optarg);
+                        if (r == -EOPNOTSUPP) {
+                                log_error("Compression %s is not supported by this build.", optarg);
+                                return r;
+                        }
+                        if (r < 0) {
+                                log_error("Failed to parse --compress= parameter.");
+                                return -EINVAL;
+                        }
+
+                        arg_compression = r;
+                        break;
+
                 case '?':
                         log_error("Unknown option %s.", argv[optind-1]);
                         return -EINVAL;
@@ -788,6 +1085,14 @@ int main(int argc, char **argv) {
         if (r < 0)
                 goto cleanup;
 
+        if (arg_compression > 0) {
+                u.compression = arg_compression;
+
+                r = negotiate_compression(&u);
+                if (r < 0)
+                        goto cleanup;
+        }
+
         log_debug("%s running as pid "PID_FMT,
                   program_invocation_short_name, getpid_cached());
 
@@ -36,6 +36,17 @@ typedef struct Uploader {
 
         /* fd stuff */
         int input;
+        bool input_journal_file;
+
+        /* compression, see compressed_input_callback() */
+        int compression;
+        size_t (*input_callback)(void *ptr, size_t size, size_t nmemb, void *userdata);
+        void *input_userdata;
+        bool input_ended;
+        char *batch;
+        void *frame;
+        size_t frame_allocated, frame_size, frame_pos;
+        char *accept_encoding;
 
         /* journal stuff */
         sd_journal* journal;
@@ -31,7 +31,9 @@ static int mhd_respond_internal(struct MHD_Connection *connection,
                                 enum MHD_RequestTerminationCode code,
                                 const char *buffer,
                                 size_t size,
-                                enum MHD_ResponseMemoryMode mode) {
+                                enum MHD_ResponseMemoryMode mode,
+                                const char *header,
+                                const char *value) {
         struct MHD_Response *response;
         int r;
 
@@ -43,6 +45,8 @@ static int mhd_respond_internal(struct MHD_Connection *connection,
 
         log_debug("Queueing response %u: %s", code, buffer);
         MHD_add_response_header(response, "Content-Type", "text/plain");
+        if (header)
+                MHD_add_response_header(response, header, value);
         r = MHD_queue_response(connection, code, response);
         MHD_destroy_response(response);
 
@@ -53,13 +57,25 @@ int mhd_respond(struct MHD_Connection *connection,
                 enum MHD_RequestTerminationCode code,
                 const char *message) {
 
+        return mhd_respond_with_header(connection, code, NULL, NULL, message);
+}
+
+int mhd_respond_with_header(struct MHD_Connection *connection,
+                            enum MHD_RequestTerminationCode code,
+                            const char *header,
+                            const char *value,
+                            const char *message) {
+
         const char *fmt;
 
+        assert(!header == !value);
+
         fmt = strjoina(message, "\n");
 
         return mhd_respond_internal(connection, code,
                                     fmt, strlen(message) + 1,
-                                    MHD_RESPMEM_PERSISTENT);
+                                    MHD_RESPMEM_PERSISTENT,
+                                    header, value);
 }
 
 int mhd_respond_oom(struct MHD_Connection *connection) {
@@ -93,7 +109,7 @@ int mhd_respondf(struct MHD_Connection *connection,
         if (r < 0)
                 return respond_oom(connection);
 
-        return mhd_respond_internal(connection, code, m, r, MHD_RESPMEM_MUST_FREE);
+        return mhd_respond_internal(connection, code, m, r, MHD_RESPMEM_MUST_FREE, NULL, NULL);
 }
 
 #if HAVE_GNUTLS
@@ -61,6 +61,12 @@ int mhd_respond(struct MHD_Connection *connection,
                 unsigned code,
                 const char *message);
 
+int mhd_respond_with_header(struct MHD_Connection *connection,
+                            unsigned code,
+                            const char *header,
+                            const char *value,
+                            const char *message);
+
 int mhd_respond_oom(struct MHD_Connection *connection);
 
 int check_permissions(struct MHD_Connection *connection, int *code, char **hostname);
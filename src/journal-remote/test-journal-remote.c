@@ -0,0 +1,347 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "alloc-util.h"
+#include "copy.h"
+#include "dirent-util.h"
+#include "fd-util.h"
+#include "io-util.h"
+#include "journal-file.h"
+#include "journal-remote.h"
+#include "journal-time-index.h"
+#include "journal-verify.h"
+#include "log.h"
+#include "rm-rf.h"
+#include "stdio-util.h"
+#include "string-util.h"
+#include "util.h"
+
+#define N_ENTRIES 200
+
+static void make_journal_file(const char *fn, bool archive) {
+        JournalFile *f;
+        unsigned i;
+
+        assert_se(journal_file_open(-1, fn, O_RDWR|O_CREAT, 0644, 0, (uint64_t) -1, false,
+                                    NULL, NULL, NULL, NULL, &f) == 0);
+
+        for (i = 0; i < N_ENTRIES; i++) {
+                char message[STRLEN("MESSAGE=") + DECIMAL_STR_MAX(unsigned)];
+                struct iovec iovec[2];
+                dual_timestamp ts;
+
+                dual_timestamp_get(&ts);
+                xsprintf(message, "MESSAGE=%u", i);
+                iovec[0] = IOVEC_MAKE_STRING(message);
+                iovec[1] = IOVEC_MAKE_STRING("_HOSTNAME=origin");
+
+                assert_se(journal_file_append_entry(f, &ts, NULL, iovec, 2, NULL, NULL, NULL) == 0);
+        }
+
+        f->archive = archive;
+        (void) journal_file_close(f);
+}
+
+static void expected_path(const char *dir, const char *prefix, const char *fn, char **ret) {
+        _cleanup_close_ int fd = -1;
+        Header h;
+
+        fd = open(fn, O_RDONLY|O_CLOEXEC);
+        assert_se(fd >= 0);
+        assert_se(pread(fd, &h, sizeof(h), 0) == sizeof(h));
+
+        assert_se(asprintf(ret, "%s/%s@" SD_ID128_FORMAT_STR "-%016"PRIx64"-%016"PRIx64".journal",
+                           dir, prefix,
+                           SD_ID128_FORMAT_VAL(h.seqnum_id),
+                           le64toh(h.head_entry_seqnum),
+                           le64toh(h.head_entry_realtime)) >= 0);
+}
+
+static unsigned n_files(const char *dir) {
+        _cleanup_closedir_ DIR *d = NULL;
+        struct dirent *de;
+        unsigned n = 0;
+
+        /* Counts hidden files too, so that left over temporary files are noticed */
+        d = opendir(dir);
+        assert_se(d);
+
+        FOREACH_DIRENT_ALL(de, d, assert_not_reached("readdir failed")) {
+                if (dot_or_dot_dot(de->d_name) || streq(de->d_name, JOURNAL_TIME_INDEX))
+                        continue;
+                n++;
+        }
+
+        return n;
+}
+
+/* Feeds the file to the server the way journal-remote-main.c does for an upload with Content-Type
+ * application/vnd.fdo.journal-file, in pieces as they arrive from the network */
+static int upload(RemoteServer *s, const char *host, const char *fn) {
+        _cleanup_close_ int fd = -1;
+        RemoteSource *source;
+        int replica_fd, r;
+        char *tmp;
+
+        fd = open(fn, O_RDONLY|O_CLOEXEC);
+        assert_se(fd >= 0);
+
+        assert_se(journal_remote_open_replica(s, host, &replica_fd, &tmp) >= 0);
+
+        assert_se(source = source_new(fd, true, strdup(host), NULL));
+        source->replica_fd = replica_fd;
+        source->replica_path = tmp;
+        source->replica_size_max = s->replica_size_max;
+
+        for (;;) {
+                char buf[4096];
+                ssize_t n;
+
+                n = read(fd, buf, sizeof(buf));
+                assert_se(n >= 0);
+
+                r = process_source_data(source, buf, n, false, false);
+                if (r < 0 || n == 0)
+                        break;
+        }
+
+        if (r >= 0) {
+                r = journal_remote_add_replica(s, source->importer.name, source->replica_fd, source->replica_path);
+                if (r > 0)
+                        source->replica_path = mfree(source->replica_path);
+        }
+
+        source_free(source);
+        return r;
+}
+
+static void test_upload_split_none(const char *t) {
+        _cleanup_free_ char *in = NULL, *bad = NULL, *online = NULL, *out = NULL, *dir = NULL,
+                *a = NULL, *b = NULL;
+        _cleanup_close_ int fd = -1;
+        RemoteServer s = {};
+        JournalFile *f;
+        struct stat st;
+        Header h;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(in = strjoin(t, "/in.journal"));
+        assert_se(bad = strjoin(t, "/bad.journal"));
+        assert_se(online = strjoin(t, "/online.journal"));
+        assert_se(dir = strjoin(t, "/none"));
+        assert_se(out = strjoin(dir, "/all.journal"));
+        assert_se(mkdir(dir, 0755) >= 0);
+
+        make_journal_file(in, true);
+        make_journal_file(online, false);
+
+        assert_se(journal_remote_server_init(&s, out, JOURNAL_WRITE_SPLIT_NONE, false, false, 0) >= 0);
+
+        /* Replicas are named after the host they came from, and are only stored once per host */
+        expected_path(dir, "all-host-a", in, &a);
+        expected_path(dir, "all-host-b", in, &b);
+
+        assert_se(upload(&s, "host-a", in) == 1);
+        assert_se(access(a, F_OK) >= 0);
+        assert_se(n_files(dir) == 1);
+
+        assert_se(journal_file_open(-1, a, O_RDONLY, 0, 0, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &f) == 0);
+        assert_se(le64toh(f->header->n_entries) == N_ENTRIES);
+        assert_se(journal_file_verify(f, NULL, NULL, NULL, NULL, false) >= 0);
+        (void) journal_file_close(f);
+
+        assert_se(upload(&s, "host-a", in) == 0);
+        assert_se(n_files(dir) == 1);
+
+        /* Another host uploading a file with the same header doesn't find it "already present" */
+        assert_se(upload(&s, "host-b", in) == 1);
+        assert_se(access(b, F_OK) >= 0);
+        assert_se(n_files(dir) == 2);
+
+        /* Files that fail verification are not moved in place */
+        assert_se(copy_file(in, bad, 0, 0644, 0, COPY_REFLINK) >= 0);
+        fd = open(bad, O_RDWR|O_CLOEXEC);
+        assert_se(fd >= 0);
+        assert_se(pread(fd, &h, sizeof(h), 0) == sizeof(h));
+        assert_se(pwrite(fd, "\xff", 1, le64toh(h.tail_object_offset)) == 1);
+
+        assert_se(upload(&s, "host-c", bad) < 0);
+        assert_se(n_files(dir) == 2);
+
+        /* Files that might still change are refused */
+        assert_se(upload(&s, "host-c", online) == -EBUSY);
+        assert_se(n_files(dir) == 2);
+
+        /* Uploads are cut off once they grow beyond the maximum */
+        assert_se(stat(in, &st) >= 0);
+        s.replica_size_max = st.st_size - 1;
+        assert_se(upload(&s, "host-c", in) == -EFBIG);
+        assert_se(n_files(dir) == 2);
+        s.replica_size_max = REPLICA_SIZE_MAX;
+
+        /* ... and so are files larger than the output files may grow */
+        s.replica_metrics.max_size = 1;
+        assert_se(upload(&s, "host-c", in) == -EFBIG);
+        assert_se(n_files(dir) == 2);
+        s.replica_metrics.max_size = (uint64_t) -1;
+
+        /* Replicas are vacuumed like the files rotated by the writers */
+        s.replica_metrics.n_max_files = 1;
+        assert_se(upload(&s, "host-c", in) == 1);
+        assert_se(n_files(dir) == 1);
+
+        journal_remote_server_destroy(&s);
+}
+
+static void test_upload_split_host(const char *t) {
+        _cleanup_free_ char *in = NULL, *dir = NULL, *a = NULL;
+        RemoteServer s = {};
+
+        log_info("/* %s */", __func__);
+
+        assert_se(in = strjoin(t, "/in.journal"));
+        assert_se(dir = strjoin(t, "/host"));
+        assert_se(mkdir(dir, 0755) >= 0);
+
+        assert_se(journal_remote_server_init(&s, dir, JOURNAL_WRITE_SPLIT_HOST, false, false, 0) >= 0);
+
+        /* The name of the host is escaped, the same way as for the output files */
+        expected_path(dir, "remote-host\\x2fa", in, &a);
+
+        assert_se(upload(&s, "host/a", in) == 1);
+        assert_se(access(a, F_OK) >= 0);
+        assert_se(n_files(dir) == 1);
+
+        assert_se(upload(&s, "host/a", in) == 0);
+        assert_se(n_files(dir) == 1);
+
+        journal_remote_server_destroy(&s);
+}
+
+static void test_replicate_file(const char *t) {
+        _cleanup_free_ char *in = NULL, *out = NULL, *dir = NULL, *a = NULL;
+        RemoteServer s = {};
+
+        log_info("/* %s */", __func__);
+
+        assert_se(in = strjoin(t, "/in.journal"));
+        assert_se(dir = strjoin(t, "/local"));
+        assert_se(out = strjoin(dir, "/all.journal"));
+        assert_se(mkdir(dir, 0755) >= 0);
+
+        assert_se(journal_remote_server_init(&s, out, JOURNAL_WRITE_SPLIT_NONE, false, false, 0) >= 0);
+
+        s.replica_size_max = 4096;
+        assert_se(journal_remote_replicate_file(&s, in) == -EFBIG);
+        assert_se(n_files(dir) == 0);
+
+        /* Local files are not uploaded by any host, hence keep the name of the output file */
+        s.replica_size_max = REPLICA_SIZE_MAX;
+        expected_path(dir, "all", in, &a);
+
+        assert_se(journal_remote_replicate_file(&s, in) == 1);
+        assert_se(access(a, F_OK) >= 0);
+        assert_se(journal_remote_replicate_file(&s, in) == 0);
+        assert_se(n_files(dir) == 1);
+
+        journal_remote_server_destroy(&s);
+}
+
+static int write_entry(Writer *w, WriterStatus *status, unsigned i) {
+        char message[STRLEN("MESSAGE=") + DECIMAL_STR_MAX(unsigned)];
+        struct iovec iovec[1];
+        struct iovec_wrapper iovw = {
+                .iovec = iovec,
+                .count = 1,
+        };
+        dual_timestamp ts;
+
+        dual_timestamp_get(&ts);
+        xsprintf(message, "MESSAGE=%u", i);
+        iovec[0] = IOVEC_MAKE_STRING(message);
+
+        return writer_write(w, &iovw, &ts, false, false, status);
+}
+
+static void write_entries(Writer *w, WriterStatus *status, unsigned n) {
+        unsigned i;
+
+        for (i = 0; i < n; i++)
+                assert_se(write_entry(w, status, i) == 0);
+}
+
+static void test_writer_pool(const char *t) {
+        _cleanup_free_ char *dir = NULL, *path = NULL;
+        WriterStatus status_a = {}, status_b = {};
+        RemoteServer s = {};
+        Writer *a, *b;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(dir = strjoin(t, "/pool"));
+        assert_se(mkdir(dir, 0755) >= 0);
+
+        assert_se(journal_remote_server_init(&s, dir, JOURNAL_WRITE_SPLIT_HOST, false, false, 2) >= 0);
+
+        /* Hosts are spread over the threads */
+        assert_se(journal_remote_get_writer(&s, "a", &a) >= 0);
+        assert_se(journal_remote_get_writer(&s, "b", &b) >= 0);
+        assert_se(a->thread && b->thread && a->thread != b->thread);
+
+        write_entries(a, &status_a, N_ENTRIES);
+        write_entries(b, &status_b, N_ENTRIES);
+
+        assert_se(writer_sync(a, &status_a) == 0);
+        assert_se(status_a.n_queued == 0);
+        assert_se(le64toh(a->journal->header->n_entries) == N_ENTRIES);
+
+        writer_pool_flush(s.writer_pool);
+        assert_se(le64toh(b->journal->header->n_entries) == N_ENTRIES);
+        assert_se(s.event_count == 2 * N_ENTRIES);
+
+        /* Entries that can't be written are reported back to the source that queued them, and not to
+         * others. Writing fails once the file can neither be appended to nor rotated. */
+        assert_se(path = strdup(b->journal->path));
+        (void) journal_file_close(b->journal);
+        assert_se(journal_file_open(-1, path, O_RDONLY, 0, 0, (uint64_t) -1, false,
+                                    NULL, b->mmap, NULL, NULL, &b->journal) == 0);
+
+        write_entries(b, &status_b, 1);
+        write_entries(a, &status_a, 1);
+        assert_se(writer_sync(b, &status_b) < 0);
+        assert_se(writer_sync(b, &status_b) == 0);
+        assert_se(writer_sync(a, &status_a) == 0);
+
+        /* Without waiting, the failure makes the next entry of the source fail */
+        write_entries(b, &status_b, 1);
+        writer_pool_flush(s.writer_pool);
+        assert_se(write_entry(b, &status_b, 0) < 0);
+        assert_se(writer_sync(b, &status_b) == 0);
+
+        writer_unref(a);
+        writer_unref(b);
+        journal_remote_server_destroy(&s);
+}
+
+int main(int argc, char *argv[]) {
+        char t[] = "/var/tmp/journal-remote-XXXXXX";
+
+        log_set_max_level(LOG_DEBUG);
+        log_parse_environment();
+        log_open();
+
+        assert_se(mkdtemp(t));
+
+        test_upload_split_none(t);
+        test_upload_split_host(t);
+        test_replicate_file(t);
+        test_writer_pool(t);
+
+        assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        return 0;
+}
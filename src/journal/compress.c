@@ -15,6 +15,12 @@
 #include <lz4frame.h>
 #endif
 
+#if HAVE_ZSTD
+#include <zdict.h>
+#include <zstd.h>
+#include <zstd_errors.h>
+#endif
+
 #include "alloc-util.h"
 #include "compress.h"
 #include "fd-util.h"
@@ -31,15 +37,50 @@ DEFINE_TRIVIAL_CLEANUP_FUNC(LZ4F_compressionContext_t, LZ4F_freeCompressionConte
 DEFINE_TRIVIAL_CLEANUP_FUNC(LZ4F_decompressionContext_t, LZ4F_freeDecompressionContext);
 #endif
 
+#if HAVE_ZSTD
+DEFINE_TRIVIAL_CLEANUP_FUNC(ZSTD_CStream*, ZSTD_freeCStream);
+DEFINE_TRIVIAL_CLEANUP_FUNC(ZSTD_DStream*, ZSTD_freeDStream);
+
+/* Level 1 is the fastest of the "regular" levels, and still compresses typical log payloads noticeably
+ * better than LZ4. */
+#define ZSTD_BLOB_LEVEL 1
+
+struct CompressDictionary {
+        ZSTD_DDict *ddict;
+        ZSTD_CDict *cdict;
+        ZSTD_CCtx *cctx;
+};
+
+static int zstd_ret_to_errno(size_t ret) {
+        switch (ZSTD_getErrorCode(ret)) {
+        case ZSTD_error_dstSize_tooSmall:
+                return -ENOBUFS;
+        case ZSTD_error_memory_allocation:
+                return -ENOMEM;
+        default:
+                return -EBADMSG;
+        }
+}
+#endif
+
 #define ALIGN_8(l) ALIGN_TO(l, sizeof(size_t))
 
 static const char* const object_compressed_table[_OBJECT_COMPRESSED_MAX] = {
         [OBJECT_COMPRESSED_XZ] = "XZ",
         [OBJECT_COMPRESSED_LZ4] = "LZ4",
+        [OBJECT_COMPRESSED_ZSTD] = "ZSTD",
 };
 
 DEFINE_STRING_TABLE_LOOKUP(object_compressed, int);
 
+/* The tokens used for the framed formats in HTTP Content-Encoding and Accept-Encoding headers */
+static const char* const content_encoding_table[_OBJECT_COMPRESSED_MAX] = {
+        [OBJECT_COMPRESSED_LZ4] = "lz4",
+        [OBJECT_COMPRESSED_ZSTD] = "zstd",
+};
+
+DEFINE_STRING_TABLE_LOOKUP(content_encoding, int);
+
 int compress_blob_xz(const void *src, uint64_t src_size,
                      void *dst, size_t dst_alloc_size, size_t *dst_size) {
 #if HAVE_XZ
@@ -112,6 +153,141 @@ int compress_blob_lz4(const void *src, uint64_t src_size,
 #endif
 }
 
+int compress_blob_zstd(const void *src, uint64_t src_size,
+                       void *dst, size_t dst_alloc_size, size_t *dst_size) {
+#if HAVE_ZSTD
+        size_t k;
+
+        assert(src);
+        assert(src_size > 0);
+        assert(dst);
+        assert(dst_alloc_size > 0);
+        assert(dst_size);
+
+        /* Returns < 0 if we couldn't compress the data or the
+         * compressed result is longer than the original */
+
+        k = ZSTD_compress(dst, dst_alloc_size, src, src_size, ZSTD_BLOB_LEVEL);
+        if (ZSTD_isError(k))
+                return zstd_ret_to_errno(k);
+
+        *dst_size = k;
+        return 0;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
+int compress_blob_zstd_with_dictionary(CompressDictionary *dict,
+                                       const void *src, uint64_t src_size,
+                                       void *dst, size_t dst_alloc_size, size_t *dst_size) {
+#if HAVE_ZSTD
+        size_t k;
+
+        assert(dict);
+        assert(src);
+        assert(src_size > 0);
+        assert(dst);
+        assert(dst_alloc_size > 0);
+        assert(dst_size);
+
+        if (!dict->cdict)
+                return -EINVAL;
+
+        if (!dict->cctx) {
+                dict->cctx = ZSTD_createCCtx();
+                if (!dict->cctx)
+                        return -ENOMEM;
+        }
+
+        k = ZSTD_compress_usingCDict(dict->cctx, dst, dst_alloc_size, src, src_size, dict->cdict);
+        if (ZSTD_isError(k))
+                return zstd_ret_to_errno(k);
+
+        *dst_size = k;
+        return 0;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
+int compress_dictionary_new(const void *data, size_t size, bool for_compression, CompressDictionary **ret) {
+#if HAVE_ZSTD
+        _cleanup_(compress_dictionary_freep) CompressDictionary *d = NULL;
+
+        assert(data);
+        assert(size > 0);
+        assert(ret);
+
+        d = new0(CompressDictionary, 1);
+        if (!d)
+                return -ENOMEM;
+
+        /* Both functions copy the dictionary, hence the caller's buffer may go away afterwards */
+        d->ddict = ZSTD_createDDict(data, size);
+        if (!d->ddict)
+                return -ENOMEM;
+
+        if (for_compression) {
+                d->cdict = ZSTD_createCDict(data, size, ZSTD_BLOB_LEVEL);
+                if (!d->cdict)
+                        return -ENOMEM;
+        }
+
+        *ret = TAKE_PTR(d);
+        return 0;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
+CompressDictionary* compress_dictionary_free(CompressDictionary *d) {
+        if (!d)
+                return NULL;
+
+#if HAVE_ZSTD
+        ZSTD_freeCCtx(d->cctx);
+        ZSTD_freeCDict(d->cdict);
+        ZSTD_freeDDict(d->ddict);
+#endif
+
+        return mfree(d);
+}
+
+int compress_dictionary_train(const void *samples, const size_t *sample_sizes, size_t n_samples,
+                              size_t max_size, void **ret, size_t *ret_size) {
+#if HAVE_ZSTD
+        _cleanup_free_ void *buf = NULL;
+        size_t k;
+
+        assert(samples);
+        assert(sample_sizes);
+        assert(max_size > 0);
+        assert(ret);
+        assert(ret_size);
+
+        if (n_samples <= 0 || n_samples > UINT_MAX)
+                return -EINVAL;
+
+        buf = malloc(max_size);
+        if (!buf)
+                return -ENOMEM;
+
+        /* Fails if there are too few samples, or they are too similar, to learn anything from */
+        k = ZDICT_trainFromBuffer(buf, max_size, samples, sample_sizes, (unsigned) n_samples);
+        if (ZDICT_isError(k)) {
+                log_debug("Failed to train ZSTD dictionary: %s", ZDICT_getErrorName(k));
+                return -ENODATA;
+        }
+
+        *ret = TAKE_PTR(buf);
+        *ret_size = k;
+        return 0;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
 int decompress_blob_xz(const void *src, uint64_t src_size,
                        void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max) {
 
@@ -212,15 +388,105 @@ int decompress_blob_lz4(const void *src, uint64_t src_size,
 #endif
 }
 
+int decompress_blob_zstd(const void *src, uint64_t src_size,
+                         void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max) {
+        return decompress_blob_zstd_with_dictionary(NULL, src, src_size, dst, dst_alloc_size, dst_size, dst_max);
+}
+
+int decompress_blob_zstd_with_dictionary(const CompressDictionary *dict,
+                                         const void *src, uint64_t src_size,
+                                         void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max) {
+
+#if HAVE_ZSTD
+        _cleanup_(ZSTD_freeDStreamp) ZSTD_DStream *dstream = NULL;
+        unsigned long long size;
+        ZSTD_inBuffer input;
+        ZSTD_outBuffer output;
+        size_t k;
+
+        assert(src);
+        assert(src_size > 0);
+        assert(dst);
+        assert(dst_alloc_size);
+        assert(dst_size);
+        assert(*dst_alloc_size == 0 || *dst);
+
+        /* ZSTD_compress() always records the content size in the frame header, hence we know upfront
+         * how much space we need. If the caller is only interested in the first dst_max bytes we stop
+         * decoding there. */
+        size = ZSTD_getFrameContentSize(src, src_size);
+        if (IN_SET(size, ZSTD_CONTENTSIZE_ERROR, ZSTD_CONTENTSIZE_UNKNOWN))
+                return -EBADMSG;
+
+        if (dst_max > 0 && size > dst_max)
+                size = dst_max;
+        if (size > SIZE_MAX)
+                return -EFBIG;
+
+        if (!greedy_realloc(dst, dst_alloc_size, MAX(size, 1u), 1))
+                return -ENOMEM;
+
+        dstream = ZSTD_createDStream();
+        if (!dstream)
+                return -ENOMEM;
+
+        k = ZSTD_initDStream(dstream);
+        if (ZSTD_isError(k))
+                return zstd_ret_to_errno(k);
+
+        /* Must come after ZSTD_initDStream(), which drops any referenced dictionary */
+        if (dict) {
+                k = ZSTD_DCtx_refDDict(dstream, dict->ddict);
+                if (ZSTD_isError(k))
+                        return zstd_ret_to_errno(k);
+        }
+
+        input = (ZSTD_inBuffer) {
+                .src = src,
+                .size = src_size,
+        };
+        output = (ZSTD_outBuffer) {
+                .dst = *dst,
+                .size = size,
+        };
+
+        while (output.pos < output.size) {
+                size_t pos = output.pos;
+
+                k = ZSTD_decompressStream(dstream, &output, &input);
+                if (ZSTD_isError(k)) {
+                        log_debug("ZSTD decoder failed: %s", ZSTD_getErrorName(k));
+                        return zstd_ret_to_errno(k);
+                }
+
+                /* The frame ended, or the decoder is stuck on truncated input */
+                if (k == 0 || output.pos == pos)
+                        break;
+        }
+
+        if (output.pos != size)
+                return -EBADMSG;
+
+        *dst_size = size;
+        return 0;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
 int decompress_blob(int compression,
                     const void *src, uint64_t src_size,
-                    void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max) {
+                    void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max,
+                    const CompressDictionary *dict) {
         if (compression == OBJECT_COMPRESSED_XZ)
                 return decompress_blob_xz(src, src_size,
                                           dst, dst_alloc_size, dst_size, dst_max);
         else if (compression == OBJECT_COMPRESSED_LZ4)
                 return decompress_blob_lz4(src, src_size,
                                            dst, dst_alloc_size, dst_size, dst_max);
+        else if (compression == OBJECT_COMPRESSED_ZSTD)
+                return decompress_blob_zstd_with_dictionary(dict, src, src_size,
+                                                            dst, dst_alloc_size, dst_size, dst_max);
         else
                 return -EBADMSG;
 }
@@ -333,11 +599,95 @@ int decompress_startswith_lz4(const void *src, uint64_t src_size,
 #endif
 }
 
+int decompress_startswith_zstd(const void *src, uint64_t src_size,
+                               void **buffer, size_t *buffer_size,
+                               const void *prefix, size_t prefix_len,
+                               uint8_t extra) {
+        return decompress_startswith_zstd_with_dictionary(NULL, src, src_size,
+                                                          buffer, buffer_size,
+                                                          prefix, prefix_len,
+                                                          extra);
+}
+
+int decompress_startswith_zstd_with_dictionary(const CompressDictionary *dict,
+                                               const void *src, uint64_t src_size,
+                                               void **buffer, size_t *buffer_size,
+                                               const void *prefix, size_t prefix_len,
+                                               uint8_t extra) {
+#if HAVE_ZSTD
+        _cleanup_(ZSTD_freeDStreamp) ZSTD_DStream *dstream = NULL;
+        ZSTD_inBuffer input;
+        ZSTD_outBuffer output;
+        size_t k;
+
+        /* Checks whether the decompressed blob starts with the
+         * mentioned prefix. The byte extra needs to follow the
+         * prefix */
+
+        assert(src);
+        assert(src_size > 0);
+        assert(buffer);
+        assert(buffer_size);
+        assert(prefix);
+        assert(*buffer_size == 0 || *buffer);
+
+        if (!(greedy_realloc(buffer, buffer_size, ALIGN_8(prefix_len + 1), 1)))
+                return -ENOMEM;
+
+        dstream = ZSTD_createDStream();
+        if (!dstream)
+                return -ENOMEM;
+
+        k = ZSTD_initDStream(dstream);
+        if (ZSTD_isError(k))
+                return zstd_ret_to_errno(k);
+
+        /* Must come after ZSTD_initDStream(), which drops any referenced dictionary */
+        if (dict) {
+                k = ZSTD_DCtx_refDDict(dstream, dict->ddict);
+                if (ZSTD_isError(k))
+                        return zstd_ret_to_errno(k);
+        }
+
+        input = (ZSTD_inBuffer) {
+                .src = src,
+                .size = src_size,
+        };
+        output = (ZSTD_outBuffer) {
+                .dst = *buffer,
+                .size = prefix_len + 1,
+        };
+
+        /* Only decode as much as we need to compare the prefix */
+        while (output.pos < output.size) {
+                size_t pos = output.pos;
+
+                k = ZSTD_decompressStream(dstream, &output, &input);
+                if (ZSTD_isError(k)) {
+                        log_debug("ZSTD decoder failed: %s", ZSTD_getErrorName(k));
+                        return zstd_ret_to_errno(k);
+                }
+
+                if (k == 0 || output.pos == pos)
+                        break;
+        }
+
+        if (output.pos < prefix_len + 1)
+                return 0;
+
+        return memcmp(*buffer, prefix, prefix_len) == 0 &&
+                ((const uint8_t*) *buffer)[prefix_len] == extra;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
 int decompress_startswith(int compression,
                           const void *src, uint64_t src_size,
                           void **buffer, size_t *buffer_size,
                           const void *prefix, size_t prefix_len,
-                          uint8_t extra) {
+                          uint8_t extra,
+                          const CompressDictionary *dict) {
         if (compression == OBJECT_COMPRESSED_XZ)
                 return decompress_startswith_xz(src, src_size,
                                                 buffer, buffer_size,
@@ -348,6 +698,11 @@ int decompress_startswith(int compression,
                                                  buffer, buffer_size,
                                                  prefix, prefix_len,
                                                  extra);
+        else if (compression == OBJECT_COMPRESSED_ZSTD)
+                return decompress_startswith_zstd_with_dictionary(dict, src, src_size,
+                                                                  buffer, buffer_size,
+                                                                  prefix, prefix_len,
+                                                                  extra);
         else
                 return -EBADMSG;
 }
@@ -657,12 +1012,420 @@ int decompress_stream_lz4(int in, int out, uint64_t max_bytes) {
 #endif
 }
 
+int compress_stream_zstd(int fdf, int fdt, uint64_t max_bytes) {
+#if HAVE_ZSTD
+        _cleanup_(ZSTD_freeCStreamp) ZSTD_CStream *cstream = NULL;
+        _cleanup_free_ void *in_buff = NULL, *out_buff = NULL;
+        size_t in_allocsize, out_allocsize, k;
+        uint64_t left = max_bytes, in_bytes = 0, out_bytes = 0;
+
+        assert(fdf >= 0);
+        assert(fdt >= 0);
+
+        /* Create the context and buffers */
+        in_allocsize = ZSTD_CStreamInSize();
+        out_allocsize = ZSTD_CStreamOutSize();
+        in_buff = malloc(in_allocsize);
+        out_buff = malloc(out_allocsize);
+        cstream = ZSTD_createCStream();
+        if (!in_buff || !out_buff || !cstream)
+                return -ENOMEM;
+
+        k = ZSTD_initCStream(cstream, ZSTD_BLOB_LEVEL);
+        if (ZSTD_isError(k)) {
+                log_debug("Failed to initialize ZSTD encoder: %s", ZSTD_getErrorName(k));
+                return zstd_ret_to_errno(k);
+        }
+
+        for (;;) {
+                ZSTD_inBuffer input;
+                size_t m = in_allocsize;
+                ssize_t n;
+
+                if (max_bytes != (uint64_t) -1 && (uint64_t) m > left)
+                        m = (size_t) left;
+
+                n = loop_read(fdf, in_buff, m, true);
+                if (n < 0)
+                        return n;
+                if (n == 0)
+                        break;
+
+                in_bytes += n;
+                if (max_bytes != (uint64_t) -1)
+                        left -= n;
+
+                input = (ZSTD_inBuffer) {
+                        .src = in_buff,
+                        .size = n,
+                };
+
+                while (input.pos < input.size) {
+                        ZSTD_outBuffer output = {
+                                .dst = out_buff,
+                                .size = out_allocsize,
+                        };
+
+                        k = ZSTD_compressStream(cstream, &output, &input);
+                        if (ZSTD_isError(k)) {
+                                log_debug("ZSTD encoder failed: %s", ZSTD_getErrorName(k));
+                                return zstd_ret_to_errno(k);
+                        }
+
+                        n = loop_write(fdt, output.dst, output.pos, false);
+                        if (n < 0)
+                                return n;
+
+                        out_bytes += output.pos;
+                }
+        }
+
+        /* Flush whatever is still buffered in the encoder and write the frame epilogue */
+        do {
+                ZSTD_outBuffer output = {
+                        .dst = out_buff,
+                        .size = out_allocsize,
+                };
+                ssize_t n;
+
+                k = ZSTD_endStream(cstream, &output);
+                if (ZSTD_isError(k)) {
+                        log_debug("ZSTD encoder failed: %s", ZSTD_getErrorName(k));
+                        return zstd_ret_to_errno(k);
+                }
+
+                n = loop_write(fdt, output.dst, output.pos, false);
+                if (n < 0)
+                        return n;
+
+                out_bytes += output.pos;
+        } while (k > 0);
+
+        log_debug("ZSTD compression finished (%"PRIu64" -> %"PRIu64" bytes, %.1f%%)",
+                  in_bytes, out_bytes,
+                  in_bytes > 0 ? (double) out_bytes / in_bytes * 100 : 0.0);
+
+        return 0;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
+int decompress_stream_zstd(int fdf, int fdt, uint64_t max_bytes) {
+
+#if HAVE_ZSTD
+        _cleanup_(ZSTD_freeDStreamp) ZSTD_DStream *dstream = NULL;
+        _cleanup_free_ void *in_buff = NULL, *out_buff = NULL;
+        size_t in_allocsize, out_allocsize, k, last = 0;
+        uint64_t in_bytes = 0, out_bytes = 0;
+
+        assert(fdf >= 0);
+        assert(fdt >= 0);
+
+        in_allocsize = ZSTD_DStreamInSize();
+        out_allocsize = ZSTD_DStreamOutSize();
+        in_buff = malloc(in_allocsize);
+        out_buff = malloc(out_allocsize);
+        dstream = ZSTD_createDStream();
+        if (!in_buff || !out_buff || !dstream)
+                return -ENOMEM;
+
+        k = ZSTD_initDStream(dstream);
+        if (ZSTD_isError(k)) {
+                log_debug("Failed to initialize ZSTD decoder: %s", ZSTD_getErrorName(k));
+                return zstd_ret_to_errno(k);
+        }
+
+        for (;;) {
+                ZSTD_inBuffer input;
+                ssize_t n;
+
+                n = loop_read(fdf, in_buff, in_allocsize, true);
+                if (n < 0)
+                        return n;
+                if (n == 0)
+                        break;
+
+                in_bytes += n;
+
+                input = (ZSTD_inBuffer) {
+                        .src = in_buff,
+                        .size = n,
+                };
+
+                while (input.pos < input.size) {
+                        ZSTD_outBuffer output = {
+                                .dst = out_buff,
+                                .size = out_allocsize,
+                        };
+
+                        last = ZSTD_decompressStream(dstream, &output, &input);
+                        if (ZSTD_isError(last)) {
+                                log_debug("ZSTD decoder failed: %s", ZSTD_getErrorName(last));
+                                return zstd_ret_to_errno(last);
+                        }
+
+                        if (max_bytes != (uint64_t) -1 && out_bytes + output.pos > max_bytes) {
+                                log_debug("Decompressed stream longer than %"PRIu64" bytes", max_bytes);
+                                return -EFBIG;
+                        }
+
+                        n = loop_write(fdt, output.dst, output.pos, false);
+                        if (n < 0)
+                                return n;
+
+                        out_bytes += output.pos;
+                }
+        }
+
+        /* A non-zero return value of the last ZSTD_decompressStream() call means the frame is incomplete */
+        if (last != 0) {
+                log_debug("ZSTD decoder failed: input is truncated");
+                return -EBADMSG;
+        }
+
+        log_debug("ZSTD decompression finished (%"PRIu64" -> %"PRIu64" bytes, %.1f%%)",
+                  in_bytes, out_bytes,
+                  in_bytes > 0 ? (double) out_bytes / in_bytes * 100 : 0.0);
+
+        return 0;
+#else
+        log_debug("Cannot decompress file. Compiled without ZSTD support.");
+        return -EPROTONOSUPPORT;
+#endif
+}
+
+int compress_frame_lz4(const void *src, size_t src_size,
+                       void **dst, size_t *dst_alloc_size, size_t *dst_size) {
+#if HAVE_LZ4
+        static const LZ4F_preferences_t preferences = {
+                .frameInfo.blockSizeID = 5,
+        };
+        size_t k;
+
+        assert(src || src_size == 0);
+        assert(dst);
+        assert(dst_alloc_size);
+        assert(dst_size);
+
+        if (!GREEDY_REALLOC(*dst, *dst_alloc_size, LZ4F_compressFrameBound(src_size, &preferences)))
+                return -ENOMEM;
+
+        k = LZ4F_compressFrame(*dst, *dst_alloc_size, src, src_size, &preferences);
+        if (LZ4F_isError(k)) {
+                log_debug("LZ4 encoder failed: %s", LZ4F_getErrorName(k));
+                return -ENOBUFS;
+        }
+
+        *dst_size = k;
+        return 0;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
+int compress_frame_zstd(const void *src, size_t src_size,
+                        void **dst, size_t *dst_alloc_size, size_t *dst_size) {
+#if HAVE_ZSTD
+        size_t k;
+
+        assert(src || src_size == 0);
+        assert(dst);
+        assert(dst_alloc_size);
+        assert(dst_size);
+
+        if (!GREEDY_REALLOC(*dst, *dst_alloc_size, ZSTD_compressBound(src_size)))
+                return -ENOMEM;
+
+        k = ZSTD_compress(*dst, *dst_alloc_size, src, src_size, ZSTD_BLOB_LEVEL);
+        if (ZSTD_isError(k)) {
+                log_debug("ZSTD encoder failed: %s", ZSTD_getErrorName(k));
+                return zstd_ret_to_errno(k);
+        }
+
+        *dst_size = k;
+        return 0;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
+int compress_frame(int compression,
+                   const void *src, size_t src_size,
+                   void **dst, size_t *dst_alloc_size, size_t *dst_size) {
+
+        if (compression == OBJECT_COMPRESSED_LZ4)
+                return compress_frame_lz4(src, src_size, dst, dst_alloc_size, dst_size);
+        else if (compression == OBJECT_COMPRESSED_ZSTD)
+                return compress_frame_zstd(src, src_size, dst, dst_alloc_size, dst_size);
+        else
+                return -EPROTONOSUPPORT;
+}
+
+#define DECOMPRESSOR_BUFSIZE (64*1024u)
+
+struct Decompressor {
+        int compression;
+        bool in_frame;
+
+#if HAVE_LZ4
+        LZ4F_decompressionContext_t lz4;
+#endif
+#if HAVE_ZSTD
+        ZSTD_DStream *zstd;
+#endif
+
+        uint8_t buffer[DECOMPRESSOR_BUFSIZE];
+};
+
+int decompressor_new(int compression, Decompressor **ret) {
+        _cleanup_(decompressor_freep) Decompressor *d = NULL;
+
+        assert(ret);
+
+        d = new0(Decompressor, 1);
+        if (!d)
+                return -ENOMEM;
+
+        d->compression = compression;
+
+        switch (compression) {
+
+#if HAVE_LZ4
+        case OBJECT_COMPRESSED_LZ4: {
+                LZ4F_errorCode_t c;
+
+                c = LZ4F_createDecompressionContext(&d->lz4, LZ4F_VERSION);
+                if (LZ4F_isError(c))
+                        return -ENOMEM;
+                break;
+        }
+#endif
+
+#if HAVE_ZSTD
+        case OBJECT_COMPRESSED_ZSTD: {
+                size_t k;
+
+                d->zstd = ZSTD_createDStream();
+                if (!d->zstd)
+                        return -ENOMEM;
+
+                k = ZSTD_initDStream(d->zstd);
+                if (ZSTD_isError(k))
+                        return zstd_ret_to_errno(k);
+                break;
+        }
+#endif
+
+        default:
+                return -EPROTONOSUPPORT;
+        }
+
+        *ret = TAKE_PTR(d);
+        return 0;
+}
+
+Decompressor* decompressor_free(Decompressor *d) {
+        if (!d)
+                return NULL;
+
+#if HAVE_LZ4
+        if (d->lz4)
+                LZ4F_freeDecompressionContext(d->lz4);
+#endif
+#if HAVE_ZSTD
+        ZSTD_freeDStream(d->zstd);
+#endif
+
+        return mfree(d);
+}
+
+int decompressor_run(Decompressor *d, const void **src, size_t *src_size, const void **ret, size_t *ret_size) {
+        size_t out = 0;
+
+        assert(d);
+        assert(src);
+        assert(src_size);
+        assert(ret);
+        assert(ret_size);
+
+        /* Decompresses as much of src as fits into the internal buffer, and advances src accordingly. The
+         * output is valid until the next call. If it filled the buffer completely there might be more,
+         * and the function should be called again, even if all of src was consumed. */
+
+        while (out < sizeof(d->buffer) && (*src_size > 0 || d->in_frame)) {
+                size_t used = *src_size, produced = sizeof(d->buffer) - out, hint;
+
+                switch (d->compression) {
+
+#if HAVE_LZ4
+                case OBJECT_COMPRESSED_LZ4:
+                        hint = LZ4F_decompress(d->lz4, d->buffer + out, &produced, *src, &used, NULL);
+                        if (LZ4F_isError(hint)) {
+                                log_debug("LZ4 decoder failed: %s", LZ4F_getErrorName(hint));
+                                return -EBADMSG;
+                        }
+                        break;
+#endif
+
+#if HAVE_ZSTD
+                case OBJECT_COMPRESSED_ZSTD: {
+                        ZSTD_inBuffer input = {
+                                .src = *src,
+                                .size = *src_size,
+                        };
+                        ZSTD_outBuffer output = {
+                                .dst = d->buffer + out,
+                                .size = produced,
+                        };
+
+                        hint = ZSTD_decompressStream(d->zstd, &output, &input);
+                        if (ZSTD_isError(hint)) {
+                                log_debug("ZSTD decoder failed: %s", ZSTD_getErrorName(hint));
+                                return zstd_ret_to_errno(hint);
+                        }
+
+                        used = input.pos;
+                        produced = output.pos;
+                        break;
+                }
+#endif
+
+                default:
+                        assert_not_reached("Unknown compression");
+                }
+
+                *src = (const uint8_t*) *src + used;
+                *src_size -= used;
+                out += produced;
+
+                /* Both decoders return 0 exactly when a frame was completed and flushed, and pick up the
+                 * next one on the following call */
+                d->in_frame = hint != 0;
+
+                if (used == 0 && produced == 0)
+                        break;
+        }
+
+        *ret = d->buffer;
+        *ret_size = out;
+        return 0;
+}
+
+bool decompressor_in_frame(Decompressor *d) {
+        assert(d);
+
+        return d->in_frame;
+}
+
 int decompress_stream(const char *filename, int fdf, int fdt, uint64_t max_bytes) {
 
         if (endswith(filename, ".lz4"))
                 return decompress_stream_lz4(fdf, fdt, max_bytes);
         else if (endswith(filename, ".xz"))
                 return decompress_stream_xz(fdf, fdt, max_bytes);
+        else if (endswith(filename, ".zst"))
+                return decompress_stream_zstd(fdf, fdt, max_bytes);
         else
                 return -EPROTONOSUPPORT;
 }
@@ -1,6 +1,8 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 #pragma once
 
+#include <errno.h>
+#include <stdbool.h>
 #include <unistd.h>
 
 #include "journal-def.h"
@@ -8,33 +10,87 @@
 const char* object_compressed_to_string(int compression);
 int object_compressed_from_string(const char *compression);
 
+const char* content_encoding_to_string(int compression);
+int content_encoding_from_string(const char *encoding);
+
 int compress_blob_xz(const void *src, uint64_t src_size,
                      void *dst, size_t dst_alloc_size, size_t *dst_size);
 int compress_blob_lz4(const void *src, uint64_t src_size,
                       void *dst, size_t dst_alloc_size, size_t *dst_size);
+int compress_blob_zstd(const void *src, uint64_t src_size,
+                       void *dst, size_t dst_alloc_size, size_t *dst_size);
 
-static inline int compress_blob(const void *src, uint64_t src_size,
-                                void *dst, size_t dst_alloc_size, size_t *dst_size) {
-        int r;
+/* A trained zstd dictionary, prepared for decompression and optionally also for compression */
+typedef struct CompressDictionary CompressDictionary;
+
+int compress_dictionary_new(const void *data, size_t size, bool for_compression, CompressDictionary **ret);
+CompressDictionary* compress_dictionary_free(CompressDictionary *d);
+DEFINE_TRIVIAL_CLEANUP_FUNC(CompressDictionary*, compress_dictionary_free);
+
+int compress_dictionary_train(const void *samples, const size_t *sample_sizes, size_t n_samples,
+                              size_t max_size, void **ret, size_t *ret_size);
+
+int compress_blob_zstd_with_dictionary(CompressDictionary *dict,
+                                       const void *src, uint64_t src_size,
+                                       void *dst, size_t dst_alloc_size, size_t *dst_size);
+
+/* The algorithm used when compression is requested without naming one. LZ4 is preferred since it is the
+ * cheapest on the CPU, zstd is used next as it still beats XZ by a wide margin on speed. */
 #if HAVE_LZ4
-        r = compress_blob_lz4(src, src_size, dst, dst_alloc_size, dst_size);
-        if (r == 0)
-                return OBJECT_COMPRESSED_LZ4;
+#  define DEFAULT_COMPRESSION OBJECT_COMPRESSED_LZ4
+#elif HAVE_ZSTD
+#  define DEFAULT_COMPRESSION OBJECT_COMPRESSED_ZSTD
+#elif HAVE_XZ
+#  define DEFAULT_COMPRESSION OBJECT_COMPRESSED_XZ
 #else
-        r = compress_blob_xz(src, src_size, dst, dst_alloc_size, dst_size);
-        if (r == 0)
-                return OBJECT_COMPRESSED_XZ;
+#  define DEFAULT_COMPRESSION 0
 #endif
-        return r;
+
+static inline int compress_blob(int compression,
+                                const void *src, uint64_t src_size,
+                                void *dst, size_t dst_alloc_size, size_t *dst_size,
+                                CompressDictionary *dict) {
+        int r;
+
+        switch (compression) {
+
+        case OBJECT_COMPRESSED_XZ:
+                r = compress_blob_xz(src, src_size, dst, dst_alloc_size, dst_size);
+                break;
+
+        case OBJECT_COMPRESSED_LZ4:
+                r = compress_blob_lz4(src, src_size, dst, dst_alloc_size, dst_size);
+                break;
+
+        case OBJECT_COMPRESSED_ZSTD:
+                if (dict)
+                        r = compress_blob_zstd_with_dictionary(dict, src, src_size, dst, dst_alloc_size, dst_size);
+                else
+                        r = compress_blob_zstd(src, src_size, dst, dst_alloc_size, dst_size);
+                break;
+
+        default:
+                return -EOPNOTSUPP;
+        }
+        if (r < 0)
+                return r;
+
+        return compression;
 }
 
 int decompress_blob_xz(const void *src, uint64_t src_size,
                        void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max);
 int decompress_blob_lz4(const void *src, uint64_t src_size,
                         void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max);
+int decompress_blob_zstd(const void *src, uint64_t src_size,
+                         void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max);
+int decompress_blob_zstd_with_dictionary(const CompressDictionary *dict,
+                                         const void *src, uint64_t src_size,
+                                         void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max);
 int decompress_blob(int compression,
                     const void *src, uint64_t src_size,
-                    void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max);
+                    void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max,
+                    const CompressDictionary *dict);
 
 int decompress_startswith_xz(const void *src, uint64_t src_size,
                              void **buffer, size_t *buffer_size,
@@ -44,24 +100,59 @@ int decompress_startswith_lz4(const void *src, uint64_t src_size,
                               void **buffer, size_t *buffer_size,
                               const void *prefix, size_t prefix_len,
                               uint8_t extra);
+int decompress_startswith_zstd(const void *src, uint64_t src_size,
+                               void **buffer, size_t *buffer_size,
+                               const void *prefix, size_t prefix_len,
+                               uint8_t extra);
+int decompress_startswith_zstd_with_dictionary(const CompressDictionary *dict,
+                                               const void *src, uint64_t src_size,
+                                               void **buffer, size_t *buffer_size,
+                                               const void *prefix, size_t prefix_len,
+                                               uint8_t extra);
 int decompress_startswith(int compression,
                           const void *src, uint64_t src_size,
                           void **buffer, size_t *buffer_size,
                           const void *prefix, size_t prefix_len,
-                          uint8_t extra);
+                          uint8_t extra,
+                          const CompressDictionary *dict);
 
 int compress_stream_xz(int fdf, int fdt, uint64_t max_bytes);
 int compress_stream_lz4(int fdf, int fdt, uint64_t max_bytes);
+int compress_stream_zstd(int fdf, int fdt, uint64_t max_bytes);
 
 int decompress_stream_xz(int fdf, int fdt, uint64_t max_size);
 int decompress_stream_lz4(int fdf, int fdt, uint64_t max_size);
+int decompress_stream_zstd(int fdf, int fdt, uint64_t max_size);
 
 #if HAVE_LZ4
 #  define compress_stream compress_stream_lz4
 #  define COMPRESSED_EXT ".lz4"
+#elif HAVE_ZSTD
+#  define compress_stream compress_stream_zstd
+#  define COMPRESSED_EXT ".zst"
 #else
 #  define compress_stream compress_stream_xz
 #  define COMPRESSED_EXT ".xz"
 #endif
 
 int decompress_stream(const char *filename, int fdf, int fdt, uint64_t max_bytes);
+
+/* Self-contained frames in the standard LZ4 and zstd frame formats, for data leaving the journal, e.g. over the
+ * network. A sequence of frames decodes to the concatenation of their contents. */
+int compress_frame_lz4(const void *src, size_t src_size,
+                       void **dst, size_t *dst_alloc_size, size_t *dst_size);
+int compress_frame_zstd(const void *src, size_t src_size,
+                        void **dst, size_t *dst_alloc_size, size_t *dst_size);
+int compress_frame(int compression,
+                   const void *src, size_t src_size,
+                   void **dst, size_t *dst_alloc_size, size_t *dst_size);
+
+/* Incrementally decodes a sequence of such frames, as it arrives in arbitrary pieces */
+typedef struct Decompressor Decompressor;
+
+int decompressor_new(int compression, Decompressor **ret);
+Decompressor* decompressor_free(Decompressor *d);
+DEFINE_TRIVIAL_CLEANUP_FUNC(Decompressor*, decompressor_free);
+
+int decompressor_run(Decompressor *d, const void **src, size_t *src_size, const void **ret, size_t *ret_size);
+bool decompressor_in_frame(Decompressor *d);
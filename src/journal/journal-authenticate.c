@@ -266,6 +266,21 @@ int journal_file_hmac_put_object(JournalFile *f, ObjectType type, Object *o, uin
                 gcry_md_write(f->hmac, &o->tag.seqnum, sizeof(o->tag.seqnum));
                 gcry_md_write(f->hmac, &o->tag.epoch, sizeof(o->tag.epoch));
                 break;
+
+        case OBJECT_DICTIONARY:
+                /* All */
+                gcry_md_write(f->hmac, o->dictionary.payload, le64toh(o->object.size) - offsetof(DictionaryObject, payload));
+                break;
+
+        case OBJECT_FIELD_INDEX:
+                /* All */
+                gcry_md_write(f->hmac, &o->field_index.hash, le64toh(o->object.size) - offsetof(FieldIndexObject, hash));
+                break;
+
+        case OBJECT_BLOOM_FILTER:
+                /* All */
+                gcry_md_write(f->hmac, &o->bloom_filter.n_hashes, le64toh(o->object.size) - offsetof(BloomFilterObject, n_hashes));
+                break;
         default:
                 return -EINVAL;
         }
@@ -454,6 +469,14 @@ int journal_file_append_first_tag(JournalFile *f) {
         if (r < 0)
                 return r;
 
+        /* A dictionary is appended right after the hash tables, before the first tag */
+        if (JOURNAL_HEADER_CONTAINS(f->header, dictionary_offset) &&
+            f->header->dictionary_offset != 0) {
+                r = journal_file_hmac_put_object(f, OBJECT_DICTIONARY, NULL, le64toh(f->header->dictionary_offset));
+                if (r < 0)
+                        return r;
+        }
+
         r = journal_file_append_tag(f);
         if (r < 0)
                 return r;
@@ -24,9 +24,13 @@ typedef struct EntryObject EntryObject;
 typedef struct HashTableObject HashTableObject;
 typedef struct EntryArrayObject EntryArrayObject;
 typedef struct TagObject TagObject;
+typedef struct DictionaryObject DictionaryObject;
+typedef struct FieldIndexObject FieldIndexObject;
+typedef struct BloomFilterObject BloomFilterObject;
 
 typedef struct EntryItem EntryItem;
 typedef struct HashItem HashItem;
+typedef struct FieldIndexItem FieldIndexItem;
 
 typedef struct FSSHeader FSSHeader;
 
@@ -40,6 +44,9 @@ typedef enum ObjectType {
         OBJECT_FIELD_HASH_TABLE,
         OBJECT_ENTRY_ARRAY,
         OBJECT_TAG,
+        OBJECT_DICTIONARY,
+        OBJECT_FIELD_INDEX,
+        OBJECT_BLOOM_FILTER,
         _OBJECT_TYPE_MAX
 } ObjectType;
 
@@ -47,10 +54,11 @@ typedef enum ObjectType {
 enum {
         OBJECT_COMPRESSED_XZ = 1 << 0,
         OBJECT_COMPRESSED_LZ4 = 1 << 1,
+        OBJECT_COMPRESSED_ZSTD = 1 << 2,
         _OBJECT_COMPRESSED_MAX
 };
 
-#define OBJECT_COMPRESSION_MASK (OBJECT_COMPRESSED_XZ | OBJECT_COMPRESSED_LZ4)
+#define OBJECT_COMPRESSION_MASK (OBJECT_COMPRESSED_XZ | OBJECT_COMPRESSED_LZ4 | OBJECT_COMPRESSED_ZSTD)
 
 struct ObjectHeader {
         uint8_t type;
@@ -119,6 +127,42 @@ struct TagObject {
         uint8_t tag[TAG_LENGTH]; /* SHA-256 HMAC */
 } _packed_;
 
+/* A zstd dictionary, trained on the data of the previous journal file, with which data objects of the
+ * file are compressed. Only used in files with HEADER_INCOMPATIBLE_COMPRESSED_ZSTD set. */
+struct DictionaryObject {
+        ObjectHeader object;
+        uint8_t payload[];
+} _packed_;
+
+/* One distinct value of a field, as stored in the data object, but always uncompressed. Items are
+ * aligned to 8 bytes. */
+struct FieldIndexItem {
+        le64_t hash;
+        le64_t n_entries;
+        le64_t size;
+        uint8_t payload[];
+} _packed_;
+
+/* Lists all distinct values of one field of an archived journal file, together with the number of
+ * entries referencing each. Appended when the file is rotated, and chained from the header. */
+struct FieldIndexObject {
+        ObjectHeader object;
+        le64_t hash; /* of the field name */
+        le64_t next_field_index_offset;
+        le64_t n_items;
+        uint8_t items[];
+} _packed_;
+
+/* A bloom filter of the hashes of all data objects of an archived journal file, so that readers may tell
+ * that a value is not in the file without looking at its data hash table. Appended when the file is
+ * rotated. The bits are a multiple of 64, and set at (low + i * high) mod n_bits for i < n_hashes, where
+ * low and high are the lower and upper 32 bits of the hash. */
+struct BloomFilterObject {
+        ObjectHeader object;
+        le64_t n_hashes;
+        uint8_t bits[];
+} _packed_;
+
 union Object {
         ObjectHeader object;
         DataObject data;
@@ -127,6 +171,9 @@ union Object {
         HashTableObject hash_table;
         EntryArrayObject entry_array;
         TagObject tag;
+        DictionaryObject dictionary;
+        FieldIndexObject field_index;
+        BloomFilterObject bloom_filter;
 };
 
 enum {
@@ -140,29 +187,38 @@ enum {
 enum {
         HEADER_INCOMPATIBLE_COMPRESSED_XZ = 1 << 0,
         HEADER_INCOMPATIBLE_COMPRESSED_LZ4 = 1 << 1,
+        HEADER_INCOMPATIBLE_COMPRESSED_ZSTD = 1 << 2,
+        HEADER_INCOMPATIBLE_COMPRESSED_ZSTD_DICTIONARY = 1 << 3,
 };
 
-#define HEADER_INCOMPATIBLE_ANY (HEADER_INCOMPATIBLE_COMPRESSED_XZ|HEADER_INCOMPATIBLE_COMPRESSED_LZ4)
+#define HEADER_INCOMPATIBLE_ANY                         \
+        (HEADER_INCOMPATIBLE_COMPRESSED_XZ|             \
+         HEADER_INCOMPATIBLE_COMPRESSED_LZ4|            \
+         HEADER_INCOMPATIBLE_COMPRESSED_ZSTD|           \
+         HEADER_INCOMPATIBLE_COMPRESSED_ZSTD_DICTIONARY)
 
-#if HAVE_XZ && HAVE_LZ4
-#  define HEADER_INCOMPATIBLE_SUPPORTED HEADER_INCOMPATIBLE_ANY
-#elif HAVE_XZ
-#  define HEADER_INCOMPATIBLE_SUPPORTED HEADER_INCOMPATIBLE_COMPRESSED_XZ
-#elif HAVE_LZ4
-#  define HEADER_INCOMPATIBLE_SUPPORTED HEADER_INCOMPATIBLE_COMPRESSED_LZ4
-#else
-#  define HEADER_INCOMPATIBLE_SUPPORTED 0
-#endif
+#define HEADER_INCOMPATIBLE_SUPPORTED                           \
+        ((HAVE_XZ ? HEADER_INCOMPATIBLE_COMPRESSED_XZ : 0) |    \
+         (HAVE_LZ4 ? HEADER_INCOMPATIBLE_COMPRESSED_LZ4 : 0) |  \
+         (HAVE_ZSTD ? HEADER_INCOMPATIBLE_COMPRESSED_ZSTD|HEADER_INCOMPATIBLE_COMPRESSED_ZSTD_DICTIONARY : 0))
 
+/* The field index and bloom filter objects are appended only when a file is archived, but since the flags are
+ * covered by the seal of the file, the flags are set when the file is created. */
 enum {
-        HEADER_COMPATIBLE_SEALED = 1
+        HEADER_COMPATIBLE_SEALED = 1 << 0,
+        HEADER_COMPATIBLE_FIELD_INDEX = 1 << 1,
+        HEADER_COMPATIBLE_BLOOM_FILTER = 1 << 2,
 };
 
-#define HEADER_COMPATIBLE_ANY HEADER_COMPATIBLE_SEALED
+#define HEADER_COMPATIBLE_ANY                   \
+        (HEADER_COMPATIBLE_SEALED|              \
+         HEADER_COMPATIBLE_FIELD_INDEX|         \
+         HEADER_COMPATIBLE_BLOOM_FILTER)
+
 #if HAVE_GCRYPT
-#  define HEADER_COMPATIBLE_SUPPORTED HEADER_COMPATIBLE_SEALED
+#  define HEADER_COMPATIBLE_SUPPORTED HEADER_COMPATIBLE_ANY
 #else
-#  define HEADER_COMPATIBLE_SUPPORTED 0
+#  define HEADER_COMPATIBLE_SUPPORTED (HEADER_COMPATIBLE_FIELD_INDEX|HEADER_COMPATIBLE_BLOOM_FILTER)
 #endif
 
 #define HEADER_SIGNATURE ((char[]) { 'L', 'P', 'K', 'S', 'H', 'H', 'R', 'H' })
@@ -198,8 +254,12 @@ struct Header {
         /* Added in 189 */
         le64_t n_tags;
         le64_t n_entry_arrays;
+        /* Added in 240 */
+        le64_t dictionary_offset;
+        le64_t field_index_offset;
+        le64_t bloom_filter_offset;
 
-        /* Size: 240 */
+        /* Size: 264 */
 } _packed_;
 
 #define FSS_HEADER_SIGNATURE ((char[]) { 'K', 'S', 'H', 'H', 'R', 'H', 'L', 'P' })
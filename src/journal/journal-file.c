@@ -19,6 +19,7 @@
 #include "journal-authenticate.h"
 #include "journal-def.h"
 #include "journal-file.h"
+#include "journal-time-index.h"
 #include "lookup3.h"
 #include "parse-util.h"
 #include "path-util.h"
@@ -36,6 +37,62 @@
 #define DEFAULT_COMPRESS_THRESHOLD (512ULL)
 #define MIN_COMPRESS_THRESHOLD (8ULL)
 
+/* With a trained dictionary even short field values compress well, hence we lower the default threshold
+ * for files that have one */
+#define DICTIONARY_COMPRESS_THRESHOLD (64ULL)
+
+/* Limits for training a dictionary at rotation time: at most this much data of the previous file is fed
+ * into the trainer, in samples no larger than the sample limit, to produce a dictionary of at most the
+ * dictionary size */
+#define DICTIONARY_SIZE_MAX (32U*1024U)                         /* 32 KiB */
+#define DICTIONARY_SAMPLES_MAX (1024U*1024U)                    /* 1 MiB */
+#define DICTIONARY_SAMPLE_SIZE_MAX (4U*1024U)                   /* 4 KiB */
+
+struct DictionaryTraining {
+        pthread_t thread;
+        JournalFile *file; /* private, read-only instance of the file to train on */
+
+        int result;
+        void *dictionary;
+        size_t size;
+};
+
+/* Limits for the field indexes written at rotation time: fields with more distinct values, or with longer
+ * values, are not indexed, and neither is anything beyond the total size limit. */
+#define FIELD_INDEX_VALUES_MAX 1024U
+#define FIELD_INDEX_VALUE_SIZE_MAX 256U
+#define FIELD_INDEX_SIZE_MAX (4U*1024U*1024U)                   /* 4 MiB */
+
+typedef struct FieldIndex {
+        uint64_t hash;
+        uint64_t n_items;
+        uint8_t *items;
+        size_t size;
+} FieldIndex;
+
+struct ArchiveIndexing {
+        pthread_t thread;
+        JournalFile *file; /* private, read-only instance of the file to index */
+
+        int field_index_result;
+        FieldIndex *field_indexes;
+        size_t n_field_indexes;
+        uint64_t field_indexes_size;
+
+        int bloom_filter_result;
+        uint8_t *bloom_filter;
+        uint64_t bloom_filter_size;
+        uint64_t bloom_filter_n_data;
+};
+
+/* Bloom filters written at rotation time use this many bits per data object, and the number of hash functions
+ * that gives the fewest false positives for it, about 1%. Files with more data objects than fit into the size
+ * limit get more false positives. */
+#define BLOOM_FILTER_BITS_PER_ITEM 10U
+#define BLOOM_FILTER_HASHES 7U
+#define BLOOM_FILTER_HASHES_MAX 32U
+#define BLOOM_FILTER_SIZE_MAX (8U*1024U*1024U)                  /* 8 MiB */
+
 /* This is the minimum journal file size */
 #define JOURNAL_FILE_SIZE_MIN (512ULL*1024ULL)                 /* 512 KiB */
 
@@ -334,9 +391,43 @@ bool journal_file_is_offlining(JournalFile *f) {
         return true;
 }
 
+static DictionaryTraining* dictionary_training_free(DictionaryTraining *t) {
+        if (!t)
+                return NULL;
+
+        /* Waits for the training thread, if it is still running */
+        (void) pthread_join(t->thread, NULL);
+
+        if (t->file)
+                (void) journal_file_close(t->file);
+        free(t->dictionary);
+
+        return mfree(t);
+}
+
+static void field_index_free_many(FieldIndex *indexes, size_t n);
+
+static ArchiveIndexing* archive_indexing_free(ArchiveIndexing *t) {
+        if (!t)
+                return NULL;
+
+        /* Waits for the indexing thread, if it is still running */
+        (void) pthread_join(t->thread, NULL);
+
+        if (t->file)
+                (void) journal_file_close(t->file);
+        field_index_free_many(t->field_indexes, t->n_field_indexes);
+        free(t->bloom_filter);
+
+        return mfree(t);
+}
+
 JournalFile* journal_file_close(JournalFile *f) {
         assert(f);
 
+        /* Append the index of the file, if it was rotated, before the final tag covers it */
+        (void) journal_file_finish_indexing(f, true);
+
 #if HAVE_GCRYPT
         /* Write the final tag */
         if (f->seal && f->writable) {
@@ -361,6 +452,9 @@ JournalFile* journal_file_close(JournalFile *f) {
 
         journal_file_set_offline(f, true);
 
+        dictionary_training_free(f->dictionary_training);
+        archive_indexing_free(f->indexing);
+
         if (f->mmap && f->cache_fd)
                 mmap_cache_free_fd(f->mmap, f->cache_fd);
 
@@ -384,9 +478,10 @@ JournalFile* journal_file_close(JournalFile *f) {
 
         ordered_hashmap_free_free(f->chain_cache);
 
-#if HAVE_XZ || HAVE_LZ4
+#if HAVE_XZ || HAVE_LZ4 || HAVE_ZSTD
         free(f->compress_buffer);
 #endif
+        compress_dictionary_free(f->compress_dictionary);
 
 #if HAVE_GCRYPT
         if (f->fss_file)
@@ -403,7 +498,7 @@ JournalFile* journal_file_close(JournalFile *f) {
         return mfree(f);
 }
 
-static int journal_file_init_header(JournalFile *f, JournalFile *template) {
+static int journal_file_init_header(JournalFile *f, JournalFile *template, bool dictionary) {
         Header h = {};
         ssize_t k;
         int r;
@@ -415,10 +510,14 @@ static int journal_file_init_header(JournalFile *f, JournalFile *template) {
 
         h.incompatible_flags |= htole32(
                 f->compress_xz * HEADER_INCOMPATIBLE_COMPRESSED_XZ |
-                f->compress_lz4 * HEADER_INCOMPATIBLE_COMPRESSED_LZ4);
+                f->compress_lz4 * HEADER_INCOMPATIBLE_COMPRESSED_LZ4 |
+                f->compress_zstd * HEADER_INCOMPATIBLE_COMPRESSED_ZSTD |
+                (f->compress_zstd && dictionary) * HEADER_INCOMPATIBLE_COMPRESSED_ZSTD_DICTIONARY);
 
         h.compatible_flags = htole32(
-                f->seal * HEADER_COMPATIBLE_SEALED);
+                f->seal * HEADER_COMPATIBLE_SEALED |
+                HEADER_COMPATIBLE_FIELD_INDEX |
+                HEADER_COMPATIBLE_BLOOM_FILTER);
 
         r = sd_id128_randomize(&h.file_id);
         if (r < 0)
@@ -485,7 +584,7 @@ static bool warn_wrong_flags(const JournalFile *f, bool compatible) {
                                   f->path, type, flags & ~any);
                 flags = (flags & any) & ~supported;
                 if (flags) {
-                        const char* strv[3];
+                        const char* strv[5];
                         unsigned n = 0;
                         _cleanup_free_ char *t = NULL;
 
@@ -495,6 +594,10 @@ static bool warn_wrong_flags(const JournalFile *f, bool compatible) {
                                 strv[n++] = "xz-compressed";
                         if (!compatible && (flags & HEADER_INCOMPATIBLE_COMPRESSED_LZ4))
                                 strv[n++] = "lz4-compressed";
+                        if (!compatible && (flags & HEADER_INCOMPATIBLE_COMPRESSED_ZSTD))
+                                strv[n++] = "zstd-compressed";
+                        if (!compatible && (flags & HEADER_INCOMPATIBLE_COMPRESSED_ZSTD_DICTIONARY))
+                                strv[n++] = "zstd-dictionary-compressed";
                         strv[n] = NULL;
                         assert(n < ELEMENTSOF(strv));
 
@@ -590,6 +693,7 @@ static int journal_file_verify_header(JournalFile *f) {
 
         f->compress_xz = JOURNAL_HEADER_COMPRESSED_XZ(f->header);
         f->compress_lz4 = JOURNAL_HEADER_COMPRESSED_LZ4(f->header);
+        f->compress_zstd = JOURNAL_HEADER_COMPRESSED_ZSTD(f->header);
 
         f->seal = JOURNAL_HEADER_SEALED(f->header);
 
@@ -732,6 +836,9 @@ static uint64_t minimum_header_size(Object *o) {
                 [OBJECT_FIELD_HASH_TABLE] = sizeof(HashTableObject),
                 [OBJECT_ENTRY_ARRAY] = sizeof(EntryArrayObject),
                 [OBJECT_TAG] = sizeof(TagObject),
+                [OBJECT_DICTIONARY] = sizeof(DictionaryObject),
+                [OBJECT_FIELD_INDEX] = sizeof(FieldIndexObject),
+                [OBJECT_BLOOM_FILTER] = sizeof(BloomFilterObject),
         };
 
         if (o->object.type >= ELEMENTSOF(table) || table[o->object.type] <= 0)
@@ -897,6 +1004,58 @@ static int journal_file_check_object(JournalFile *f, uint64_t offset, Object *o)
                         return -EBADMSG;
                 }
 
+                break;
+
+        case OBJECT_DICTIONARY:
+                if (le64toh(o->object.size) <= offsetof(DictionaryObject, payload)) {
+                        log_debug(
+                              "Invalid object dictionary size: %"PRIu64": %"PRIu64,
+                              le64toh(o->object.size),
+                              offset);
+                        return -EBADMSG;
+                }
+
+                break;
+
+        case OBJECT_FIELD_INDEX:
+                if (le64toh(o->field_index.n_items) <= 0 ||
+                    le64toh(o->field_index.n_items) > (le64toh(o->object.size) - offsetof(FieldIndexObject, items)) / sizeof(FieldIndexItem)) {
+                        log_debug(
+                              "Invalid object field index size: %"PRIu64": %"PRIu64,
+                              le64toh(o->object.size),
+                              offset);
+                        return -EBADMSG;
+                }
+
+                if (!VALID64(le64toh(o->field_index.next_field_index_offset))) {
+                        log_debug(
+                              "Invalid object field index next_field_index_offset: "OFSfmt": %"PRIu64,
+                              le64toh(o->field_index.next_field_index_offset),
+                              offset);
+                        return -EBADMSG;
+                }
+
+                break;
+
+        case OBJECT_BLOOM_FILTER:
+                if (le64toh(o->object.size) <= offsetof(BloomFilterObject, bits) ||
+                    (le64toh(o->object.size) - offsetof(BloomFilterObject, bits)) % sizeof(uint64_t) != 0) {
+                        log_debug(
+                              "Invalid object bloom filter size: %"PRIu64": %"PRIu64,
+                              le64toh(o->object.size),
+                              offset);
+                        return -EBADMSG;
+                }
+
+                if (le64toh(o->bloom_filter.n_hashes) <= 0 ||
+                    le64toh(o->bloom_filter.n_hashes) > BLOOM_FILTER_HASHES_MAX) {
+                        log_debug(
+                              "Invalid object bloom filter n_hashes: %"PRIu64": %"PRIu64,
+                              le64toh(o->bloom_filter.n_hashes),
+                              offset);
+                        return -EBADMSG;
+                }
+
                 break;
         }
 
@@ -1372,7 +1531,7 @@ int journal_file_find_data_object_with_hash(
                         goto next;
 
                 if (o->object.flags & OBJECT_COMPRESSION_MASK) {
-#if HAVE_XZ || HAVE_LZ4
+#if HAVE_XZ || HAVE_LZ4 || HAVE_ZSTD
                         uint64_t l;
                         size_t rsize = 0;
 
@@ -1382,8 +1541,11 @@ int journal_file_find_data_object_with_hash(
 
                         l -= offsetof(Object, data.payload);
 
+                        (void) journal_file_load_dictionary(f);
+
                         r = decompress_blob(o->object.flags & OBJECT_COMPRESSION_MASK,
-                                            o->data.payload, l, &f->compress_buffer, &f->compress_buffer_size, &rsize, 0);
+                                            o->data.payload, l, &f->compress_buffer, &f->compress_buffer_size, &rsize, 0,
+                                            f->compress_dictionary);
                         if (r < 0)
                                 return r;
 
@@ -1529,6 +1691,10 @@ static int journal_file_append_data(
                 return 0;
         }
 
+        /* A file we reopened might come with a dictionary from the rotation that created it */
+        if (f->compress_zstd)
+                (void) journal_file_load_dictionary(f);
+
         osize = offsetof(Object, data.payload) + size;
         r = journal_file_append_object(f, OBJECT_DATA, osize, &o, &p);
         if (r < 0)
@@ -1536,11 +1702,12 @@ static int journal_file_append_data(
 
         o->data.hash = htole64(hash);
 
-#if HAVE_XZ || HAVE_LZ4
+#if HAVE_XZ || HAVE_LZ4 || HAVE_ZSTD
         if (JOURNAL_FILE_COMPRESS(f) && size >= f->compress_threshold_bytes) {
                 size_t rsize = 0;
 
-                compression = compress_blob(data, size, o->data.payload, size - 1, &rsize);
+                compression = compress_blob(JOURNAL_FILE_COMPRESSION(f), data, size, o->data.payload, size - 1, &rsize,
+                                            f->compress_dictionary);
 
                 if (compression >= 0) {
                         o->object.size = htole64(offsetof(Object, data.payload) + rsize);
@@ -1627,12 +1794,21 @@ uint64_t journal_file_hash_table_n_items(Object *o) {
         return (le64toh(o->object.size) - offsetof(Object, hash_table.items)) / sizeof(HashItem);
 }
 
+/* Remembers the array at the end of an entry array chain, so that linking many entries into the same chain
+ * in a row doesn't require walking it from its head for each of them. Only valid as long as nobody else
+ * links entries into the chain. */
+typedef struct EntryArrayCursor {
+        uint64_t array; /* the last array we linked an entry into, or 0 if not known yet */
+        uint64_t begin; /* the index of the first item in that array */
+} EntryArrayCursor;
+
 static int link_entry_into_array(JournalFile *f,
                                  le64_t *first,
                                  le64_t *idx,
-                                 uint64_t p) {
+                                 uint64_t p,
+                                 EntryArrayCursor *cursor) {
         int r;
-        uint64_t n = 0, ap = 0, q, i, a, hidx;
+        uint64_t n = 0, ap = 0, q, i, a, hidx, begin;
         Object *o;
 
         assert(f);
@@ -1643,6 +1819,13 @@ static int link_entry_into_array(JournalFile *f,
 
         a = le64toh(*first);
         i = hidx = le64toh(*idx);
+
+        if (cursor && cursor->array != 0 && hidx >= cursor->begin) {
+                a = cursor->array;
+                i = hidx - cursor->begin;
+        }
+
+        begin = hidx - i;
         while (a > 0) {
 
                 r = journal_file_move_to_object(f, OBJECT_ENTRY_ARRAY, a, &o);
@@ -1653,10 +1836,15 @@ static int link_entry_into_array(JournalFile *f,
                 if (i < n) {
                         o->entry_array.items[i] = htole64(p);
                         *idx = htole64(hidx + 1);
+
+                        if (cursor)
+                                *cursor = (EntryArrayCursor) { .array = a, .begin = begin };
+
                         return 0;
                 }
 
                 i -= n;
+                begin += n;
                 ap = a;
                 a = le64toh(o->entry_array.next_entry_array_offset);
         }
@@ -1698,6 +1886,9 @@ static int link_entry_into_array(JournalFile *f,
 
         *idx = htole64(hidx + 1);
 
+        if (cursor)
+                *cursor = (EntryArrayCursor) { .array = q, .begin = begin };
+
         return 0;
 }
 
@@ -1721,7 +1912,7 @@ static int link_entry_into_array_plus_one(JournalFile *f,
                 le64_t i;
 
                 i = htole64(le64toh(*idx) - 1);
-                r = link_entry_into_array(f, first, &i, p);
+                r = link_entry_into_array(f, first, &i, p, NULL);
                 if (r < 0)
                         return r;
         }
@@ -1752,7 +1943,7 @@ static int journal_file_link_entry_item(JournalFile *f, Object *o, uint64_t offs
                                               offset);
 }
 
-static int journal_file_link_entry(JournalFile *f, Object *o, uint64_t offset) {
+static int journal_file_link_entry(JournalFile *f, Object *o, uint64_t offset, EntryArrayCursor *cursor) {
         uint64_t n, i;
         int r;
 
@@ -1770,7 +1961,8 @@ static int journal_file_link_entry(JournalFile *f, Object *o, uint64_t offset) {
         r = link_entry_into_array(f,
                                   &f->header->entry_array_offset,
                                   &f->header->n_entries,
-                                  offset);
+                                  offset,
+                                  cursor);
         if (r < 0)
                 return r;
 
@@ -1800,6 +1992,7 @@ static int journal_file_append_entry_internal(
                 uint64_t xor_hash,
                 const EntryItem items[], unsigned n_items,
                 uint64_t *seqnum,
+                EntryArrayCursor *cursor,
                 Object **ret, uint64_t *offset) {
         uint64_t np;
         uint64_t osize;
@@ -1830,7 +2023,7 @@ static int journal_file_append_entry_internal(
                 return r;
 #endif
 
-        r = journal_file_link_entry(f, o, np);
+        r = journal_file_link_entry(f, o, np, cursor);
         if (r < 0)
                 return r;
 
@@ -1943,18 +2136,78 @@ static int entry_item_cmp(const void *_a, const void *_b) {
         return 0;
 }
 
-int journal_file_append_entry(
+static int journal_file_check_timestamp(const dual_timestamp *ts) {
+        assert(ts);
+
+        if (!VALID_REALTIME(ts->realtime)) {
+                log_debug("Invalid realtime timestamp %"PRIu64", refusing entry.", ts->realtime);
+                return -EBADMSG;
+        }
+        if (!VALID_MONOTONIC(ts->monotonic)) {
+                log_debug("Invalid monotomic timestamp %"PRIu64", refusing entry.", ts->monotonic);
+                return -EBADMSG;
+        }
+
+        return 0;
+}
+
+static int journal_file_append_entry_iovec(
                 JournalFile *f,
                 const dual_timestamp *ts,
                 const sd_id128_t *boot_id,
                 const struct iovec iovec[], unsigned n_iovec,
+                EntryItem *items,
                 uint64_t *seqnum,
+                EntryArrayCursor *cursor,
                 Object **ret, uint64_t *offset) {
 
         unsigned i;
+        uint64_t xor_hash = 0;
+        int r;
+
+        assert(f);
+        assert(iovec || n_iovec == 0);
+        assert(items);
+
+        for (i = 0; i < n_iovec; i++) {
+                uint64_t p;
+                Object *o;
+
+                r = journal_file_append_data(f, iovec[i].iov_base, iovec[i].iov_len, &o, &p);
+                if (r < 0)
+                        return r;
+
+                xor_hash ^= le64toh(o->data.hash);
+                items[i].object_offset = htole64(p);
+                items[i].hash = o->data.hash;
+        }
+
+        /* Order by the position on disk, in order to improve seek
+         * times for rotating media. */
+        qsort_safe(items, n_iovec, sizeof(EntryItem), entry_item_cmp);
+
+        return journal_file_append_entry_internal(f, ts, boot_id, xor_hash, items, n_iovec, seqnum, cursor, ret, offset);
+}
+
+static void journal_file_append_done(JournalFile *f) {
+        assert(f);
+
+        if (f->post_change_timer)
+                schedule_post_change(f);
+        else
+                journal_file_post_change(f);
+}
+
+int journal_file_append_entry(
+                JournalFile *f,
+                const dual_timestamp *ts,
+                const sd_id128_t *boot_id,
+                const struct iovec iovec[], unsigned n_iovec,
+                uint64_t *seqnum,
+                Object **ret, uint64_t *offset) {
+
         EntryItem *items;
         int r;
-        uint64_t xor_hash = 0;
         struct dual_timestamp _ts;
 
         assert(f);
@@ -1962,14 +2215,9 @@ int journal_file_append_entry(
         assert(iovec || n_iovec == 0);
 
         if (ts) {
-                if (!VALID_REALTIME(ts->realtime)) {
-                        log_debug("Invalid realtime timestamp %"PRIu64", refusing entry.", ts->realtime);
-                        return -EBADMSG;
-                }
-                if (!VALID_MONOTONIC(ts->monotonic)) {
-                        log_debug("Invalid monotomic timestamp %"PRIu64", refusing entry.", ts->monotonic);
-                        return -EBADMSG;
-                }
+                r = journal_file_check_timestamp(ts);
+                if (r < 0)
+                        return r;
         } else {
                 dual_timestamp_get(&_ts);
                 ts = &_ts;
@@ -1984,37 +2232,86 @@ int journal_file_append_entry(
         /* alloca() can't take 0, hence let's allocate at least one */
         items = newa(EntryItem, MAX(1u, n_iovec));
 
-        for (i = 0; i < n_iovec; i++) {
-                uint64_t p;
-                Object *o;
+        r = journal_file_append_entry_iovec(f, ts, boot_id, iovec, n_iovec, items, seqnum, NULL, ret, offset);
 
-                r = journal_file_append_data(f, iovec[i].iov_base, iovec[i].iov_len, &o, &p);
+        /* If the memory mapping triggered a SIGBUS then we return an
+         * IO error and ignore the error code passed down to us, since
+         * it is very likely just an effect of a nullified replacement
+         * mapping page */
+
+        if (mmap_cache_got_sigbus(f->mmap, f->cache_fd))
+                r = -EIO;
+
+        journal_file_append_done(f);
+
+        return r;
+}
+
+int journal_file_append_entries(
+                JournalFile *f,
+                const dual_timestamp *ts,
+                const sd_id128_t *boot_id,
+                const JournalEntry entries[], size_t n_entries,
+                uint64_t *seqnum,
+                size_t *ret_n_appended) {
+
+        _cleanup_free_ EntryItem *items = NULL;
+        EntryArrayCursor cursor = {};
+        struct dual_timestamp _ts;
+        unsigned max_iovec = 1;
+        size_t i, n = 0;
+        int r = 0;
+
+        assert(f);
+        assert(f->header);
+        assert(entries || n_entries == 0);
+
+        /* Appends a number of entries that share the same timestamp, as is the case for everything
+         * journald processes in one event loop iteration. Compared to calling journal_file_append_entry()
+         * for each of them, this does the per-call work (timestamp validation, sealing, SIGBUS checking,
+         * change notification) only once, and avoids walking the main entry array chain from its head
+         * for each entry. On failure, ret_n_appended tells how many entries were written, so that the
+         * caller may retry the rest, e.g. after rotating. */
+
+        if (ret_n_appended)
+                *ret_n_appended = 0;
+
+        if (ts) {
+                r = journal_file_check_timestamp(ts);
                 if (r < 0)
                         return r;
-
-                xor_hash ^= le64toh(o->data.hash);
-                items[i].object_offset = htole64(p);
-                items[i].hash = o->data.hash;
+        } else {
+                dual_timestamp_get(&_ts);
+                ts = &_ts;
         }
 
-        /* Order by the position on disk, in order to improve seek
-         * times for rotating media. */
-        qsort_safe(items, n_iovec, sizeof(EntryItem), entry_item_cmp);
+#if HAVE_GCRYPT
+        r = journal_file_maybe_append_tag(f, ts->realtime);
+        if (r < 0)
+                return r;
+#endif
 
-        r = journal_file_append_entry_internal(f, ts, boot_id, xor_hash, items, n_iovec, seqnum, ret, offset);
+        for (i = 0; i < n_entries; i++)
+                max_iovec = MAX(max_iovec, entries[i].n_iovec);
 
-        /* If the memory mapping triggered a SIGBUS then we return an
-         * IO error and ignore the error code passed down to us, since
-         * it is very likely just an effect of a nullified replacement
-         * mapping page */
+        items = new(EntryItem, max_iovec);
+        if (!items)
+                return -ENOMEM;
+
+        for (; n < n_entries; n++) {
+                r = journal_file_append_entry_iovec(f, ts, boot_id, entries[n].iovec, entries[n].n_iovec,
+                                                    items, seqnum, &cursor, NULL, NULL);
+                if (r < 0)
+                        break;
+        }
 
         if (mmap_cache_got_sigbus(f->mmap, f->cache_fd))
                 r = -EIO;
 
-        if (f->post_change_timer)
-                schedule_post_change(f);
-        else
-                journal_file_post_change(f);
+        journal_file_append_done(f);
+
+        if (ret_n_appended)
+                *ret_n_appended = n;
 
         return r;
 }
@@ -3007,78 +3304,1022 @@ int journal_file_move_to_entry_by_realtime_for_data(
                                              ret, offset, NULL);
 }
 
-void journal_file_dump(JournalFile *f) {
+int journal_file_load_dictionary(JournalFile *f) {
+#if HAVE_ZSTD
+        uint64_t p;
         Object *o;
         int r;
-        uint64_t p;
 
         assert(f);
         assert(f->header);
 
-        journal_file_print_header(f);
+        if (f->compress_dictionary)
+                return 1;
 
-        p = le64toh(f->header->header_size);
-        while (p != 0) {
-                r = journal_file_move_to_object(f, OBJECT_UNUSED, p, &o);
-                if (r < 0)
-                        goto fail;
+        /* The dictionary is appended by the writer only after creating the file, hence readers might see
+         * it show up late. This is why we load it lazily, whenever we need it. */
+        if (!JOURNAL_HEADER_COMPRESSED_ZSTD_DICTIONARY(f->header) ||
+            !JOURNAL_HEADER_CONTAINS(f->header, dictionary_offset))
+                return 0;
 
-                switch (o->object.type) {
+        p = le64toh(f->header->dictionary_offset);
+        if (p == 0)
+                return 0;
 
-                case OBJECT_UNUSED:
-                        printf("Type: OBJECT_UNUSED\n");
-                        break;
+        r = journal_file_move_to_object(f, OBJECT_DICTIONARY, p, &o);
+        if (r < 0)
+                return log_debug_errno(r, "Failed to read compression dictionary of %s: %m", f->path);
 
-                case OBJECT_DATA:
-                        printf("Type: OBJECT_DATA\n");
-                        break;
+        r = compress_dictionary_new(o->dictionary.payload,
+                                    le64toh(o->object.size) - offsetof(Object, dictionary.payload),
+                                    f->writable && f->compress_zstd,
+                                    &f->compress_dictionary);
+        if (r < 0)
+                return log_debug_errno(r, "Failed to load compression dictionary of %s: %m", f->path);
 
-                case OBJECT_FIELD:
-                        printf("Type: OBJECT_FIELD\n");
-                        break;
+        /* Unless configured otherwise, compress shorter objects too, now that it pays off */
+        if (f->writable && f->compress_zstd && f->compress_threshold_unset)
+                f->compress_threshold_bytes = DICTIONARY_COMPRESS_THRESHOLD;
 
-                case OBJECT_ENTRY:
-                        printf("Type: OBJECT_ENTRY seqnum=%"PRIu64" monotonic=%"PRIu64" realtime=%"PRIu64"\n",
-                               le64toh(o->entry.seqnum),
-                               le64toh(o->entry.monotonic),
-                               le64toh(o->entry.realtime));
-                        break;
+        return 1;
+#else
+        return 0;
+#endif
+}
 
-                case OBJECT_FIELD_HASH_TABLE:
-                        printf("Type: OBJECT_FIELD_HASH_TABLE\n");
-                        break;
+#if HAVE_ZSTD
+static int journal_file_train_dictionary(JournalFile *from, void **ret, size_t *ret_size) {
+        _cleanup_free_ uint8_t *samples = NULL;
+        _cleanup_free_ size_t *sizes = NULL;
+        size_t samples_allocated = 0, sizes_allocated = 0, n_samples = 0, total = 0;
+        uint64_t p;
+        Object *o;
+        int r;
 
-                case OBJECT_DATA_HASH_TABLE:
-                        printf("Type: OBJECT_DATA_HASH_TABLE\n");
-                        break;
+        assert(from);
+        assert(from->header);
+        assert(ret);
+        assert(ret_size);
 
-                case OBJECT_ENTRY_ARRAY:
-                        printf("Type: OBJECT_ENTRY_ARRAY\n");
-                        break;
+        /* Trains a dictionary on the data objects of a file, so that the many short field values which
+         * typically repeat from file to file compress well, even though each is compressed on its own.
+         * Returns 0 if the file has nothing to train on. */
 
-                case OBJECT_TAG:
-                        printf("Type: OBJECT_TAG seqnum=%"PRIu64" epoch=%"PRIu64"\n",
-                               le64toh(o->tag.seqnum),
-                               le64toh(o->tag.epoch));
-                        break;
+        if (le64toh(from->header->n_objects) <= 0)
+                return 0;
 
-                default:
-                        printf("Type: unknown (%i)\n", o->object.type);
-                        break;
-                }
+        (void) journal_file_load_dictionary(from);
 
-                if (o->object.flags & OBJECT_COMPRESSION_MASK)
-                        printf("Flags: %s\n",
-                               object_compressed_to_string(o->object.flags & OBJECT_COMPRESSION_MASK));
+        p = le64toh(from->header->header_size);
+        while (p != 0 && total < DICTIONARY_SAMPLES_MAX) {
+                r = journal_file_move_to_object(from, OBJECT_UNUSED, p, &o);
+                if (r < 0)
+                        return r;
 
-                if (p == le64toh(f->header->tail_object_offset))
-                        p = 0;
-                else
-                        p = p + ALIGN64(le64toh(o->object.size));
-        }
+                if (o->object.type == OBJECT_DATA) {
+                        const void *data;
+                        uint64_t l;
+                        size_t n;
+                        int compression;
 
-        return;
-fail:
+                        l = le64toh(o->object.size) - offsetof(Object, data.payload);
+                        compression = o->object.flags & OBJECT_COMPRESSION_MASK;
+
+                        if (compression != 0 && l > 0) {
+                                size_t rsize = 0;
+
+                                r = decompress_blob(compression,
+                                                    o->data.payload, l, &from->compress_buffer, &from->compress_buffer_size, &rsize, 0,
+                                                    from->compress_dictionary);
+                                if (r < 0)
+                                        return r;
+
+                                data = from->compress_buffer;
+                                n = rsize;
+                        } else {
+                                data = o->data.payload;
+                                n = l;
+                        }
+
+                        if (n > 0 && n <= DICTIONARY_SAMPLE_SIZE_MAX) {
+                                if (!GREEDY_REALLOC(samples, samples_allocated, total + n) ||
+                                    !GREEDY_REALLOC(sizes, sizes_allocated, n_samples + 1))
+                                        return -ENOMEM;
+
+                                memcpy(samples + total, data, n);
+                                sizes[n_samples++] = n;
+                                total += n;
+                        }
+                }
+
+                if (p == le64toh(from->header->tail_object_offset))
+                        p = 0;
+                else
+                        p = p + ALIGN64(le64toh(o->object.size));
+        }
+
+        if (n_samples <= 0)
+                return 0;
+
+        r = compress_dictionary_train(samples, sizes, n_samples, DICTIONARY_SIZE_MAX, ret, ret_size);
+        if (r < 0)
+                return r;
+
+        log_debug("Trained %zu byte compression dictionary on %zu data objects (%zu bytes) of %s.",
+                  *ret_size, n_samples, total, from->path);
+
+        return 1;
+}
+
+static void* journal_file_dictionary_training_thread(void *arg) {
+        DictionaryTraining *t = arg;
+
+        (void) pthread_setname_np(pthread_self(), "journal-dict");
+
+        t->result = journal_file_train_dictionary(t->file, &t->dictionary, &t->size);
+
+        return NULL;
+}
+#endif
+
+static int journal_file_start_dictionary_training(JournalFile *f, JournalFile *from) {
+#if HAVE_ZSTD
+        _cleanup_free_ DictionaryTraining *t = NULL;
+        sigset_t ss, saved_ss;
+        int fd, r, k;
+
+        assert(f);
+        assert(from);
+        assert(!f->dictionary_training);
+
+        /* Trains a dictionary on the file we are rotating away from, for the file that replaces f once f is
+         * rotated. Training takes a while, hence it is done in a thread of its own, which reads a private,
+         * read-only instance of the file, with its own mmap cache. */
+
+        if (!f->writable || !f->compress_zstd)
+                return 0;
+
+        t = new0(DictionaryTraining, 1);
+        if (!t)
+                return -ENOMEM;
+
+        fd = fcntl(from->fd, F_DUPFD_CLOEXEC, 3);
+        if (fd < 0)
+                return -errno;
+
+        r = journal_file_open(fd, from->path, O_RDONLY, 0, 0, 0, false, NULL, NULL, NULL, NULL, &t->file);
+        if (r < 0) {
+                safe_close(fd);
+                return r;
+        }
+
+        if (sigfillset(&ss) < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        r = pthread_sigmask(SIG_BLOCK, &ss, &saved_ss);
+        if (r > 0) {
+                r = -r;
+                goto fail;
+        }
+
+        r = pthread_create(&t->thread, NULL, journal_file_dictionary_training_thread, t);
+
+        k = pthread_sigmask(SIG_SETMASK, &saved_ss, NULL);
+        if (r > 0) {
+                r = -r;
+                goto fail;
+        }
+
+        f->dictionary_training = TAKE_PTR(t);
+
+        if (k > 0)
+                return -k;
+
+        return 1;
+
+fail:
+        (void) journal_file_close(t->file);
+        return r;
+#else
+        return 0;
+#endif
+}
+
+static int journal_file_finish_dictionary_training(JournalFile *f, void **ret, size_t *ret_size) {
+        DictionaryTraining *t;
+        int r;
+
+        assert(f);
+        assert(ret);
+        assert(ret_size);
+
+        /* Picks up the dictionary that was trained for the file replacing f. Waits for the training to
+         * finish, which normally happened long before, since files are rotated rarely. */
+
+        t = TAKE_PTR(f->dictionary_training);
+        if (!t)
+                return 0;
+
+        r = pthread_join(t->thread, NULL);
+        if (r > 0) {
+                f->dictionary_training = t;
+                return -r;
+        }
+
+        r = t->result;
+        if (r > 0) {
+                *ret = TAKE_PTR(t->dictionary);
+                *ret_size = t->size;
+        }
+
+        (void) journal_file_close(t->file);
+        free(t->dictionary);
+        free(t);
+
+        return r;
+}
+
+static int journal_file_append_dictionary(JournalFile *f, const void *dictionary, size_t size) {
+        uint64_t q;
+        Object *o;
+        int r;
+
+        assert(f);
+        assert(f->header);
+        assert(dictionary);
+
+        /* Only files that have no data yet and were created for it carry a dictionary, so that all their
+         * objects are compressed the same way. The dictionary is covered by the first tag of sealed files,
+         * see journal_file_append_first_tag(). */
+
+        if (!f->writable ||
+            !JOURNAL_HEADER_COMPRESSED_ZSTD_DICTIONARY(f->header) ||
+            !JOURNAL_HEADER_CONTAINS(f->header, dictionary_offset) ||
+            f->header->dictionary_offset != 0 ||
+            le64toh(f->header->n_data) > 0)
+                return -EINVAL;
+
+        r = journal_file_append_object(f, OBJECT_DICTIONARY, offsetof(Object, dictionary.payload) + size, &o, &q);
+        if (r < 0)
+                return r;
+
+        memcpy(o->dictionary.payload, dictionary, size);
+
+        f->header->dictionary_offset = htole64(q);
+
+        r = journal_file_load_dictionary(f);
+        if (r < 0)
+                return r;
+
+        log_debug("Added %zu byte compression dictionary to %s.", size, f->path);
+
+        return 1;
+}
+
+static int journal_file_end_offset(JournalFile *f, uint64_t *ret) {
+        uint64_t p;
+        Object *o;
+        int r;
+
+        assert(f);
+        assert(f->header);
+        assert(ret);
+
+        /* Returns where the next object would be appended */
+
+        p = le64toh(f->header->tail_object_offset);
+        if (p == 0)
+                p = le64toh(f->header->header_size);
+        else {
+                r = journal_file_move_to_object(f, OBJECT_UNUSED, p, &o);
+                if (r < 0)
+                        return r;
+
+                p += ALIGN64(le64toh(o->object.size));
+        }
+
+        *ret = p;
+        return 0;
+}
+
+int journal_file_field_index_next_item(Object *o, uint64_t *pos, FieldIndexItem **ret) {
+        FieldIndexItem *i;
+        uint64_t size, l;
+
+        assert(o);
+        assert(o->object.type == OBJECT_FIELD_INDEX);
+        assert(pos);
+        assert(ret);
+
+        /* Returns the item at *pos, and moves *pos to the next one. Start with *pos == 0. */
+
+        size = le64toh(o->object.size);
+
+        if (*pos == 0)
+                *pos = offsetof(Object, field_index.items);
+        if (*pos >= size)
+                return 0;
+
+        if (size - *pos < sizeof(FieldIndexItem))
+                return -EBADMSG;
+
+        i = (FieldIndexItem*) ((uint8_t*) o + *pos);
+        l = le64toh(i->size);
+        if (l <= 0 || l > size - *pos - offsetof(FieldIndexItem, payload))
+                return -EBADMSG;
+
+        *pos += ALIGN64(offsetof(FieldIndexItem, payload) + l);
+        *ret = i;
+
+        return 1;
+}
+
+int journal_file_find_field_index(JournalFile *f, const void *field, uint64_t size, Object **ret, uint64_t *offset) {
+        uint64_t p, hash;
+        Object *o;
+        int r;
+
+        assert(f);
+        assert(f->header);
+        assert(field && size > 0);
+
+        if (!JOURNAL_HEADER_CONTAINS(f->header, field_index_offset))
+                return 0;
+
+        hash = hash64(field, size);
+
+        p = le64toh(f->header->field_index_offset);
+        while (p > 0) {
+                FieldIndexItem *i;
+                uint64_t pos = 0, next;
+
+                r = journal_file_move_to_object(f, OBJECT_FIELD_INDEX, p, &o);
+                if (r < 0)
+                        return r;
+
+                /* The field name is not stored separately, hence compare it with the first value */
+                if (le64toh(o->field_index.hash) == hash &&
+                    journal_file_field_index_next_item(o, &pos, &i) > 0 &&
+                    le64toh(i->size) > size &&
+                    memcmp(i->payload, field, size) == 0 &&
+                    i->payload[size] == '=') {
+
+                        if (ret)
+                                *ret = o;
+                        if (offset)
+                                *offset = p;
+
+                        return 1;
+                }
+
+                /* The chain always points backwards, which also protects us from loops */
+                next = le64toh(o->field_index.next_field_index_offset);
+                if (next >= p)
+                        return -EBADMSG;
+
+                p = next;
+        }
+
+        return 0;
+}
+
+static void field_index_free_many(FieldIndex *indexes, size_t n) {
+        size_t i;
+
+        for (i = 0; i < n; i++)
+                free(indexes[i].items);
+
+        free(indexes);
+}
+
+static int field_index_collect(JournalFile *f, uint64_t p, FieldIndex *ret) {
+        _cleanup_free_ uint8_t *items = NULL;
+        size_t size = 0, allocated = 0;
+        uint64_t hash, n_items = 0;
+        Object *o;
+        int r;
+
+        assert(f);
+        assert(ret);
+
+        r = journal_file_move_to_object(f, OBJECT_FIELD, p, &o);
+        if (r < 0)
+                return r;
+
+        hash = le64toh(o->field.hash);
+        p = le64toh(o->field.head_data_offset);
+
+        while (p > 0) {
+                FieldIndexItem *i;
+                const void *data;
+                uint64_t l;
+                int compression;
+
+                if (n_items >= FIELD_INDEX_VALUES_MAX)
+                        return 0;
+
+                r = journal_file_move_to_object(f, OBJECT_DATA, p, &o);
+                if (r < 0)
+                        return r;
+
+                l = le64toh(o->object.size) - offsetof(Object, data.payload);
+                compression = o->object.flags & OBJECT_COMPRESSION_MASK;
+
+                if (compression != 0) {
+#if HAVE_XZ || HAVE_LZ4 || HAVE_ZSTD
+                        size_t rsize = 0;
+
+                        r = decompress_blob(compression,
+                                            o->data.payload, l, &f->compress_buffer, &f->compress_buffer_size, &rsize, 0,
+                                            f->compress_dictionary);
+                        if (r < 0)
+                                return r;
+
+                        data = f->compress_buffer;
+                        l = rsize;
+#else
+                        return -EPROTONOSUPPORT;
+#endif
+                } else
+                        data = o->data.payload;
+
+                if (l <= 0 || l > FIELD_INDEX_VALUE_SIZE_MAX)
+                        return 0;
+
+                if (!GREEDY_REALLOC0(items, allocated, size + ALIGN64(offsetof(FieldIndexItem, payload) + l)))
+                        return -ENOMEM;
+
+                i = (FieldIndexItem*) (items + size);
+                i->hash = o->data.hash;
+                i->n_entries = o->data.n_entries;
+                i->size = htole64(l);
+                memcpy(i->payload, data, l);
+
+                size += ALIGN64(offsetof(FieldIndexItem, payload) + l);
+                n_items++;
+
+                p = le64toh(o->data.next_field_offset);
+        }
+
+        if (n_items <= 0)
+                return 0;
+
+        *ret = (FieldIndex) {
+                .hash = hash,
+                .n_items = n_items,
+                .items = TAKE_PTR(items),
+                .size = size,
+        };
+
+        return 1;
+}
+
+static int field_index_build(JournalFile *f, FieldIndex **ret, size_t *ret_n, uint64_t *ret_total) {
+        FieldIndex *indexes = NULL;
+        size_t n_indexes = 0, indexes_allocated = 0;
+        uint64_t total = 0, p, m, h;
+        Object *o;
+        int r;
+
+        assert(f);
+        assert(f->header);
+        assert(ret);
+        assert(ret_n);
+        assert(ret_total);
+
+        /* Collects the distinct values of all fields with few and short values. This only reads the file,
+         * hence may be done on a private, read-only instance of it. Returns 0 if there is nothing to index. */
+
+        /* Files created by older versions lack the flag, which makes their verifiers reject the objects */
+        if (!JOURNAL_HEADER_FIELD_INDEX(f->header) ||
+            !JOURNAL_HEADER_CONTAINS(f->header, field_index_offset) ||
+            f->header->field_index_offset != 0 ||
+            le64toh(f->header->field_hash_table_size) <= 0 ||
+            le64toh(f->header->n_fields) <= 0)
+                return 0;
+
+        (void) journal_file_load_dictionary(f);
+
+        r = journal_file_map_field_hash_table(f);
+        if (r < 0)
+                return r;
+
+        m = le64toh(f->header->field_hash_table_size) / sizeof(HashItem);
+
+        for (h = 0; h < m; h++) {
+                p = le64toh(f->field_hash_table[h].head_hash_offset);
+
+                while (p > 0) {
+                        FieldIndex index;
+
+                        if (!GREEDY_REALLOC(indexes, indexes_allocated, n_indexes + 1)) {
+                                r = -ENOMEM;
+                                goto fail;
+                        }
+
+                        r = field_index_collect(f, p, &index);
+                        if (r < 0)
+                                goto fail;
+                        if (r > 0) {
+                                uint64_t l;
+
+                                l = ALIGN64(offsetof(Object, field_index.items) + index.size);
+                                if (total + l <= FIELD_INDEX_SIZE_MAX) {
+                                        indexes[n_indexes++] = index;
+                                        total += l;
+                                } else
+                                        free(index.items);
+                        }
+
+                        r = journal_file_move_to_object(f, OBJECT_FIELD, p, &o);
+                        if (r < 0)
+                                goto fail;
+
+                        p = le64toh(o->field.next_hash_offset);
+                }
+        }
+
+        if (n_indexes <= 0) {
+                free(indexes);
+                return 0;
+        }
+
+        *ret = indexes;
+        *ret_n = n_indexes;
+        *ret_total = total;
+        return 1;
+
+fail:
+        field_index_free_many(indexes, n_indexes);
+        return r;
+}
+
+static int field_index_write(JournalFile *f, const FieldIndex *indexes, size_t n_indexes, uint64_t total) {
+        uint64_t saved_max_size, p, q = 0;
+        size_t i;
+        Object *o;
+        int r;
+
+        assert(f);
+        assert(f->header);
+        assert(indexes || n_indexes == 0);
+
+        /* Appends the indexes collected by field_index_build() to the file they were collected from */
+
+        if (!f->writable)
+                return -EINVAL;
+
+        if (n_indexes <= 0 || f->header->field_index_offset != 0)
+                return 0;
+
+        /* Files are commonly rotated because they reached their maximum size, hence allow the index to
+         * grow the file beyond it, but only by exactly as much as it needs. */
+        r = journal_file_end_offset(f, &p);
+        if (r < 0)
+                return r;
+
+        saved_max_size = f->metrics.max_size;
+        if (saved_max_size > 0)
+                f->metrics.max_size = MAX(saved_max_size, PAGE_ALIGN(p + total));
+
+        for (i = 0; i < n_indexes; i++) {
+                uint64_t k;
+
+                r = journal_file_append_object(f, OBJECT_FIELD_INDEX, offsetof(Object, field_index.items) + indexes[i].size, &o, &k);
+                if (r < 0)
+                        break;
+
+                /* Each object points to the one appended before it, so that none needs to be changed
+                 * once written */
+                o->field_index.hash = htole64(indexes[i].hash);
+                o->field_index.next_field_index_offset = htole64(q);
+                o->field_index.n_items = htole64(indexes[i].n_items);
+                memcpy(o->field_index.items, indexes[i].items, indexes[i].size);
+
+#if HAVE_GCRYPT
+                r = journal_file_hmac_put_object(f, OBJECT_FIELD_INDEX, o, k);
+                if (r < 0)
+                        break;
+#endif
+
+                q = k;
+        }
+
+        f->metrics.max_size = saved_max_size;
+
+        /* Each object is complete on its own, hence reference whatever we managed to write */
+        f->header->field_index_offset = htole64(q);
+
+        if (r < 0)
+                return r;
+
+        log_debug("Added index of %zu fields (%"PRIu64" bytes) to %s.", n_indexes, total, f->path);
+        return 1;
+}
+
+int journal_file_append_field_index(JournalFile *f) {
+        FieldIndex *indexes = NULL;
+        size_t n_indexes = 0;
+        uint64_t total = 0;
+        int r;
+
+        assert(f);
+
+        /* Writes the distinct values of all fields with few and short values to the end of a file we are
+         * about to archive, so that sd_journal_enumerate_unique() can list them without looking at every
+         * data object, and without looking values up in every other file to eliminate duplicates. */
+
+        if (!f->writable)
+                return -EINVAL;
+
+        r = field_index_build(f, &indexes, &n_indexes, &total);
+        if (r <= 0)
+                return r;
+
+        r = field_index_write(f, indexes, n_indexes, total);
+        field_index_free_many(indexes, n_indexes);
+        return r;
+}
+
+static uint64_t bloom_filter_bit(uint64_t hash, uint64_t i, uint64_t n_bits) {
+        return ((hash & UINT32_MAX) + i * (hash >> 32)) % n_bits;
+}
+
+int journal_file_bloom_filter_test(JournalFile *f, uint64_t hash) {
+        uint64_t p, n_bits, n_hashes, i;
+        Object *o;
+        int r;
+
+        assert(f);
+        assert(f->header);
+
+        /* Returns 0 if the file has no data object with the hash, and > 0 if it might have one, which is
+         * also what we say about files without a bloom filter */
+
+        if (!JOURNAL_HEADER_CONTAINS(f->header, bloom_filter_offset))
+                return 1;
+
+        p = le64toh(f->header->bloom_filter_offset);
+        if (p == 0)
+                return 1;
+
+        r = journal_file_move_to_object(f, OBJECT_BLOOM_FILTER, p, &o);
+        if (r < 0)
+                return r;
+
+        n_bits = (le64toh(o->object.size) - offsetof(Object, bloom_filter.bits)) * 8;
+        n_hashes = le64toh(o->bloom_filter.n_hashes);
+
+        for (i = 0; i < n_hashes; i++) {
+                uint64_t b;
+
+                b = bloom_filter_bit(hash, i, n_bits);
+                if (!(o->bloom_filter.bits[b / 8] & (1U << (b % 8))))
+                        return 0;
+        }
+
+        return 1;
+}
+
+static int bloom_filter_build(JournalFile *f, uint8_t **ret, uint64_t *ret_size, uint64_t *ret_n_data) {
+        _cleanup_free_ uint8_t *bits = NULL;
+        uint64_t n_data, size, n_bits, m, h, p;
+        Object *o;
+        int r;
+
+        assert(f);
+        assert(f->header);
+        assert(ret);
+        assert(ret_size);
+        assert(ret_n_data);
+
+        /* Sets the bits for the hashes of all data objects. This only reads the file, hence may be done on a
+         * private, read-only instance of it. Returns 0 if the file gets no filter. */
+
+        if (!JOURNAL_HEADER_BLOOM_FILTER(f->header) ||
+            !JOURNAL_HEADER_CONTAINS(f->header, bloom_filter_offset) ||
+            f->header->bloom_filter_offset != 0 ||
+            le64toh(f->header->data_hash_table_size) <= 0 ||
+            le64toh(f->header->n_data) <= 0)
+                return 0;
+
+        n_data = le64toh(f->header->n_data);
+        size = MIN(DIV_ROUND_UP(n_data * BLOOM_FILTER_BITS_PER_ITEM, 64) * sizeof(uint64_t), BLOOM_FILTER_SIZE_MAX);
+        n_bits = size * 8;
+
+        bits = malloc0(size);
+        if (!bits)
+                return -ENOMEM;
+
+        r = journal_file_map_data_hash_table(f);
+        if (r < 0)
+                return r;
+
+        m = le64toh(f->header->data_hash_table_size) / sizeof(HashItem);
+
+        for (h = 0; h < m; h++) {
+                p = le64toh(f->data_hash_table[h].head_hash_offset);
+
+                while (p > 0) {
+                        uint64_t hash, i;
+
+                        r = journal_file_move_to_object(f, OBJECT_DATA, p, &o);
+                        if (r < 0)
+                                return r;
+
+                        hash = le64toh(o->data.hash);
+                        for (i = 0; i < BLOOM_FILTER_HASHES; i++) {
+                                uint64_t b;
+
+                                b = bloom_filter_bit(hash, i, n_bits);
+                                bits[b / 8] |= 1U << (b % 8);
+                        }
+
+                        p = le64toh(o->data.next_hash_offset);
+                }
+        }
+
+        *ret = TAKE_PTR(bits);
+        *ret_size = size;
+        *ret_n_data = n_data;
+        return 1;
+}
+
+static int bloom_filter_write(JournalFile *f, const uint8_t *bits, uint64_t size, uint64_t n_data) {
+        uint64_t saved_max_size, p, q;
+        Object *o;
+        int r;
+
+        assert(f);
+        assert(f->header);
+        assert(bits);
+        assert(size > 0);
+
+        /* Appends the filter set up by bloom_filter_build() to the file it was set up from */
+
+        if (!f->writable)
+                return -EINVAL;
+
+        if (f->header->bloom_filter_offset != 0)
+                return 0;
+
+        /* Like the field index, the filter may grow the file beyond its maximum size */
+        r = journal_file_end_offset(f, &p);
+        if (r < 0)
+                return r;
+
+        saved_max_size = f->metrics.max_size;
+        if (saved_max_size > 0)
+                f->metrics.max_size = MAX(saved_max_size, PAGE_ALIGN(p + ALIGN64(offsetof(Object, bloom_filter.bits) + size)));
+
+        r = journal_file_append_object(f, OBJECT_BLOOM_FILTER, offsetof(Object, bloom_filter.bits) + size, &o, &q);
+        f->metrics.max_size = saved_max_size;
+        if (r < 0)
+                return r;
+
+        o->bloom_filter.n_hashes = htole64(BLOOM_FILTER_HASHES);
+        memcpy(o->bloom_filter.bits, bits, size);
+
+#if HAVE_GCRYPT
+        r = journal_file_hmac_put_object(f, OBJECT_BLOOM_FILTER, o, q);
+        if (r < 0)
+                return r;
+#endif
+
+        f->header->bloom_filter_offset = htole64(q);
+
+        log_debug("Added bloom filter of %"PRIu64" data objects (%"PRIu64" bytes) to %s.", n_data, size, f->path);
+        return 1;
+}
+
+int journal_file_append_bloom_filter(JournalFile *f) {
+        _cleanup_free_ uint8_t *bits = NULL;
+        uint64_t size = 0, n_data = 0;
+        int r;
+
+        assert(f);
+
+        /* Writes a bloom filter of the hashes of all data objects to the end of a file we are about to
+         * archive, so that readers looking for values the file doesn't have can skip it without probing the
+         * data hash table, which mostly means faulting in pages of it and of the data objects it lists. */
+
+        if (!f->writable)
+                return -EINVAL;
+
+        r = bloom_filter_build(f, &bits, &size, &n_data);
+        if (r <= 0)
+                return r;
+
+        return bloom_filter_write(f, bits, size, n_data);
+}
+
+static void* journal_file_indexing_thread(void *arg) {
+        ArchiveIndexing *t = arg;
+
+        (void) pthread_setname_np(pthread_self(), "journal-index");
+
+        /* Both go through all data objects, hence are done one after the other, while they are in the page
+         * cache */
+        t->field_index_result = field_index_build(t->file, &t->field_indexes, &t->n_field_indexes, &t->field_indexes_size);
+        t->bloom_filter_result = bloom_filter_build(t->file, &t->bloom_filter, &t->bloom_filter_size, &t->bloom_filter_n_data);
+
+        return NULL;
+}
+
+static int journal_file_start_indexing(JournalFile *f) {
+        _cleanup_free_ ArchiveIndexing *t = NULL;
+        sigset_t ss, saved_ss;
+        int fd, r, k;
+
+        assert(f);
+        assert(f->header);
+        assert(!f->indexing);
+
+        /* Indexes a file we are about to archive, and sets up its bloom filter. Going through all its data
+         * objects takes a while, hence it
+         * is done in a thread of its own, which reads a private, read-only instance of the file, with its own
+         * mmap cache. The index is appended by journal_file_finish_indexing() once the thread is done. */
+
+        if (!f->writable ||
+            (!JOURNAL_HEADER_FIELD_INDEX(f->header) && !JOURNAL_HEADER_BLOOM_FILTER(f->header)))
+                return 0;
+
+        t = new0(ArchiveIndexing, 1);
+        if (!t)
+                return -ENOMEM;
+
+        fd = fcntl(f->fd, F_DUPFD_CLOEXEC, 3);
+        if (fd < 0)
+                return -errno;
+
+        r = journal_file_open(fd, f->path, O_RDONLY, 0, 0, 0, false, NULL, NULL, NULL, NULL, &t->file);
+        if (r < 0) {
+                safe_close(fd);
+                return r;
+        }
+
+        if (sigfillset(&ss) < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        r = pthread_sigmask(SIG_BLOCK, &ss, &saved_ss);
+        if (r > 0) {
+                r = -r;
+                goto fail;
+        }
+
+        r = pthread_create(&t->thread, NULL, journal_file_indexing_thread, t);
+
+        k = pthread_sigmask(SIG_SETMASK, &saved_ss, NULL);
+        if (r > 0) {
+                r = -r;
+                goto fail;
+        }
+
+        f->indexing = TAKE_PTR(t);
+
+        if (k > 0)
+                return -k;
+
+        return 1;
+
+fail:
+        (void) journal_file_close(t->file);
+        return r;
+}
+
+int journal_file_finish_indexing(JournalFile *f, bool wait) {
+        ArchiveIndexing *t;
+        int r;
+
+        assert(f);
+
+        /* Appends the index and bloom filter built by the thread started when the file was rotated. If wait is false and the
+         * thread is not done yet, returns -EAGAIN. Returns 0 if the file isn't being indexed, and > 0 once
+         * the index was picked up, which happens only once. Failing to append it is not fatal, since
+         * readers do without. */
+
+        t = f->indexing;
+        if (!t)
+                return 0;
+
+        r = wait ? pthread_join(t->thread, NULL) : pthread_tryjoin_np(t->thread, NULL);
+        if (r == EBUSY)
+                return -EAGAIN;
+        if (r > 0)
+                return -r;
+
+        f->indexing = NULL;
+
+        r = t->field_index_result;
+        if (r > 0)
+                r = field_index_write(f, t->field_indexes, t->n_field_indexes, t->field_indexes_size);
+        if (r < 0)
+                log_debug_errno(r, "Failed to add field index to %s, ignoring: %m", f->path);
+
+        r = t->bloom_filter_result;
+        if (r > 0)
+                r = bloom_filter_write(f, t->bloom_filter, t->bloom_filter_size, t->bloom_filter_n_data);
+        if (r < 0)
+                log_debug_errno(r, "Failed to add bloom filter to %s, ignoring: %m", f->path);
+
+        (void) journal_file_close(t->file);
+        field_index_free_many(t->field_indexes, t->n_field_indexes);
+        free(t->bloom_filter);
+        free(t);
+
+        return 1;
+}
+
+void journal_file_dump(JournalFile *f) {
+        Object *o;
+        int r;
+        uint64_t p;
+
+        assert(f);
+        assert(f->header);
+
+        journal_file_print_header(f);
+
+        p = le64toh(f->header->header_size);
+        while (p != 0) {
+                r = journal_file_move_to_object(f, OBJECT_UNUSED, p, &o);
+                if (r < 0)
+                        goto fail;
+
+                switch (o->object.type) {
+
+                case OBJECT_UNUSED:
+                        printf("Type: OBJECT_UNUSED\n");
+                        break;
+
+                case OBJECT_DATA:
+                        printf("Type: OBJECT_DATA\n");
+                        break;
+
+                case OBJECT_FIELD:
+                        printf("Type: OBJECT_FIELD\n");
+                        break;
+
+                case OBJECT_ENTRY:
+                        printf("Type: OBJECT_ENTRY seqnum=%"PRIu64" monotonic=%"PRIu64" realtime=%"PRIu64"\n",
+                               le64toh(o->entry.seqnum),
+                               le64toh(o->entry.monotonic),
+                               le64toh(o->entry.realtime));
+                        break;
+
+                case OBJECT_FIELD_HASH_TABLE:
+                        printf("Type: OBJECT_FIELD_HASH_TABLE\n");
+                        break;
+
+                case OBJECT_DATA_HASH_TABLE:
+                        printf("Type: OBJECT_DATA_HASH_TABLE\n");
+                        break;
+
+                case OBJECT_ENTRY_ARRAY:
+                        printf("Type: OBJECT_ENTRY_ARRAY\n");
+                        break;
+
+                case OBJECT_TAG:
+                        printf("Type: OBJECT_TAG seqnum=%"PRIu64" epoch=%"PRIu64"\n",
+                               le64toh(o->tag.seqnum),
+                               le64toh(o->tag.epoch));
+                        break;
+
+                case OBJECT_DICTIONARY:
+                        printf("Type: OBJECT_DICTIONARY\n");
+                        break;
+
+                case OBJECT_FIELD_INDEX:
+                        printf("Type: OBJECT_FIELD_INDEX n_items=%"PRIu64"\n",
+                               le64toh(o->field_index.n_items));
+                        break;
+
+                case OBJECT_BLOOM_FILTER:
+                        printf("Type: OBJECT_BLOOM_FILTER n_hashes=%"PRIu64"\n",
+                               le64toh(o->bloom_filter.n_hashes));
+                        break;
+
+                default:
+                        printf("Type: unknown (%i)\n", o->object.type);
+                        break;
+                }
+
+                if (o->object.flags & OBJECT_COMPRESSION_MASK)
+                        printf("Flags: %s\n",
+                               object_compressed_to_string(o->object.flags & OBJECT_COMPRESSION_MASK));
+
+                if (p == le64toh(f->header->tail_object_offset))
+                        p = 0;
+                else
+                        p = p + ALIGN64(le64toh(o->object.size));
+        }
+
+        return;
+fail:
         log_error("File corrupt");
 }
 
@@ -3106,8 +4347,8 @@ void journal_file_print_header(JournalFile *f) {
                "Boot ID: %s\n"
                "Sequential Number ID: %s\n"
                "State: %s\n"
-               "Compatible Flags:%s%s\n"
-               "Incompatible Flags:%s%s%s\n"
+               "Compatible Flags:%s%s%s%s\n"
+               "Incompatible Flags:%s%s%s%s%s\n"
                "Header size: %"PRIu64"\n"
                "Arena size: %"PRIu64"\n"
                "Data Hash Table Size: %"PRIu64"\n"
@@ -3129,9 +4370,13 @@ void journal_file_print_header(JournalFile *f) {
                f->header->state == STATE_ONLINE ? "ONLINE" :
                f->header->state == STATE_ARCHIVED ? "ARCHIVED" : "UNKNOWN",
                JOURNAL_HEADER_SEALED(f->header) ? " SEALED" : "",
+               JOURNAL_HEADER_FIELD_INDEX(f->header) ? " FIELD-INDEX" : "",
+               JOURNAL_HEADER_BLOOM_FILTER(f->header) ? " BLOOM-FILTER" : "",
                (le32toh(f->header->compatible_flags) & ~HEADER_COMPATIBLE_ANY) ? " ???" : "",
                JOURNAL_HEADER_COMPRESSED_XZ(f->header) ? " COMPRESSED-XZ" : "",
                JOURNAL_HEADER_COMPRESSED_LZ4(f->header) ? " COMPRESSED-LZ4" : "",
+               JOURNAL_HEADER_COMPRESSED_ZSTD(f->header) ? " COMPRESSED-ZSTD" : "",
+               JOURNAL_HEADER_COMPRESSED_ZSTD_DICTIONARY(f->header) ? " COMPRESSED-ZSTD-DICTIONARY" : "",
                (le32toh(f->header->incompatible_flags) & ~HEADER_INCOMPATIBLE_ANY) ? " ???" : "",
                le64toh(f->header->header_size),
                le64toh(f->header->arena_size),
@@ -3209,7 +4454,7 @@ int journal_file_open(
                 const char *fname,
                 int flags,
                 mode_t mode,
-                bool compress,
+                int compress,
                 uint64_t compress_threshold_bytes,
                 bool seal,
                 JournalMetrics *metrics,
@@ -3218,6 +4463,8 @@ int journal_file_open(
                 JournalFile *template,
                 JournalFile **ret) {
 
+        _cleanup_free_ void *dictionary = NULL;
+        size_t dictionary_size = 0;
         bool newly_created = false;
         JournalFile *f;
         void *h;
@@ -3243,15 +4490,15 @@ int journal_file_open(
         f->flags = flags;
         f->prot = prot_from_flags(flags);
         f->writable = (flags & O_ACCMODE) != O_RDONLY;
-#if HAVE_LZ4
-        f->compress_lz4 = compress;
-#elif HAVE_XZ
-        f->compress_xz = compress;
-#endif
+        /* Algorithms not compiled in are silently turned into "no compression" */
+        f->compress_xz = HAVE_XZ && compress == OBJECT_COMPRESSED_XZ;
+        f->compress_lz4 = HAVE_LZ4 && compress == OBJECT_COMPRESSED_LZ4;
+        f->compress_zstd = HAVE_ZSTD && compress == OBJECT_COMPRESSED_ZSTD;
 
-        if (compress_threshold_bytes == (uint64_t) -1)
+        if (compress_threshold_bytes == (uint64_t) -1) {
                 f->compress_threshold_bytes = DEFAULT_COMPRESS_THRESHOLD;
-        else
+                f->compress_threshold_unset = true;
+        } else
                 f->compress_threshold_bytes = MAX(MIN_COMPRESS_THRESHOLD, compress_threshold_bytes);
 
 #if HAVE_GCRYPT
@@ -3259,7 +4506,7 @@ int journal_file_open(
 #endif
 
         log_debug("Journal effective settings seal=%s compress=%s compress_threshold_bytes=%s",
-                  yes_no(f->seal), yes_no(JOURNAL_FILE_COMPRESS(f)),
+                  yes_no(f->seal), JOURNAL_FILE_COMPRESS(f) ? object_compressed_to_string(JOURNAL_FILE_COMPRESSION(f)) : "no",
                   format_bytes(bytes, sizeof(bytes), f->compress_threshold_bytes));
 
         if (mmap_cache)
@@ -3344,7 +4591,15 @@ int journal_file_open(
                 }
 #endif
 
-                r = journal_file_init_header(f, template);
+                /* A dictionary trained on the contents of an earlier file is attached right away, since the
+                 * header flags announcing it are covered by the seal */
+                if (template && f->compress_zstd) {
+                        r = journal_file_finish_dictionary_training(template, &dictionary, &dictionary_size);
+                        if (r < 0)
+                                log_debug_errno(r, "Failed to train compression dictionary for %s, ignoring: %m", f->path);
+                }
+
+                r = journal_file_init_header(f, template, !!dictionary);
                 if (r < 0)
                         goto fail;
 
@@ -3409,6 +4664,12 @@ int journal_file_open(
                 if (r < 0)
                         goto fail;
 
+                if (dictionary) {
+                        r = journal_file_append_dictionary(f, dictionary, dictionary_size);
+                        if (r < 0)
+                                goto fail;
+                }
+
 #if HAVE_GCRYPT
                 r = journal_file_append_first_tag(f);
                 if (r < 0)
@@ -3446,10 +4707,32 @@ fail:
         return r;
 }
 
-int journal_file_rotate(JournalFile **f, bool compress, uint64_t compress_threshold_bytes, bool seal, Set *deferred_closes) {
-        _cleanup_free_ char *p = NULL;
+int journal_file_archived_path(JournalFile *f, char **ret) {
         size_t l;
+
+        assert(f);
+        assert(ret);
+
+        /* Returns the name a file gets when it is archived */
+
+        if (!endswith(f->path, ".journal"))
+                return -EINVAL;
+
+        l = strlen(f->path);
+        if (asprintf(ret, "%.*s@" SD_ID128_FORMAT_STR "-%016"PRIx64"-%016"PRIx64".journal",
+                     (int) l - 8, f->path,
+                     SD_ID128_FORMAT_VAL(f->header->seqnum_id),
+                     le64toh(f->header->head_entry_seqnum),
+                     le64toh(f->header->head_entry_realtime)) < 0)
+                return -ENOMEM;
+
+        return 0;
+}
+
+int journal_file_rotate(JournalFile **f, int compress, uint64_t compress_threshold_bytes, bool seal, Set *deferred_closes) {
+        _cleanup_free_ char *p = NULL;
         JournalFile *old_file, *new_file = NULL;
+        bool renamed;
         int r;
 
         assert(f);
@@ -3465,17 +4748,9 @@ int journal_file_rotate(JournalFile **f, bool compress, uint64_t compress_thresh
         if (path_startswith(old_file->path, "/proc/self/fd"))
                 return -EINVAL;
 
-        if (!endswith(old_file->path, ".journal"))
-                return -EINVAL;
-
-        l = strlen(old_file->path);
-        r = asprintf(&p, "%.*s@" SD_ID128_FORMAT_STR "-%016"PRIx64"-%016"PRIx64".journal",
-                     (int) l - 8, old_file->path,
-                     SD_ID128_FORMAT_VAL(old_file->header->seqnum_id),
-                     le64toh((*f)->header->head_entry_seqnum),
-                     le64toh((*f)->header->head_entry_realtime));
+        r = journal_file_archived_path(old_file, &p);
         if (r < 0)
-                return -ENOMEM;
+                return r;
 
         /* Try to rename the file to the archived version. If the file
          * already was deleted, we'll get ENOENT, let's ignore that
@@ -3483,10 +4758,29 @@ int journal_file_rotate(JournalFile **f, bool compress, uint64_t compress_thresh
         r = rename(old_file->path, p);
         if (r < 0 && errno != ENOENT)
                 return -errno;
+        renamed = r >= 0;
 
         /* Sync the rename to disk */
         (void) fsync_directory_of_file(old_file->fd);
 
+        /* Nothing is written to the file anymore from here on, hence this is the time to index it, and set up
+         * its bloom filter. That is
+         * done in the background, and the index is appended when the file is closed, or earlier when the
+         * owner of the deferred closes calls journal_file_finish_indexing(). */
+        r = journal_file_start_indexing(old_file);
+        if (r < 0)
+                log_debug_errno(r, "Failed to start indexing %s, ignoring: %m", old_file->path);
+
+        /* Realtime timestamps are ordered within a file, hence this is the time range it covers */
+        if (renamed) {
+                r = journal_time_index_add(p, &(JournalTimeRange) {
+                                .head_realtime = le64toh(old_file->header->head_entry_realtime),
+                                .tail_realtime = le64toh(old_file->header->tail_entry_realtime),
+                        });
+                if (r < 0)
+                        log_debug_errno(r, "Failed to add %s to time index, ignoring: %m", p);
+        }
+
         /* Set as archive so offlining commits w/state=STATE_ARCHIVED.
          * Previously we would set old_file->header->state to STATE_ARCHIVED directly here,
          * but journal_file_set_offline() short-circuits when state != STATE_ONLINE, which
@@ -3500,14 +4794,26 @@ int journal_file_rotate(JournalFile **f, bool compress, uint64_t compress_thresh
          * we archive them */
         old_file->defrag_on_close = true;
 
+        /* This also attaches the dictionary trained on the file before the old one to the new one */
         r = journal_file_open(-1, old_file->path, old_file->flags, old_file->mode, compress,
                               compress_threshold_bytes, seal, NULL, old_file->mmap, deferred_closes,
                               old_file, &new_file);
+        if (r >= 0) {
+                int k;
+
+                /* The old file is still around, hence this is the time to learn from its contents, for the
+                 * file that will replace the new one */
+                k = journal_file_start_dictionary_training(new_file, old_file);
+                if (k < 0)
+                        log_debug_errno(k, "Failed to start training compression dictionary on %s, ignoring: %m", p);
+        }
 
         if (deferred_closes &&
-            set_put(deferred_closes, old_file) >= 0)
-                (void) journal_file_set_offline(old_file, false);
-        else
+            set_put(deferred_closes, old_file) >= 0) {
+                /* A file that is being indexed is set offline after its index was appended */
+                if (!old_file->indexing)
+                        (void) journal_file_set_offline(old_file, false);
+        } else
                 (void) journal_file_close(old_file);
 
         *f = new_file;
@@ -3518,7 +4824,7 @@ int journal_file_open_reliably(
                 const char *fname,
                 int flags,
                 mode_t mode,
-                bool compress,
+                int compress,
                 uint64_t compress_threshold_bytes,
                 bool seal,
                 JournalMetrics *metrics,
@@ -3627,11 +4933,14 @@ int journal_file_copy_entry(JournalFile *from, JournalFile *to, Object *o, uint6
                         return -E2BIG;
 
                 if (o->object.flags & OBJECT_COMPRESSION_MASK) {
-#if HAVE_XZ || HAVE_LZ4
+#if HAVE_XZ || HAVE_LZ4 || HAVE_ZSTD
                         size_t rsize = 0;
 
+                        (void) journal_file_load_dictionary(from);
+
                         r = decompress_blob(o->object.flags & OBJECT_COMPRESSION_MASK,
-                                            o->data.payload, l, &from->compress_buffer, &from->compress_buffer_size, &rsize, 0);
+                                            o->data.payload, l, &from->compress_buffer, &from->compress_buffer_size, &rsize, 0,
+                                            from->compress_dictionary);
                         if (r < 0)
                                 return r;
 
@@ -3657,7 +4966,7 @@ int journal_file_copy_entry(JournalFile *from, JournalFile *to, Object *o, uint6
         }
 
         r = journal_file_append_entry_internal(to, &ts, boot_id, xor_hash, items, n,
-                                               NULL, NULL, NULL);
+                                               NULL, NULL, NULL, NULL);
 
         if (mmap_cache_got_sigbus(to->mmap, to->cache_fd))
                 return -EIO;
@@ -9,6 +9,7 @@
 
 #include "sd-id128.h"
 
+#include "compress.h"
 #include "hashmap.h"
 #include "journal-def.h"
 #include "macro.h"
@@ -55,6 +56,9 @@ typedef enum OfflineState {
         OFFLINE_DONE
 } OfflineState;
 
+typedef struct DictionaryTraining DictionaryTraining;
+typedef struct ArchiveIndexing ArchiveIndexing;
+
 typedef struct JournalFile {
         int fd;
         MMapFileDescriptor *cache_fd;
@@ -66,10 +70,12 @@ typedef struct JournalFile {
         bool writable:1;
         bool compress_xz:1;
         bool compress_lz4:1;
+        bool compress_zstd:1;
         bool seal:1;
         bool defrag_on_close:1;
         bool close_fd:1;
         bool archive:1;
+        bool compress_threshold_unset:1;
 
         direction_t last_direction;
         LocationType location_type;
@@ -104,10 +110,13 @@ typedef struct JournalFile {
         unsigned last_seen_generation;
 
         uint64_t compress_threshold_bytes;
-#if HAVE_XZ || HAVE_LZ4
+#if HAVE_XZ || HAVE_LZ4 || HAVE_ZSTD
         void *compress_buffer;
         size_t compress_buffer_size;
 #endif
+        CompressDictionary *compress_dictionary;
+        DictionaryTraining *dictionary_training; /* for the file that replaces this one on rotation */
+        ArchiveIndexing *indexing; /* of this file, after it was rotated */
 
 #if HAVE_GCRYPT
         gcry_md_hd_t hmac;
@@ -132,7 +141,7 @@ int journal_file_open(
                 const char *fname,
                 int flags,
                 mode_t mode,
-                bool compress,
+                int compress,
                 uint64_t compress_threshold_bytes,
                 bool seal,
                 JournalMetrics *metrics,
@@ -149,7 +158,7 @@ int journal_file_open_reliably(
                 const char *fname,
                 int flags,
                 mode_t mode,
-                bool compress,
+                int compress,
                 uint64_t compress_threshold_bytes,
                 bool seal,
                 JournalMetrics *metrics,
@@ -192,6 +201,18 @@ static inline bool VALID_EPOCH(uint64_t u) {
 #define JOURNAL_HEADER_COMPRESSED_LZ4(h) \
         (!!(le32toh((h)->incompatible_flags) & HEADER_INCOMPATIBLE_COMPRESSED_LZ4))
 
+#define JOURNAL_HEADER_COMPRESSED_ZSTD(h) \
+        (!!(le32toh((h)->incompatible_flags) & HEADER_INCOMPATIBLE_COMPRESSED_ZSTD))
+
+#define JOURNAL_HEADER_COMPRESSED_ZSTD_DICTIONARY(h) \
+        (!!(le32toh((h)->incompatible_flags) & HEADER_INCOMPATIBLE_COMPRESSED_ZSTD_DICTIONARY))
+
+#define JOURNAL_HEADER_FIELD_INDEX(h) \
+        (!!(le32toh((h)->compatible_flags) & HEADER_COMPATIBLE_FIELD_INDEX))
+
+#define JOURNAL_HEADER_BLOOM_FILTER(h) \
+        (!!(le32toh((h)->compatible_flags) & HEADER_COMPATIBLE_BLOOM_FILTER))
+
 int journal_file_move_to_object(JournalFile *f, ObjectType type, uint64_t offset, Object **ret);
 
 uint64_t journal_file_entry_n_items(Object *o) _pure_;
@@ -208,6 +229,19 @@ int journal_file_append_entry(
                 Object **ret,
                 uint64_t *offset);
 
+typedef struct JournalEntry {
+        const struct iovec *iovec;
+        unsigned n_iovec;
+} JournalEntry;
+
+int journal_file_append_entries(
+                JournalFile *f,
+                const dual_timestamp *ts,
+                const sd_id128_t *boot_id,
+                const JournalEntry entries[], size_t n_entries,
+                uint64_t *seqno,
+                size_t *ret_n_appended);
+
 int journal_file_find_data_object(JournalFile *f, const void *data, uint64_t size, Object **ret, uint64_t *offset);
 int journal_file_find_data_object_with_hash(JournalFile *f, const void *data, uint64_t size, uint64_t hash, Object **ret, uint64_t *offset);
 
@@ -232,10 +266,21 @@ int journal_file_move_to_entry_by_monotonic_for_data(JournalFile *f, uint64_t da
 
 int journal_file_copy_entry(JournalFile *from, JournalFile *to, Object *o, uint64_t p);
 
+int journal_file_load_dictionary(JournalFile *f);
+
+int journal_file_append_field_index(JournalFile *f);
+int journal_file_finish_indexing(JournalFile *f, bool wait);
+int journal_file_find_field_index(JournalFile *f, const void *field, uint64_t size, Object **ret, uint64_t *offset);
+int journal_file_field_index_next_item(Object *o, uint64_t *pos, FieldIndexItem **ret);
+
+int journal_file_append_bloom_filter(JournalFile *f);
+int journal_file_bloom_filter_test(JournalFile *f, uint64_t hash);
+
 void journal_file_dump(JournalFile *f);
 void journal_file_print_header(JournalFile *f);
 
-int journal_file_rotate(JournalFile **f, bool compress, uint64_t compress_threshold_bytes, bool seal, Set *deferred_closes);
+int journal_file_archived_path(JournalFile *f, char **ret);
+int journal_file_rotate(JournalFile **f, int compress, uint64_t compress_threshold_bytes, bool seal, Set *deferred_closes);
 
 void journal_file_post_change(JournalFile *f);
 int journal_file_enable_post_change_timer(JournalFile *f, sd_event *e, usec_t t);
@@ -253,5 +298,18 @@ int journal_file_map_field_hash_table(JournalFile *f);
 
 static inline bool JOURNAL_FILE_COMPRESS(JournalFile *f) {
         assert(f);
-        return f->compress_xz || f->compress_lz4;
+        return f->compress_xz || f->compress_lz4 || f->compress_zstd;
+}
+
+static inline int JOURNAL_FILE_COMPRESSION(JournalFile *f) {
+        assert(f);
+
+        /* Returns the OBJECT_COMPRESSED_* flag of the algorithm new data objects are compressed with, or 0 */
+        if (f->compress_zstd)
+                return OBJECT_COMPRESSED_ZSTD;
+        if (f->compress_lz4)
+                return OBJECT_COMPRESSED_LZ4;
+        if (f->compress_xz)
+                return OBJECT_COMPRESSED_XZ;
+        return 0;
 }
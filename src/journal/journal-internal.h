@@ -11,6 +11,8 @@
 #include "hashmap.h"
 #include "journal-def.h"
 #include "journal-file.h"
+#include "journal-lookahead.h"
+#include "journal-time-index.h"
 #include "list.h"
 #include "set.h"
 
@@ -62,6 +64,8 @@ struct Directory {
         int wd;
         bool is_root;
         unsigned last_seen_generation;
+
+        Hashmap *time_ranges; /* file name → JournalTimeRange, only loaded if we have a time window */
 };
 
 struct sd_journal {
@@ -92,6 +96,10 @@ struct sd_journal {
         char *unique_field;
         JournalFile *unique_file;
         uint64_t unique_offset;
+        uint64_t unique_index_offset; /* Field index object of unique_file, if it has one. In that case
+                                       * unique_offset is the position within it */
+        Set *unique_values;           /* Values we found in field indexes so far... */
+        Set *unique_unindexed_files;  /* ...and the files we enumerated without one */
 
         /* Iterating through known fields */
         JournalFile *fields_file;
@@ -119,10 +127,24 @@ struct sd_journal {
         Hashmap *directories_by_wd;
 
         Hashmap *errors;
+
+        /* Worker threads looking for the next matching entries of archived files ahead of time */
+        unsigned n_lookahead_threads;
+        LookaheadPool *lookahead_pool;
+        Hashmap *lookaheads; /* JournalFile → FileLookahead */
+
+        /* Archived files without entries in this time window are not opened, see journal_open_time_window() */
+        usec_t window_since;
+        usec_t window_until;
+        JournalTimeRange skipped_range; /* covered by the files we didn't open because of that */
 };
 
 char *journal_make_match_string(sd_journal *j);
+void journal_set_lookahead_threads(sd_journal *j, unsigned n);
+int journal_open_time_window(sd_journal **ret, const char *path, int flags, usec_t since, usec_t until);
 void journal_print_header(sd_journal *j);
+int journal_peek_data(sd_journal *j, sd_id128_t *ret_file_id, uint64_t *ret_offset);
+void journal_skip_data(sd_journal *j);
 
 #define JOURNAL_FOREACH_DATA_RETVAL(j, data, l, retval)                     \
         for (sd_journal_restart_data(j); ((retval) = sd_journal_enumerate_data((j), &(data), &(l))) > 0; )
@@ -0,0 +1,330 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "alloc-util.h"
+#include "journal-lookahead.h"
+#include "list.h"
+#include "macro.h"
+#include "process-util.h"
+
+/* How many offsets we compute ahead per stream at most. After a (re)start only a single offset is computed,
+ * and the window is doubled each time the owner catches up with it, much like file readahead. This way we
+ * don't waste time on files of which just the first match is needed, e.g. for "journalctl -n". */
+#define LOOKAHEAD_MAX 256U
+
+struct Lookahead {
+        LookaheadPool *pool;
+
+        lookahead_step_t step;
+        void *userdata;
+
+        uint64_t offsets[LOOKAHEAD_MAX];
+        size_t head;
+        size_t n;
+        size_t window; /* how many offsets to compute ahead */
+        int error; /* why the stream ended, if it did */
+
+        bool ended:1;
+        bool queued:1;   /* waiting for a worker */
+        bool running:1;  /* a worker is calling step() */
+        bool stopping:1; /* the owner waits for the worker to let go */
+
+        LIST_FIELDS(Lookahead, queue);
+};
+
+struct LookaheadPool {
+        pthread_mutex_t mutex;
+        pthread_cond_t work; /* signalled when a stream was queued, or we shall quit */
+        pthread_cond_t done; /* signalled when the stream we wait for made progress */
+
+        LIST_HEAD(Lookahead, queue);
+        Lookahead *waiting; /* the stream the owner waits for */
+
+        bool quit;
+        pid_t pid;
+
+        size_t n_threads;
+        pthread_t threads[];
+};
+
+static void lookahead_enqueue(Lookahead *l, bool urgent) {
+        assert(l);
+        assert(!l->queued);
+        assert(!l->running);
+
+        /* Must be called with the mutex held. Streams are picked up in the order they were queued, which is
+         * the order in which we are going to ask for their results, except for those the owner is already
+         * blocked on. */
+
+        if (urgent)
+                LIST_PREPEND(queue, l->pool->queue, l);
+        else
+                LIST_APPEND(queue, l->pool->queue, l);
+        l->queued = true;
+
+        assert_se(pthread_cond_signal(&l->pool->work) == 0);
+}
+
+static void* lookahead_thread(void *arg) {
+        LookaheadPool *p = arg;
+
+        (void) pthread_setname_np(pthread_self(), "journal-search");
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+        for (;;) {
+                Lookahead *l;
+
+                while (!p->quit && !p->queue)
+                        assert_se(pthread_cond_wait(&p->work, &p->mutex) == 0);
+
+                if (p->quit)
+                        break;
+
+                l = p->queue;
+                LIST_REMOVE(queue, p->queue, l);
+                l->queued = false;
+                l->running = true;
+
+                while (!l->stopping && !l->ended && l->n < l->window) {
+                        uint64_t offset = 0;
+                        int r;
+
+                        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+                        r = l->step(l->userdata, &offset);
+                        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+                        if (l->stopping)
+                                break;
+
+                        if (r > 0) {
+                                l->offsets[(l->head + l->n) % LOOKAHEAD_MAX] = offset;
+                                l->n++;
+                        } else {
+                                l->ended = true;
+                                l->error = r;
+                        }
+
+                        if (p->waiting == l)
+                                assert_se(pthread_cond_broadcast(&p->done) == 0);
+                }
+
+                l->running = false;
+                assert_se(pthread_cond_broadcast(&p->done) == 0);
+        }
+
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        return NULL;
+}
+
+int lookahead_pool_new(unsigned n_threads, LookaheadPool **ret) {
+        _cleanup_free_ LookaheadPool *p = NULL;
+        sigset_t ss, saved_ss;
+        int r = 0;
+
+        assert(n_threads > 0);
+        assert(ret);
+
+        p = malloc0(offsetof(LookaheadPool, threads) + n_threads * sizeof(pthread_t));
+        if (!p)
+                return -ENOMEM;
+
+        p->pid = getpid_cached();
+
+        assert_se(pthread_mutex_init(&p->mutex, NULL) == 0);
+        assert_se(pthread_cond_init(&p->work, NULL) == 0);
+        assert_se(pthread_cond_init(&p->done, NULL) == 0);
+
+        /* Signals are the business of the thread that called us, except for SIGBUS, which is synchronous and
+         * must reach the thread that touched the mapping. */
+        if (sigfillset(&ss) < 0 ||
+            sigdelset(&ss, SIGBUS) < 0)
+                return -errno;
+
+        r = pthread_sigmask(SIG_BLOCK, &ss, &saved_ss);
+        if (r > 0)
+                return -r;
+
+        for (; p->n_threads < n_threads; p->n_threads++) {
+                r = pthread_create(p->threads + p->n_threads, NULL, lookahead_thread, p);
+                if (r > 0)
+                        break;
+        }
+
+        (void) pthread_sigmask(SIG_SETMASK, &saved_ss, NULL);
+
+        if (r > 0) {
+                lookahead_pool_free(TAKE_PTR(p));
+                return -r;
+        }
+
+        *ret = TAKE_PTR(p);
+        return 0;
+}
+
+LookaheadPool* lookahead_pool_free(LookaheadPool *p) {
+        size_t i;
+
+        if (!p)
+                return NULL;
+
+        /* After a fork() the threads are gone, and so might be whoever held the mutex */
+        if (p->pid != getpid_cached())
+                return mfree(p);
+
+        assert(!p->queue);
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+        p->quit = true;
+        assert_se(pthread_cond_broadcast(&p->work) == 0);
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        for (i = 0; i < p->n_threads; i++)
+                assert_se(pthread_join(p->threads[i], NULL) == 0);
+
+        pthread_cond_destroy(&p->done);
+        pthread_cond_destroy(&p->work);
+        pthread_mutex_destroy(&p->mutex);
+
+        return mfree(p);
+}
+
+int lookahead_new(LookaheadPool *p, lookahead_step_t step, void *userdata, Lookahead **ret) {
+        Lookahead *l;
+
+        assert(p);
+        assert(step);
+        assert(ret);
+
+        l = new0(Lookahead, 1);
+        if (!l)
+                return -ENOMEM;
+
+        l->pool = p;
+        l->step = step;
+        l->userdata = userdata;
+        l->ended = true;
+
+        *ret = l;
+        return 0;
+}
+
+Lookahead* lookahead_free(Lookahead *l) {
+        if (!l)
+                return NULL;
+
+        lookahead_stop(l);
+
+        return mfree(l);
+}
+
+void lookahead_start(Lookahead *l) {
+        assert(l);
+
+        /* Starts computing offsets in the background. The stream must have been stopped before, and whatever
+         * state step() works on may be set up only while it is stopped. */
+
+        assert_se(pthread_mutex_lock(&l->pool->mutex) == 0);
+
+        assert(!l->queued);
+        assert(!l->running);
+
+        l->head = l->n = 0;
+        l->window = 1;
+        l->ended = false;
+        l->error = 0;
+
+        lookahead_enqueue(l, false);
+
+        assert_se(pthread_mutex_unlock(&l->pool->mutex) == 0);
+}
+
+void lookahead_stop(Lookahead *l) {
+        LookaheadPool *p;
+
+        assert(l);
+
+        /* Drops everything computed so far, and waits until no worker thread uses the stream anymore */
+
+        p = l->pool;
+
+        /* After a fork() there's no worker thread left that could use it */
+        if (p->pid != getpid_cached())
+                return;
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+        if (l->queued) {
+                LIST_REMOVE(queue, p->queue, l);
+                l->queued = false;
+        }
+
+        if (l->running) {
+                l->stopping = true;
+                p->waiting = l;
+
+                do
+                        assert_se(pthread_cond_wait(&p->done, &p->mutex) == 0);
+                while (l->running);
+
+                p->waiting = NULL;
+                l->stopping = false;
+        }
+
+        l->head = l->n = 0;
+        l->ended = true;
+        l->error = 0;
+
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+}
+
+int lookahead_pop(Lookahead *l, uint64_t *ret) {
+        LookaheadPool *p;
+        int r;
+
+        assert(l);
+        assert(ret);
+
+        p = l->pool;
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+        while (l->n == 0 && !l->ended) {
+                /* The workers paused this stream when it was full, make sure somebody picks it up again, and
+                 * before anything else */
+                if (l->queued) {
+                        LIST_REMOVE(queue, p->queue, l);
+                        LIST_PREPEND(queue, p->queue, l);
+                } else if (!l->running) {
+                        l->window = MIN(l->window * 2, LOOKAHEAD_MAX);
+                        lookahead_enqueue(l, true);
+                }
+
+                p->waiting = l;
+                assert_se(pthread_cond_wait(&p->done, &p->mutex) == 0);
+        }
+
+        p->waiting = NULL;
+
+        if (l->n > 0) {
+                *ret = l->offsets[l->head];
+                l->head = (l->head + 1) % LOOKAHEAD_MAX;
+                l->n--;
+
+                if (!l->ended && !l->queued && !l->running && l->n <= l->window / 2) {
+                        l->window = MIN(l->window * 2, LOOKAHEAD_MAX);
+                        lookahead_enqueue(l, false);
+                }
+
+                r = 1;
+        } else
+                r = l->error;
+
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        return r;
+}
@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+#pragma once
+
+#include <inttypes.h>
+
+typedef struct LookaheadPool LookaheadPool;
+typedef struct Lookahead Lookahead;
+
+/* Called in a worker thread to compute the next offset of a stream. Returns > 0 and the offset if there is
+ * one, 0 at the end of the stream, or a negative errno, which also ends the stream. A stream's step function
+ * is never called concurrently with itself. */
+typedef int (*lookahead_step_t)(void *userdata, uint64_t *ret);
+
+int lookahead_pool_new(unsigned n_threads, LookaheadPool **ret);
+LookaheadPool* lookahead_pool_free(LookaheadPool *p);
+
+int lookahead_new(LookaheadPool *p, lookahead_step_t step, void *userdata, Lookahead **ret);
+Lookahead* lookahead_free(Lookahead *l);
+
+void lookahead_start(Lookahead *l);
+void lookahead_stop(Lookahead *l);
+int lookahead_pop(Lookahead *l, uint64_t *ret);
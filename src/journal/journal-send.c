@@ -16,6 +16,7 @@
 #include "fd-util.h"
 #include "fileio.h"
 #include "io-util.h"
+#include "journal-importer.h"
 #include "memfd-util.h"
 #include "socket-util.h"
 #include "stdio-util.h"
@@ -277,16 +278,21 @@ _public_ int sd_journal_sendv(const struct iovec *iov, int n) {
         mh.msg_iov = w;
         mh.msg_iovlen = j;
 
-        k = sendmsg(fd, &mh, MSG_NOSIGNAL);
-        if (k >= 0)
-                return 0;
+        /* journald receives datagrams of any size we can send, but only keeps NATIVE_DATAGRAM_SIZE_MAX of each
+         * batch buffer resident. Larger datagrams fault in pages that are given back right after, hence pass those
+         * in a memfd right away, which also saves copying them through the socket buffers. */
+        if (IOVEC_TOTAL_SIZE(w, j) < NATIVE_DATAGRAM_SIZE_MAX) {
+                k = sendmsg(fd, &mh, MSG_NOSIGNAL);
+                if (k >= 0)
+                        return 0;
 
-        /* Fail silently if the journal is not available */
-        if (errno == ENOENT)
-                return 0;
+                /* Fail silently if the journal is not available */
+                if (errno == ENOENT)
+                        return 0;
 
-        if (!IN_SET(errno, EMSGSIZE, ENOBUFS))
-                return -errno;
+                if (!IN_SET(errno, EMSGSIZE, ENOBUFS))
+                        return -errno;
+        }
 
         /* Message doesn't fit... Let's dump the data in a memfd or
          * temporary file and just pass a file descriptor of it to the
@@ -0,0 +1,211 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "alloc-util.h"
+#include "def.h"
+#include "extract-word.h"
+#include "fd-util.h"
+#include "fileio.h"
+#include "fs-util.h"
+#include "journal-time-index.h"
+#include "parse-util.h"
+#include "path-util.h"
+#include "string-util.h"
+
+/* The index is a text file with one line per archived journal file in the same directory, naming the file and the
+ * realtime timestamps of its first and last entry. Lines are only ever appended, with a single write() each, so
+ * that concurrent writers don't get into each other's way, and the whole file is only rewritten when vacuuming. */
+
+static int parse_line(const char *line, char **ret_filename, JournalTimeRange *ret_range) {
+        _cleanup_free_ char *filename = NULL, *head = NULL, *tail = NULL;
+        JournalTimeRange range;
+        const char *p = line;
+        int r;
+
+        assert(line);
+        assert(ret_filename);
+        assert(ret_range);
+
+        r = extract_many_words(&p, NULL, 0, &filename, &head, &tail, NULL);
+        if (r < 0)
+                return r;
+        if (r != 3 || !isempty(p))
+                return -EBADMSG;
+
+        if (!filename_is_valid(filename) || !endswith(filename, ".journal"))
+                return -EBADMSG;
+
+        if (safe_atou64(head, &range.head_realtime) < 0 ||
+            safe_atou64(tail, &range.tail_realtime) < 0 ||
+            range.head_realtime > range.tail_realtime)
+                return -EBADMSG;
+
+        *ret_filename = TAKE_PTR(filename);
+        *ret_range = range;
+        return 0;
+}
+
+int journal_time_index_add(const char *path, const JournalTimeRange *range) {
+        _cleanup_free_ char *dir = NULL, *line = NULL;
+        _cleanup_close_ int fd = -1;
+        const char *fn, *p;
+        size_t l;
+        ssize_t n;
+
+        assert(path);
+        assert(range);
+
+        /* Records the time range of the archived journal file at path, in the index of its directory */
+
+        fn = basename(path);
+        if (!filename_is_valid(fn) || strpbrk(fn, WHITESPACE))
+                return -EINVAL;
+
+        if (range->head_realtime > range->tail_realtime)
+                return -EINVAL;
+
+        dir = dirname_malloc(path);
+        if (!dir)
+                return -ENOMEM;
+
+        if (asprintf(&line, "%s " USEC_FMT " " USEC_FMT "\n", fn, range->head_realtime, range->tail_realtime) < 0)
+                return -ENOMEM;
+
+        p = strjoina(dir, "/" JOURNAL_TIME_INDEX);
+        fd = open(p, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC|O_NOCTTY, 0640);
+        if (fd < 0)
+                return -errno;
+
+        l = strlen(line);
+        n = write(fd, line, l);
+        if (n < 0)
+                return -errno;
+        if ((size_t) n != l)
+                return -EIO;
+
+        return 0;
+}
+
+int journal_time_index_load(int dir_fd, Hashmap **ret) {
+        _cleanup_hashmap_free_free_free_ Hashmap *h = NULL;
+        _cleanup_fclose_ FILE *f = NULL;
+        int fd, r;
+
+        assert(dir_fd >= 0 || dir_fd == AT_FDCWD);
+        assert(ret);
+
+        /* Returns a hashmap from file names to JournalTimeRange */
+
+        fd = openat(dir_fd, JOURNAL_TIME_INDEX, O_RDONLY|O_CLOEXEC|O_NOCTTY);
+        if (fd < 0)
+                return -errno;
+
+        f = fdopen(fd, "re");
+        if (!f) {
+                safe_close(fd);
+                return -errno;
+        }
+
+        h = hashmap_new(&string_hash_ops);
+        if (!h)
+                return -ENOMEM;
+
+        for (;;) {
+                _cleanup_free_ char *line = NULL, *filename = NULL;
+                _cleanup_free_ JournalTimeRange *range = NULL;
+
+                r = read_line(f, LONG_LINE_MAX, &line);
+                if (r < 0)
+                        return r;
+                if (r == 0)
+                        break;
+
+                range = new(JournalTimeRange, 1);
+                if (!range)
+                        return -ENOMEM;
+
+                if (parse_line(line, &filename, range) < 0)
+                        continue;
+
+                /* File names are never reused, hence any duplicate says the same */
+                if (hashmap_contains(h, filename))
+                        continue;
+
+                r = hashmap_put(h, filename, range);
+                if (r < 0)
+                        return r;
+
+                filename = NULL;
+                range = NULL;
+        }
+
+        *ret = TAKE_PTR(h);
+        return 0;
+}
+
+int journal_time_index_prune(const char *directory) {
+        _cleanup_(unlink_and_freep) char *temp = NULL;
+        _cleanup_fclose_ FILE *f = NULL, *t = NULL;
+        _cleanup_close_ int dir_fd = -1;
+        bool changed = false;
+        const char *p;
+        int r;
+
+        assert(directory);
+
+        /* Drops the lines of files that are gone. Returns > 0 if there were any. */
+
+        dir_fd = open(directory, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if (dir_fd < 0)
+                return -errno;
+
+        p = strjoina(directory, "/" JOURNAL_TIME_INDEX);
+        f = fopen(p, "re");
+        if (!f)
+                return errno == ENOENT ? 0 : -errno;
+
+        r = fopen_temporary(p, &t, &temp);
+        if (r < 0)
+                return r;
+
+        if (fchmod(fileno(t), 0640) < 0)
+                return -errno;
+
+        for (;;) {
+                _cleanup_free_ char *line = NULL, *filename = NULL;
+                JournalTimeRange range;
+
+                r = read_line(f, LONG_LINE_MAX, &line);
+                if (r < 0)
+                        return r;
+                if (r == 0)
+                        break;
+
+                if (parse_line(line, &filename, &range) < 0 ||
+                    (faccessat(dir_fd, filename, F_OK, 0) < 0 && errno == ENOENT)) {
+                        changed = true;
+                        continue;
+                }
+
+                fputs(line, t);
+                fputc('\n', t);
+        }
+
+        if (!changed)
+                return 0;
+
+        r = fflush_and_check(t);
+        if (r < 0)
+                return r;
+
+        if (rename(temp, p) < 0)
+                return -errno;
+
+        temp = mfree(temp);
+        return 1;
+}
@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+#pragma once
+
+#include "hashmap.h"
+#include "time-util.h"
+
+/* Archived journal files never change, hence the time range they cover is recorded once, when they are archived,
+ * in a small index file next to them. Readers interested in a specific time window may then skip files that are
+ * wholly outside of it without opening them. The index is only ever a hint: files it doesn't know are opened and
+ * looked at as usual, hence it's fine to lose entries, e.g. to a race between rotation and vacuuming. */
+
+#define JOURNAL_TIME_INDEX ".time-ranges"
+
+typedef struct JournalTimeRange {
+        usec_t head_realtime;
+        usec_t tail_realtime;
+} JournalTimeRange;
+
+int journal_time_index_add(const char *path, const JournalTimeRange *range);
+int journal_time_index_load(int dir_fd, Hashmap **ret);
+int journal_time_index_prune(const char *directory);
+
+static inline bool journal_time_range_overlaps(const JournalTimeRange *range, usec_t since, usec_t until) {
+        return range->tail_realtime >= since && range->head_realtime <= until;
+}
@@ -7,17 +7,24 @@
 #include "sd-id128.h"
 
 #include "alloc-util.h"
+#include "async.h"
 #include "dirent-util.h"
 #include "fd-util.h"
 #include "fs-util.h"
 #include "journal-def.h"
 #include "journal-file.h"
+#include "journal-time-index.h"
 #include "journal-vacuum.h"
 #include "parse-util.h"
 #include "string-util.h"
+#include "strv.h"
 #include "util.h"
 #include "xattr-util.h"
 
+/* Vacuuming picks the oldest archived files of a directory until the limits are met. Instead of reading the whole
+ * directory every time, journald keeps the list of archived files ordered by age around, tells it about the files it
+ * archives, and only reads the directory again when somebody else changed it. */
+
 struct vacuum_info {
         uint64_t usage;
         char *filename;
@@ -59,7 +66,7 @@ static void patch_realtime(
                 int fd,
                 const char *fn,
                 const struct stat *st,
-                unsigned long long *realtime) {
+                usec_t *realtime) {
 
         usec_t x, crtime = 0;
 
@@ -126,209 +133,520 @@ static int journal_file_empty(int dir_fd, const char *name) {
         return le64toh(n_entries) <= 0;
 }
 
-int journal_directory_vacuum(
-                const char *directory,
-                uint64_t max_use,
-                uint64_t n_max_files,
-                usec_t max_retention_usec,
-                usec_t *oldest_usec,
-                bool verbose) {
+struct JournalVacuumPlan {
+        char *directory;
+        bool async; /* whether to release the space of deleted files in a thread of its own */
+
+        struct vacuum_info *list; /* archived and corrupted files, oldest first */
+        size_t n_list, n_allocated;
+        uint64_t sum; /* disk usage of the files in the list */
+
+        char **active; /* journal files that are not to be vacuumed, i.e. those in use */
+
+        /* Modification time of the directory when the plan was last in sync with it, USEC_INFINITY if never */
+        usec_t mtime;
+};
+
+int journal_vacuum_plan_new(const char *directory, bool async, JournalVacuumPlan **ret) {
+        _cleanup_(journal_vacuum_plan_freep) JournalVacuumPlan *p = NULL;
+
+        assert(directory);
+        assert(ret);
+
+        p = new0(JournalVacuumPlan, 1);
+        if (!p)
+                return -ENOMEM;
+
+        p->directory = strdup(directory);
+        if (!p->directory)
+                return -ENOMEM;
+
+        p->async = async;
+        p->mtime = USEC_INFINITY;
+
+        *ret = TAKE_PTR(p);
+        return 0;
+}
+
+static void vacuum_plan_clear(JournalVacuumPlan *p) {
+        size_t i;
+
+        assert(p);
+
+        for (i = 0; i < p->n_list; i++)
+                free(p->list[i].filename);
+
+        p->n_list = 0;
+        p->sum = 0;
+        p->active = strv_free(p->active);
+        p->mtime = USEC_INFINITY;
+}
+
+JournalVacuumPlan* journal_vacuum_plan_free(JournalVacuumPlan *p) {
+        if (!p)
+                return NULL;
+
+        vacuum_plan_clear(p);
+
+        free(p->list);
+        free(p->directory);
+        return mfree(p);
+}
+
+static int vacuum_info_parse(char *name, struct vacuum_info *ret) {
+        unsigned long long seqnum = 0, realtime;
+        sd_id128_t seqnum_id = {};
+        bool have_seqnum;
+        size_t q;
+
+        assert(name);
+        assert(ret);
+
+        /* Returns > 0 for files that may be vacuumed, 0 for active files, and -EINVAL for files we don't know. The
+         * name is clobbered while parsing it. */
+
+        q = strlen(name);
+
+        if (endswith(name, ".journal")) {
+
+                /* Vacuum archived files. Active files are
+                 * left around */
+
+                if (q < 1 + 32 + 1 + 16 + 1 + 16 + 8)
+                        return 0;
+
+                if (name[q-8-16-1] != '-' ||
+                    name[q-8-16-1-16-1] != '-' ||
+                    name[q-8-16-1-16-1-32-1] != '@')
+                        return 0;
+
+                name[q-8-16-1-16-1] = 0;
+                if (sd_id128_from_string(name + q-8-16-1-16-1-32, &seqnum_id) < 0)
+                        return 0;
+
+                if (sscanf(name + q-8-16-1-16, "%16llx-%16llx.journal", &seqnum, &realtime) != 2)
+                        return 0;
+
+                have_seqnum = true;
+
+        } else if (endswith(name, ".journal~")) {
+                unsigned long long tmp;
+
+                /* Vacuum corrupted files */
+
+                if (q < 1 + 16 + 1 + 16 + 8 + 1)
+                        return 0;
+
+                if (name[q-1-8-16-1] != '-' ||
+                    name[q-1-8-16-1-16-1] != '@')
+                        return 0;
+
+                if (sscanf(name + q-1-8-16-1-16, "%16llx-%16llx.journal~", &realtime, &tmp) != 2)
+                        return 0;
+
+                have_seqnum = false;
+        } else
+                return -EINVAL;
 
+        *ret = (struct vacuum_info) {
+                .realtime = realtime,
+                .seqnum_id = seqnum_id,
+                .seqnum = seqnum,
+                .have_seqnum = have_seqnum,
+        };
+
+        return 1;
+}
+
+static int vacuum_plan_add_file(JournalVacuumPlan *p, int dir_fd, const char *name, bool verbose, uint64_t *freed) {
+        _cleanup_free_ char *copy = NULL;
+        struct vacuum_info info;
+        struct stat st;
+        int r;
+
+        assert(p);
+        assert(dir_fd >= 0);
+        assert(name);
+        assert(freed);
+
+        /* Appends the file to the list if it may be vacuumed, the caller needs to restore the order */
+
+        if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                log_debug_errno(errno, "Failed to stat file %s while vacuuming, ignoring: %m", name);
+                return 0;
+        }
+
+        if (!S_ISREG(st.st_mode))
+                return 0;
+
+        copy = strdup(name);
+        if (!copy)
+                return -ENOMEM;
+
+        r = vacuum_info_parse(copy, &info);
+        if (r == -EINVAL) {
+                /* We do not vacuum unknown files! */
+                log_debug("Not vacuuming unknown file %s.", name);
+                return 0;
+        }
+        if (r == 0)
+                return strv_extend(&p->active, name);
+
+        info.usage = 512UL * (uint64_t) st.st_blocks;
+
+        r = journal_file_empty(dir_fd, name);
+        if (r < 0) {
+                log_debug_errno(r, "Failed check if %s is empty, ignoring: %m", name);
+                return 0;
+        }
+        if (r > 0) {
+                char sbytes[FORMAT_BYTES_MAX];
+
+                /* Always vacuum empty non-online files. */
+
+                r = unlinkat_deallocate(dir_fd, name, 0);
+                if (r >= 0) {
+
+                        log_full(verbose ? LOG_INFO : LOG_DEBUG,
+                                 "Deleted empty archived journal %s/%s (%s).", p->directory, name, format_bytes(sbytes, sizeof(sbytes), info.usage));
+
+                        *freed += info.usage;
+                } else if (r != -ENOENT)
+                        log_warning_errno(r, "Failed to delete empty archived journal %s/%s: %m", p->directory, name);
+
+                return 0;
+        }
+
+        patch_realtime(dir_fd, name, &st, &info.realtime);
+
+        if (!GREEDY_REALLOC(p->list, p->n_allocated, p->n_list + 1))
+                return -ENOMEM;
+
+        strcpy(copy, name);
+        info.filename = TAKE_PTR(copy);
+
+        p->list[p->n_list++] = info;
+        p->sum += info.usage;
+
+        return 1;
+}
+
+static int vacuum_plan_sync(JournalVacuumPlan *p, int dir_fd) {
+        struct stat st;
+
+        assert(p);
+        assert(dir_fd >= 0);
+
+        /* Remembers that the plan agrees with the directory as it is now */
+
+        if (fstat(dir_fd, &st) < 0)
+                return -errno;
+
+        p->mtime = timespec_load(&st.st_mtim);
+        return 0;
+}
+
+static int vacuum_plan_refresh(JournalVacuumPlan *p, int dir_fd, bool verbose, uint64_t *freed) {
         _cleanup_closedir_ DIR *d = NULL;
-        struct vacuum_info *list = NULL;
-        unsigned n_list = 0, i, n_active_files = 0;
-        size_t n_allocated = 0;
-        uint64_t sum = 0, freed = 0;
-        usec_t retention_limit = 0;
-        char sbytes[FORMAT_BYTES_MAX];
         struct dirent *de;
+        struct stat st;
         int r;
 
-        assert(directory);
+        assert(p);
+        assert(dir_fd >= 0);
+        assert(freed);
 
-        if (max_use <= 0 && max_retention_usec <= 0 && n_max_files <= 0)
+        if (fstat(dir_fd, &st) < 0)
+                return -errno;
+
+        if (p->mtime != USEC_INFINITY && p->mtime == timespec_load(&st.st_mtim))
                 return 0;
 
-        if (max_retention_usec > 0) {
-                retention_limit = now(CLOCK_REALTIME);
-                if (retention_limit > max_retention_usec)
-                        retention_limit -= max_retention_usec;
-                else
-                        max_retention_usec = retention_limit = 0;
-        }
+        log_debug("Reading %s for vacuuming.", p->directory);
 
-        d = opendir(directory);
+        vacuum_plan_clear(p);
+
+        d = opendir(p->directory);
         if (!d)
                 return -errno;
 
-        FOREACH_DIRENT_ALL(de, d, r = -errno; goto finish) {
+        FOREACH_DIRENT_ALL(de, d, return -errno) {
+                r = vacuum_plan_add_file(p, dir_fd, de->d_name, verbose, freed);
+                if (r < 0) {
+                        vacuum_plan_clear(p);
+                        return r;
+                }
+        }
 
-                unsigned long long seqnum = 0, realtime;
-                _cleanup_free_ char *p = NULL;
-                sd_id128_t seqnum_id;
-                bool have_seqnum;
-                uint64_t size;
-                struct stat st;
-                size_t q;
+        qsort_safe(p->list, p->n_list, sizeof(struct vacuum_info), vacuum_compare);
 
-                if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
-                        log_debug_errno(errno, "Failed to stat file %s while vacuuming, ignoring: %m", de->d_name);
-                        continue;
-                }
+        /* The time of before reading the directory, so that changes made meanwhile make us read it again */
+        p->mtime = timespec_load(&st.st_mtim);
 
-                if (!S_ISREG(st.st_mode))
-                        continue;
+        return 1;
+}
 
-                q = strlen(de->d_name);
+static int vacuum_plan_open_directory(JournalVacuumPlan *p) {
+        int fd;
 
-                if (endswith(de->d_name, ".journal")) {
+        assert(p);
 
-                        /* Vacuum archived files. Active files are
-                         * left around */
+        fd = open(p->directory, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if (fd < 0)
+                return -errno;
 
-                        if (q < 1 + 32 + 1 + 16 + 1 + 16 + 8) {
-                                n_active_files++;
-                                continue;
-                        }
+        return fd;
+}
 
-                        if (de->d_name[q-8-16-1] != '-' ||
-                            de->d_name[q-8-16-1-16-1] != '-' ||
-                            de->d_name[q-8-16-1-16-1-32-1] != '@') {
-                                n_active_files++;
-                                continue;
-                        }
+int journal_vacuum_plan_validate(JournalVacuumPlan *p) {
+        struct stat st;
 
-                        p = strdup(de->d_name);
-                        if (!p) {
-                                r = -ENOMEM;
-                                goto finish;
-                        }
+        assert(p);
 
-                        de->d_name[q-8-16-1-16-1] = 0;
-                        if (sd_id128_from_string(de->d_name + q-8-16-1-16-1-32, &seqnum_id) < 0) {
-                                n_active_files++;
-                                continue;
-                        }
+        /* Drops what the plan knows unless it is in sync with the directory. To be called before changing the
+         * directory in a way that is then reported with journal_vacuum_plan_add(), since that can't tell our own
+         * changes from those of others anymore. */
 
-                        if (sscanf(de->d_name + q-8-16-1-16, "%16llx-%16llx.journal", &seqnum, &realtime) != 2) {
-                                n_active_files++;
-                                continue;
-                        }
+        if (p->mtime == USEC_INFINITY)
+                return 0;
 
-                        have_seqnum = true;
+        if (stat(p->directory, &st) >= 0 && p->mtime == timespec_load(&st.st_mtim))
+                return 1;
 
-                } else if (endswith(de->d_name, ".journal~")) {
-                        unsigned long long tmp;
+        vacuum_plan_clear(p);
+        return 0;
+}
 
-                        /* Vacuum corrupted files */
+int journal_vacuum_plan_add(JournalVacuumPlan *p, const char *name) {
+        _cleanup_close_ int dir_fd = -1;
+        uint64_t freed = 0;
+        size_t i;
+        int r;
 
-                        if (q < 1 + 16 + 1 + 16 + 8 + 1) {
-                                n_active_files++;
-                                continue;
-                        }
+        assert(p);
+        assert(name);
 
-                        if (de->d_name[q-1-8-16-1] != '-' ||
-                            de->d_name[q-1-8-16-1-16-1] != '@') {
-                                n_active_files++;
-                                continue;
-                        }
+        /* Tells the plan about a file that was just archived in the directory, so that it doesn't have to read the
+         * directory again. Unless it wasn't in sync with the directory before, see journal_vacuum_plan_validate(). */
 
-                        p = strdup(de->d_name);
-                        if (!p) {
-                                r = -ENOMEM;
-                                goto finish;
-                        }
+        if (p->mtime == USEC_INFINITY)
+                return 0;
 
-                        if (sscanf(de->d_name + q-1-8-16-1-16, "%16llx-%16llx.journal~", &realtime, &tmp) != 2) {
-                                n_active_files++;
-                                continue;
-                        }
+        dir_fd = vacuum_plan_open_directory(p);
+        if (dir_fd < 0)
+                return dir_fd;
 
-                        have_seqnum = false;
-                } else {
-                        /* We do not vacuum unknown files! */
-                        log_debug("Not vacuuming unknown file %s.", de->d_name);
-                        continue;
-                }
+        r = vacuum_plan_add_file(p, dir_fd, name, false, &freed);
+        if (r < 0)
+                return r;
+        if (r > 0)
+                /* Usually the file is the most recent one, and stays where it is */
+                for (i = p->n_list - 1; i > 0 && vacuum_compare(&p->list[i-1], &p->list[i]) > 0; i--)
+                        SWAP_TWO(p->list[i-1], p->list[i]);
 
-                size = 512UL * (uint64_t) st.st_blocks;
+        return vacuum_plan_sync(p, dir_fd);
+}
 
-                r = journal_file_empty(dirfd(d), p);
-                if (r < 0) {
-                        log_debug_errno(r, "Failed check if %s is empty, ignoring: %m", p);
-                        continue;
-                }
-                if (r > 0) {
-                        /* Always vacuum empty non-online files. */
+int journal_vacuum_plan_get_usage(JournalVacuumPlan *p, uint64_t *ret) {
+        _cleanup_close_ int dir_fd = -1;
+        uint64_t freed = 0, sum;
+        char **i;
+        int r;
+
+        assert(p);
+        assert(ret);
 
-                        r = unlinkat_deallocate(dirfd(d), p, 0);
-                        if (r >= 0) {
+        /* Returns the disk usage of all journal files in the directory. Only the active files are looked at, since
+         * the size of the others doesn't change anymore. */
 
-                                log_full(verbose ? LOG_INFO : LOG_DEBUG,
-                                         "Deleted empty archived journal %s/%s (%s).", directory, p, format_bytes(sbytes, sizeof(sbytes), size));
+        dir_fd = vacuum_plan_open_directory(p);
+        if (dir_fd < 0)
+                return dir_fd;
 
-                                freed += size;
-                        } else if (r != -ENOENT)
-                                log_warning_errno(r, "Failed to delete empty archived journal %s/%s: %m", directory, p);
+        r = vacuum_plan_refresh(p, dir_fd, false, &freed);
+        if (r < 0)
+                return r;
+        if (freed > 0) {
+                r = vacuum_plan_sync(p, dir_fd);
+                if (r < 0)
+                        return r;
+        }
 
+        sum = p->sum;
+
+        STRV_FOREACH(i, p->active) {
+                struct stat st;
+
+                if (fstatat(dir_fd, *i, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                        log_debug_errno(errno, "Failed to stat %s/%s, ignoring: %m", p->directory, *i);
                         continue;
                 }
 
-                patch_realtime(dirfd(d), p, &st, &realtime);
+                sum += 512UL * (uint64_t) st.st_blocks;
+        }
 
-                if (!GREEDY_REALLOC(list, n_allocated, n_list + 1)) {
-                        r = -ENOMEM;
-                        goto finish;
-                }
+        *ret = sum;
+        return 0;
+}
 
-                list[n_list].filename = TAKE_PTR(p);
-                list[n_list].usage = size;
-                list[n_list].seqnum = seqnum;
-                list[n_list].realtime = realtime;
-                list[n_list].seqnum_id = seqnum_id;
-                list[n_list].have_seqnum = have_seqnum;
-                n_list++;
+static void* deallocate_thread(void *p) {
+        int *fds = p;
+        size_t i;
 
-                sum += size;
+        for (i = 0; fds[i] >= 0; i++) {
+                (void) fd_deallocate(fds[i]);
+                safe_close(fds[i]);
         }
 
-        qsort_safe(list, n_list, sizeof(struct vacuum_info), vacuum_compare);
+        free(fds);
+        return NULL;
+}
 
-        for (i = 0; i < n_list; i++) {
+int journal_vacuum_plan_execute(
+                JournalVacuumPlan *p,
+                uint64_t max_use,
+                uint64_t n_max_files,
+                usec_t max_retention_usec,
+                usec_t *oldest_usec,
+                bool verbose) {
+
+        _cleanup_close_ int dir_fd = -1;
+        _cleanup_free_ int *fds = NULL;
+        size_t n_fds = 0, n_fds_allocated = 0, i, j;
+        unsigned n_active_files;
+        uint64_t freed = 0;
+        usec_t retention_limit = 0;
+        char sbytes[FORMAT_BYTES_MAX];
+        int r;
+
+        assert(p);
+
+        if (max_use <= 0 && max_retention_usec <= 0 && n_max_files <= 0)
+                return 0;
+
+        if (max_retention_usec > 0) {
+                retention_limit = now(CLOCK_REALTIME);
+                if (retention_limit > max_retention_usec)
+                        retention_limit -= max_retention_usec;
+                else
+                        max_retention_usec = retention_limit = 0;
+        }
+
+        dir_fd = vacuum_plan_open_directory(p);
+        if (dir_fd < 0)
+                return dir_fd;
+
+        r = vacuum_plan_refresh(p, dir_fd, verbose, &freed);
+        if (r < 0)
+                goto finish;
+
+        n_active_files = strv_length(p->active);
+
+        /* Files that we failed to delete are kept, and moved to the front, in order */
+        for (i = 0, j = 0; i < p->n_list; i++) {
+                struct vacuum_info *v = p->list + i;
                 unsigned left;
 
-                left = n_active_files + n_list - i;
+                left = n_active_files + p->n_list - i;
 
-                if ((max_retention_usec <= 0 || list[i].realtime >= retention_limit) &&
-                    (max_use <= 0 || sum <= max_use) &&
+                if ((max_retention_usec <= 0 || v->realtime >= retention_limit) &&
+                    (max_use <= 0 || p->sum <= max_use) &&
                     (n_max_files <= 0 || left <= n_max_files))
                         break;
 
-                r = unlinkat_deallocate(dirfd(d), list[i].filename, 0);
+                if (p->async) {
+                        int fd;
+
+                        /* Only remove the name here, the data is released in the background, see below */
+                        if (!GREEDY_REALLOC(fds, n_fds_allocated, n_fds + 2)) {
+                                r = -ENOMEM;
+                                break;
+                        }
+
+                        fd = openat(dir_fd, v->filename, O_WRONLY|O_CLOEXEC|O_NOCTTY|O_NOFOLLOW|O_NONBLOCK);
+                        if (fd < 0 && errno == ENOENT)
+                                r = -errno;
+                        else if (unlinkat(dir_fd, v->filename, 0) < 0) {
+                                r = -errno;
+                                safe_close(fd);
+                        } else {
+                                if (fd >= 0)
+                                        fds[n_fds++] = fd;
+                                r = 0;
+                        }
+                } else
+                        r = unlinkat_deallocate(dir_fd, v->filename, 0);
                 if (r >= 0) {
-                        log_full(verbose ? LOG_INFO : LOG_DEBUG, "Deleted archived journal %s/%s (%s).", directory, list[i].filename, format_bytes(sbytes, sizeof(sbytes), list[i].usage));
-                        freed += list[i].usage;
+                        log_full(verbose ? LOG_INFO : LOG_DEBUG, "Deleted archived journal %s/%s (%s).", p->directory, v->filename, format_bytes(sbytes, sizeof(sbytes), v->usage));
+                        freed += v->usage;
+                } else if (r != -ENOENT) {
+                        log_warning_errno(r, "Failed to delete archived journal %s/%s: %m", p->directory, v->filename);
+                        p->list[j++] = *v;
+                        continue;
+                }
 
-                        if (list[i].usage < sum)
-                                sum -= list[i].usage;
-                        else
-                                sum = 0;
+                p->sum = LESS_BY(p->sum, v->usage);
+                free(v->filename);
+        }
 
-                } else if (r != -ENOENT)
-                        log_warning_errno(r, "Failed to delete archived journal %s/%s: %m", directory, list[i].filename);
+        if (j < i) {
+                memmove(p->list + j, p->list + i, (p->n_list - i) * sizeof(struct vacuum_info));
+                p->n_list -= i - j;
         }
 
-        if (oldest_usec && i < n_list && (*oldest_usec == 0 || list[i].realtime < *oldest_usec))
-                *oldest_usec = list[i].realtime;
+        if (oldest_usec && j < p->n_list && (*oldest_usec == 0 || p->list[j].realtime < *oldest_usec))
+                *oldest_usec = p->list[j].realtime;
+
+        if (r == -ENOMEM)
+                goto finish;
+
+        if (freed > 0) {
+                r = journal_time_index_prune(p->directory);
+                if (r < 0)
+                        log_debug_errno(r, "Failed to prune time index of %s, ignoring: %m", p->directory);
+
+                /* Everything we changed is accounted for */
+                r = vacuum_plan_sync(p, dir_fd);
+                if (r < 0)
+                        goto finish;
+        }
 
         r = 0;
 
 finish:
-        for (i = 0; i < n_list; i++)
-                free(list[i].filename);
-        free(list);
+        if (n_fds > 0) {
+                fds[n_fds] = -1;
 
-        log_full(verbose ? LOG_INFO : LOG_DEBUG, "Vacuuming done, freed %s of archived journals from %s.", format_bytes(sbytes, sizeof(sbytes), freed), directory);
+                if (asynchronous_job(deallocate_thread, fds) >= 0)
+                        fds = NULL;
+                else
+                        deallocate_thread(TAKE_PTR(fds));
+        }
+
+        if (r < 0)
+                vacuum_plan_clear(p);
+
+        log_full(verbose ? LOG_INFO : LOG_DEBUG, "Vacuuming done, freed %s of archived journals from %s.", format_bytes(sbytes, sizeof(sbytes), freed), p->directory);
 
         return r;
 }
+
+int journal_directory_vacuum(
+                const char *directory,
+                uint64_t max_use,
+                uint64_t n_max_files,
+                usec_t max_retention_usec,
+                usec_t *oldest_usec,
+                bool verbose) {
+
+        _cleanup_(journal_vacuum_plan_freep) JournalVacuumPlan *p = NULL;
+        int r;
+
+        assert(directory);
+
+        r = journal_vacuum_plan_new(directory, false, &p);
+        if (r < 0)
+                return r;
+
+        return journal_vacuum_plan_execute(p, max_use, n_max_files, max_retention_usec, oldest_usec, verbose);
+}
@@ -4,6 +4,18 @@
 #include <inttypes.h>
 #include <stdbool.h>
 
+#include "macro.h"
 #include "time-util.h"
 
+typedef struct JournalVacuumPlan JournalVacuumPlan;
+
+int journal_vacuum_plan_new(const char *directory, bool async, JournalVacuumPlan **ret);
+JournalVacuumPlan* journal_vacuum_plan_free(JournalVacuumPlan *p);
+int journal_vacuum_plan_validate(JournalVacuumPlan *p);
+int journal_vacuum_plan_add(JournalVacuumPlan *p, const char *name);
+int journal_vacuum_plan_get_usage(JournalVacuumPlan *p, uint64_t *ret);
+int journal_vacuum_plan_execute(JournalVacuumPlan *p, uint64_t max_use, uint64_t n_max_files, usec_t max_retention_usec, usec_t *oldest_usec, bool verbose);
+
+DEFINE_TRIVIAL_CLEANUP_FUNC(JournalVacuumPlan*, journal_vacuum_plan_free);
+
 int journal_directory_vacuum(const char *directory, uint64_t max_use, uint64_t n_max_files, usec_t max_retention_usec, usec_t *oldest_usec, bool verbose);
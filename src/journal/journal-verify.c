@@ -117,7 +117,7 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
          * possible field values. It does not follow any references to
          * other objects. */
 
-        if ((o->object.flags & OBJECT_COMPRESSED_XZ) &&
+        if ((o->object.flags & OBJECT_COMPRESSION_MASK) &&
             o->object.type != OBJECT_DATA) {
                 error(offset, "Found compressed object that isn't of type DATA, which is not allowed.");
                 return -EBADMSG;
@@ -151,10 +151,13 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
                         _cleanup_free_ void *b = NULL;
                         size_t alloc = 0, b_size;
 
+                        (void) journal_file_load_dictionary(f);
+
                         r = decompress_blob(compression,
                                             o->data.payload,
                                             le64toh(o->object.size) - offsetof(Object, data.payload),
-                                            &b, &alloc, &b_size, 0);
+                                            &b, &alloc, &b_size, 0,
+                                            f->compress_dictionary);
                         if (r < 0) {
                                 error_errno(offset, r, "%s decompression failed: %m",
                                             object_compressed_to_string(compression));
@@ -343,6 +346,87 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
                 }
 
                 break;
+
+        case OBJECT_DICTIONARY:
+                if (le64toh(o->object.size) <= offsetof(DictionaryObject, payload)) {
+                        error(offset,
+                              "Invalid object dictionary size: %"PRIu64,
+                              le64toh(o->object.size));
+                        return -EBADMSG;
+                }
+
+                break;
+
+        case OBJECT_FIELD_INDEX: {
+                FieldIndexItem *item;
+                uint64_t pos = 0, n = 0;
+                int k;
+
+                if (le64toh(o->field_index.next_field_index_offset) >= offset) {
+                        error(offset,
+                              "Invalid field index next_field_index_offset: "OFSfmt,
+                              le64toh(o->field_index.next_field_index_offset));
+                        return -EBADMSG;
+                }
+
+                for (;;) {
+                        k = journal_file_field_index_next_item(o, &pos, &item);
+                        if (k < 0) {
+                                error(offset, "Invalid field index item at %"PRIu64, pos);
+                                return k;
+                        }
+                        if (k == 0)
+                                break;
+
+                        if (le64toh(item->hash) != hash64(item->payload, le64toh(item->size))) {
+                                error(offset, "Invalid hash of field index item %"PRIu64, n);
+                                return -EBADMSG;
+                        }
+
+                        if (!memchr(item->payload, '=', le64toh(item->size))) {
+                                error(offset, "Field index item %"PRIu64" without '='", n);
+                                return -EBADMSG;
+                        }
+
+                        n++;
+                }
+
+                if (n != le64toh(o->field_index.n_items)) {
+                        error(offset,
+                              "Field index item number mismatch: %"PRIu64" vs. %"PRIu64,
+                              n, le64toh(o->field_index.n_items));
+                        return -EBADMSG;
+                }
+
+                break;
+        }
+        }
+
+        return 0;
+}
+
+static int verify_compression_flags(JournalFile *f, uint64_t p, Object *o) {
+        assert(f);
+        assert(o);
+
+        if (__builtin_popcount(o->object.flags & OBJECT_COMPRESSION_MASK) > 1) {
+                error(p, "Objected with double compression");
+                return -EINVAL;
+        }
+
+        if ((o->object.flags & OBJECT_COMPRESSED_XZ) && !JOURNAL_HEADER_COMPRESSED_XZ(f->header)) {
+                error(p, "XZ compressed object in file without XZ compression");
+                return -EBADMSG;
+        }
+
+        if ((o->object.flags & OBJECT_COMPRESSED_LZ4) && !JOURNAL_HEADER_COMPRESSED_LZ4(f->header)) {
+                error(p, "LZ4 compressed object in file without LZ4 compression");
+                return -EBADMSG;
+        }
+
+        if ((o->object.flags & OBJECT_COMPRESSED_ZSTD) && !JOURNAL_HEADER_COMPRESSED_ZSTD(f->header)) {
+                error(p, "ZSTD compressed object in file without ZSTD compression");
+                return -EBADMSG;
         }
 
         return 0;
@@ -808,7 +892,7 @@ int journal_file_verify(
 
         uint64_t entry_seqnum = 0, entry_monotonic = 0, entry_realtime = 0;
         sd_id128_t entry_boot_id;
-        bool entry_seqnum_set = false, entry_monotonic_set = false, entry_realtime_set = false, found_main_entry_array = false;
+        bool entry_seqnum_set = false, entry_monotonic_set = false, entry_realtime_set = false, found_main_entry_array = false, found_dictionary = false, found_field_index = false, found_bloom_filter = false;
         uint64_t n_weird = 0, n_objects = 0, n_entries = 0, n_data = 0, n_fields = 0, n_data_hash_tables = 0, n_field_hash_tables = 0, n_entry_arrays = 0, n_tags = 0;
         usec_t last_usec = 0;
         int data_fd = -1, entry_fd = -1, entry_array_fd = -1;
@@ -923,24 +1007,9 @@ int journal_file_verify(
                         goto fail;
                 }
 
-                if ((o->object.flags & OBJECT_COMPRESSED_XZ) &&
-                    (o->object.flags & OBJECT_COMPRESSED_LZ4)) {
-                        error(p, "Objected with double compression");
-                        r = -EINVAL;
-                        goto fail;
-                }
-
-                if ((o->object.flags & OBJECT_COMPRESSED_XZ) && !JOURNAL_HEADER_COMPRESSED_XZ(f->header)) {
-                        error(p, "XZ compressed object in file without XZ compression");
-                        r = -EBADMSG;
-                        goto fail;
-                }
-
-                if ((o->object.flags & OBJECT_COMPRESSED_LZ4) && !JOURNAL_HEADER_COMPRESSED_LZ4(f->header)) {
-                        error(p, "LZ4 compressed object in file without LZ4 compression");
-                        r = -EBADMSG;
+                r = verify_compression_flags(f, p, o);
+                if (r < 0)
                         goto fail;
-                }
 
                 switch (o->object.type) {
 
@@ -949,6 +1018,13 @@ int journal_file_verify(
                         if (r < 0)
                                 goto fail;
 
+                        /* Readers skip the file for values the bloom filter doesn't know */
+                        if (journal_file_bloom_filter_test(f, le64toh(o->data.hash)) == 0) {
+                                error(p, "Data object missing from bloom filter");
+                                r = -EBADMSG;
+                                goto fail;
+                        }
+
                         n_data++;
                         break;
 
@@ -1155,6 +1231,58 @@ int journal_file_verify(
                         n_tags++;
                         break;
 
+                case OBJECT_DICTIONARY:
+                        if (!JOURNAL_HEADER_COMPRESSED_ZSTD_DICTIONARY(f->header)) {
+                                error(p, "Dictionary object in file without dictionary compression");
+                                r = -EBADMSG;
+                                goto fail;
+                        }
+
+                        if (!JOURNAL_HEADER_CONTAINS(f->header, dictionary_offset) ||
+                            p != le64toh(f->header->dictionary_offset)) {
+                                error(p, "Dictionary object not referenced from header");
+                                r = -EBADMSG;
+                                goto fail;
+                        }
+
+                        if (found_dictionary) {
+                                error(p, "More than one dictionary object");
+                                r = -EBADMSG;
+                                goto fail;
+                        }
+
+                        found_dictionary = true;
+                        break;
+
+                case OBJECT_FIELD_INDEX:
+                        if (!JOURNAL_HEADER_FIELD_INDEX(f->header)) {
+                                error(p, "Field index object in file without field indexes");
+                                r = -EBADMSG;
+                                goto fail;
+                        }
+
+                        if (JOURNAL_HEADER_CONTAINS(f->header, field_index_offset) &&
+                            p == le64toh(f->header->field_index_offset))
+                                found_field_index = true;
+                        break;
+
+                case OBJECT_BLOOM_FILTER:
+                        if (!JOURNAL_HEADER_BLOOM_FILTER(f->header)) {
+                                error(p, "Bloom filter object in file without bloom filters");
+                                r = -EBADMSG;
+                                goto fail;
+                        }
+
+                        if (!JOURNAL_HEADER_CONTAINS(f->header, bloom_filter_offset) ||
+                            p != le64toh(f->header->bloom_filter_offset)) {
+                                error(p, "Bloom filter object not referenced from header");
+                                r = -EBADMSG;
+                                goto fail;
+                        }
+
+                        found_bloom_filter = true;
+                        break;
+
                 default:
                         n_weird++;
                 }
@@ -1219,6 +1347,30 @@ int journal_file_verify(
                 goto fail;
         }
 
+        if (!found_dictionary &&
+            JOURNAL_HEADER_CONTAINS(f->header, dictionary_offset) &&
+            le64toh(f->header->dictionary_offset) != 0) {
+                error(offsetof(Header, dictionary_offset), "Missing dictionary");
+                r = -EBADMSG;
+                goto fail;
+        }
+
+        if (!found_field_index &&
+            JOURNAL_HEADER_CONTAINS(f->header, field_index_offset) &&
+            le64toh(f->header->field_index_offset) != 0) {
+                error(offsetof(Header, field_index_offset), "Missing field index");
+                r = -EBADMSG;
+                goto fail;
+        }
+
+        if (!found_bloom_filter &&
+            JOURNAL_HEADER_CONTAINS(f->header, bloom_filter_offset) &&
+            le64toh(f->header->bloom_filter_offset) != 0) {
+                error(offsetof(Header, bloom_filter_offset), "Missing bloom filter");
+                r = -EBADMSG;
+                goto fail;
+        }
+
         if (entry_seqnum_set &&
             entry_seqnum != le64toh(f->header->tail_entry_seqnum)) {
                 error(offsetof(Header, tail_entry_seqnum), "Invalid tail seqnum");
@@ -1316,3 +1468,377 @@ fail:
 
         return r;
 }
+
+/* The scrubber checks a file in steps of bounded size, so that it may run in the background of journald without
+ * stalling it. It does what the first iteration of journal_file_verify() does, and additionally follows the
+ * references of each entry to its data objects, and of each data object to its hash table. Whatever requires lists
+ * of all objects is left to journal_file_verify(), as are seals, since the scrubber has no key. A scrubber may be
+ * started at the offset where an earlier one stopped, see journal_file_scrub_offset(), in which case the counters in
+ * the header are only compared with what was found if the whole file was walked in one go. */
+
+struct JournalFileScrub {
+        JournalFile *file;
+
+        uint64_t offset; /* of the next object to check */
+        bool from_start;
+        bool found_field_index;
+
+        uint64_t n_objects, n_entries, n_data, n_fields, n_tags, n_entry_arrays;
+
+        uint64_t entry_seqnum, entry_monotonic;
+        sd_id128_t entry_boot_id;
+        bool entry_seqnum_set, entry_monotonic_set;
+};
+
+int journal_file_scrub_new(JournalFile *f, uint64_t offset, JournalFileScrub **ret) {
+        JournalFileScrub *s;
+
+        assert(f);
+        assert(f->header);
+        assert(ret);
+
+        if (le32toh(f->header->compatible_flags) & ~HEADER_COMPATIBLE_SUPPORTED)
+                return -EOPNOTSUPP;
+
+        s = new0(JournalFileScrub, 1);
+        if (!s)
+                return -ENOMEM;
+
+        s->file = f;
+
+        /* Continue where an earlier scrubber left off, unless that isn't the start of an object, as far as we
+         * can tell */
+        if (offset > le64toh(f->header->header_size) &&
+            VALID64(offset) &&
+            offset <= le64toh(f->header->header_size) + le64toh(f->header->arena_size))
+                s->offset = offset;
+        else {
+                s->offset = le64toh(f->header->header_size);
+                s->from_start = true;
+        }
+
+        *ret = s;
+        return 0;
+}
+
+JournalFileScrub* journal_file_scrub_free(JournalFileScrub *s) {
+        return mfree(s);
+}
+
+uint64_t journal_file_scrub_offset(JournalFileScrub *s) {
+        assert(s);
+
+        return s->offset;
+}
+
+static int scrub_entry(JournalFileScrub *s, uint64_t p, Object *o) {
+        JournalFile *f = s->file;
+        uint64_t i, n;
+        int r;
+
+        if (JOURNAL_HEADER_SEALED(f->header) && s->from_start && s->n_tags <= 0) {
+                error(p, "First entry before first tag");
+                return -EBADMSG;
+        }
+
+        if (s->from_start && !s->entry_seqnum_set &&
+            le64toh(o->entry.seqnum) != le64toh(f->header->head_entry_seqnum)) {
+                error(p, "Head entry sequence number incorrect");
+                return -EBADMSG;
+        }
+
+        if (s->entry_seqnum_set &&
+            s->entry_seqnum >= le64toh(o->entry.seqnum)) {
+                error(p, "Entry sequence number out of synchronization");
+                return -EBADMSG;
+        }
+
+        s->entry_seqnum = le64toh(o->entry.seqnum);
+        s->entry_seqnum_set = true;
+
+        if (s->entry_monotonic_set &&
+            sd_id128_equal(s->entry_boot_id, o->entry.boot_id) &&
+            s->entry_monotonic > le64toh(o->entry.monotonic)) {
+                error(p, "Entry timestamp out of synchronization");
+                return -EBADMSG;
+        }
+
+        s->entry_monotonic = le64toh(o->entry.monotonic);
+        s->entry_boot_id = o->entry.boot_id;
+        s->entry_monotonic_set = true;
+
+        n = journal_file_entry_n_items(o);
+        for (i = 0; i < n; i++) {
+                uint64_t q, h;
+                Object *u;
+
+                q = le64toh(o->entry.items[i].object_offset);
+                h = le64toh(o->entry.items[i].hash);
+
+                if (q >= p) {
+                        error(p, "Data object of entry after entry");
+                        return -EBADMSG;
+                }
+
+                r = journal_file_move_to_object(f, OBJECT_DATA, q, &u);
+                if (r < 0) {
+                        error(p, "Invalid data object of entry");
+                        return -EBADMSG;
+                }
+
+                if (le64toh(u->data.hash) != h) {
+                        error(p, "Hash mismatch for data object of entry");
+                        return -EBADMSG;
+                }
+        }
+
+        s->n_entries++;
+        return 0;
+}
+
+static int scrub_object(JournalFileScrub *s, uint64_t p, Object *o) {
+        JournalFile *f = s->file;
+        int r;
+
+        r = journal_file_object_verify(f, p, o);
+        if (r < 0) {
+                error_errno(p, r, "Invalid object contents: %m");
+                return r;
+        }
+
+        r = verify_compression_flags(f, p, o);
+        if (r < 0)
+                return r;
+
+        switch (o->object.type) {
+
+        case OBJECT_DATA:
+                if (journal_file_bloom_filter_test(f, le64toh(o->data.hash)) == 0) {
+                        error(p, "Data object missing from bloom filter");
+                        return -EBADMSG;
+                }
+
+                r = data_object_in_hash_table(f, le64toh(o->data.hash), p);
+                if (r < 0)
+                        return r;
+                if (r == 0) {
+                        error(p, "Data object missing from hash table");
+                        return -EBADMSG;
+                }
+
+                s->n_data++;
+                break;
+
+        case OBJECT_FIELD:
+                s->n_fields++;
+                break;
+
+        case OBJECT_ENTRY:
+                return scrub_entry(s, p, o);
+
+        case OBJECT_DATA_HASH_TABLE:
+                if (le64toh(f->header->data_hash_table_offset) != p + offsetof(HashTableObject, items) ||
+                    le64toh(f->header->data_hash_table_size) != le64toh(o->object.size) - offsetof(HashTableObject, items)) {
+                        error(p, "header fields for data hash table invalid");
+                        return -EBADMSG;
+                }
+                break;
+
+        case OBJECT_FIELD_HASH_TABLE:
+                if (le64toh(f->header->field_hash_table_offset) != p + offsetof(HashTableObject, items) ||
+                    le64toh(f->header->field_hash_table_size) != le64toh(o->object.size) - offsetof(HashTableObject, items)) {
+                        error(p, "Header fields for field hash table invalid");
+                        return -EBADMSG;
+                }
+                break;
+
+        case OBJECT_ENTRY_ARRAY:
+                s->n_entry_arrays++;
+                break;
+
+        case OBJECT_TAG:
+                if (!JOURNAL_HEADER_SEALED(f->header)) {
+                        error(p, "Tag object in file without sealing");
+                        return -EBADMSG;
+                }
+
+                if (s->from_start && le64toh(o->tag.seqnum) != s->n_tags + 1) {
+                        error(p, "Tag sequence number out of synchronization");
+                        return -EBADMSG;
+                }
+
+                s->n_tags++;
+                break;
+
+        case OBJECT_DICTIONARY:
+                if (!JOURNAL_HEADER_COMPRESSED_ZSTD_DICTIONARY(f->header)) {
+                        error(p, "Dictionary object in file without dictionary compression");
+                        return -EBADMSG;
+                }
+
+                if (!JOURNAL_HEADER_CONTAINS(f->header, dictionary_offset) ||
+                    p != le64toh(f->header->dictionary_offset)) {
+                        error(p, "Dictionary object not referenced from header");
+                        return -EBADMSG;
+                }
+                break;
+
+        case OBJECT_FIELD_INDEX:
+                if (!JOURNAL_HEADER_FIELD_INDEX(f->header)) {
+                        error(p, "Field index object in file without field indexes");
+                        return -EBADMSG;
+                }
+
+                /* Field index objects are chained backwards from the one the header points to */
+                if (!JOURNAL_HEADER_CONTAINS(f->header, field_index_offset) ||
+                    p > le64toh(f->header->field_index_offset)) {
+                        error(p, "Field index object not referenced from header");
+                        return -EBADMSG;
+                }
+
+                if (p == le64toh(f->header->field_index_offset))
+                        s->found_field_index = true;
+                break;
+
+        case OBJECT_BLOOM_FILTER:
+                if (!JOURNAL_HEADER_BLOOM_FILTER(f->header)) {
+                        error(p, "Bloom filter object in file without bloom filters");
+                        return -EBADMSG;
+                }
+
+                if (!JOURNAL_HEADER_CONTAINS(f->header, bloom_filter_offset) ||
+                    p != le64toh(f->header->bloom_filter_offset)) {
+                        error(p, "Bloom filter object not referenced from header");
+                        return -EBADMSG;
+                }
+                break;
+        }
+
+        return 0;
+}
+
+static int scrub_finish(JournalFileScrub *s) {
+        JournalFile *f = s->file;
+
+        if (!s->from_start)
+                return 1;
+
+        if (!s->found_field_index &&
+            JOURNAL_HEADER_CONTAINS(f->header, field_index_offset) &&
+            le64toh(f->header->field_index_offset) != 0) {
+                error(offsetof(Header, field_index_offset), "Missing field index");
+                return -EBADMSG;
+        }
+
+        if (s->n_objects != le64toh(f->header->n_objects)) {
+                error(offsetof(Header, n_objects), "Object number mismatch");
+                return -EBADMSG;
+        }
+
+        if (s->n_entries != le64toh(f->header->n_entries)) {
+                error(offsetof(Header, n_entries), "Entry number mismatch");
+                return -EBADMSG;
+        }
+
+        if (JOURNAL_HEADER_CONTAINS(f->header, n_data) &&
+            s->n_data != le64toh(f->header->n_data)) {
+                error(offsetof(Header, n_data), "Data number mismatch");
+                return -EBADMSG;
+        }
+
+        if (JOURNAL_HEADER_CONTAINS(f->header, n_fields) &&
+            s->n_fields != le64toh(f->header->n_fields)) {
+                error(offsetof(Header, n_fields), "Field number mismatch");
+                return -EBADMSG;
+        }
+
+        if (JOURNAL_HEADER_CONTAINS(f->header, n_tags) &&
+            s->n_tags != le64toh(f->header->n_tags)) {
+                error(offsetof(Header, n_tags), "Tag number mismatch");
+                return -EBADMSG;
+        }
+
+        if (JOURNAL_HEADER_CONTAINS(f->header, n_entry_arrays) &&
+            s->n_entry_arrays != le64toh(f->header->n_entry_arrays)) {
+                error(offsetof(Header, n_entry_arrays), "Entry array number mismatch");
+                return -EBADMSG;
+        }
+
+        if (s->entry_seqnum_set &&
+            s->entry_seqnum != le64toh(f->header->tail_entry_seqnum)) {
+                error(offsetof(Header, tail_entry_seqnum), "Invalid tail seqnum");
+                return -EBADMSG;
+        }
+
+        return 1;
+}
+
+int journal_file_scrub_step(JournalFileScrub *s, uint64_t max_bytes, usec_t until) {
+        JournalFile *f;
+        uint64_t tail, end;
+        int r;
+
+        assert(s);
+
+        /* Checks the objects from where the last step stopped on, until at least max_bytes of them have been
+         * looked at, or CLOCK_MONOTONIC passed until, whichever comes first. At least one object is checked
+         * per step. Returns 0 if there is more to check, 1 once the whole file was checked, and < 0 if
+         * corruption was found. */
+
+        f = s->file;
+
+        tail = le64toh(f->header->tail_object_offset);
+        if (tail == 0 || s->offset > tail)
+                return 1;
+
+        end = s->offset + MIN(max_bytes, UINT64_MAX - s->offset);
+
+        for (;;) {
+                uint64_t p = s->offset;
+                Object *o;
+
+                r = journal_file_move_to_object(f, OBJECT_UNUSED, p, &o);
+                if (r < 0) {
+                        error(p, "Invalid object");
+                        goto fail;
+                }
+
+                s->offset = p + ALIGN64(le64toh(o->object.size));
+                s->n_objects++;
+
+                r = scrub_object(s, p, o);
+                if (r < 0) {
+                        s->offset = p;
+                        goto fail;
+                }
+
+                if (p == tail) {
+                        r = scrub_finish(s);
+                        if (r < 0)
+                                goto fail;
+
+                        return 1;
+                }
+
+                if (s->offset > tail) {
+                        error(offsetof(Header, tail_object_offset), "Tail object pointer dead");
+                        r = -EBADMSG;
+                        goto fail;
+                }
+
+                if (s->offset >= end)
+                        return 0;
+
+                if (until != USEC_INFINITY && now(CLOCK_MONOTONIC) >= until)
+                        return 0;
+        }
+
+fail:
+        log_error("File corruption detected at %s:"OFSfmt" (of %llu bytes, %"PRIu64"%%).",
+                  f->path,
+                  s->offset,
+                  (unsigned long long) f->last_stat.st_size,
+                  100 * s->offset / f->last_stat.st_size);
+
+        return r;
+}
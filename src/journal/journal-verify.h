@@ -4,3 +4,12 @@
 #include "journal-file.h"
 
 int journal_file_verify(JournalFile *f, const char *key, usec_t *first_contained, usec_t *last_validated, usec_t *last_contained, bool show_progress);
+
+typedef struct JournalFileScrub JournalFileScrub;
+
+int journal_file_scrub_new(JournalFile *f, uint64_t offset, JournalFileScrub **ret);
+JournalFileScrub* journal_file_scrub_free(JournalFileScrub *s);
+int journal_file_scrub_step(JournalFileScrub *s, uint64_t max_bytes, usec_t until);
+uint64_t journal_file_scrub_offset(JournalFileScrub *s);
+
+DEFINE_TRIVIAL_CLEANUP_FUNC(JournalFileScrub*, journal_file_scrub_free);
@@ -37,6 +37,7 @@
 #include "glob-util.h"
 #include "hostname-util.h"
 #include "io-util.h"
+#include "journal-columnar.h"
 #include "journal-def.h"
 #include "journal-internal.h"
 #include "journal-qrcode.h"
@@ -143,6 +144,7 @@ static uint64_t arg_vacuum_size = 0;
 static uint64_t arg_vacuum_n_files = 0;
 static usec_t arg_vacuum_time = 0;
 static char **arg_output_fields = NULL;
+static unsigned arg_threads = 0;
 
 #if HAVE_PCRE2
 static const char *arg_pattern = NULL;
@@ -321,6 +323,8 @@ static void help(void) {
                "  -p --priority=RANGE        Show entries with the specified priority\n"
                "  -g --grep=PATTERN          Show entries with MESSAGE matching PATTERN\n"
                "     --case-sensitive[=BOOL] Force case sensitive or insenstive matching\n"
+               "     --threads=INT           Search archived journal files in the specified\n"
+               "                               number of threads\n"
                "  -e --pager-end             Immediately jump to the end in the pager\n"
                "  -f --follow                Follow the journal\n"
                "  -n --lines[=INTEGER]       Number of journal entries to show\n"
@@ -408,6 +412,7 @@ static int parse_argv(int argc, char *argv[]) {
                 ARG_VACUUM_TIME,
                 ARG_NO_HOSTNAME,
                 ARG_OUTPUT_FIELDS,
+                ARG_THREADS,
         };
 
         static const struct option options[] = {
@@ -469,6 +474,7 @@ static int parse_argv(int argc, char *argv[]) {
                 { "vacuum-time",    required_argument, NULL, ARG_VACUUM_TIME    },
                 { "no-hostname",    no_argument,       NULL, ARG_NO_HOSTNAME    },
                 { "output-fields",  required_argument, NULL, ARG_OUTPUT_FIELDS  },
+                { "threads",        required_argument, NULL, ARG_THREADS        },
                 {}
         };
 
@@ -516,7 +522,7 @@ static int parse_argv(int argc, char *argv[]) {
                                 return -EINVAL;
                         }
 
-                        if (IN_SET(arg_output, OUTPUT_EXPORT, OUTPUT_JSON, OUTPUT_JSON_PRETTY, OUTPUT_JSON_SSE, OUTPUT_CAT))
+                        if (IN_SET(arg_output, OUTPUT_EXPORT, OUTPUT_EXPORT_COLUMNAR, OUTPUT_JSON, OUTPUT_JSON_PRETTY, OUTPUT_JSON_SSE, OUTPUT_CAT))
                                 arg_quiet = true;
 
                         break;
@@ -816,6 +822,12 @@ static int parse_argv(int argc, char *argv[]) {
                         return log_error("Compiled without pattern matching support");
 #endif
 
+                case ARG_THREADS:
+                        r = safe_atou(optarg, &arg_threads);
+                        if (r < 0)
+                                return log_error_errno(r, "Failed to parse number of threads: %s", optarg);
+                        break;
+
                 case 'S':
                         r = parse_timestamp(optarg, &arg_since);
                         if (r < 0) {
@@ -2067,6 +2079,7 @@ static int sync_journal(void) {
 int main(int argc, char *argv[]) {
         int r;
         _cleanup_(sd_journal_closep) sd_journal *j = NULL;
+        _cleanup_(journal_columnar_freep) JournalColumnar *columnar = NULL;
         bool need_seek = false;
         sd_id128_t previous_boot_id;
         bool previous_boot_id_valid = false, first_line = true;
@@ -2157,7 +2170,18 @@ int main(int argc, char *argv[]) {
                 assert_not_reached("Unknown action");
         }
 
-        if (arg_directory)
+        if (arg_action == ACTION_SHOW && (arg_since_set || arg_until_set) && !arg_boot &&
+            !arg_file_stdin && !arg_file && !arg_machine)
+                /* Don't bother with archived files outside of the time window we are going to show. With --boot
+                 * we need all of them to number the boots, though. */
+                r = journal_open_time_window(&j,
+                                             arg_directory ?: arg_root,
+                                             arg_directory ? arg_journal_type :
+                                             arg_root ? arg_journal_type | SD_JOURNAL_OS_ROOT :
+                                             !arg_merge*SD_JOURNAL_LOCAL_ONLY + arg_journal_type,
+                                             arg_since_set ? arg_since : 0,
+                                             arg_until_set ? arg_until : USEC_INFINITY);
+        else if (arg_directory)
                 r = sd_journal_open_directory(&j, arg_directory, arg_journal_type);
         else if (arg_root)
                 r = sd_journal_open_directory(&j, arg_root, arg_journal_type | SD_JOURNAL_OS_ROOT);
@@ -2352,6 +2376,9 @@ int main(int argc, char *argv[]) {
                 log_debug("Journal filter: %s", filter);
         }
 
+        if (arg_threads > 0)
+                journal_set_lookahead_threads(j, arg_threads);
+
         if (arg_action == ACTION_LIST_FIELDS) {
                 const void *data;
                 size_t size;
@@ -2499,6 +2526,16 @@ int main(int argc, char *argv[]) {
                 }
         }
 
+        /* Values are written only once for the whole output in this mode, hence don't go through
+         * show_journal_entry() for each entry */
+        if (arg_output == OUTPUT_EXPORT_COLUMNAR) {
+                r = journal_columnar_new(stdout, arg_output_fields, &columnar);
+                if (r < 0) {
+                        log_oom();
+                        goto finish;
+                }
+        }
+
         for (;;) {
                 while (arg_lines < 0 || n_shown < arg_lines || (arg_follow && !first_line)) {
                         int flags;
@@ -2616,8 +2653,11 @@ int main(int argc, char *argv[]) {
                                 arg_utc * OUTPUT_UTC |
                                 arg_no_hostname * OUTPUT_NO_HOSTNAME;
 
-                        r = show_journal_entry(stdout, j, arg_output, 0, flags,
-                                               arg_output_fields, highlight, &ellipsized);
+                        if (columnar)
+                                r = journal_columnar_add(columnar, j);
+                        else
+                                r = show_journal_entry(stdout, j, arg_output, 0, flags,
+                                                       arg_output_fields, highlight, &ellipsized);
                         need_seek = true;
                         if (r == -EADDRNOTAVAIL)
                                 break;
@@ -2658,6 +2698,9 @@ int main(int argc, char *argv[]) {
                         break;
                 }
 
+                if (columnar)
+                        (void) journal_columnar_flush(columnar);
+
                 fflush(stdout);
                 r = sd_journal_wait(j, (uint64_t) -1);
                 if (r < 0) {
@@ -2669,6 +2712,9 @@ int main(int argc, char *argv[]) {
         }
 
 finish:
+        if (columnar)
+                (void) journal_columnar_flush(columnar);
+
         fflush(stdout);
         pager_close();
 
@@ -1,5 +1,7 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 
+#include <sys/inotify.h>
+
 #if HAVE_SELINUX
 #include <selinux/selinux.h>
 #endif
@@ -44,6 +46,12 @@
  *    stream connection. This should improve cases where a service process logs immediately before exiting and we
  *    previously had trouble associating the log message with the service.
  *
+ * Metadata that follows from the cgroup of a client (unit, slice, session, owner, as well as what PID 1 exports about
+ * the unit in /run/systemd/units/, i.e. invocation ID, maximum log level and extra fields) is cached a second time,
+ * indexed by the cgroup path and shared by all clients in that cgroup. Hence, a short-lived process that logs a single
+ * line only costs reading its own bits from /proc, and the cgroup path. The unit data is reread when PID 1 changes
+ * it, which we learn from inotify, or (if watching is not possible) at the same pace as above.
+ *
  * NB: With and without the metadata cache: the implicitly added entry metadata in the journal (with the exception of
  *     UID/PID/GID and SELinux label) must be understood as possibly slightly out of sync (i.e. sometimes slighly older
  *     and sometimes slightly newer than what was current at the log event).
@@ -102,11 +110,8 @@ static int client_context_new(Server *s, pid_t pid, ClientContext **ret) {
         c->gid = GID_INVALID;
         c->auditid = AUDIT_SESSION_INVALID;
         c->loginuid = UID_INVALID;
-        c->owner_uid = UID_INVALID;
         c->lru_index = PRIOQ_IDX_NULL;
         c->timestamp = USEC_INFINITY;
-        c->extra_fields_mtime = NSEC_INFINITY;
-        c->log_level_max = -1;
 
         r = hashmap_put(s->client_contexts, PID_TO_PTR(pid), c);
         if (r < 0) {
@@ -118,7 +123,115 @@ static int client_context_new(Server *s, pid_t pid, ClientContext **ret) {
         return 0;
 }
 
-static void client_context_reset(ClientContext *c) {
+static UnitContext* unit_context_free(Server *s, UnitContext *u) {
+        assert(s);
+
+        if (!u)
+                return NULL;
+
+        if (u->cgroup)
+                assert_se(hashmap_remove(s->unit_contexts, u->cgroup) == u);
+
+        free(u->cgroup);
+        free(u->session);
+        free(u->unit);
+        free(u->user_unit);
+        free(u->slice);
+        free(u->user_slice);
+
+        journal_rate_limit_group_unref(u->rate_limit_group);
+
+        free(u->extra_fields_iovec);
+        free(u->extra_fields_data);
+
+        return mfree(u);
+}
+
+static UnitContext* unit_context_unref(Server *s, UnitContext *u) {
+        assert(s);
+
+        if (!u)
+                return NULL;
+
+        assert(u->n_ref > 0);
+
+        u->n_ref--;
+        if (u->n_ref > 0)
+                return NULL;
+
+        return unit_context_free(s, u);
+}
+
+static UnitContext* unit_context_new(void) {
+        UnitContext *u;
+
+        u = new0(UnitContext, 1);
+        if (!u)
+                return NULL;
+
+        u->n_ref = 1;
+        u->timestamp = USEC_INFINITY;
+        u->owner_uid = UID_INVALID;
+        u->log_level_max = -1;
+        u->extra_fields_mtime = NSEC_INFINITY;
+
+        return u;
+}
+
+static int unit_context_get(Server *s, const char *cgroup, UnitContext **ret) {
+        UnitContext *u;
+        int r;
+
+        assert(s);
+        assert(cgroup);
+        assert(ret);
+
+        u = hashmap_get(s->unit_contexts, cgroup);
+        if (u) {
+                u->n_ref++;
+
+                *ret = u;
+                return 0;
+        }
+
+        r = hashmap_ensure_allocated(&s->unit_contexts, &string_hash_ops);
+        if (r < 0)
+                return r;
+
+        u = unit_context_new();
+        if (!u)
+                return -ENOMEM;
+
+        u->cgroup = strdup(cgroup);
+        if (!u->cgroup) {
+                free(u);
+                return -ENOMEM;
+        }
+
+        /* All of this follows from the cgroup path alone, hence never changes */
+        (void) cg_path_get_session(u->cgroup, &u->session);
+
+        if (cg_path_get_owner_uid(u->cgroup, &u->owner_uid) < 0)
+                u->owner_uid = UID_INVALID;
+
+        (void) cg_path_get_unit(u->cgroup, &u->unit);
+        (void) cg_path_get_user_unit(u->cgroup, &u->user_unit);
+        (void) cg_path_get_slice(u->cgroup, &u->slice);
+        (void) cg_path_get_user_slice(u->cgroup, &u->user_slice);
+
+        r = hashmap_put(s->unit_contexts, u->cgroup, u);
+        if (r < 0) {
+                u->cgroup = mfree(u->cgroup);
+                unit_context_free(s, u);
+                return r;
+        }
+
+        *ret = u;
+        return 0;
+}
+
+static void client_context_reset(Server *s, ClientContext *c) {
+        assert(s);
         assert(c);
 
         c->timestamp = USEC_INFINITY;
@@ -134,25 +247,10 @@ static void client_context_reset(ClientContext *c) {
         c->auditid = AUDIT_SESSION_INVALID;
         c->loginuid = UID_INVALID;
 
-        c->cgroup = mfree(c->cgroup);
-        c->session = mfree(c->session);
-        c->owner_uid = UID_INVALID;
-        c->unit = mfree(c->unit);
-        c->user_unit = mfree(c->user_unit);
-        c->slice = mfree(c->slice);
-        c->user_slice = mfree(c->user_slice);
-
-        c->invocation_id = SD_ID128_NULL;
-
         c->label = mfree(c->label);
         c->label_size = 0;
 
-        c->extra_fields_iovec = mfree(c->extra_fields_iovec);
-        c->extra_fields_n_iovec = 0;
-        c->extra_fields_data = mfree(c->extra_fields_data);
-        c->extra_fields_mtime = NSEC_INFINITY;
-
-        c->log_level_max = -1;
+        c->unit_context = unit_context_unref(s, c->unit_context);
 }
 
 static ClientContext* client_context_free(Server *s, ClientContext *c) {
@@ -166,7 +264,7 @@ static ClientContext* client_context_free(Server *s, ClientContext *c) {
         if (c->in_lru)
                 assert_se(prioq_remove(s->client_contexts_lru, c, &c->lru_index) >= 0);
 
-        client_context_reset(c);
+        client_context_reset(s, c);
 
         return mfree(c);
 }
@@ -243,7 +341,8 @@ static int client_context_read_label(
 }
 
 static int client_context_read_cgroup(Server *s, ClientContext *c, const char *unit_id) {
-        char *t = NULL;
+        _cleanup_free_ char *t = NULL;
+        UnitContext *u;
         int r;
 
         assert(c);
@@ -252,81 +351,74 @@ static int client_context_read_cgroup(Server *s, ClientContext *c, const char *u
         r = cg_pid_get_path_shifted(c->pid, s->cgroup_root, &t);
         if (r < 0) {
 
-                /* If that didn't work, we use the unit ID passed in as fallback, if we have nothing cached yet */
-                if (unit_id && !c->unit) {
-                        c->unit = strdup(unit_id);
-                        if (c->unit)
-                                return 0;
+                /* If that didn't work, we use the unit ID passed in as fallback, if we have nothing cached yet. Such
+                 * a context isn't shared with anybody, as we don't know the cgroup. */
+                if (unit_id && !c->unit_context) {
+                        u = unit_context_new();
+                        if (u) {
+                                u->unit = strdup(unit_id);
+                                if (u->unit) {
+                                        c->unit_context = u;
+                                        return 0;
+                                }
+
+                                free(u);
+                        }
                 }
 
                 return r;
         }
 
         /* Let's shortcut this if the cgroup path didn't change */
-        if (streq_ptr(c->cgroup, t)) {
-                free(t);
+        if (c->unit_context && streq_ptr(c->unit_context->cgroup, t))
                 return 0;
-        }
-
-        free_and_replace(c->cgroup, t);
-
-        (void) cg_path_get_session(c->cgroup, &t);
-        free_and_replace(c->session, t);
-
-        if (cg_path_get_owner_uid(c->cgroup, &c->owner_uid) < 0)
-                c->owner_uid = UID_INVALID;
 
-        (void) cg_path_get_unit(c->cgroup, &t);
-        free_and_replace(c->unit, t);
-
-        (void) cg_path_get_user_unit(c->cgroup, &t);
-        free_and_replace(c->user_unit, t);
-
-        (void) cg_path_get_slice(c->cgroup, &t);
-        free_and_replace(c->slice, t);
+        r = unit_context_get(s, t, &u);
+        if (r < 0)
+                return r;
 
-        (void) cg_path_get_user_slice(c->cgroup, &t);
-        free_and_replace(c->user_slice, t);
+        unit_context_unref(s, c->unit_context);
+        c->unit_context = u;
 
         return 0;
 }
 
-static int client_context_read_invocation_id(
+static int unit_context_read_invocation_id(
                 Server *s,
-                ClientContext *c) {
+                UnitContext *u) {
 
         _cleanup_free_ char *value = NULL;
         const char *p;
         int r;
 
         assert(s);
-        assert(c);
+        assert(u);
 
         /* Read the invocation ID of a unit off a unit. PID 1 stores it in a per-unit symlink in /run/systemd/units/ */
 
-        if (!c->unit)
+        if (!u->unit)
                 return 0;
 
-        p = strjoina("/run/systemd/units/invocation:", c->unit);
+        p = strjoina("/run/systemd/units/invocation:", u->unit);
         r = readlink_malloc(p, &value);
         if (r < 0)
                 return r;
 
-        return sd_id128_from_string(value, &c->invocation_id);
+        return sd_id128_from_string(value, &u->invocation_id);
 }
 
-static int client_context_read_log_level_max(
+static int unit_context_read_log_level_max(
                 Server *s,
-                ClientContext *c) {
+                UnitContext *u) {
 
         _cleanup_free_ char *value = NULL;
         const char *p;
         int r, ll;
 
-        if (!c->unit)
+        if (!u->unit)
                 return 0;
 
-        p = strjoina("/run/systemd/units/log-level-max:", c->unit);
+        p = strjoina("/run/systemd/units/log-level-max:", u->unit);
         r = readlink_malloc(p, &value);
         if (r < 0)
                 return r;
@@ -335,13 +427,13 @@ static int client_context_read_log_level_max(
         if (ll < 0)
                 return -EINVAL;
 
-        c->log_level_max = ll;
+        u->log_level_max = ll;
         return 0;
 }
 
-static int client_context_read_extra_fields(
+static int unit_context_read_extra_fields(
                 Server *s,
-                ClientContext *c) {
+                UnitContext *u) {
 
         size_t size = 0, n_iovec = 0, n_allocated = 0, left;
         _cleanup_free_ struct iovec *iovec = NULL;
@@ -352,12 +444,12 @@ static int client_context_read_extra_fields(
         uint8_t *q;
         int r;
 
-        if (!c->unit)
+        if (!u->unit)
                 return 0;
 
-        p = strjoina("/run/systemd/units/log-extra-fields:", c->unit);
+        p = strjoina("/run/systemd/units/log-extra-fields:", u->unit);
 
-        if (c->extra_fields_mtime != NSEC_INFINITY) {
+        if (u->extra_fields_mtime != NSEC_INFINITY) {
                 if (stat(p, &st) < 0) {
                         if (errno == ENOENT)
                                 return 0;
@@ -365,7 +457,7 @@ static int client_context_read_extra_fields(
                         return -errno;
                 }
 
-                if (timespec_load_nsec(&st.st_mtim) == c->extra_fields_mtime)
+                if (timespec_load_nsec(&st.st_mtim) == u->extra_fields_mtime)
                         return 0;
         }
 
@@ -418,17 +510,42 @@ static int client_context_read_extra_fields(
                 left -= n, q += n;
         }
 
-        free(c->extra_fields_iovec);
-        free(c->extra_fields_data);
+        free(u->extra_fields_iovec);
+        free(u->extra_fields_data);
 
-        c->extra_fields_iovec = TAKE_PTR(iovec);
-        c->extra_fields_n_iovec = n_iovec;
-        c->extra_fields_data = TAKE_PTR(data);
-        c->extra_fields_mtime = timespec_load_nsec(&st.st_mtim);
+        u->extra_fields_iovec = TAKE_PTR(iovec);
+        u->extra_fields_n_iovec = n_iovec;
+        u->extra_fields_data = TAKE_PTR(data);
+        u->extra_fields_mtime = timespec_load_nsec(&st.st_mtim);
 
         return 0;
 }
 
+static void unit_context_maybe_refresh(
+                Server *s,
+                UnitContext *u,
+                usec_t timestamp) {
+
+        assert(s);
+        assert(u);
+
+        if (u->timestamp != USEC_INFINITY) {
+
+                /* While we are watching /run/systemd/units/, the data is flushed out whenever it changes */
+                if (s->units_event_source && u->cgroup)
+                        return;
+
+                if (u->timestamp + REFRESH_USEC >= timestamp)
+                        return;
+        }
+
+        (void) unit_context_read_invocation_id(s, u);
+        (void) unit_context_read_log_level_max(s, u);
+        (void) unit_context_read_extra_fields(s, u);
+
+        u->timestamp = timestamp;
+}
+
 static void client_context_really_refresh(
                 Server *s,
                 ClientContext *c,
@@ -452,9 +569,8 @@ static void client_context_really_refresh(
         (void) audit_loginuid_from_pid(c->pid, &c->loginuid);
 
         (void) client_context_read_cgroup(s, c, unit_id);
-        (void) client_context_read_invocation_id(s, c);
-        (void) client_context_read_log_level_max(s, c);
-        (void) client_context_read_extra_fields(s, c);
+        if (c->unit_context)
+                unit_context_maybe_refresh(s, c->unit_context, timestamp);
 
         c->timestamp = timestamp;
 
@@ -485,7 +601,7 @@ void client_context_maybe_refresh(
         /* If the data isn't pinned and if the cashed data is older than the upper limit, we flush it out
          * entirely. This follows the logic that as long as an entry is pinned the PID reuse is unlikely. */
         if (c->n_ref == 0 && c->timestamp + MAX_USEC < timestamp) {
-                client_context_reset(c);
+                client_context_reset(s, c);
                 goto refresh;
         }
 
@@ -503,6 +619,10 @@ void client_context_maybe_refresh(
         if (label_size > 0 && (label_size != c->label_size || memcmp(label, c->label, label_size) != 0))
                 goto refresh;
 
+        /* The unit data is shared with other clients, and might have been flushed out in the meantime */
+        if (c->unit_context)
+                unit_context_maybe_refresh(s, c->unit_context, timestamp);
+
         return;
 
 refresh:
@@ -544,9 +664,11 @@ void client_context_flush_all(Server *s) {
 
         assert(prioq_size(s->client_contexts_lru) == 0);
         assert(hashmap_size(s->client_contexts) == 0);
+        assert(hashmap_size(s->unit_contexts) == 0);
 
         s->client_contexts_lru = prioq_free(s->client_contexts_lru);
         s->client_contexts = hashmap_free(s->client_contexts);
+        s->unit_contexts = hashmap_free(s->unit_contexts);
 }
 
 static int client_context_get_internal(
@@ -685,3 +807,58 @@ void client_context_acquire_default(Server *s) {
 
         }
 }
+
+static int dispatch_units_change(sd_event_source *es, const struct inotify_event *event, void *userdata) {
+        Server *s = userdata;
+        const char *unit = NULL;
+        UnitContext *u;
+        Iterator i;
+
+        assert(s);
+        assert(event);
+
+        /* PID 1 exported new data about a unit, or removed it. Let's flush out what we have, so that it is reread
+         * when the next message of the unit comes in. If we lost track, let's flush out everything. */
+
+        if (event->mask & IN_IGNORED) {
+                log_debug("/run/systemd/units/ is not watched anymore, refreshing unit data periodically.");
+                s->units_event_source = sd_event_source_unref(s->units_event_source);
+        } else if (!(event->mask & IN_Q_OVERFLOW)) {
+                if (event->len == 0)
+                        return 0;
+
+                unit = startswith(event->name, "invocation:");
+                if (!unit)
+                        unit = startswith(event->name, "log-level-max:");
+                if (!unit)
+                        unit = startswith(event->name, "log-extra-fields:");
+                if (!unit)
+                        return 0;
+        }
+
+        HASHMAP_FOREACH(u, s->unit_contexts, i)
+                if (!unit || streq_ptr(u->unit, unit))
+                        u->timestamp = USEC_INFINITY;
+
+        return 0;
+}
+
+int unit_context_watch(Server *s) {
+        int r;
+
+        assert(s);
+        assert(!s->units_event_source);
+
+        r = sd_event_add_inotify(s->event, &s->units_event_source, "/run/systemd/units",
+                                 IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_CLOSE_WRITE|IN_ONLYDIR,
+                                 dispatch_units_change, s);
+        if (r < 0)
+                return log_debug_errno(r, "Failed to watch /run/systemd/units/, refreshing unit data periodically: %m");
+
+        /* Process this before any messages that come in at the same time, so that they already see the new data */
+        r = sd_event_source_set_priority(s->units_event_source, SD_EVENT_PRIORITY_IMPORTANT-10);
+        if (r < 0)
+                return log_error_errno(r, "Failed to adjust priority of units event source: %m");
+
+        return 0;
+}
@@ -6,27 +6,16 @@
 
 #include "sd-id128.h"
 
+#include "journald-rate-limit.h"
+
 typedef struct ClientContext ClientContext;
+typedef struct UnitContext UnitContext;
 
 #include "journald-server.h"
 
-struct ClientContext {
+struct UnitContext {
         unsigned n_ref;
-        unsigned lru_index;
         usec_t timestamp;
-        bool in_lru;
-
-        pid_t pid;
-        uid_t uid;
-        gid_t gid;
-
-        char *comm;
-        char *exe;
-        char *cmdline;
-        char *capeff;
-
-        uint32_t auditid;
-        uid_t loginuid;
 
         char *cgroup;
         char *session;
@@ -40,17 +29,42 @@ struct ClientContext {
 
         sd_id128_t invocation_id;
 
-        char *label;
-        size_t label_size;
-
         int log_level_max;
 
+        /* The rate limiting state of the unit, so that it needn't be looked up for every message */
+        JournalRateLimitGroup *rate_limit_group;
+
         struct iovec *extra_fields_iovec;
         size_t extra_fields_n_iovec;
         void *extra_fields_data;
         nsec_t extra_fields_mtime;
 };
 
+struct ClientContext {
+        unsigned n_ref;
+        unsigned lru_index;
+        usec_t timestamp;
+        bool in_lru;
+
+        pid_t pid;
+        uid_t uid;
+        gid_t gid;
+
+        char *comm;
+        char *exe;
+        char *cmdline;
+        char *capeff;
+
+        uint32_t auditid;
+        uid_t loginuid;
+
+        char *label;
+        size_t label_size;
+
+        /* Shared by all clients in the same cgroup */
+        UnitContext *unit_context;
+};
+
 int client_context_get(
                 Server *s,
                 pid_t pid,
@@ -80,16 +94,18 @@ void client_context_maybe_refresh(
 void client_context_acquire_default(Server *s);
 void client_context_flush_all(Server *s);
 
+int unit_context_watch(Server *s);
+
 static inline size_t client_context_extra_fields_n_iovec(const ClientContext *c) {
-        return c ? c->extra_fields_n_iovec : 0;
+        return c && c->unit_context ? c->unit_context->extra_fields_n_iovec : 0;
 }
 
 static inline bool client_context_test_priority(const ClientContext *c, int priority) {
-        if (!c)
+        if (!c || !c->unit_context)
                 return true;
 
-        if (c->log_level_max < 0)
+        if (c->unit_context->log_level_max < 0)
                 return true;
 
-        return LOG_PRI(priority) <= c->log_level_max;
+        return LOG_PRI(priority) <= c->unit_context->log_level_max;
 }
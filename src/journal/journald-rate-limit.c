@@ -4,6 +4,9 @@
 #include <string.h>
 
 #include "alloc-util.h"
+#include "fd-util.h"
+#include "fileio.h"
+#include "fs-util.h"
 #include "hashmap.h"
 #include "journald-rate-limit.h"
 #include "list.h"
@@ -11,6 +14,12 @@
 #include "string-util.h"
 #include "util.h"
 
+/* Messages are rate limited in a hierarchy of token buckets: each priority class of a unit has a budget of its own,
+ * refilled at the configured rate. Once it is used up, messages may still be let through from a budget shared by all
+ * priorities of the unit, and then from one shared by all units of the same slice. A unit logging too much hence only
+ * ever uses up what is left over by the other units in its slice, and never what they are guaranteed. All budgets
+ * have the size of the burst, hence a unit may log up to POOLS_MAX + 2 times the burst per interval. */
+
 #define POOLS_MAX 5
 #define BUCKETS_MAX 127
 #define GROUPS_MAX 2047
@@ -27,21 +36,35 @@ static const int priority_map[] = {
 };
 
 typedef struct JournalRateLimitPool JournalRateLimitPool;
-typedef struct JournalRateLimitGroup JournalRateLimitGroup;
 
 struct JournalRateLimitPool {
-        usec_t begin;
-        unsigned num;
-        unsigned suppressed;
+        usec_t timestamp;
+
+        /* Counted in 1/interval of a message, so that refilling works with integers */
+        uint64_t credit;
 };
 
 struct JournalRateLimitGroup {
         JournalRateLimit *parent;
+        unsigned n_ref;
 
         char *id;
-        JournalRateLimitPool pools[POOLS_MAX];
         uint64_t hash;
 
+        /* The slice of a unit, NULL for slices */
+        JournalRateLimitGroup *slice;
+
+        JournalRateLimitPool pools[POOLS_MAX];
+        JournalRateLimitPool shared;
+        usec_t last;
+
+        unsigned suppressed;
+        usec_t reported;
+        uint64_t suppressed_total;
+
+        /* What suppressed_total was when it was last written out */
+        uint64_t suppressed_written;
+
         LIST_FIELDS(JournalRateLimitGroup, bucket);
         LIST_FIELDS(JournalRateLimitGroup, lru);
 };
@@ -90,13 +113,33 @@ static void journal_rate_limit_group_free(JournalRateLimitGroup *g) {
                 g->parent->n_groups--;
         }
 
+        journal_rate_limit_group_unref(g->slice);
+
         free(g->id);
         free(g);
 }
 
+JournalRateLimitGroup *journal_rate_limit_group_unref(JournalRateLimitGroup *g) {
+        if (!g)
+                return NULL;
+
+        /* Unreferenced groups stay around until they expire, see journal_rate_limit_vacuum() */
+
+        assert(g->n_ref > 0);
+        g->n_ref--;
+
+        return NULL;
+}
+
 void journal_rate_limit_free(JournalRateLimit *r) {
+        JournalRateLimitGroup *g;
+
         assert(r);
 
+        /* Everything goes, hence the references between groups don't matter */
+        LIST_FOREACH(lru, g, r->lru)
+                g->slice = NULL;
+
         while (r->lru)
                 journal_rate_limit_group_free(r->lru);
 
@@ -104,35 +147,69 @@ void journal_rate_limit_free(JournalRateLimit *r) {
 }
 
 _pure_ static bool journal_rate_limit_group_expired(JournalRateLimitGroup *g, usec_t ts) {
-        unsigned i;
-
         assert(g);
 
-        for (i = 0; i < POOLS_MAX; i++)
-                if (g->pools[i].begin + g->parent->interval >= ts)
-                        return false;
+        /* After an interval without messages all pools are full again, hence the group may as well be created
+         * anew. That is, unless it is still referenced, or knows about suppressed messages that weren't written
+         * out yet. */
 
-        return true;
+        return g->n_ref == 0 &&
+                g->suppressed_total == g->suppressed_written &&
+                g->last + g->parent->interval < ts;
 }
 
 static void journal_rate_limit_vacuum(JournalRateLimit *r, usec_t ts) {
+        JournalRateLimitGroup *g, *prev;
+
         assert(r);
 
         /* Makes room for at least one new item, but drop all
-         * expored items too. */
+         * expired items too. */
+
+        for (g = r->lru_tail; g; g = prev) {
+                prev = g->lru_prev;
 
-        while (r->n_groups >= GROUPS_MAX ||
-               (r->lru_tail && journal_rate_limit_group_expired(r->lru_tail, ts)))
-                journal_rate_limit_group_free(r->lru_tail);
+                if (g->n_ref > 0)
+                        continue;
+
+                if (r->n_groups >= GROUPS_MAX || journal_rate_limit_group_expired(g, ts))
+                        journal_rate_limit_group_free(g);
+        }
 }
 
-static JournalRateLimitGroup* journal_rate_limit_group_new(JournalRateLimit *r, const char *id, usec_t ts) {
+static JournalRateLimitGroup* journal_rate_limit_group_find(JournalRateLimit *r, const char *id, uint64_t *ret_hash) {
         JournalRateLimitGroup *g;
         struct siphash state;
+        uint64_t h;
+
+        assert(r);
+        assert(id);
+        assert(ret_hash);
+
+        siphash24_init(&state, r->hash_key);
+        string_hash_func(id, &state);
+        h = siphash24_finalize(&state);
+
+        *ret_hash = h;
+
+        LIST_FOREACH(bucket, g, r->buckets[h % BUCKETS_MAX])
+                if (streq(g->id, id))
+                        return g;
+
+        return NULL;
+}
+
+static JournalRateLimitGroup* journal_rate_limit_group_get(JournalRateLimit *r, const char *id, usec_t ts) {
+        JournalRateLimitGroup *g;
+        uint64_t h;
 
         assert(r);
         assert(id);
 
+        g = journal_rate_limit_group_find(r, id, &h);
+        if (g)
+                return g;
+
         g = new0(JournalRateLimitGroup, 1);
         if (!g)
                 return NULL;
@@ -141,9 +218,7 @@ static JournalRateLimitGroup* journal_rate_limit_group_new(JournalRateLimit *r,
         if (!g->id)
                 goto fail;
 
-        siphash24_init(&state, r->hash_key);
-        string_hash_func(g->id, &state);
-        g->hash = siphash24_finalize(&state);
+        g->hash = h;
 
         journal_rate_limit_vacuum(r, ts);
 
@@ -161,6 +236,32 @@ fail:
         return NULL;
 }
 
+static JournalRateLimitGroup* journal_rate_limit_unit_get(JournalRateLimit *r, const char *id, const char *slice, usec_t ts) {
+        JournalRateLimitGroup *g, *sg;
+
+        assert(r);
+        assert(id);
+
+        g = journal_rate_limit_group_get(r, id, ts);
+        if (!g)
+                return NULL;
+
+        if (g->slice || !slice || streq(slice, id))
+                return g;
+
+        /* The unit is referenced while we look up the slice, so that the vacuuming doesn't drop it */
+        g->n_ref++;
+        sg = journal_rate_limit_group_get(r, slice, ts);
+        g->n_ref--;
+        if (!sg)
+                return NULL;
+
+        sg->n_ref++;
+        g->slice = sg;
+
+        return g;
+}
+
 static unsigned burst_modulate(unsigned burst, uint64_t available) {
         unsigned k;
 
@@ -189,13 +290,39 @@ static unsigned burst_modulate(unsigned burst, uint64_t available) {
         return burst;
 }
 
-int journal_rate_limit_test(JournalRateLimit *r, const char *id, int priority, uint64_t available) {
-        uint64_t h;
-        JournalRateLimitGroup *g;
-        JournalRateLimitPool *p;
-        struct siphash state;
-        unsigned burst;
-        usec_t ts;
+static bool pool_take(JournalRateLimitPool *p, usec_t interval, unsigned burst, usec_t ts) {
+        uint64_t capacity, passed;
+
+        assert(p);
+        assert(interval > 0);
+
+        /* Refills the pool by burst messages per interval, up to burst messages, and takes one message out of
+         * it if there is one. A pool never used before is full. */
+
+        capacity = burst > UINT64_MAX / interval ? UINT64_MAX : (uint64_t) burst * interval;
+        passed = p->timestamp == 0 ? interval : MIN(LESS_BY(ts, p->timestamp), interval);
+
+        p->credit = MIN(p->credit + passed * burst, capacity);
+        p->timestamp = ts;
+
+        if (p->credit < interval)
+                return false;
+
+        p->credit -= interval;
+        return true;
+}
+
+int journal_rate_limit_test(
+                JournalRateLimit *r,
+                JournalRateLimitGroup **cache,
+                const char *id,
+                const char *slice,
+                int priority,
+                uint64_t available,
+                usec_t ts) {
+
+        JournalRateLimitGroup *g = NULL;
+        unsigned burst, s;
 
         assert(id);
 
@@ -204,7 +331,11 @@ int journal_rate_limit_test(JournalRateLimit *r, const char *id, int priority, u
          * 0     → the log message shall be suppressed,
          * 1 + n → the log message shall be permitted, and n messages were dropped from the peer before
          * < 0   → error
-         */
+         *
+         * If cache is non-NULL, it refers to the group of the unit, for passing to later calls. The caller
+         * is supposed to drop it with journal_rate_limit_group_unref() when the unit changes.
+         *
+         * ts is the current time in CLOCK_MONOTONIC. */
 
         if (!r)
                 return 1;
@@ -214,48 +345,80 @@ int journal_rate_limit_test(JournalRateLimit *r, const char *id, int priority, u
 
         burst = burst_modulate(r->burst, available);
 
-        ts = now(CLOCK_MONOTONIC);
-
-        siphash24_init(&state, r->hash_key);
-        string_hash_func(id, &state);
-        h = siphash24_finalize(&state);
-        g = r->buckets[h % BUCKETS_MAX];
-
-        LIST_FOREACH(bucket, g, g)
-                if (streq(g->id, id))
-                        break;
-
+        if (cache)
+                g = *cache;
         if (!g) {
-                g = journal_rate_limit_group_new(r, id, ts);
+                g = journal_rate_limit_unit_get(r, id, slice, ts);
                 if (!g)
                         return -ENOMEM;
-        }
-
-        p = &g->pools[priority_map[priority]];
 
-        if (p->begin <= 0) {
-                p->suppressed = 0;
-                p->num = 1;
-                p->begin = ts;
-                return 1;
+                if (cache) {
+                        g->n_ref++;
+                        *cache = g;
+                }
         }
 
-        if (p->begin + r->interval < ts) {
-                unsigned s;
+        g->last = ts;
+        if (g->slice)
+                g->slice->last = ts;
 
-                s = p->suppressed;
-                p->suppressed = 0;
-                p->num = 1;
-                p->begin = ts;
+        if (!pool_take(&g->pools[priority_map[priority]], r->interval, burst, ts) &&
+            !pool_take(&g->shared, r->interval, burst, ts) &&
+            !(g->slice && pool_take(&g->slice->shared, r->interval, burst, ts))) {
 
-                return 1 + s;
+                if (g->suppressed < INT_MAX - 1)
+                        g->suppressed++;
+                g->suppressed_total++;
+                return 0;
         }
 
-        if (p->num < burst) {
-                p->num++;
+        /* Under sustained pressure messages keep being let through as the pools are refilled, hence we report
+         * about the suppressed ones only once per interval. */
+        if (g->suppressed == 0 || (g->reported > 0 && g->reported + r->interval > ts))
                 return 1;
-        }
 
-        p->suppressed++;
+        s = g->suppressed;
+        g->suppressed = 0;
+        g->reported = ts;
+
+        return 1 + s;
+}
+
+int journal_rate_limit_write_suppressed(JournalRateLimit *r, const char *path) {
+        _cleanup_(unlink_and_freep) char *temp = NULL;
+        _cleanup_fclose_ FILE *f = NULL;
+        JournalRateLimitGroup *g;
+        int k;
+
+        assert(path);
+
+        /* Writes the number of messages suppressed so far for each unit that had any, one unit per line. Once
+         * written, a unit is forgotten like any other after an interval without messages, and not listed
+         * anymore. */
+
+        k = fopen_temporary(path, &f, &temp);
+        if (k < 0)
+                return k;
+
+        (void) fchmod(fileno(f), 0644);
+
+        if (r)
+                LIST_FOREACH(lru, g, r->lru)
+                        if (g->suppressed_total > 0)
+                                fprintf(f, "%s %" PRIu64 "\n", g->id, g->suppressed_total);
+
+        k = fflush_and_check(f);
+        if (k < 0)
+                return k;
+
+        if (rename(temp, path) < 0)
+                return -errno;
+
+        temp = mfree(temp);
+
+        if (r)
+                LIST_FOREACH(lru, g, r->lru)
+                        g->suppressed_written = g->suppressed_total;
+
         return 0;
 }
@@ -4,7 +4,10 @@
 #include "util.h"
 
 typedef struct JournalRateLimit JournalRateLimit;
+typedef struct JournalRateLimitGroup JournalRateLimitGroup;
 
 JournalRateLimit *journal_rate_limit_new(usec_t interval, unsigned burst);
 void journal_rate_limit_free(JournalRateLimit *r);
-int journal_rate_limit_test(JournalRateLimit *r, const char *id, int priority, uint64_t available);
+int journal_rate_limit_test(JournalRateLimit *r, JournalRateLimitGroup **cache, const char *id, const char *slice, int priority, uint64_t available, usec_t ts);
+JournalRateLimitGroup *journal_rate_limit_group_unref(JournalRateLimitGroup *g);
+int journal_rate_limit_write_suppressed(JournalRateLimit *r, const char *path);
@@ -0,0 +1,379 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <fcntl.h>
+
+#include "alloc-util.h"
+#include "def.h"
+#include "dirent-util.h"
+#include "fd-util.h"
+#include "fileio.h"
+#include "hashmap.h"
+#include "journal-verify.h"
+#include "journald-scrub.h"
+#include "journald-server.h"
+#include "mkdir.h"
+#include "parse-util.h"
+#include "path-util.h"
+#include "string-util.h"
+
+/* Archived journal files are checked in the background, a few milliseconds at a time, so that corruption is noticed
+ * long before anybody tries to read them. The files themselves are never written to. Progress is recorded in a
+ * state file of our own instead, hence a restart of journald continues where it left off, and files that were
+ * checked completely are not looked at again. */
+
+#define SCRUB_STATE_FILE "/var/lib/systemd/journal/scrub"
+
+/* Each step stops after whichever of the two limits is hit first */
+#define SCRUB_STEP_BYTES (8U*1024U*1024U)
+#define SCRUB_STEP_MAX_USEC (5*USEC_PER_MSEC)
+#define SCRUB_STEP_USEC (100*USEC_PER_MSEC)
+
+/* How often we look for files that were archived since we were last done with all of them */
+#define SCRUB_RESCAN_USEC (1*USEC_PER_HOUR)
+
+/* Give the system time to settle after boot, before we start reading in old files */
+#define SCRUB_START_USEC (5*USEC_PER_MINUTE)
+
+/* Recorded for files that were checked completely, whether they turned out to be fine or not */
+#define SCRUB_DONE UINT64_MAX
+
+static int server_scrub_record(Server *s, const char *path, uint64_t offset) {
+        _cleanup_free_ uint64_t *v = NULL;
+        _cleanup_free_ char *p = NULL;
+        uint64_t *existing;
+        int r;
+
+        assert(s);
+        assert(path);
+
+        existing = hashmap_get(s->scrub_offsets, path);
+        if (existing) {
+                *existing = offset;
+                return 0;
+        }
+
+        r = hashmap_ensure_allocated(&s->scrub_offsets, &path_hash_ops);
+        if (r < 0)
+                return r;
+
+        p = strdup(path);
+        v = newdup(uint64_t, &offset, 1);
+        if (!p || !v)
+                return -ENOMEM;
+
+        r = hashmap_put(s->scrub_offsets, p, v);
+        if (r < 0)
+                return r;
+
+        p = NULL;
+        v = NULL;
+
+        return 0;
+}
+
+static int server_scrub_load_state(Server *s) {
+        _cleanup_fclose_ FILE *f = NULL;
+        int r;
+
+        assert(s);
+
+        /* Loaded only once we start scrubbing, since /var might not have been mounted when we were started */
+
+        s->scrub_state_loaded = true;
+
+        f = fopen(SCRUB_STATE_FILE, "re");
+        if (!f) {
+                if (errno == ENOENT)
+                        return 0;
+
+                return log_debug_errno(errno, "Failed to open %s, ignoring: %m", SCRUB_STATE_FILE);
+        }
+
+        for (;;) {
+                _cleanup_free_ char *line = NULL;
+                uint64_t offset;
+                char *p;
+
+                r = read_line(f, LONG_LINE_MAX, &line);
+                if (r < 0)
+                        return log_debug_errno(r, "Failed to read %s, ignoring: %m", SCRUB_STATE_FILE);
+                if (r == 0)
+                        break;
+
+                if (IN_SET(line[0], 0, '#'))
+                        continue;
+
+                /* Each line carries an offset and the path of the file it belongs to */
+                p = strchr(line, ' ');
+                if (!p) {
+                        log_debug("Ignoring invalid line in %s: %s", SCRUB_STATE_FILE, line);
+                        continue;
+                }
+
+                *(p++) = 0;
+
+                if (safe_atou64(line, &offset) < 0 || !path_is_absolute(p)) {
+                        log_debug("Ignoring invalid line in %s: %s %s", SCRUB_STATE_FILE, line, p);
+                        continue;
+                }
+
+                r = server_scrub_record(s, p, offset);
+                if (r < 0)
+                        return log_oom();
+        }
+
+        return 0;
+}
+
+static int server_scrub_save_state(Server *s) {
+        _cleanup_free_ char *temp_path = NULL;
+        _cleanup_fclose_ FILE *f = NULL;
+        uint64_t *offset;
+        const char *path;
+        Iterator i;
+        int r;
+
+        assert(s);
+
+        if (!s->scrub_state_loaded)
+                return 0;
+
+        /* Forget about files that were vacuumed meanwhile */
+        HASHMAP_FOREACH_KEY(offset, path, s->scrub_offsets, i) {
+                void *k;
+
+                if (access(path, F_OK) >= 0 || errno != ENOENT)
+                        continue;
+
+                free(hashmap_remove2(s->scrub_offsets, path, &k));
+                free(k);
+        }
+
+        r = mkdir_parents(SCRUB_STATE_FILE, 0755);
+        if (r < 0)
+                goto fail;
+
+        r = fopen_temporary(SCRUB_STATE_FILE, &f, &temp_path);
+        if (r < 0)
+                goto fail;
+
+        fputs("# This is private data. Do not parse.\n", f);
+
+        HASHMAP_FOREACH_KEY(offset, path, s->scrub_offsets, i)
+                fprintf(f, "%" PRIu64 " %s\n", *offset, path);
+
+        r = fflush_and_check(f);
+        if (r < 0)
+                goto fail;
+
+        if (rename(temp_path, SCRUB_STATE_FILE) < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        return 0;
+
+fail:
+        if (temp_path)
+                (void) unlink(temp_path);
+
+        return log_debug_errno(r, "Failed to save scrubbing progress to %s, ignoring: %m", SCRUB_STATE_FILE);
+}
+
+static void server_scrub_close(Server *s) {
+        assert(s);
+
+        s->scrubber = journal_file_scrub_free(s->scrubber);
+
+        if (s->scrub_file)
+                s->scrub_file = journal_file_close(s->scrub_file);
+}
+
+static int server_scrub_done(Server *s) {
+        int r;
+
+        assert(s);
+        assert(s->scrub_file);
+
+        r = server_scrub_record(s, s->scrub_file->path, SCRUB_DONE);
+        server_scrub_close(s);
+        if (r < 0)
+                return r;
+
+        (void) server_scrub_save_state(s);
+
+        return 0;
+}
+
+static int server_scrub_open_next(Server *s) {
+        const char *dirs[] = { s->system_storage.path, s->runtime_storage.path };
+        unsigned i;
+        int r;
+
+        assert(s);
+        assert(!s->scrub_file);
+
+        /* Finds the next archived file that wasn't checked completely yet. Returns 0 if there is none. */
+
+        for (i = 0; i < ELEMENTSOF(dirs); i++) {
+                _cleanup_closedir_ DIR *d = NULL;
+                struct dirent *de;
+
+                d = opendir(dirs[i]);
+                if (!d) {
+                        if (errno != ENOENT)
+                                log_debug_errno(errno, "Failed to open %s, not scrubbing its files: %m", dirs[i]);
+                        continue;
+                }
+
+                FOREACH_DIRENT(de, d, break) {
+                        _cleanup_free_ char *p = NULL;
+                        uint64_t *offset;
+                        JournalFile *f;
+
+                        dirent_ensure_type(d, de);
+                        if (de->d_type != DT_REG)
+                                continue;
+
+                        /* Archived files carry the seqnum ID and head entry of their contents in their names */
+                        if (!endswith(de->d_name, ".journal") || !strchr(de->d_name, '@'))
+                                continue;
+
+                        p = strjoin(dirs[i], "/", de->d_name);
+                        if (!p)
+                                return -ENOMEM;
+
+                        offset = hashmap_get(s->scrub_offsets, p);
+                        if (offset && *offset == SCRUB_DONE)
+                                continue;
+
+                        /* With an mmap cache of its own, since the one of the server is used by the writer thread */
+                        r = journal_file_open(-1, p, O_RDONLY, 0, 0, 0, false, NULL, NULL, NULL, NULL, &f);
+                        if (r < 0) {
+                                log_debug_errno(r, "Failed to open %s for scrubbing, ignoring: %m", p);
+                                continue;
+                        }
+
+                        s->scrub_file = f;
+
+                        if (f->header->state != STATE_ARCHIVED) {
+                                r = server_scrub_done(s);
+                                if (r < 0)
+                                        return r;
+
+                                continue;
+                        }
+
+                        r = journal_file_scrub_new(f, offset ? *offset : 0, &s->scrubber);
+                        if (r < 0) {
+                                log_debug_errno(r, "Cannot scrub %s, ignoring: %m", p);
+
+                                r = server_scrub_done(s);
+                                if (r < 0)
+                                        return r;
+
+                                continue;
+                        }
+
+                        log_debug("Scrubbing %s from offset %" PRIu64 ".", p, journal_file_scrub_offset(s->scrubber));
+                        return 1;
+                }
+        }
+
+        return 0;
+}
+
+static int server_scrub_step(Server *s) {
+        uint64_t p;
+        int r;
+
+        assert(s);
+        assert(s->scrubber);
+
+        r = journal_file_scrub_step(s->scrubber, SCRUB_STEP_BYTES, now(CLOCK_MONOTONIC) + SCRUB_STEP_MAX_USEC);
+        if (r < 0) {
+                p = journal_file_scrub_offset(s->scrubber);
+
+                server_driver_message(s, 0, NULL,
+                                      LOG_MESSAGE("Archived journal file %s is corrupted at offset %" PRIu64 ", run 'journalctl --verify --file=%s' for details.",
+                                                  s->scrub_file->path, p, s->scrub_file->path),
+                                      "JOURNAL_PATH=%s", s->scrub_file->path,
+                                      "OFFSET=%" PRIu64, p,
+                                      NULL);
+
+                return server_scrub_done(s);
+        }
+        if (r > 0) {
+                log_debug("Scrubbed %s, no corruption found.", s->scrub_file->path);
+                return server_scrub_done(s);
+        }
+
+        /* Saved to disk only once the file is done, or when we are stopped */
+        return server_scrub_record(s, s->scrub_file->path, journal_file_scrub_offset(s->scrubber));
+}
+
+static int dispatch_scrub(sd_event_source *es, usec_t usec, void *userdata) {
+        Server *s = userdata;
+        usec_t next = SCRUB_STEP_USEC;
+        int r;
+
+        assert(s);
+
+        if (!s->scrub_state_loaded)
+                (void) server_scrub_load_state(s);
+
+        if (!s->scrubber) {
+                r = server_scrub_open_next(s);
+                if (r < 0)
+                        log_warning_errno(r, "Failed to find journal files to scrub, ignoring: %m");
+                if (r <= 0)
+                        next = SCRUB_RESCAN_USEC;
+        }
+
+        if (s->scrubber) {
+                r = server_scrub_step(s);
+                if (r < 0)
+                        log_warning_errno(r, "Failed to scrub journal file, ignoring: %m");
+        }
+
+        r = sd_event_source_set_time(es, usec + next);
+        if (r < 0)
+                return log_error_errno(r, "Failed to reschedule scrubbing: %m");
+
+        return sd_event_source_set_enabled(es, SD_EVENT_ONESHOT);
+}
+
+int server_start_scrub(Server *s) {
+        int r;
+
+        assert(s);
+
+        if (!s->scrub)
+                return 0;
+
+        r = sd_event_add_time(s->event, &s->scrub_event_source, CLOCK_MONOTONIC,
+                              now(CLOCK_MONOTONIC) + SCRUB_START_USEC, USEC_PER_SEC,
+                              dispatch_scrub, s);
+        if (r < 0)
+                return log_error_errno(r, "Failed to add scrub event source: %m");
+
+        r = sd_event_source_set_priority(s->scrub_event_source, SD_EVENT_PRIORITY_IDLE);
+        if (r < 0)
+                return log_error_errno(r, "Failed to adjust priority of scrub event source: %m");
+
+        return 0;
+}
+
+void server_stop_scrub(Server *s) {
+        assert(s);
+
+        if (s->scrubber &&
+            server_scrub_record(s, s->scrub_file->path, journal_file_scrub_offset(s->scrubber)) >= 0)
+                (void) server_scrub_save_state(s);
+
+        server_scrub_close(s);
+
+        s->scrub_event_source = sd_event_source_unref(s->scrub_event_source);
+        s->scrub_offsets = hashmap_free_free_free(s->scrub_offsets);
+        s->scrub_state_loaded = false;
+}
@@ -18,8 +18,8 @@
 #include "alloc-util.h"
 #include "audit-util.h"
 #include "cgroup-util.h"
+#include "compress.h"
 #include "conf-parser.h"
-#include "dirent-util.h"
 #include "extract-word.h"
 #include "fd-util.h"
 #include "fileio.h"
@@ -31,6 +31,7 @@
 #include "io-util.h"
 #include "journal-authenticate.h"
 #include "journal-file.h"
+#include "journal-importer.h"
 #include "journal-internal.h"
 #include "journal-vacuum.h"
 #include "journald-audit.h"
@@ -38,9 +39,11 @@
 #include "journald-kmsg.h"
 #include "journald-native.h"
 #include "journald-rate-limit.h"
+#include "journald-scrub.h"
 #include "journald-server.h"
 #include "journald-stream.h"
 #include "journald-syslog.h"
+#include "journald-writer.h"
 #include "log.h"
 #include "missing.h"
 #include "mkdir.h"
@@ -68,6 +71,13 @@
 
 #define NOTIFY_SNDBUF_SIZE (8*1024*1024)
 
+/* How many datagrams we receive at once, and how large each may be. Once a datagram is part of a batch it cannot be
+ * received again, should it not fit. Hence each one gets room for the largest datagram clients send: older
+ * sd_journal_sendv() raised SO_SNDBUF to 8M, which the kernel doubles. Only pages that are written to are backed by
+ * memory, and we give back what goes beyond NATIVE_DATAGRAM_SIZE_MAX after each large datagram. */
+#define DATAGRAM_BATCH_MAX 16U
+#define DATAGRAM_BATCH_BUFFER_SIZE (16U*1024U*1024U)
+
 /* The period to insert between posting changes for coalescing */
 #define POST_CHANGE_TIMER_INTERVAL_USEC (250*USEC_PER_MSEC)
 
@@ -75,41 +85,82 @@
  * for a bit of additional metadata. */
 #define DEFAULT_LINE_MAX (48*1024)
 
-static int determine_path_usage(Server *s, const char *path, uint64_t *ret_used, uint64_t *ret_free) {
-        _cleanup_closedir_ DIR *d = NULL;
-        struct dirent *de;
+static Server* server_lock_journals(Server *s) {
+        assert(s);
+
+        /* While the writer thread is running, the journal files (and everything that goes with them) are its
+         * business. Code on the event loop that wants to touch them needs to lock them first, which waits until
+         * everything queued so far has been written. Returns the server if it needs to be unlocked again, NULL
+         * if we own the journal files already. */
+
+        if (!s->writer || journal_writer_in_writer_thread() || journal_writer_is_locked(s->writer))
+                return NULL;
+
+        journal_writer_lock(s->writer);
+        return s;
+}
+
+static int server_try_lock_journals(Server *s, Server **ret_locked) {
+        assert(s);
+        assert(ret_locked);
+
+        /* Like server_lock_journals(), but fails with -EBUSY rather than waiting for the writer thread */
+
+        if (!s->writer || journal_writer_in_writer_thread() || journal_writer_is_locked(s->writer)) {
+                *ret_locked = NULL;
+                return 0;
+        }
+
+        if (!journal_writer_trylock(s->writer))
+                return -EBUSY;
+
+        *ret_locked = s;
+        return 0;
+}
+
+static void server_unlock_journalsp(Server **s) {
+        if (*s)
+                journal_writer_unlock((*s)->writer);
+}
+
+bool server_trylock_journals(Server *s) {
+        assert(s);
+        assert(!s->writer || !journal_writer_is_locked(s->writer));
+
+        /* Only to be called from the main loop, when not holding the lock already. If this returns false, the
+         * event loop is woken up once the writer thread is done, so that it can try again. */
+
+        if (!s->writer)
+                return true;
+
+        return journal_writer_trylock(s->writer);
+}
+
+void server_unlock_journals(Server *s) {
+        assert(s);
+
+        if (s->writer)
+                journal_writer_unlock(s->writer);
+}
+
+static int determine_path_usage(Server *s, JournalStorage *storage, uint64_t *ret_used, uint64_t *ret_free) {
         struct statvfs ss;
+        int r;
 
+        assert(storage);
         assert(ret_used);
         assert(ret_free);
 
-        d = opendir(path);
-        if (!d)
+        if (statvfs(storage->path, &ss) < 0)
                 return log_full_errno(errno == ENOENT ? LOG_DEBUG : LOG_ERR,
-                                      errno, "Failed to open %s: %m", path);
-
-        if (fstatvfs(dirfd(d), &ss) < 0)
-                return log_error_errno(errno, "Failed to fstatvfs(%s): %m", path);
+                                      errno, "Failed to statvfs(%s): %m", storage->path);
 
         *ret_free = ss.f_bsize * ss.f_bavail;
-        *ret_used = 0;
-        FOREACH_DIRENT_ALL(de, d, break) {
-                struct stat st;
 
-                if (!endswith(de->d_name, ".journal") &&
-                    !endswith(de->d_name, ".journal~"))
-                        continue;
-
-                if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
-                        log_debug_errno(errno, "Failed to stat %s/%s, ignoring: %m", path, de->d_name);
-                        continue;
-                }
-
-                if (!S_ISREG(st.st_mode))
-                        continue;
-
-                *ret_used += (uint64_t) st.st_blocks * 512UL;
-        }
+        /* Only reads the directory if it was changed by others */
+        r = journal_vacuum_plan_get_usage(storage->vacuum_plan, ret_used);
+        if (r < 0)
+                return log_error_errno(r, "Failed to determine disk usage of %s: %m", storage->path);
 
         return 0;
 }
@@ -135,7 +186,7 @@ static int cache_space_refresh(Server *s, JournalStorage *storage) {
         if (space->timestamp != 0 && space->timestamp + RECHECK_SPACE_USEC > ts)
                 return 0;
 
-        r = determine_path_usage(s, storage->path, &vfs_used, &vfs_avail);
+        r = determine_path_usage(s, storage, &vfs_used, &vfs_avail);
         if (r < 0)
                 return r;
 
@@ -183,10 +234,13 @@ static int determine_space(Server *s, uint64_t *available, uint64_t *limit) {
 void server_space_usage_message(Server *s, JournalStorage *storage) {
         char fb1[FORMAT_BYTES_MAX], fb2[FORMAT_BYTES_MAX], fb3[FORMAT_BYTES_MAX],
              fb4[FORMAT_BYTES_MAX], fb5[FORMAT_BYTES_MAX], fb6[FORMAT_BYTES_MAX];
+        _cleanup_(server_unlock_journalsp) Server *locked = NULL;
         JournalMetrics *metrics;
 
         assert(s);
 
+        locked = server_lock_journals(s);
+
         if (!storage)
                 storage = s->system_journal ? &s->system_storage : &s->runtime_storage;
 
@@ -245,6 +299,12 @@ static void server_add_acls(JournalFile *f, uid_t uid) {
 #endif
 }
 
+static int server_compression(Server *s) {
+        assert(s);
+
+        return s->compress.enabled ? s->compress.algorithm : 0;
+}
+
 static int open_journal(
                 Server *s,
                 bool reliably,
@@ -261,19 +321,23 @@ static int open_journal(
         assert(ret);
 
         if (reliably)
-                r = journal_file_open_reliably(fname, flags, 0640, s->compress.enabled, s->compress.threshold_bytes,
+                r = journal_file_open_reliably(fname, flags, 0640, server_compression(s), s->compress.threshold_bytes,
                                                seal, metrics, s->mmap, s->deferred_closes, NULL, &f);
         else
-                r = journal_file_open(-1, fname, flags, 0640, s->compress.enabled, s->compress.threshold_bytes, seal,
+                r = journal_file_open(-1, fname, flags, 0640, server_compression(s), s->compress.threshold_bytes, seal,
                                       metrics, s->mmap, s->deferred_closes, NULL, &f);
 
         if (r < 0)
                 return r;
 
-        r = journal_file_enable_post_change_timer(f, s->event, POST_CHANGE_TIMER_INTERVAL_USEC);
-        if (r < 0) {
-                (void) journal_file_close(f);
-                return r;
+        /* The timer lives on the event loop, which the writer thread may not touch. Without it, the writer
+         * thread posts changes right away, but only once per batch of entries. */
+        if (!s->writer) {
+                r = journal_file_enable_post_change_timer(f, s->event, POST_CHANGE_TIMER_INTERVAL_USEC);
+                if (r < 0) {
+                        (void) journal_file_close(f);
+                        return r;
+                }
         }
 
         *ret = f;
@@ -323,8 +387,15 @@ static int system_journal_open(Server *s, bool flush_requested) {
                  * Perform an implicit flush to var, leaving the runtime
                  * journal closed, now that the system journal is back.
                  */
-                if (!flush_requested)
-                        (void) server_flush_to_var(s, true);
+                if (!flush_requested) {
+                        /* Flushing logs about itself, which the writer thread can't do. Leave it to the event
+                         * loop, we'll keep writing to the runtime journal until then. */
+                        if (journal_writer_in_writer_thread()) {
+                                s->flush_requested = true;
+                                journal_writer_wakeup(s->writer);
+                        } else
+                                (void) server_flush_to_var(s, true);
+                }
         }
 
         if (!s->runtime_journal &&
@@ -436,18 +507,32 @@ static JournalFile* find_journal(Server *s, uid_t uid) {
 
 static int do_rotate(
                 Server *s,
+                JournalStorage *storage,
                 JournalFile **f,
                 const char* name,
                 bool seal,
                 uint32_t uid) {
 
-        int r;
+        _cleanup_free_ char *archived = NULL;
+        int r, k;
         assert(s);
+        assert(storage);
 
         if (!*f)
                 return -EINVAL;
 
-        r = journal_file_rotate(f, s->compress.enabled, s->compress.threshold_bytes, seal, s->deferred_closes);
+        /* Let the vacuum plan know about the archived file, rather than having it read the directory again */
+        (void) journal_vacuum_plan_validate(storage->vacuum_plan);
+        (void) journal_file_archived_path(*f, &archived);
+
+        r = journal_file_rotate(f, server_compression(s), s->compress.threshold_bytes, seal, s->deferred_closes);
+
+        if (archived) {
+                k = journal_vacuum_plan_add(storage->vacuum_plan, basename(archived));
+                if (k < 0)
+                        log_debug_errno(k, "Failed to add %s to vacuum plan, ignoring: %m", archived);
+        }
+
         if (r < 0) {
                 if (*f)
                         return log_error_errno(r, "Failed to rotate %s: %m", (*f)->path);
@@ -460,19 +545,47 @@ static int do_rotate(
         return r;
 }
 
+static void server_process_deferred_closes(Server *s) {
+        JournalFile *f;
+        Iterator i;
+        int r;
+
+        assert(s);
+
+        /* Rotated files are indexed in the background. Once that is done, append the index and set the file
+         * offline, again in the background. Then perform the deferred close. */
+        SET_FOREACH(f, s->deferred_closes, i) {
+                r = journal_file_finish_indexing(f, false);
+                if (r == -EAGAIN)
+                        continue;
+                if (r > 0) {
+                        (void) journal_file_set_offline(f, false);
+                        continue;
+                }
+
+                if (!journal_file_is_offlining(f)) {
+                        (void) set_remove(s->deferred_closes, f);
+                        (void) journal_file_close(f);
+                }
+        }
+}
+
 void server_rotate(Server *s) {
+        _cleanup_(server_unlock_journalsp) Server *locked = NULL;
         JournalFile *f;
         void *k;
         Iterator i;
         int r;
 
+        locked = server_lock_journals(s);
+
         log_debug("Rotating...");
 
-        (void) do_rotate(s, &s->runtime_journal, "runtime", false, 0);
-        (void) do_rotate(s, &s->system_journal, "system", s->seal, 0);
+        (void) do_rotate(s, &s->runtime_storage, &s->runtime_journal, "runtime", false, 0);
+        (void) do_rotate(s, &s->system_storage, &s->system_journal, "system", s->seal, 0);
 
         ORDERED_HASHMAP_FOREACH_KEY(f, k, s->user_journals, i) {
-                r = do_rotate(s, &f, "user", s->seal, PTR_TO_UID(k));
+                r = do_rotate(s, &s->system_storage, &f, "user", s->seal, PTR_TO_UID(k));
                 if (r >= 0)
                         ordered_hashmap_replace(s->user_journals, k, f);
                 else if (!f)
@@ -480,19 +593,47 @@ void server_rotate(Server *s) {
                         ordered_hashmap_remove(s->user_journals, k);
         }
 
-        /* Perform any deferred closes which aren't still offlining. */
-        SET_FOREACH(f, s->deferred_closes, i)
-                if (!journal_file_is_offlining(f)) {
-                        (void) set_remove(s->deferred_closes, f);
-                        (void) journal_file_close(f);
-                }
+        server_process_deferred_closes(s);
+}
+
+static void server_report_writer_stats(Server *s) {
+        char ts[FORMAT_TIMESPAN_MAX], fb[FORMAT_BYTES_MAX];
+        JournalWriterStats stats;
+
+        assert(s);
+
+        if (!s->writer)
+                return;
+
+        journal_writer_get_stats(s->writer, true, &stats);
+
+        log_debug("Writer thread wrote %" PRIu64 " entries in %" PRIu64 " batches, queue peaked at %zu entries (%s).",
+                  stats.n_entries, stats.n_batches, stats.max_queued, format_bytes(fb, sizeof(fb), stats.max_queued_bytes));
+
+        if (stats.n_stalls == 0)
+                return;
+
+        server_driver_message(s, 0, NULL,
+                              LOG_MESSAGE("Journal writer could not keep up, stopped receiving %" PRIu64 " times for a total of %s.",
+                                          stats.n_stalls,
+                                          format_timespan(ts, sizeof(ts), stats.stall_usec, USEC_PER_MSEC)),
+                              "N_STALLS=%" PRIu64, stats.n_stalls,
+                              "STALL_USEC=" USEC_FMT, stats.stall_usec,
+                              "QUEUE_MAX_ENTRIES=%zu", stats.max_queued,
+                              "QUEUE_MAX_BYTES=%zu", stats.max_queued_bytes,
+                              NULL);
 }
 
 void server_sync(Server *s) {
+        _cleanup_(server_unlock_journalsp) Server *locked = NULL;
         JournalFile *f;
         Iterator i;
         int r;
 
+        locked = server_lock_journals(s);
+
+        server_report_writer_stats(s);
+
         if (s->system_journal) {
                 r = journal_file_set_offline(s->system_journal, false);
                 if (r < 0)
@@ -505,6 +646,9 @@ void server_sync(Server *s) {
                         log_warning_errno(r, "Failed to sync user journal, ignoring: %m");
         }
 
+        /* Also finish what is left to do for the files rotated away from */
+        server_process_deferred_closes(s);
+
         if (s->sync_event_source) {
                 r = sd_event_source_set_enabled(s->sync_event_source, SD_EVENT_OFF);
                 if (r < 0)
@@ -526,9 +670,9 @@ static void do_vacuum(Server *s, JournalStorage *storage, bool verbose) {
         if (verbose)
                 server_space_usage_message(s, storage);
 
-        r = journal_directory_vacuum(storage->path, storage->space.limit,
-                                     storage->metrics.n_max_files, s->max_retention_usec,
-                                     &s->oldest_file_usec, verbose);
+        r = journal_vacuum_plan_execute(storage->vacuum_plan, storage->space.limit,
+                                        storage->metrics.n_max_files, s->max_retention_usec,
+                                        &s->oldest_file_usec, verbose);
         if (r < 0 && r != -ENOENT)
                 log_warning_errno(r, "Failed to vacuum %s, ignoring: %m", storage->path);
 
@@ -536,8 +680,12 @@ static void do_vacuum(Server *s, JournalStorage *storage, bool verbose) {
 }
 
 int server_vacuum(Server *s, bool verbose) {
+        _cleanup_(server_unlock_journalsp) Server *locked = NULL;
+
         assert(s);
 
+        locked = server_lock_journals(s);
+
         log_debug("Vacuuming...");
 
         s->oldest_file_usec = 0;
@@ -639,23 +787,18 @@ static bool shall_try_append_again(JournalFile *f, int r) {
         }
 }
 
-static void write_to_journal(Server *s, uid_t uid, struct iovec *iovec, size_t n, int priority) {
-        bool vacuumed = false, rotate = false;
-        struct dual_timestamp ts;
+static void write_to_journal(Server *s, uid_t uid, const dual_timestamp *ts, const JournalEntry *entries, size_t n_entries) {
+        bool vacuumed = false, rotate = false, retried = false;
         JournalFile *f;
+        size_t k;
         int r;
 
         assert(s);
-        assert(iovec);
-        assert(n > 0);
+        assert(ts);
+        assert(entries);
+        assert(n_entries > 0);
 
-        /* Get the closest, linearized time we have for this log event from the event loop. (Note that we do not use
-         * the source time, and not even the time the event was originally seen, but instead simply the time we started
-         * processing it, as we want strictly linear ordering in what we write out.) */
-        assert_se(sd_event_now(s->event, CLOCK_REALTIME, &ts.realtime) >= 0);
-        assert_se(sd_event_now(s->event, CLOCK_MONOTONIC, &ts.monotonic) >= 0);
-
-        if (ts.realtime < s->last_realtime_clock) {
+        if (ts->realtime < s->last_realtime_clock) {
                 /* When the time jumps backwards, let's immediately rotate. Of course, this should not happen during
                  * regular operation. However, when it does happen, then we should make sure that we start fresh files
                  * to ensure that the entries in the journal files are strictly ordered by time, in order to ensure
@@ -685,32 +828,118 @@ static void write_to_journal(Server *s, uid_t uid, struct iovec *iovec, size_t n
                         return;
         }
 
-        s->last_realtime_clock = ts.realtime;
+        s->last_realtime_clock = ts->realtime;
 
-        r = journal_file_append_entry(f, &ts, NULL, iovec, n, &s->seqnum, NULL, NULL);
-        if (r >= 0) {
-                server_schedule_sync(s, priority);
-                return;
+        for (;;) {
+                r = journal_file_append_entries(f, ts, NULL, entries, n_entries, &s->seqnum, &k);
+                if (r >= 0)
+                        return;
+
+                /* Skip over what made it, the entry at hand is the one that failed */
+                entries += k;
+                n_entries -= k;
+
+                if (vacuumed || !shall_try_append_again(f, r)) {
+                        if (retried)
+                                log_error_errno(r, "Failed to write entry (%u items, %zu bytes) despite vacuuming, ignoring: %m",
+                                                entries->n_iovec, IOVEC_TOTAL_SIZE(entries->iovec, entries->n_iovec));
+                        else
+                                log_error_errno(r, "Failed to write entry (%u items, %zu bytes), ignoring: %m",
+                                                entries->n_iovec, IOVEC_TOTAL_SIZE(entries->iovec, entries->n_iovec));
+
+                        entries++;
+                        n_entries--;
+                        if (n_entries == 0)
+                                return;
+
+                        continue;
+                }
+
+                server_rotate(s);
+                server_vacuum(s, false);
+                vacuumed = retried = true;
+
+                f = find_journal(s, uid);
+                if (!f)
+                        return;
+
+                log_debug("Retrying write.");
         }
+}
 
-        if (vacuumed || !shall_try_append_again(f, r)) {
-                log_error_errno(r, "Failed to write entry (%zu items, %zu bytes), ignoring: %m", n, IOVEC_TOTAL_SIZE(iovec, n));
-                return;
+static void server_write(Server *s, uid_t uid, struct iovec *iovec, size_t n, int priority) {
+        dual_timestamp ts;
+        int r;
+
+        assert(s);
+        assert(iovec);
+        assert(n > 0);
+
+        /* Get the closest, linearized time we have for this log event from the event loop. (Note that we do not use
+         * the source time, and not even the time the event was originally seen, but instead simply the time we started
+         * processing it, as we want strictly linear ordering in what we write out.) */
+        assert_se(sd_event_now(s->event, CLOCK_REALTIME, &ts.realtime) >= 0);
+        assert_se(sd_event_now(s->event, CLOCK_MONOTONIC, &ts.monotonic) >= 0);
+
+        if (s->writer && !journal_writer_is_locked(s->writer)) {
+                r = journal_writer_enqueue(s->writer, uid, priority, &ts, iovec, n);
+                if (r < 0) {
+                        log_error_errno(r, "Failed to queue entry (%zu items, %zu bytes), ignoring: %m", n, IOVEC_TOTAL_SIZE(iovec, n));
+                        return;
+                }
+        } else
+                /* No writer thread, or we locked the journal files, and hence everything queued is written
+                 * already. Either way it's on us. */
+                write_to_journal(s, uid, &ts, &(JournalEntry) { .iovec = iovec, .n_iovec = n }, 1);
+
+        server_schedule_sync(s, priority);
+}
+
+static void server_write_batch(JournalWriterEntry *entries[], size_t n, void *userdata) {
+        Server *s = userdata;
+        JournalEntry *group;
+        size_t i, j;
+
+        assert(s);
+        assert(entries);
+
+        /* Called in the writer thread. Entries received in the same event loop iteration carry the same
+         * timestamp, and if they also go into the same file, we append them in one go. */
+
+        group = newa(JournalEntry, n);
+
+        for (i = 0; i < n; i = j) {
+                for (j = i; j < n; j++) {
+                        if (entries[j]->uid != entries[i]->uid ||
+                            entries[j]->ts.realtime != entries[i]->ts.realtime ||
+                            entries[j]->ts.monotonic != entries[i]->ts.monotonic)
+                                break;
+
+                        group[j - i] = (JournalEntry) {
+                                .iovec = entries[j]->iovec,
+                                .n_iovec = entries[j]->n_iovec,
+                        };
+                }
+
+                write_to_journal(s, entries[i]->uid, &entries[i]->ts, group, j - i);
         }
+}
 
-        server_rotate(s);
-        server_vacuum(s, false);
+static void server_writer_wakeup(void *userdata) {
+        _cleanup_(server_unlock_journalsp) Server *locked = NULL;
+        Server *s = userdata;
 
-        f = find_journal(s, uid);
-        if (!f)
+        assert(s);
+
+        /* Most wakeups only tell us that the writer thread is done with what was queued, because
+         * server_try_lock_journals() failed earlier, and then there is nothing to do here. Only take the
+         * lock, which waits for whatever was queued in the meantime, if there is a flush to do. */
+        if (!__sync_bool_compare_and_swap(&s->flush_requested, true, false))
                 return;
 
-        log_debug("Retrying write.");
-        r = journal_file_append_entry(f, &ts, NULL, iovec, n, &s->seqnum, NULL, NULL);
-        if (r < 0)
-                log_error_errno(r, "Failed to write entry (%zu items, %zu bytes) despite vacuuming, ignoring: %m", n, IOVEC_TOTAL_SIZE(iovec, n));
-        else
-                server_schedule_sync(s, priority);
+        locked = server_lock_journals(s);
+
+        (void) server_flush_to_var(s, true);
 }
 
 #define IOVEC_ADD_NUMERIC_FIELD(iovec, n, value, type, isset, format, field)  \
@@ -754,11 +983,17 @@ static void dispatch_message_real(
 
         char source_time[sizeof("_SOURCE_REALTIME_TIMESTAMP=") + DECIMAL_STR_MAX(usec_t)];
         uid_t journal_uid;
-        ClientContext *o;
+        ClientContext *o = NULL;
 
         assert(s);
         assert(iovec);
         assert(n > 0);
+
+        /* Look up the object first: its unit data might be shared with the client, and refreshing it must not happen
+         * after we copied references to it. */
+        if (pid_is_valid(object_pid) && client_context_get(s, object_pid, NULL, NULL, 0, NULL, &o) < 0)
+                o = NULL;
+
         assert(n +
                N_IOVEC_META_FIELDS +
                (pid_is_valid(object_pid) ? N_IOVEC_OBJECT_FIELDS : 0) +
@@ -778,26 +1013,30 @@ static void dispatch_message_real(
 
                 IOVEC_ADD_NUMERIC_FIELD(iovec, n, c->auditid, uint32_t, audit_session_is_valid, "%" PRIu32, "_AUDIT_SESSION");
                 IOVEC_ADD_NUMERIC_FIELD(iovec, n, c->loginuid, uid_t, uid_is_valid, UID_FMT, "_AUDIT_LOGINUID");
+        }
 
-                IOVEC_ADD_STRING_FIELD(iovec, n, c->cgroup, "_SYSTEMD_CGROUP");
-                IOVEC_ADD_STRING_FIELD(iovec, n, c->session, "_SYSTEMD_SESSION");
-                IOVEC_ADD_NUMERIC_FIELD(iovec, n, c->owner_uid, uid_t, uid_is_valid, UID_FMT, "_SYSTEMD_OWNER_UID");
-                IOVEC_ADD_STRING_FIELD(iovec, n, c->unit, "_SYSTEMD_UNIT");
-                IOVEC_ADD_STRING_FIELD(iovec, n, c->user_unit, "_SYSTEMD_USER_UNIT");
-                IOVEC_ADD_STRING_FIELD(iovec, n, c->slice, "_SYSTEMD_SLICE");
-                IOVEC_ADD_STRING_FIELD(iovec, n, c->user_slice, "_SYSTEMD_USER_SLICE");
+        if (c && c->unit_context) {
+                const UnitContext *u = c->unit_context;
 
-                IOVEC_ADD_ID128_FIELD(iovec, n, c->invocation_id, "_SYSTEMD_INVOCATION_ID");
+                IOVEC_ADD_STRING_FIELD(iovec, n, u->cgroup, "_SYSTEMD_CGROUP");
+                IOVEC_ADD_STRING_FIELD(iovec, n, u->session, "_SYSTEMD_SESSION");
+                IOVEC_ADD_NUMERIC_FIELD(iovec, n, u->owner_uid, uid_t, uid_is_valid, UID_FMT, "_SYSTEMD_OWNER_UID");
+                IOVEC_ADD_STRING_FIELD(iovec, n, u->unit, "_SYSTEMD_UNIT");
+                IOVEC_ADD_STRING_FIELD(iovec, n, u->user_unit, "_SYSTEMD_USER_UNIT");
+                IOVEC_ADD_STRING_FIELD(iovec, n, u->slice, "_SYSTEMD_SLICE");
+                IOVEC_ADD_STRING_FIELD(iovec, n, u->user_slice, "_SYSTEMD_USER_SLICE");
 
-                if (c->extra_fields_n_iovec > 0) {
-                        memcpy(iovec + n, c->extra_fields_iovec, c->extra_fields_n_iovec * sizeof(struct iovec));
-                        n += c->extra_fields_n_iovec;
+                IOVEC_ADD_ID128_FIELD(iovec, n, u->invocation_id, "_SYSTEMD_INVOCATION_ID");
+
+                if (u->extra_fields_n_iovec > 0) {
+                        memcpy(iovec + n, u->extra_fields_iovec, u->extra_fields_n_iovec * sizeof(struct iovec));
+                        n += u->extra_fields_n_iovec;
                 }
         }
 
         assert(n <= m);
 
-        if (pid_is_valid(object_pid) && client_context_get(s, object_pid, NULL, NULL, 0, NULL, &o) >= 0) {
+        if (o) {
 
                 IOVEC_ADD_NUMERIC_FIELD(iovec, n, o->pid, pid_t, pid_is_valid, PID_FMT, "OBJECT_PID");
                 IOVEC_ADD_NUMERIC_FIELD(iovec, n, o->uid, uid_t, uid_is_valid, UID_FMT, "OBJECT_UID");
@@ -813,15 +1052,19 @@ static void dispatch_message_real(
                 IOVEC_ADD_NUMERIC_FIELD(iovec, n, o->auditid, uint32_t, audit_session_is_valid, "%" PRIu32, "OBJECT_AUDIT_SESSION");
                 IOVEC_ADD_NUMERIC_FIELD(iovec, n, o->loginuid, uid_t, uid_is_valid, UID_FMT, "OBJECT_AUDIT_LOGINUID");
 
-                IOVEC_ADD_STRING_FIELD(iovec, n, o->cgroup, "OBJECT_SYSTEMD_CGROUP");
-                IOVEC_ADD_STRING_FIELD(iovec, n, o->session, "OBJECT_SYSTEMD_SESSION");
-                IOVEC_ADD_NUMERIC_FIELD(iovec, n, o->owner_uid, uid_t, uid_is_valid, UID_FMT, "OBJECT_SYSTEMD_OWNER_UID");
-                IOVEC_ADD_STRING_FIELD(iovec, n, o->unit, "OBJECT_SYSTEMD_UNIT");
-                IOVEC_ADD_STRING_FIELD(iovec, n, o->user_unit, "OBJECT_SYSTEMD_USER_UNIT");
-                IOVEC_ADD_STRING_FIELD(iovec, n, o->slice, "OBJECT_SYSTEMD_SLICE");
-                IOVEC_ADD_STRING_FIELD(iovec, n, o->user_slice, "OBJECT_SYSTEMD_USER_SLICE");
+                if (o->unit_context) {
+                        const UnitContext *u = o->unit_context;
+
+                        IOVEC_ADD_STRING_FIELD(iovec, n, u->cgroup, "OBJECT_SYSTEMD_CGROUP");
+                        IOVEC_ADD_STRING_FIELD(iovec, n, u->session, "OBJECT_SYSTEMD_SESSION");
+                        IOVEC_ADD_NUMERIC_FIELD(iovec, n, u->owner_uid, uid_t, uid_is_valid, UID_FMT, "OBJECT_SYSTEMD_OWNER_UID");
+                        IOVEC_ADD_STRING_FIELD(iovec, n, u->unit, "OBJECT_SYSTEMD_UNIT");
+                        IOVEC_ADD_STRING_FIELD(iovec, n, u->user_unit, "OBJECT_SYSTEMD_USER_UNIT");
+                        IOVEC_ADD_STRING_FIELD(iovec, n, u->slice, "OBJECT_SYSTEMD_SLICE");
+                        IOVEC_ADD_STRING_FIELD(iovec, n, u->user_slice, "OBJECT_SYSTEMD_USER_SLICE");
 
-                IOVEC_ADD_ID128_FIELD(iovec, n, o->invocation_id, "OBJECT_SYSTEMD_INVOCATION_ID=");
+                        IOVEC_ADD_ID128_FIELD(iovec, n, u->invocation_id, "OBJECT_SYSTEMD_INVOCATION_ID=");
+                }
         }
 
         assert(n <= m);
@@ -848,17 +1091,17 @@ static void dispatch_message_real(
         if (s->split_mode == SPLIT_UID && c && uid_is_valid(c->uid))
                 /* Split up strictly by (non-root) UID */
                 journal_uid = c->uid;
-        else if (s->split_mode == SPLIT_LOGIN && c && c->uid > 0 && uid_is_valid(c->owner_uid))
+        else if (s->split_mode == SPLIT_LOGIN && c && c->uid > 0 && c->unit_context && uid_is_valid(c->unit_context->owner_uid))
                 /* Split up by login UIDs.  We do this only if the
                  * realuid is not root, in order not to accidentally
                  * leak privileged information to the user that is
                  * logged by a privileged process that is part of an
                  * unprivileged session. */
-                journal_uid = c->owner_uid;
+                journal_uid = c->unit_context->owner_uid;
         else
                 journal_uid = 0;
 
-        write_to_journal(s, journal_uid, iovec, n, priority);
+        server_write(s, journal_uid, iovec, n, priority);
 }
 
 void server_driver_message(Server *s, pid_t object_pid, const char *message_id, const char *format, ...) {
@@ -935,10 +1178,19 @@ void server_dispatch_message(
         if (s->storage == STORAGE_NONE)
                 return;
 
-        if (c && c->unit) {
-                (void) determine_space(s, &available, NULL);
+        if (c && c->unit_context && c->unit_context->unit) {
+                UnitContext *u = c->unit_context;
+                _cleanup_(server_unlock_journalsp) Server *locked = NULL;
+
+                /* Don't wait for the writer thread for this, if it is busy go by what we found last time */
+                if (server_try_lock_journals(s, &locked) >= 0) {
+                        (void) determine_space(s, &available, NULL);
+                        s->last_available = available;
+                } else
+                        available = s->last_available;
 
-                rl = journal_rate_limit_test(s->rate_limit, c->unit, priority & LOG_PRIMASK, available);
+                rl = journal_rate_limit_test(s->rate_limit, &u->rate_limit_group, u->unit, u->slice,
+                                             priority & LOG_PRIMASK, available, now(CLOCK_MONOTONIC));
                 if (rl == 0)
                         return;
 
@@ -946,7 +1198,7 @@ void server_dispatch_message(
                 if (rl > 1)
                         server_driver_message(s, c->pid,
                                               "MESSAGE_ID=" SD_MESSAGE_JOURNAL_DROPPED_STR,
-                                              LOG_MESSAGE("Suppressed %i messages from %s", rl - 1, c->unit),
+                                              LOG_MESSAGE("Suppressed %i messages from %s", rl - 1, u->unit),
                                               "N_DROPPED=%i", rl - 1,
                                               NULL);
         }
@@ -955,6 +1207,7 @@ void server_dispatch_message(
 }
 
 int server_flush_to_var(Server *s, bool require_flag_file) {
+        _cleanup_(server_unlock_journalsp) Server *locked = NULL;
         sd_id128_t machine;
         sd_journal *j = NULL;
         char ts[FORMAT_TIMESPAN_MAX];
@@ -967,6 +1220,8 @@ int server_flush_to_var(Server *s, bool require_flag_file) {
         if (!IN_SET(s->storage, STORAGE_AUTO, STORAGE_PERSISTENT))
                 return 0;
 
+        locked = server_lock_journals(s);
+
         if (!s->runtime_journal)
                 return 0;
 
@@ -1054,77 +1309,70 @@ finish:
         return r;
 }
 
-int server_process_datagram(sd_event_source *es, int fd, uint32_t revents, void *userdata) {
-        Server *s = userdata;
-        struct ucred *ucred = NULL;
-        struct timeval *tv = NULL;
-        struct cmsghdr *cmsg;
-        char *label = NULL;
-        size_t label_len = 0, m;
-        struct iovec iovec;
-        ssize_t n;
-        int *fds = NULL, v = 0;
-        size_t n_fds = 0;
-
-        union {
-                struct cmsghdr cmsghdr;
-
-                /* We use NAME_MAX space for the SELinux label
-                 * here. The kernel currently enforces no
-                 * limit, but according to suggestions from
-                 * the SELinux people this will change and it
-                 * will probably be identical to NAME_MAX. For
-                 * now we use that, but this should be updated
-                 * one day when the final limit is known. */
-                uint8_t buf[CMSG_SPACE(sizeof(struct ucred)) +
-                            CMSG_SPACE(sizeof(struct timeval)) +
-                            CMSG_SPACE(sizeof(int)) + /* fd */
-                            CMSG_SPACE(NAME_MAX)]; /* selinux label */
-        } control = {};
+typedef union DatagramControl {
+        struct cmsghdr cmsghdr;
+
+        /* We use NAME_MAX space for the SELinux label
+         * here. The kernel currently enforces no
+         * limit, but according to suggestions from
+         * the SELinux people this will change and it
+         * will probably be identical to NAME_MAX. For
+         * now we use that, but this should be updated
+         * one day when the final limit is known. */
+        uint8_t buf[CMSG_SPACE(sizeof(struct ucred)) +
+                    CMSG_SPACE(sizeof(struct timeval)) +
+                    CMSG_SPACE(sizeof(int)) + /* fd */
+                    CMSG_SPACE(NAME_MAX)]; /* selinux label */
+} DatagramControl;
+
+struct DatagramBatch {
+        struct mmsghdr msgs[DATAGRAM_BATCH_MAX];
+        struct iovec iovecs[DATAGRAM_BATCH_MAX];
+        union sockaddr_union addresses[DATAGRAM_BATCH_MAX];
+        DatagramControl controls[DATAGRAM_BATCH_MAX];
+        char *buffers; /* DATAGRAM_BATCH_MAX × DATAGRAM_BATCH_BUFFER_SIZE, mapped with MAP_NORESERVE */
+};
 
-        union sockaddr_union sa = {};
+static int datagram_batch_new(DatagramBatch **ret) {
+        _cleanup_(datagram_batch_freep) DatagramBatch *b = NULL;
+        void *p;
 
-        struct msghdr msghdr = {
-                .msg_iov = &iovec,
-                .msg_iovlen = 1,
-                .msg_control = &control,
-                .msg_controllen = sizeof(control),
-                .msg_name = &sa,
-                .msg_namelen = sizeof(sa),
-        };
+        assert(ret);
 
-        assert(s);
-        assert(fd == s->native_fd || fd == s->syslog_fd || fd == s->audit_fd);
+        b = new0(DatagramBatch, 1);
+        if (!b)
+                return -ENOMEM;
 
-        if (revents != EPOLLIN) {
-                log_error("Got invalid event from epoll for datagram fd: %"PRIx32, revents);
-                return -EIO;
-        }
+        p = mmap(NULL, DATAGRAM_BATCH_MAX * DATAGRAM_BATCH_BUFFER_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED)
+                return -errno;
 
-        /* Try to get the right size, if we can. (Not all sockets support SIOCINQ, hence we just try, but don't rely on
-         * it.) */
-        (void) ioctl(fd, SIOCINQ, &v);
+        b->buffers = p;
 
-        /* Fix it up, if it is too small. We use the same fixed value as auditd here. Awful! */
-        m = PAGE_ALIGN(MAX3((size_t) v + 1,
-                            (size_t) LINE_MAX,
-                            ALIGN(sizeof(struct nlmsghdr)) + ALIGN((size_t) MAX_AUDIT_MESSAGE_LENGTH)) + 1);
+        *ret = TAKE_PTR(b);
+        return 0;
+}
 
-        if (!GREEDY_REALLOC(s->buffer, s->buffer_size, m))
-                return log_oom();
+DatagramBatch* datagram_batch_free(DatagramBatch *b) {
+        if (!b)
+                return NULL;
 
-        iovec.iov_base = s->buffer;
-        iovec.iov_len = s->buffer_size - 1; /* Leave room for trailing NUL we add later */
+        if (b->buffers)
+                (void) munmap(b->buffers, DATAGRAM_BATCH_MAX * DATAGRAM_BATCH_BUFFER_SIZE);
 
-        n = recvmsg(fd, &msghdr, MSG_DONTWAIT|MSG_CMSG_CLOEXEC);
-        if (n < 0) {
-                if (IN_SET(errno, EINTR, EAGAIN))
-                        return 0;
+        return mfree(b);
+}
 
-                return log_error_errno(errno, "recvmsg() failed: %m");
-        }
+static void server_process_one_datagram(Server *s, int fd, char *buffer, size_t n, struct msghdr *msghdr) {
+        struct ucred *ucred = NULL;
+        struct timeval *tv = NULL;
+        struct cmsghdr *cmsg;
+        char *label = NULL;
+        size_t label_len = 0;
+        int *fds = NULL;
+        size_t n_fds = 0;
 
-        CMSG_FOREACH(cmsg, &msghdr) {
+        CMSG_FOREACH(cmsg, msghdr) {
 
                 if (cmsg->cmsg_level == SOL_SOCKET &&
                     cmsg->cmsg_type == SCM_CREDENTIALS &&
@@ -1139,24 +1387,24 @@ int server_process_datagram(sd_event_source *es, int fd, uint32_t revents, void
                            cmsg->cmsg_len == CMSG_LEN(sizeof(struct timeval)))
                         tv = (struct timeval*) CMSG_DATA(cmsg);
                 else if (cmsg->cmsg_level == SOL_SOCKET &&
-                         cmsg->cmsg_type == SCM_RIGHTS) {
+                           cmsg->cmsg_type == SCM_RIGHTS) {
                         fds = (int*) CMSG_DATA(cmsg);
                         n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
                 }
         }
 
         /* And a trailing NUL, just in case */
-        s->buffer[n] = 0;
+        buffer[n] = 0;
 
         if (fd == s->syslog_fd) {
                 if (n > 0 && n_fds == 0)
-                        server_process_syslog_message(s, s->buffer, n, ucred, tv, label, label_len);
+                        server_process_syslog_message(s, buffer, n, ucred, tv, label, label_len);
                 else if (n_fds > 0)
                         log_warning("Got file descriptors via syslog socket. Ignoring.");
 
         } else if (fd == s->native_fd) {
                 if (n > 0 && n_fds == 0)
-                        server_process_native_message(s, s->buffer, n, ucred, tv, label, label_len);
+                        server_process_native_message(s, buffer, n, ucred, tv, label, label_len);
                 else if (n == 0 && n_fds == 1)
                         server_process_native_file(s, fds[0], ucred, tv, label, label_len);
                 else if (n_fds > 0)
@@ -1166,21 +1414,156 @@ int server_process_datagram(sd_event_source *es, int fd, uint32_t revents, void
                 assert(fd == s->audit_fd);
 
                 if (n > 0 && n_fds == 0)
-                        server_process_audit_message(s, s->buffer, n, ucred, &sa, msghdr.msg_namelen);
+                        server_process_audit_message(s, buffer, n, ucred, msghdr->msg_name, msghdr->msg_namelen);
                 else if (n_fds > 0)
                         log_warning("Got file descriptors via audit socket. Ignoring.");
         }
 
         close_many(fds, n_fds);
+}
+
+static int server_process_datagram_single(Server *s, int fd, size_t size) {
+        DatagramControl control = {};
+        union sockaddr_union sa = {};
+        struct iovec iovec;
+        size_t m;
+        ssize_t n;
+
+        struct msghdr msghdr = {
+                .msg_iov = &iovec,
+                .msg_iovlen = 1,
+                .msg_control = &control,
+                .msg_controllen = sizeof(control),
+                .msg_name = &sa,
+                .msg_namelen = sizeof(sa),
+        };
+
+        /* Fix it up, if it is too small. We use the same fixed value as auditd here. Awful! */
+        m = PAGE_ALIGN(MAX3(size + 1,
+                            (size_t) LINE_MAX,
+                            ALIGN(sizeof(struct nlmsghdr)) + ALIGN((size_t) MAX_AUDIT_MESSAGE_LENGTH)) + 1);
+
+        if (!GREEDY_REALLOC(s->buffer, s->buffer_size, m))
+                return log_oom();
+
+        iovec.iov_base = s->buffer;
+        iovec.iov_len = s->buffer_size - 1; /* Leave room for trailing NUL we add later */
+
+        n = recvmsg(fd, &msghdr, MSG_DONTWAIT|MSG_CMSG_CLOEXEC);
+        if (n < 0) {
+                if (IN_SET(errno, EINTR, EAGAIN))
+                        return 0;
+
+                return log_error_errno(errno, "recvmsg() failed: %m");
+        }
+
+        server_process_one_datagram(s, fd, s->buffer, n, &msghdr);
+        return 0;
+}
+
+int server_process_datagram(sd_event_source *es, int fd, uint32_t revents, void *userdata) {
+        Server *s = userdata;
+        DatagramBatch *b;
+        int v = 0, n, i, r;
+
+        assert(s);
+        assert(fd == s->native_fd || fd == s->syslog_fd || fd == s->audit_fd);
+
+        if (revents != EPOLLIN) {
+                log_error("Got invalid event from epoll for datagram fd: %"PRIx32, revents);
+                return -EIO;
+        }
+
+        /* Try to get the right size, if we can. (Not all sockets support SIOCINQ, hence we just try, but don't rely on
+         * it.) */
+        (void) ioctl(fd, SIOCINQ, &v);
+
+        /* Datagrams that don't even fit into a batch buffer are rare, and we can only find out about the first one
+         * queued. Receive it on its own into a buffer of the right size. */
+        if ((size_t) v + 1 > DATAGRAM_BATCH_BUFFER_SIZE)
+                return server_process_datagram_single(s, fd, v);
+
+        if (!s->datagram_batch) {
+                r = datagram_batch_new(&s->datagram_batch);
+                if (r == -ENOMEM)
+                        return log_oom();
+                if (r < 0) {
+                        log_debug_errno(r, "Failed to map datagram batch buffers, receiving datagrams one by one: %m");
+                        return server_process_datagram_single(s, fd, v);
+                }
+        }
+
+        b = s->datagram_batch;
+
+        /* The kernel updates the lengths on each call, hence reset them every time */
+        for (i = 0; i < (int) DATAGRAM_BATCH_MAX; i++) {
+                /* Leave room for trailing NUL */
+                b->iovecs[i] = IOVEC_MAKE(b->buffers + (size_t) i * DATAGRAM_BATCH_BUFFER_SIZE, DATAGRAM_BATCH_BUFFER_SIZE - 1);
+
+                b->msgs[i] = (struct mmsghdr) {
+                        .msg_hdr = {
+                                .msg_iov = b->iovecs + i,
+                                .msg_iovlen = 1,
+                                .msg_control = b->controls + i,
+                                .msg_controllen = sizeof(DatagramControl),
+                                .msg_name = b->addresses + i,
+                                .msg_namelen = sizeof(union sockaddr_union),
+                        },
+                };
+        }
+
+        n = recvmmsg(fd, b->msgs, DATAGRAM_BATCH_MAX, MSG_DONTWAIT|MSG_CMSG_CLOEXEC, NULL);
+        if (n < 0) {
+                if (IN_SET(errno, EINTR, EAGAIN))
+                        return 0;
+
+                return log_error_errno(errno, "recvmmsg() failed: %m");
+        }
+
+        for (i = 0; i < n; i++) {
+                struct msghdr *mh = &b->msgs[i].msg_hdr;
+                char *buffer;
+
+                if (mh->msg_flags & MSG_TRUNC) {
+                        /* Only datagrams after the first one can end up here, and no client of ours sends datagrams
+                         * this large. Hence this is either a syslog line, which we'll just take as far as it goes, or
+                         * something is off. */
+                        if (fd == s->syslog_fd)
+                                log_debug("Datagram on syslog socket exceeds %u bytes, truncating.", DATAGRAM_BATCH_BUFFER_SIZE - 1);
+                        else {
+                                struct cmsghdr *cmsg;
+
+                                log_warning("Datagram exceeds %u bytes, ignoring.", DATAGRAM_BATCH_BUFFER_SIZE - 1);
+
+                                CMSG_FOREACH(cmsg, mh)
+                                        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+                                                close_many((int*) CMSG_DATA(cmsg), (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+                                continue;
+                        }
+                }
+
+                buffer = b->buffers + (size_t) i * DATAGRAM_BATCH_BUFFER_SIZE;
+                server_process_one_datagram(s, fd, buffer, b->msgs[i].msg_len, mh);
+
+                /* Don't keep the memory of a large datagram around */
+                if (b->msgs[i].msg_len + 1 > NATIVE_DATAGRAM_SIZE_MAX)
+                        (void) madvise(buffer + NATIVE_DATAGRAM_SIZE_MAX,
+                                       PAGE_ALIGN(b->msgs[i].msg_len + 1) - NATIVE_DATAGRAM_SIZE_MAX,
+                                       MADV_DONTNEED);
+        }
+
         return 0;
 }
 
 static int dispatch_sigusr1(sd_event_source *es, const struct signalfd_siginfo *si, void *userdata) {
+        _cleanup_(server_unlock_journalsp) Server *locked = NULL;
         Server *s = userdata;
         int r;
 
         assert(s);
 
+        locked = server_lock_journals(s);
+
         log_info("Received request to flush runtime journal from PID " PID_FMT, si->ssi_pid);
 
         (void) server_flush_to_var(s, false);
@@ -1196,11 +1579,14 @@ static int dispatch_sigusr1(sd_event_source *es, const struct signalfd_siginfo *
 }
 
 static int dispatch_sigusr2(sd_event_source *es, const struct signalfd_siginfo *si, void *userdata) {
+        _cleanup_(server_unlock_journalsp) Server *locked = NULL;
         Server *s = userdata;
         int r;
 
         assert(s);
 
+        locked = server_lock_journals(s);
+
         log_info("Received request to rotate journal from PID " PID_FMT, si->ssi_pid);
         server_rotate(s);
         server_vacuum(s, true);
@@ -1239,6 +1625,11 @@ static int dispatch_sigrtmin1(sd_event_source *es, const struct signalfd_siginfo
 
         server_sync(s);
 
+        /* Also let them know how many messages were suppressed so far, per unit. */
+        r = journal_rate_limit_write_suppressed(s->rate_limit, "/run/systemd/journal/suppressed");
+        if (r < 0)
+                log_warning_errno(r, "Failed to write /run/systemd/journal/suppressed, ignoring: %m");
+
         /* Let clients know when the most recent sync happened. */
         r = write_timestamp_file_atomic("/run/systemd/journal/synced", now(CLOCK_MONOTONIC));
         if (r < 0)
@@ -1681,8 +2072,10 @@ int server_init(Server *s) {
         s->syslog_fd = s->native_fd = s->stdout_fd = s->dev_kmsg_fd = s->audit_fd = s->hostname_fd = s->notify_fd = -1;
         s->compress.enabled = true;
         s->compress.threshold_bytes = (uint64_t) -1;
+        s->compress.algorithm = DEFAULT_COMPRESSION;
         s->seal = true;
         s->read_kmsg = true;
+        s->scrub = true;
 
         s->watchdog_usec = USEC_INFINITY;
 
@@ -1857,6 +2250,8 @@ int server_init(Server *s) {
         if (r < 0)
                 return r;
 
+        (void) unit_context_watch(s);
+
         server_cache_hostname(s);
         server_cache_boot_id(s);
         server_cache_machine_id(s);
@@ -1869,10 +2264,24 @@ int server_init(Server *s) {
         if (!s->runtime_storage.path || !s->system_storage.path)
                 return -ENOMEM;
 
+        r = journal_vacuum_plan_new(s->runtime_storage.path, true, &s->runtime_storage.vacuum_plan);
+        if (r < 0)
+                return r;
+
+        r = journal_vacuum_plan_new(s->system_storage.path, true, &s->system_storage.vacuum_plan);
+        if (r < 0)
+                return r;
+
         (void) server_connect_notify(s);
 
         (void) client_context_acquire_default(s);
 
+        r = journal_writer_new(s->event, server_write_batch, server_writer_wakeup, s, &s->writer);
+        if (r < 0)
+                return log_error_errno(r, "Failed to start writer thread: %m");
+
+        (void) server_start_scrub(s);
+
         return system_journal_open(s, false);
 }
 
@@ -1882,6 +2291,11 @@ void server_maybe_append_tags(Server *s) {
         Iterator i;
         usec_t n;
 
+        /* Called on every event loop iteration, hence don't wait for the writer thread. It seals as it
+         * appends anyway. */
+        if (!server_trylock_journals(s))
+                return;
+
         n = now(CLOCK_REALTIME);
 
         if (s->system_journal)
@@ -1889,12 +2303,17 @@ void server_maybe_append_tags(Server *s) {
 
         ORDERED_HASHMAP_FOREACH(f, s->user_journals, i)
                 journal_file_maybe_append_tag(f, n);
+
+        server_unlock_journals(s);
 #endif
 }
 
 void server_done(Server *s) {
         assert(s);
 
+        /* Writes out whatever is still queued */
+        s->writer = journal_writer_free(s->writer);
+
         set_free_with_destructor(s->deferred_closes, journal_file_close);
 
         while (s->stdout_streams)
@@ -1902,6 +2321,8 @@ void server_done(Server *s) {
 
         client_context_flush_all(s);
 
+        server_stop_scrub(s);
+
         if (s->system_journal)
                 (void) journal_file_close(s->system_journal);
 
@@ -1924,6 +2345,7 @@ void server_done(Server *s) {
         sd_event_source_unref(s->hostname_event_source);
         sd_event_source_unref(s->notify_event_source);
         sd_event_source_unref(s->watchdog_event_source);
+        sd_event_source_unref(s->units_event_source);
         sd_event_unref(s->event);
 
         safe_close(s->syslog_fd);
@@ -1941,11 +2363,14 @@ void server_done(Server *s) {
                 munmap(s->kernel_seqnum, sizeof(uint64_t));
 
         free(s->buffer);
+        datagram_batch_free(s->datagram_batch);
         free(s->tty_path);
         free(s->cgroup_root);
         free(s->hostname_field);
         free(s->runtime_storage.path);
         free(s->system_storage.path);
+        journal_vacuum_plan_free(s->runtime_storage.vacuum_plan);
+        journal_vacuum_plan_free(s->system_storage.vacuum_plan);
 
         if (s->mmap)
                 mmap_cache_unref(s->mmap);
@@ -2057,3 +2482,42 @@ int config_parse_compress(const char* unit,
 
         return 0;
 }
+
+int config_parse_compress_algorithm(
+                const char* unit,
+                const char *filename,
+                unsigned line,
+                const char *section,
+                unsigned section_line,
+                const char *lvalue,
+                int ltype,
+                const char *rvalue,
+                void *data,
+                void *userdata) {
+
+        int *algorithm = data, a;
+
+        assert(algorithm);
+
+        if (isempty(rvalue)) {
+                *algorithm = DEFAULT_COMPRESSION;
+                return 0;
+        }
+
+        a = object_compressed_from_string(ascii_strupper(strdupa(rvalue)));
+        if (a < 0) {
+                log_syntax(unit, LOG_ERR, filename, line, 0, "Failed to parse CompressAlgorithm= value, ignoring: %s", rvalue);
+                return 0;
+        }
+
+        if ((a == OBJECT_COMPRESSED_XZ && !HAVE_XZ) ||
+            (a == OBJECT_COMPRESSED_LZ4 && !HAVE_LZ4) ||
+            (a == OBJECT_COMPRESSED_ZSTD && !HAVE_ZSTD)) {
+                log_syntax(unit, LOG_WARNING, filename, line, 0,
+                           "Compression algorithm %s is not supported by this build, ignoring.", rvalue);
+                return 0;
+        }
+
+        *algorithm = a;
+        return 0;
+}
@@ -7,13 +7,17 @@
 #include "sd-event.h"
 
 typedef struct Server Server;
+typedef struct DatagramBatch DatagramBatch;
 
 #include "conf-parser.h"
 #include "hashmap.h"
 #include "journal-file.h"
+#include "journal-vacuum.h"
+#include "journal-verify.h"
 #include "journald-context.h"
 #include "journald-rate-limit.h"
 #include "journald-stream.h"
+#include "journald-writer.h"
 #include "list.h"
 #include "prioq.h"
 
@@ -37,6 +41,7 @@ typedef enum SplitMode {
 typedef struct JournalCompressOptions {
         bool enabled;
         uint64_t threshold_bytes;
+        int algorithm; /* One of OBJECT_COMPRESSED_* */
 } JournalCompressOptions;
 
 typedef struct JournalStorageSpace {
@@ -55,6 +60,8 @@ typedef struct JournalStorage {
 
         JournalMetrics metrics;
         JournalStorageSpace space;
+
+        JournalVacuumPlan *vacuum_plan;
 } JournalStorage;
 
 struct Server {
@@ -82,6 +89,8 @@ struct Server {
         sd_event_source *hostname_event_source;
         sd_event_source *notify_event_source;
         sd_event_source *watchdog_event_source;
+        sd_event_source *units_event_source;
+        sd_event_source *scrub_event_source;
 
         JournalFile *runtime_journal;
         JournalFile *system_journal;
@@ -91,6 +100,7 @@ struct Server {
 
         char *buffer;
         size_t buffer_size;
+        DatagramBatch *datagram_batch;
 
         JournalRateLimit *rate_limit;
         usec_t sync_interval_usec;
@@ -103,6 +113,7 @@ struct Server {
         JournalCompressOptions compress;
         bool seal;
         bool read_kmsg;
+        bool scrub;
 
         bool forward_to_kmsg;
         bool forward_to_syslog;
@@ -137,6 +148,17 @@ struct Server {
 
         Set *deferred_closes;
 
+        /* Background checking of archived files, see journald-scrub.c */
+        JournalFile *scrub_file;
+        JournalFileScrub *scrubber;
+        Hashmap *scrub_offsets; /* path → how far it was checked */
+        bool scrub_state_loaded;
+
+        /* Owns the journal files, unless the event loop locked them */
+        JournalWriter *writer;
+        bool flush_requested; /* set by the writer thread, hence not a bitfield */
+        uint64_t last_available; /* for rate limiting while the writer thread is busy */
+
         struct udev *udev;
 
         uint64_t *kernel_seqnum;
@@ -162,6 +184,7 @@ struct Server {
         /* Caching of client metadata */
         Hashmap *client_contexts;
         Prioq *client_contexts_lru;
+        Hashmap *unit_contexts; /* indexed by cgroup path */
 
         ClientContext *my_context; /* the context of journald itself */
         ClientContext *pid1_context; /* the context of PID 1 */
@@ -193,6 +216,7 @@ const struct ConfigPerfItem* journald_gperf_lookup(const char *key, GPERF_LEN_TY
 CONFIG_PARSER_PROTOTYPE(config_parse_storage);
 CONFIG_PARSER_PROTOTYPE(config_parse_line_max);
 CONFIG_PARSER_PROTOTYPE(config_parse_compress);
+CONFIG_PARSER_PROTOTYPE(config_parse_compress_algorithm);
 
 const char *storage_to_string(Storage s) _const_;
 Storage storage_from_string(const char *s) _pure_;
@@ -210,5 +234,9 @@ void server_rotate(Server *s);
 int server_schedule_sync(Server *s, int priority);
 int server_flush_to_var(Server *s, bool require_flag_file);
 void server_maybe_append_tags(Server *s);
+bool server_trylock_journals(Server *s);
+void server_unlock_journals(Server *s);
 int server_process_datagram(sd_event_source *es, int fd, uint32_t revents, void *userdata);
+DatagramBatch* datagram_batch_free(DatagramBatch *b);
+DEFINE_TRIVIAL_CLEANUP_FUNC(DatagramBatch*, datagram_batch_free);
 void server_space_usage_message(Server *s, JournalStorage *storage);
@@ -35,6 +35,10 @@
 
 #define STDOUT_STREAMS_MAX 4096
 
+/* The read buffer of a stream is grown while the stream keeps filling it up entirely, up to this size (or the
+ * maximum line length, if that's larger), so that busy streams are processed in large chunks */
+#define STDOUT_STREAM_BUFFER_MAX (128U*1024U)
+
 typedef enum StdoutStreamState {
         STDOUT_STREAM_IDENTIFIER,
         STDOUT_STREAM_UNIT_ID,
@@ -65,6 +69,7 @@ struct StdoutStream {
         struct ucred ucred;
         char *label;
         char *identifier;
+        char *identifier_field;
         char *unit_id;
         int priority;
         bool level_prefix:1;
@@ -78,6 +83,11 @@ struct StdoutStream {
         char *buffer;
         size_t length;
         size_t allocated;
+        bool busy:1;
+
+        /* Reused for the MESSAGE= field of every line */
+        char *message;
+        size_t message_allocated;
 
         sd_event_source *event_source;
 
@@ -116,9 +126,11 @@ void stdout_stream_free(StdoutStream *s) {
         safe_close(s->fd);
         free(s->label);
         free(s->identifier);
+        free(s->identifier_field);
         free(s->unit_id);
         free(s->state_file);
         free(s->buffer);
+        free(s->message);
 
         free(s);
 }
@@ -238,16 +250,14 @@ static int stdout_stream_log(StdoutStream *s, const char *p, LineBreak line_brea
         int priority;
         char syslog_priority[] = "PRIORITY=\0";
         char syslog_facility[STRLEN("SYSLOG_FACILITY=") + DECIMAL_STR_MAX(int) + 1];
-        _cleanup_free_ char *message = NULL, *syslog_identifier = NULL;
-        size_t n = 0, m;
+        size_t n = 0, m, l;
         int r;
 
         assert(s);
         assert(p);
 
-        if (s->context)
-                (void) client_context_maybe_refresh(s->server, s->context, NULL, NULL, 0, NULL, USEC_INFINITY);
-        else if (pid_is_valid(s->ucred.pid)) {
+        /* The context is refreshed by stdout_stream_scan(), once for all lines read at once */
+        if (!s->context && pid_is_valid(s->ucred.pid)) {
                 r = client_context_acquire(s->server, s->ucred.pid, &s->ucred, s->label, strlen_ptr(s->label), s->unit_id, &s->context);
                 if (r < 0)
                         log_warning_errno(r, "Failed to acquire client context, ignoring: %m");
@@ -291,9 +301,10 @@ static int stdout_stream_log(StdoutStream *s, const char *p, LineBreak line_brea
         }
 
         if (s->identifier) {
-                syslog_identifier = strappend("SYSLOG_IDENTIFIER=", s->identifier);
-                if (syslog_identifier)
-                        iovec[n++] = IOVEC_MAKE_STRING(syslog_identifier);
+                if (!s->identifier_field)
+                        s->identifier_field = strappend("SYSLOG_IDENTIFIER=", s->identifier);
+                if (s->identifier_field)
+                        iovec[n++] = IOVEC_MAKE_STRING(s->identifier_field);
         }
 
         if (line_break != LINE_BREAK_NEWLINE) {
@@ -308,9 +319,11 @@ static int stdout_stream_log(StdoutStream *s, const char *p, LineBreak line_brea
                 iovec[n++] = IOVEC_MAKE_STRING(c);
         }
 
-        message = strappend("MESSAGE=", p);
-        if (message)
-                iovec[n++] = IOVEC_MAKE_STRING(message);
+        l = strlen(p);
+        if (GREEDY_REALLOC(s->message, s->message_allocated, STRLEN("MESSAGE=") + l + 1)) {
+                memcpy(mempcpy(s->message, "MESSAGE=", STRLEN("MESSAGE=")), p, l + 1);
+                iovec[n++] = IOVEC_MAKE_STRING(s->message);
+        }
 
         server_dispatch_message(s->server, iovec, n, m, s->context, NULL, priority, 0);
         return 0;
@@ -323,8 +336,19 @@ static int stdout_stream_line(StdoutStream *s, char *p, LineBreak line_break) {
         assert(s);
         assert(p);
 
+        /* Log lines only lose trailing whitespace, such as the \r of CRLF line breaks. The lines of the negotiation
+         * part of the protocol are stripped on both ends. */
         orig = p;
-        p = strstrip(p);
+        if (s->state == STDOUT_STREAM_RUNNING) {
+                size_t l;
+
+                /* Look at the end of the line only, rather than checking every character like strstrip() does */
+                l = strlen(p);
+                while (l > 0 && strchr(WHITESPACE, p[l-1]))
+                        l--;
+                p[l] = 0;
+        } else
+                p = strstrip(p);
 
         /* line breaks by NUL, line max length or EOF are not permissible during the negotiation part of the protocol */
         if (line_break != LINE_BREAK_NEWLINE && s->state != STDOUT_STREAM_RUNNING) {
@@ -426,41 +450,53 @@ static int stdout_stream_scan(StdoutStream *s, bool force_flush) {
         int r;
 
         assert(s);
+        assert(s->buffer);
+        assert(s->buffer[s->length] == 0);
 
         p = s->buffer;
         remaining = s->length;
 
-        /* XXX: This function does nothing if (s->length == 0) */
+        if (s->context)
+                (void) client_context_maybe_refresh(s->server, s->context, NULL, NULL, 0, NULL, USEC_INFINITY);
+
+        /* The data read is followed by a NUL byte, hence strchrnul() finds the next \n or NUL terminator in a single
+         * pass, and stops at the end of the data if there is none. */
 
         for (;;) {
                 LineBreak line_break;
-                size_t skip;
-                char *end1, *end2;
-
-                end1 = memchr(p, '\n', remaining);
-                end2 = memchr(p, 0, end1 ? (size_t) (end1 - p) : remaining);
-
-                if (end2) {
-                        /* We found a NUL terminator */
-                        skip = end2 - p + 1;
-                        line_break = LINE_BREAK_NUL;
-                } else if (end1) {
-                        /* We found a \n terminator */
-                        *end1 = 0;
-                        skip = end1 - p + 1;
-                        line_break = LINE_BREAK_NEWLINE;
-                } else if (remaining >= s->server->line_max) {
-                        /* Force a line break after the maximum line length */
-                        *(p + s->server->line_max) = 0;
-                        skip = remaining;
-                        line_break = LINE_BREAK_LINE_MAX;
+                size_t length, skip;
+                char *end;
+
+                end = strchrnul(p, '\n');
+                length = end - p;
+
+                if (length >= s->server->line_max) {
+                        char c;
+
+                        /* Force a line break after the maximum line length. There might be more data after it, hence
+                         * restore what we overwrite with the NUL. */
+                        c = p[s->server->line_max];
+                        p[s->server->line_max] = 0;
+
+                        r = stdout_stream_line(s, p, LINE_BREAK_LINE_MAX);
+                        p[s->server->line_max] = c;
+                        if (r < 0)
+                                return r;
+
+                        skip = s->server->line_max;
+                } else if (length < remaining) {
+                        /* We found a \n or NUL terminator */
+                        line_break = *end == '\n' ? LINE_BREAK_NEWLINE : LINE_BREAK_NUL;
+                        *end = 0;
+
+                        r = stdout_stream_line(s, p, line_break);
+                        if (r < 0)
+                                return r;
+
+                        skip = length + 1;
                 } else
                         break;
 
-                r = stdout_stream_line(s, p, line_break);
-                if (r < 0)
-                        return r;
-
                 remaining -= skip;
                 p += skip;
         }
@@ -476,7 +512,7 @@ static int stdout_stream_scan(StdoutStream *s, bool force_flush) {
         }
 
         if (p > s->buffer) {
-                memmove(s->buffer, p, remaining);
+                memmove(s->buffer, p, remaining + 1);
                 s->length = remaining;
         }
 
@@ -502,11 +538,29 @@ static int stdout_stream_process(sd_event_source *es, int fd, uint32_t revents,
                         log_oom();
                         goto terminate;
                 }
+        } else if (s->busy) {
+                size_t sz;
+
+                /* The last read filled up the buffer entirely, hence there's likely more to come. Let's double
+                 * the buffer then, up to a limit. */
+                sz = MIN(s->allocated * 2, MAX(STDOUT_STREAM_BUFFER_MAX, s->server->line_max + 1));
+                if (sz > s->allocated) {
+                        char *b;
+
+                        b = realloc(s->buffer, sz);
+                        if (!b) {
+                                log_oom();
+                                goto terminate;
+                        }
+
+                        s->buffer = b;
+                        s->allocated = sz;
+                }
         }
 
-        /* Try to make use of the allocated buffer in full, but never read more than the configured line size. Also,
-         * always leave room for a terminating NUL we might need to add. */
-        limit = MIN(s->allocated - 1, s->server->line_max);
+        /* Try to make use of the allocated buffer in full. Lines longer than the configured maximum are broken up
+         * by stdout_stream_scan(). Always leave room for the terminating NUL we add. */
+        limit = s->allocated - 1;
 
         l = read(s->fd, s->buffer + s->length, limit - s->length);
         if (l < 0) {
@@ -517,12 +571,15 @@ static int stdout_stream_process(sd_event_source *es, int fd, uint32_t revents,
                 goto terminate;
         }
 
+        s->busy = (size_t) l == limit - s->length;
+        s->length += l;
+        s->buffer[s->length] = 0;
+
         if (l == 0) {
                 stdout_stream_scan(s, true);
                 goto terminate;
         }
 
-        s->length += l;
         r = stdout_stream_scan(s, false);
         if (r < 0)
                 goto terminate;
@@ -534,7 +591,7 @@ terminate:
         return 0;
 }
 
-static int stdout_stream_install(Server *s, int fd, StdoutStream **ret) {
+int stdout_stream_install(Server *s, int fd, StdoutStream **ret) {
         _cleanup_(stdout_stream_freep) StdoutStream *stream = NULL;
         sd_id128_t id;
         int r;
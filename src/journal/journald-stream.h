@@ -9,5 +9,7 @@ typedef struct StdoutStream StdoutStream;
 int server_open_stdout_socket(Server *s);
 int server_restore_streams(Server *s, FDSet *fds);
 
+int stdout_stream_install(Server *s, int fd, StdoutStream **ret);
+
 void stdout_stream_free(StdoutStream *s);
 void stdout_stream_send_notify(StdoutStream *s);
@@ -0,0 +1,383 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/eventfd.h>
+
+#include "alloc-util.h"
+#include "fd-util.h"
+#include "io-util.h"
+#include "journald-writer.h"
+#include "log.h"
+#include "macro.h"
+
+/* How many entries and payload bytes we buffer between the event loop and the writer thread before the event
+ * loop has to wait, and how many entries the writer thread takes off the queue at once. */
+#define WRITER_QUEUE_MAX 4096U
+#define WRITER_QUEUE_BYTES_MAX (16U*1024U*1024U)
+#define WRITER_BATCH_MAX 256U
+
+struct JournalWriter {
+        pthread_t thread;
+        pthread_mutex_t mutex;
+        pthread_cond_t work; /* signalled when there's something for the writer thread to do */
+        pthread_cond_t idle; /* signalled when queue space was freed or the writer thread finished a batch */
+
+        JournalWriterEntry *queue[WRITER_QUEUE_MAX];
+        size_t head;
+        size_t n_queued;
+        size_t queued_bytes;
+
+        bool busy:1;   /* the writer thread is processing a batch */
+        bool locked:1; /* the event loop owns the journal files */
+        bool quit:1;
+        bool wakeup_requested:1;
+
+        JournalWriterStats stats;
+
+        int wakeup_fd;
+        sd_event_source *wakeup_event_source;
+
+        journal_writer_handler_t handler;
+        journal_writer_wakeup_handler_t wakeup_handler;
+        void *userdata;
+};
+
+static thread_local bool in_writer_thread = false;
+
+bool journal_writer_in_writer_thread(void) {
+        return in_writer_thread;
+}
+
+static void journal_writer_kick(JournalWriter *w) {
+        assert(w);
+
+        /* Must be called with the mutex held */
+        (void) eventfd_write(w->wakeup_fd, 1);
+}
+
+static void* journal_writer_thread(void *arg) {
+        JournalWriterEntry *batch[WRITER_BATCH_MAX];
+        JournalWriter *w = arg;
+
+        (void) pthread_setname_np(pthread_self(), "journal-writer");
+        in_writer_thread = true;
+
+        assert_se(pthread_mutex_lock(&w->mutex) == 0);
+
+        for (;;) {
+                size_t n = 0, i;
+
+                while (!w->quit && (w->n_queued == 0 || w->locked))
+                        assert_se(pthread_cond_wait(&w->work, &w->mutex) == 0);
+
+                /* When asked to quit, we still write out everything that has been queued so far */
+                if (w->n_queued == 0)
+                        break;
+
+                while (n < WRITER_BATCH_MAX && w->n_queued > 0) {
+                        batch[n] = TAKE_PTR(w->queue[w->head]);
+                        w->queued_bytes -= batch[n]->size;
+                        w->head = (w->head + 1) % WRITER_QUEUE_MAX;
+                        w->n_queued--;
+                        n++;
+                }
+
+                w->busy = true;
+                w->stats.n_batches++;
+                assert_se(pthread_cond_broadcast(&w->idle) == 0);
+
+                assert_se(pthread_mutex_unlock(&w->mutex) == 0);
+
+                w->handler(batch, n, w->userdata);
+
+                for (i = 0; i < n; i++)
+                        free(batch[i]);
+
+                assert_se(pthread_mutex_lock(&w->mutex) == 0);
+
+                w->busy = false;
+
+                if (w->n_queued == 0) {
+                        assert_se(pthread_cond_broadcast(&w->idle) == 0);
+
+                        if (w->wakeup_requested) {
+                                w->wakeup_requested = false;
+                                journal_writer_kick(w);
+                        }
+                }
+        }
+
+        assert_se(pthread_mutex_unlock(&w->mutex) == 0);
+
+        return NULL;
+}
+
+static int dispatch_wakeup(sd_event_source *es, int fd, uint32_t revents, void *userdata) {
+        JournalWriter *w = userdata;
+        eventfd_t v;
+
+        assert(w);
+
+        (void) eventfd_read(fd, &v);
+
+        if (w->wakeup_handler)
+                w->wakeup_handler(w->userdata);
+
+        return 0;
+}
+
+int journal_writer_new(
+                sd_event *e,
+                journal_writer_handler_t handler,
+                journal_writer_wakeup_handler_t wakeup_handler,
+                void *userdata,
+                JournalWriter **ret) {
+
+        _cleanup_free_ JournalWriter *w = NULL;
+        sigset_t ss, saved_ss;
+        int r;
+
+        assert(e);
+        assert(handler);
+        assert(ret);
+
+        w = new0(JournalWriter, 1);
+        if (!w)
+                return -ENOMEM;
+
+        w->handler = handler;
+        w->wakeup_handler = wakeup_handler;
+        w->userdata = userdata;
+
+        w->wakeup_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+        if (w->wakeup_fd < 0)
+                return -errno;
+
+        r = sd_event_add_io(e, &w->wakeup_event_source, w->wakeup_fd, EPOLLIN, dispatch_wakeup, w);
+        if (r < 0)
+                goto fail_fd;
+
+        assert_se(pthread_mutex_init(&w->mutex, NULL) == 0);
+        assert_se(pthread_cond_init(&w->work, NULL) == 0);
+        assert_se(pthread_cond_init(&w->idle, NULL) == 0);
+
+        /* The event loop handles signals via signalfd, hence make sure they are never delivered to the writer
+         * thread. SIGBUS however is synchronous and must reach the thread that touched the mapping. */
+        if (sigfillset(&ss) < 0 ||
+            sigdelset(&ss, SIGBUS) < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        r = pthread_sigmask(SIG_BLOCK, &ss, &saved_ss);
+        if (r > 0) {
+                r = -r;
+                goto fail;
+        }
+
+        r = pthread_create(&w->thread, NULL, journal_writer_thread, w);
+
+        (void) pthread_sigmask(SIG_SETMASK, &saved_ss, NULL);
+        if (r > 0) {
+                r = -r;
+                goto fail;
+        }
+
+        *ret = TAKE_PTR(w);
+        return 0;
+
+fail:
+        pthread_cond_destroy(&w->idle);
+        pthread_cond_destroy(&w->work);
+        pthread_mutex_destroy(&w->mutex);
+        sd_event_source_unref(w->wakeup_event_source);
+fail_fd:
+        safe_close(w->wakeup_fd);
+        return r;
+}
+
+JournalWriter* journal_writer_free(JournalWriter *w) {
+        size_t i;
+
+        if (!w)
+                return NULL;
+
+        assert(!w->locked);
+
+        assert_se(pthread_mutex_lock(&w->mutex) == 0);
+        w->quit = true;
+        assert_se(pthread_cond_signal(&w->work) == 0);
+        assert_se(pthread_mutex_unlock(&w->mutex) == 0);
+
+        assert_se(pthread_join(w->thread, NULL) == 0);
+
+        for (i = 0; i < WRITER_QUEUE_MAX; i++)
+                free(w->queue[i]);
+
+        pthread_cond_destroy(&w->idle);
+        pthread_cond_destroy(&w->work);
+        pthread_mutex_destroy(&w->mutex);
+
+        sd_event_source_unref(w->wakeup_event_source);
+        safe_close(w->wakeup_fd);
+
+        return mfree(w);
+}
+
+static bool journal_writer_is_full(JournalWriter *w, size_t size) {
+        assert(w);
+
+        if (w->n_queued >= WRITER_QUEUE_MAX)
+                return true;
+
+        /* Always accept a single entry, however large */
+        return w->n_queued > 0 && w->queued_bytes + size > WRITER_QUEUE_BYTES_MAX;
+}
+
+int journal_writer_enqueue(JournalWriter *w, uid_t uid, int priority, const dual_timestamp *ts, const struct iovec *iovec, size_t n) {
+        JournalWriterEntry *e;
+        size_t size, i;
+        uint8_t *p;
+
+        assert(w);
+        assert(!w->locked);
+        assert(!in_writer_thread);
+        assert(ts);
+        assert(iovec || n == 0);
+
+        /* Entries are copied, so that the caller may reuse its buffers right away */
+        size = IOVEC_TOTAL_SIZE(iovec, n);
+
+        e = malloc(offsetof(JournalWriterEntry, iovec) + n * sizeof(struct iovec) + size);
+        if (!e)
+                return -ENOMEM;
+
+        e->uid = uid;
+        e->priority = priority;
+        e->ts = *ts;
+        e->size = size;
+        e->n_iovec = n;
+
+        p = (uint8_t*) (e->iovec + n);
+        for (i = 0; i < n; i++) {
+                e->iovec[i] = IOVEC_MAKE(p, iovec[i].iov_len);
+                p = mempcpy(p, iovec[i].iov_base, iovec[i].iov_len);
+        }
+
+        assert_se(pthread_mutex_lock(&w->mutex) == 0);
+
+        if (journal_writer_is_full(w, size)) {
+                usec_t start;
+
+                /* This is the backpressure: rather than dropping entries we stop reading from our sockets until
+                 * the writer thread caught up, and let the kernel buffer things for us meanwhile. */
+                start = now(CLOCK_MONOTONIC);
+
+                do
+                        assert_se(pthread_cond_wait(&w->idle, &w->mutex) == 0);
+                while (journal_writer_is_full(w, size));
+
+                w->stats.n_stalls++;
+                w->stats.stall_usec += now(CLOCK_MONOTONIC) - start;
+        }
+
+        w->queue[(w->head + w->n_queued) % WRITER_QUEUE_MAX] = e;
+        w->n_queued++;
+        w->queued_bytes += size;
+
+        w->stats.n_entries++;
+        w->stats.max_queued = MAX(w->stats.max_queued, w->n_queued);
+        w->stats.max_queued_bytes = MAX(w->stats.max_queued_bytes, w->queued_bytes);
+
+        assert_se(pthread_cond_signal(&w->work) == 0);
+        assert_se(pthread_mutex_unlock(&w->mutex) == 0);
+
+        return 0;
+}
+
+void journal_writer_lock(JournalWriter *w) {
+        assert(w);
+        assert(!w->locked);
+        assert(!in_writer_thread);
+
+        /* Waits until everything queued so far has been written, and then hands the journal files to the
+         * caller. As the event loop is the only one queueing entries, nothing new shows up until it calls
+         * journal_writer_unlock(). */
+
+        assert_se(pthread_mutex_lock(&w->mutex) == 0);
+
+        while (w->busy || w->n_queued > 0)
+                assert_se(pthread_cond_wait(&w->idle, &w->mutex) == 0);
+
+        w->locked = true;
+
+        assert_se(pthread_mutex_unlock(&w->mutex) == 0);
+}
+
+bool journal_writer_trylock(JournalWriter *w) {
+        bool locked;
+
+        assert(w);
+        assert(!w->locked);
+        assert(!in_writer_thread);
+
+        /* Like journal_writer_lock(), but doesn't wait. If the writer thread is still busy, the event loop is
+         * woken up once it is done, so that the caller gets another chance. */
+
+        assert_se(pthread_mutex_lock(&w->mutex) == 0);
+
+        locked = !w->busy && w->n_queued == 0;
+        if (locked)
+                w->locked = true;
+        else
+                w->wakeup_requested = true;
+
+        assert_se(pthread_mutex_unlock(&w->mutex) == 0);
+
+        return locked;
+}
+
+void journal_writer_unlock(JournalWriter *w) {
+        assert(w);
+        assert(w->locked);
+
+        assert_se(pthread_mutex_lock(&w->mutex) == 0);
+        w->locked = false;
+        assert_se(pthread_cond_signal(&w->work) == 0);
+        assert_se(pthread_mutex_unlock(&w->mutex) == 0);
+}
+
+bool journal_writer_is_locked(JournalWriter *w) {
+        assert(w);
+        assert(!in_writer_thread);
+
+        /* Only the event loop ever changes this, hence it may read it without taking the mutex */
+        return w->locked;
+}
+
+void journal_writer_wakeup(JournalWriter *w) {
+        assert(w);
+
+        assert_se(pthread_mutex_lock(&w->mutex) == 0);
+        journal_writer_kick(w);
+        assert_se(pthread_mutex_unlock(&w->mutex) == 0);
+}
+
+void journal_writer_get_stats(JournalWriter *w, bool reset, JournalWriterStats *ret) {
+        assert(w);
+        assert(ret);
+
+        assert_se(pthread_mutex_lock(&w->mutex) == 0);
+
+        *ret = w->stats;
+        if (reset)
+                w->stats = (JournalWriterStats) {
+                        .max_queued = w->n_queued,
+                        .max_queued_bytes = w->queued_bytes,
+                };
+
+        assert_se(pthread_mutex_unlock(&w->mutex) == 0);
+}
@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "sd-event.h"
+
+#include "time-util.h"
+
+typedef struct JournalWriter JournalWriter;
+
+typedef struct JournalWriterEntry {
+        uid_t uid;
+        int priority;
+        dual_timestamp ts;
+        size_t size;
+        size_t n_iovec;
+        struct iovec iovec[];
+} JournalWriterEntry;
+
+typedef struct JournalWriterStats {
+        uint64_t n_entries;      /* entries passed to the writer thread */
+        uint64_t n_batches;      /* batches written by the writer thread */
+        uint64_t n_stalls;       /* how often the receive side had to wait for queue space */
+        usec_t stall_usec;       /* how long the receive side waited in total */
+        size_t max_queued;       /* high watermark of queued entries */
+        size_t max_queued_bytes; /* high watermark of queued payload bytes */
+} JournalWriterStats;
+
+/* Called in the writer thread with a batch of entries in the order they were queued */
+typedef void (*journal_writer_handler_t)(JournalWriterEntry *entries[], size_t n, void *userdata);
+
+/* Called from the event loop after the writer thread invoked journal_writer_wakeup() */
+typedef void (*journal_writer_wakeup_handler_t)(void *userdata);
+
+int journal_writer_new(
+                sd_event *e,
+                journal_writer_handler_t handler,
+                journal_writer_wakeup_handler_t wakeup_handler,
+                void *userdata,
+                JournalWriter **ret);
+JournalWriter* journal_writer_free(JournalWriter *w);
+
+int journal_writer_enqueue(JournalWriter *w, uid_t uid, int priority, const dual_timestamp *ts, const struct iovec *iovec, size_t n);
+
+void journal_writer_lock(JournalWriter *w);
+bool journal_writer_trylock(JournalWriter *w);
+void journal_writer_unlock(JournalWriter *w);
+bool journal_writer_is_locked(JournalWriter *w);
+
+bool journal_writer_in_writer_thread(void);
+void journal_writer_wakeup(JournalWriter *w);
+
+void journal_writer_get_stats(JournalWriter *w, bool reset, JournalWriterStats *ret);
@@ -62,33 +62,41 @@ int main(int argc, char *argv[]) {
 
                 n = now(CLOCK_REALTIME);
 
-                if (server.max_retention_usec > 0 && server.oldest_file_usec > 0) {
-
-                        /* The retention time is reached, so let's vacuum! */
-                        if (server.oldest_file_usec + server.max_retention_usec < n) {
-                                log_info("Retention time reached.");
-                                server_rotate(&server);
-                                server_vacuum(&server, false);
-                                continue;
+                /* The writer thread owns the journal files while it is busy. If it is, we'll be woken up once it
+                 * is done, and check again. */
+                if (server_trylock_journals(&server)) {
+
+                        if (server.max_retention_usec > 0 && server.oldest_file_usec > 0) {
+
+                                /* The retention time is reached, so let's vacuum! */
+                                if (server.oldest_file_usec + server.max_retention_usec < n) {
+                                        log_info("Retention time reached.");
+                                        server_rotate(&server);
+                                        server_vacuum(&server, false);
+                                        server_unlock_journals(&server);
+                                        continue;
+                                }
+
+                                /* Calculate when to rotate the next time */
+                                t = server.oldest_file_usec + server.max_retention_usec - n;
                         }
 
-                        /* Calculate when to rotate the next time */
-                        t = server.oldest_file_usec + server.max_retention_usec - n;
-                }
-
 #if HAVE_GCRYPT
-                if (server.system_journal) {
-                        usec_t u;
-
-                        if (journal_file_next_evolve_usec(server.system_journal, &u)) {
-                                if (n >= u)
-                                        t = 0;
-                                else
-                                        t = MIN(t, u - n);
+                        if (server.system_journal) {
+                                usec_t u;
+
+                                if (journal_file_next_evolve_usec(server.system_journal, &u)) {
+                                        if (n >= u)
+                                                t = 0;
+                                        else
+                                                t = MIN(t, u - n);
+                                }
                         }
-                }
 #endif
 
+                        server_unlock_journals(&server);
+                }
+
                 r = sd_event_run(server.event, t);
                 if (r < 0) {
                         log_error_errno(r, "Failed to run event loop: %m");
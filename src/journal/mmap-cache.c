@@ -45,18 +45,27 @@ struct Context {
         LIST_FIELDS(Context, by_window);
 };
 
+/* How a context accesses a file, tracked on each miss */
+typedef struct AccessPattern {
+        uint64_t offset;      /* the window mapped on the last miss */
+        uint64_t size;
+        uint64_t window_size; /* the size of the window mapped on the next miss, 0 if there was none yet */
+} AccessPattern;
+
 struct MMapFileDescriptor {
         MMapCache *cache;
         int fd;
         bool sigbus;
         LIST_HEAD(Window, windows);
+
+        AccessPattern access[MMAP_CACHE_MAX_CONTEXTS];
 };
 
 struct MMapCache {
         int n_ref;
         unsigned n_windows;
 
-        unsigned n_hit, n_missed;
+        unsigned n_hit, n_missed, n_unmapped;
 
         Hashmap *fds;
         Context *contexts[MMAP_CACHE_MAX_CONTEXTS];
@@ -70,8 +79,17 @@ struct MMapCache {
 #if ENABLE_DEBUG_MMAP_CACHE
 /* Tiny windows increase mmap activity and the chance of exposing unsafe use. */
 # define WINDOW_SIZE (page_size())
+# define WINDOW_SIZE_MIN WINDOW_SIZE
+# define WINDOW_SIZE_MAX WINDOW_SIZE
 #else
 # define WINDOW_SIZE (8ULL*1024ULL*1024ULL)
+# define WINDOW_SIZE_MIN (1ULL*1024ULL*1024ULL)
+# if __SIZEOF_POINTER__ >= 8
+#  define WINDOW_SIZE_MAX (64ULL*1024ULL*1024ULL)
+# else
+/* Address space is scarce, don't grow windows beyond the default */
+#  define WINDOW_SIZE_MAX WINDOW_SIZE
+# endif
 #endif
 
 MMapCache* mmap_cache_new(void) {
@@ -98,8 +116,10 @@ static void window_unlink(Window *w) {
 
         assert(w);
 
-        if (w->ptr)
+        if (w->ptr) {
                 munmap(w->ptr, w->size);
+                w->cache->n_unmapped++;
+        }
 
         if (w->fd)
                 LIST_REMOVE(by_fd, w->fd->windows, w);
@@ -436,6 +456,34 @@ static int mmap_try_harder(MMapCache *m, void *addr, MMapFileDescriptor *f, int
         return 0;
 }
 
+static int access_pattern_update(AccessPattern *a, uint64_t offset, size_t size) {
+        int direction = 0;
+
+        assert(a);
+
+        /* Called on each miss. If the miss is next to the window mapped on the previous one, we are probably
+         * scanning through the file, and the next window is made larger, so that we need fewer of them. If it
+         * isn't, we are probing at random, and the next window is made smaller, as we are unlikely to use much
+         * of it. Returns 1 when scanning forward, -1 when scanning backward, 0 otherwise. */
+
+        if (a->window_size == 0) {
+                a->window_size = WINDOW_SIZE;
+                return 0;
+        }
+
+        if (offset >= a->offset && offset <= a->offset + a->size + a->window_size)
+                direction = 1;
+        else if (offset < a->offset && offset + size + a->window_size >= a->offset)
+                direction = -1;
+
+        if (direction != 0)
+                a->window_size = MIN(a->window_size * 2, WINDOW_SIZE_MAX);
+        else
+                a->window_size = MAX(a->window_size / 2, WINDOW_SIZE_MIN);
+
+        return direction;
+}
+
 static int add_mmap(
                 MMapCache *m,
                 MMapFileDescriptor *f,
@@ -449,10 +497,11 @@ static int add_mmap(
                 size_t *ret_size) {
 
         uint64_t woffset, wsize;
+        AccessPattern *a;
+        int direction, r;
         Context *c;
         Window *w;
         void *d;
-        int r;
 
         assert(m);
         assert(m->n_ref > 0);
@@ -464,17 +513,26 @@ static int add_mmap(
         wsize = size + (offset - woffset);
         wsize = PAGE_ALIGN(wsize);
 
-        if (wsize < WINDOW_SIZE) {
+        a = f->access + context;
+        direction = access_pattern_update(a, offset, size);
+
+        if (wsize < a->window_size) {
                 uint64_t delta;
 
-                delta = PAGE_ALIGN((WINDOW_SIZE - wsize) / 2);
+                /* When scanning, map what comes next in the direction we are going, otherwise what's around */
+                if (direction > 0)
+                        delta = 0;
+                else if (direction < 0)
+                        delta = a->window_size - wsize;
+                else
+                        delta = PAGE_ALIGN((a->window_size - wsize) / 2);
 
-                if (delta > offset)
+                if (delta > woffset)
                         woffset = 0;
                 else
                         woffset -= delta;
 
-                wsize = WINDOW_SIZE;
+                wsize = a->window_size;
         }
 
         if (st) {
@@ -503,6 +561,18 @@ static int add_mmap(
 
         context_attach_window(c, w);
 
+        a->offset = woffset;
+        a->size = wsize;
+
+        /* Let the kernel read ahead of scans. Writers only touch what they just appended, which is in the
+         * page cache anyway. */
+        if (direction != 0 && !(prot & PROT_WRITE)) {
+                if (direction > 0)
+                        (void) madvise(d, wsize, MADV_SEQUENTIAL);
+
+                (void) madvise(d, wsize, MADV_WILLNEED);
+        }
+
         *ret = (uint8_t*) w->ptr + (offset - w->offset);
         if (ret_size)
                 *ret_size = w->size - (offset - w->offset);
@@ -567,6 +637,12 @@ unsigned mmap_cache_get_missed(MMapCache *m) {
         return m->n_missed;
 }
 
+unsigned mmap_cache_get_unmapped(MMapCache *m) {
+        assert(m);
+
+        return m->n_unmapped;
+}
+
 static void mmap_cache_process_sigbus(MMapCache *m) {
         bool found = false;
         MMapFileDescriptor *f;
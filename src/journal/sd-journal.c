@@ -27,6 +27,7 @@
 #include "journal-def.h"
 #include "journal-file.h"
 #include "journal-internal.h"
+#include "journal-time-index.h"
 #include "list.h"
 #include "lookup3.h"
 #include "missing.h"
@@ -47,8 +48,33 @@
 
 #define DEFAULT_DATA_THRESHOLD (64*1024)
 
+/* Each archived file searched by the lookahead threads needs a handle of its own, i.e. another fd and another
+ * set of mappings. Hence only this many files per thread are searched ahead, the others are searched serially. */
+#define LOOKAHEAD_FILES_PER_THREAD 2U
+
 static void remove_file_real(sd_journal *j, JournalFile *f);
 
+/* Looks for the matching entries of an archived file in a worker thread, ahead of time. The worker thread
+ * uses its own handle of the file, as JournalFile objects and their mmap caches may not be shared between
+ * threads. As archived files never change the offsets it comes up with are valid for our handle, too. */
+typedef struct FileLookahead {
+        sd_journal *journal;
+        JournalFile *shadow;
+        Lookahead *lookahead; /* NULL if we failed to set things up and search this file serially */
+
+        /* Set up while the stream is stopped, used by the worker thread while it runs */
+        Match *match;
+        Location location;
+        direction_t direction;
+        bool seek;
+        uint64_t offset;
+
+        /* Only used by the owner */
+        bool kicked;       /* we started a seek to location in direction, and didn't look at the result yet */
+        bool running;      /* the stream continues from position */
+        uint64_t position;
+} FileLookahead;
+
 static bool journal_pid_changed(sd_journal *j) {
         assert(j);
 
@@ -137,6 +163,42 @@ static void init_location(Location *l, LocationType type, JournalFile *f, Object
         l->seqnum_set = l->realtime_set = l->monotonic_set = l->xor_hash_set = true;
 }
 
+static FileLookahead* file_lookahead_free(FileLookahead *fl) {
+        if (!fl)
+                return NULL;
+
+        lookahead_free(fl->lookahead);
+        if (fl->shadow)
+                journal_file_close(fl->shadow);
+
+        return mfree(fl);
+}
+
+DEFINE_TRIVIAL_CLEANUP_FUNC(FileLookahead*, file_lookahead_free);
+
+static void stop_lookaheads(sd_journal *j) {
+        FileLookahead *fl;
+        Iterator i;
+
+        assert(j);
+
+        /* Must be called before the matches are changed, as the worker threads look at them */
+
+        HASHMAP_FOREACH(fl, j->lookaheads, i) {
+                if (fl->lookahead)
+                        lookahead_stop(fl->lookahead);
+
+                fl->kicked = fl->running = false;
+        }
+}
+
+static void free_lookaheads(sd_journal *j) {
+        assert(j);
+
+        j->lookaheads = hashmap_free_with_destructor(j->lookaheads, file_lookahead_free);
+        j->lookahead_pool = lookahead_pool_free(j->lookahead_pool);
+}
+
 static void set_location(sd_journal *j, JournalFile *f, Object *o) {
         assert(j);
         assert(f);
@@ -250,6 +312,8 @@ _public_ int sd_journal_add_match(sd_journal *j, const void *data, size_t size)
 
         assert_return(match_is_valid(data, size), -EINVAL);
 
+        stop_lookaheads(j);
+
         /* level 0: AND term
          * level 1: OR terms
          * level 2: AND terms
@@ -420,10 +484,22 @@ char *journal_make_match_string(sd_journal *j) {
         return match_make_string(j->level0);
 }
 
+void journal_set_lookahead_threads(sd_journal *j, unsigned n) {
+        assert(j);
+
+        /* Search archived files for matches in n worker threads. Pass 0 to search them serially, which is the
+         * default. */
+
+        free_lookaheads(j);
+        j->n_lookahead_threads = n;
+}
+
 _public_ void sd_journal_flush_matches(sd_journal *j) {
         if (!j)
                 return;
 
+        stop_lookaheads(j);
+
         if (j->level0)
                 match_free(j->level0);
 
@@ -483,6 +559,19 @@ _pure_ static int compare_with_location(JournalFile *f, Location *l) {
         return 0;
 }
 
+static int find_data_for_match(JournalFile *f, Match *m, uint64_t *ret) {
+        assert(f);
+        assert(m);
+        assert(m->type == MATCH_DISCRETE);
+
+        /* Ask the bloom filter first, it rules out most files without the value much more cheaply than the
+         * hash table does. If it is broken, we just look at the hash table. */
+        if (journal_file_bloom_filter_test(f, le64toh(m->le_hash)) == 0)
+                return 0;
+
+        return journal_file_find_data_object_with_hash(f, m->data, m->size, le64toh(m->le_hash), NULL, ret);
+}
+
 static int next_for_match(
                 sd_journal *j,
                 Match *m,
@@ -503,7 +592,7 @@ static int next_for_match(
         if (m->type == MATCH_DISCRETE) {
                 uint64_t dp;
 
-                r = journal_file_find_data_object_with_hash(f, m->data, m->size, le64toh(m->le_hash), NULL, &dp);
+                r = find_data_for_match(f, m, &dp);
                 if (r <= 0)
                         return r;
 
@@ -577,6 +666,7 @@ static int next_for_match(
 
 static int find_location_for_match(
                 sd_journal *j,
+                const Location *l,
                 Match *m,
                 JournalFile *f,
                 direction_t direction,
@@ -586,31 +676,32 @@ static int find_location_for_match(
         int r;
 
         assert(j);
+        assert(l);
         assert(m);
         assert(f);
 
         if (m->type == MATCH_DISCRETE) {
                 uint64_t dp;
 
-                r = journal_file_find_data_object_with_hash(f, m->data, m->size, le64toh(m->le_hash), NULL, &dp);
+                r = find_data_for_match(f, m, &dp);
                 if (r <= 0)
                         return r;
 
                 /* FIXME: missing: find by monotonic */
 
-                if (j->current_location.type == LOCATION_HEAD)
+                if (l->type == LOCATION_HEAD)
                         return journal_file_next_entry_for_data(f, NULL, 0, dp, DIRECTION_DOWN, ret, offset);
-                if (j->current_location.type == LOCATION_TAIL)
+                if (l->type == LOCATION_TAIL)
                         return journal_file_next_entry_for_data(f, NULL, 0, dp, DIRECTION_UP, ret, offset);
-                if (j->current_location.seqnum_set && sd_id128_equal(j->current_location.seqnum_id, f->header->seqnum_id))
-                        return journal_file_move_to_entry_by_seqnum_for_data(f, dp, j->current_location.seqnum, direction, ret, offset);
-                if (j->current_location.monotonic_set) {
-                        r = journal_file_move_to_entry_by_monotonic_for_data(f, dp, j->current_location.boot_id, j->current_location.monotonic, direction, ret, offset);
+                if (l->seqnum_set && sd_id128_equal(l->seqnum_id, f->header->seqnum_id))
+                        return journal_file_move_to_entry_by_seqnum_for_data(f, dp, l->seqnum, direction, ret, offset);
+                if (l->monotonic_set) {
+                        r = journal_file_move_to_entry_by_monotonic_for_data(f, dp, l->boot_id, l->monotonic, direction, ret, offset);
                         if (r != -ENOENT)
                                 return r;
                 }
-                if (j->current_location.realtime_set)
-                        return journal_file_move_to_entry_by_realtime_for_data(f, dp, j->current_location.realtime, direction, ret, offset);
+                if (l->realtime_set)
+                        return journal_file_move_to_entry_by_realtime_for_data(f, dp, l->realtime, direction, ret, offset);
 
                 return journal_file_next_entry_for_data(f, NULL, 0, dp, direction, ret, offset);
 
@@ -624,7 +715,7 @@ static int find_location_for_match(
                 LIST_FOREACH(matches, i, m->matches) {
                         uint64_t cp;
 
-                        r = find_location_for_match(j, i, f, direction, NULL, &cp);
+                        r = find_location_for_match(j, l, i, f, direction, NULL, &cp);
                         if (r < 0)
                                 return r;
                         else if (r > 0) {
@@ -662,7 +753,7 @@ static int find_location_for_match(
                 LIST_FOREACH(matches, i, m->matches) {
                         uint64_t cp;
 
-                        r = find_location_for_match(j, i, f, direction, NULL, &cp);
+                        r = find_location_for_match(j, l, i, f, direction, NULL, &cp);
                         if (r <= 0)
                                 return r;
 
@@ -674,6 +765,137 @@ static int find_location_for_match(
         }
 }
 
+static int file_lookahead_step(void *userdata, uint64_t *ret) {
+        FileLookahead *fl = userdata;
+        uint64_t p;
+        int r;
+
+        /* Called in a worker thread */
+
+        if (fl->seek) {
+                fl->seek = false;
+                r = find_location_for_match(fl->journal, &fl->location, fl->match, fl->shadow, fl->direction, NULL, &p);
+        } else
+                r = next_for_match(fl->journal, fl->match, fl->shadow,
+                                   fl->direction == DIRECTION_DOWN ? fl->offset + 1 : fl->offset - 1,
+                                   fl->direction, NULL, &p);
+        if (r <= 0)
+                return r;
+
+        fl->offset = p;
+        *ret = p;
+
+        return 1;
+}
+
+static FileLookahead* get_file_lookahead(sd_journal *j, JournalFile *f) {
+        _cleanup_(file_lookahead_freep) FileLookahead *fl = NULL;
+        FileLookahead *existing;
+        int fd, r;
+
+        assert(j);
+        assert(f);
+
+        if (j->n_lookahead_threads == 0 || !j->level0)
+                return NULL;
+
+        existing = hashmap_get(j->lookaheads, f);
+        if (existing)
+                return existing->lookahead ? existing : NULL;
+
+        /* Files that are still written to might change under the worker thread's feet */
+        if (f->header->state != STATE_ARCHIVED)
+                return NULL;
+
+        if (hashmap_size(j->lookaheads) >= j->n_lookahead_threads * LOOKAHEAD_FILES_PER_THREAD)
+                return NULL;
+
+        if (!j->lookahead_pool) {
+                r = lookahead_pool_new(j->n_lookahead_threads, &j->lookahead_pool);
+                if (r < 0) {
+                        log_debug_errno(r, "Failed to start lookahead threads, searching serially: %m");
+                        j->n_lookahead_threads = 0;
+                        return NULL;
+                }
+        }
+
+        if (hashmap_ensure_allocated(&j->lookaheads, NULL) < 0)
+                return NULL;
+
+        fl = new0(FileLookahead, 1);
+        if (!fl)
+                return NULL;
+
+        fl->journal = j;
+
+        fd = fcntl(f->fd, F_DUPFD_CLOEXEC, 3);
+        if (fd < 0)
+                r = -errno;
+        else {
+                r = journal_file_open(fd, f->path, O_RDONLY, 0, 0, 0, false, NULL, NULL, NULL, NULL, &fl->shadow);
+                if (r < 0)
+                        safe_close(fd);
+                else
+                        r = lookahead_new(j->lookahead_pool, file_lookahead_step, fl, &fl->lookahead);
+        }
+        if (r < 0) {
+                log_debug_errno(r, "Failed to set up lookahead for %s, searching it serially: %m", f->path);
+
+                /* Keep the entry around nonetheless, so that we don't try again and again */
+                if (fl->shadow)
+                        fl->shadow = journal_file_close(fl->shadow);
+        }
+
+        if (hashmap_put(j->lookaheads, f, fl) < 0)
+                return NULL;
+
+        existing = TAKE_PTR(fl);
+        return existing->lookahead ? existing : NULL;
+}
+
+static void file_lookahead_start(FileLookahead *fl, direction_t direction, bool seek, uint64_t offset) {
+        assert(fl);
+
+        lookahead_stop(fl->lookahead);
+
+        fl->match = fl->journal->level0;
+        memcpy(&fl->location, &fl->journal->current_location, sizeof(Location));
+        fl->direction = direction;
+        fl->seek = seek;
+        fl->offset = offset;
+
+        fl->kicked = seek;
+        fl->running = false;
+
+        lookahead_start(fl->lookahead);
+}
+
+static int file_lookahead_pop(FileLookahead *fl, JournalFile *f, Object **ret, uint64_t *offset) {
+        uint64_t p;
+        int r;
+
+        assert(fl);
+        assert(f);
+
+        fl->kicked = false;
+
+        r = lookahead_pop(fl->lookahead, &p);
+        if (r <= 0) {
+                fl->running = false;
+                return r;
+        }
+
+        fl->running = true;
+        fl->position = p;
+
+        r = journal_file_move_to_object(f, OBJECT_ENTRY, p, ret);
+        if (r < 0)
+                return r;
+
+        *offset = p;
+        return 1;
+}
+
 static int find_location_with_matches(
                 sd_journal *j,
                 JournalFile *f,
@@ -706,8 +928,21 @@ static int find_location_with_matches(
                         return journal_file_move_to_entry_by_realtime(f, j->current_location.realtime, direction, ret, offset);
 
                 return journal_file_next_entry(f, 0, direction, ret, offset);
-        } else
-                return find_location_for_match(j, j->level0, f, direction, ret, offset);
+        } else {
+                FileLookahead *fl;
+
+                fl = get_file_lookahead(j, f);
+                if (fl) {
+                        /* Maybe real_journal_next() already started this for us */
+                        if (!fl->kicked || fl->direction != direction ||
+                            memcmp(&fl->location, &j->current_location, sizeof(Location)) != 0)
+                                file_lookahead_start(fl, direction, true, 0);
+
+                        return file_lookahead_pop(fl, f, ret, offset);
+                }
+
+                return find_location_for_match(j, &j->current_location, j->level0, f, direction, ret, offset);
+        }
 }
 
 static int next_with_matches(
@@ -717,6 +952,8 @@ static int next_with_matches(
                 Object **ret,
                 uint64_t *offset) {
 
+        FileLookahead *fl;
+
         assert(j);
         assert(f);
         assert(ret);
@@ -727,6 +964,14 @@ static int next_with_matches(
         if (!j->level0)
                 return journal_file_next_entry(f, f->current_offset, direction, ret, offset);
 
+        fl = get_file_lookahead(j, f);
+        if (fl) {
+                if (!fl->running || fl->direction != direction || fl->position != f->current_offset)
+                        file_lookahead_start(fl, direction, false, f->current_offset);
+
+                return file_lookahead_pop(fl, f, ret, offset);
+        }
+
         /* If we have a match then we look for the next matching entry
          * with an offset at least one step larger */
         return next_for_match(j, j->level0, f,
@@ -735,6 +980,21 @@ static int next_with_matches(
                               direction, ret, offset);
 }
 
+static bool file_hit_eof(JournalFile *f, direction_t direction) {
+        assert(f);
+
+        /* If we hit EOF before, we don't need to look into this file again
+         * unless direction changed or new entries appeared. */
+        return f->last_direction == direction && f->location_type == LOCATION_TAIL &&
+                le64toh(f->header->n_entries) == f->last_n_entries;
+}
+
+static bool file_continues(JournalFile *f, direction_t direction) {
+        assert(f);
+
+        return f->last_direction == direction && f->current_offset > 0;
+}
+
 static int next_beyond_location(sd_journal *j, JournalFile *f, direction_t direction) {
         Object *c;
         uint64_t cp, n_entries;
@@ -745,15 +1005,12 @@ static int next_beyond_location(sd_journal *j, JournalFile *f, direction_t direc
 
         n_entries = le64toh(f->header->n_entries);
 
-        /* If we hit EOF before, we don't need to look into this file again
-         * unless direction changed or new entries appeared. */
-        if (f->last_direction == direction && f->location_type == LOCATION_TAIL &&
-            n_entries == f->last_n_entries)
+        if (file_hit_eof(f, direction))
                 return 0;
 
         f->last_n_entries = n_entries;
 
-        if (f->last_direction == direction && f->current_offset > 0) {
+        if (file_continues(f, direction)) {
                 /* LOCATION_SEEK here means we did the work in a previous
                  * iteration and the current location already points to a
                  * candidate entry. */
@@ -817,6 +1074,21 @@ static int real_journal_next(sd_journal *j, direction_t direction) {
         if (r < 0)
                 return r;
 
+        /* Start looking for the entry to seek to in all files at once, so that the worker threads can do that in
+         * parallel while we go through the files one by one below */
+        if (j->n_lookahead_threads > 0 && j->level0)
+                for (i = 0; i < n_files; i++) {
+                        JournalFile *f = (JournalFile *)files[i];
+                        FileLookahead *fl;
+
+                        if (file_hit_eof(f, direction) || file_continues(f, direction))
+                                continue;
+
+                        fl = get_file_lookahead(j, f);
+                        if (fl)
+                                file_lookahead_start(fl, direction, true, 0);
+                }
+
         for (i = 0; i < n_files; i++) {
                 JournalFile *f = (JournalFile *)files[i];
                 bool found;
@@ -1235,6 +1507,50 @@ static void track_file_disposition(sd_journal *j, JournalFile *f) {
                 j->has_persistent_files = true;
 }
 
+static bool has_time_window(sd_journal *j) {
+        assert(j);
+
+        return j->window_since > 0 || j->window_until != USEC_INFINITY;
+}
+
+static bool skip_for_time_window(sd_journal *j, const char *path, const JournalTimeRange *range) {
+        assert(j);
+        assert(path);
+
+        if (!range || journal_time_range_overlaps(range, j->window_since, j->window_until))
+                return false;
+
+        log_debug("Archived journal file %s has no entries in the time window, not adding it.", path);
+
+        /* Keep track of what we skipped, so that the cutoff timestamps stay the same */
+        if (range->head_realtime > 0) {
+                if (j->skipped_range.head_realtime == 0 || range->head_realtime < j->skipped_range.head_realtime)
+                        j->skipped_range.head_realtime = range->head_realtime;
+                if (range->tail_realtime > j->skipped_range.tail_realtime)
+                        j->skipped_range.tail_realtime = range->tail_realtime;
+        }
+
+        return true;
+}
+
+static const JournalTimeRange* time_index_lookup(sd_journal *j, const char *path) {
+        const char *slash;
+        Directory *d;
+
+        assert(j);
+        assert(path);
+
+        slash = strrchr(path, '/');
+        if (!slash)
+                return NULL;
+
+        d = hashmap_get(j->directories_by_path, strndupa(path, slash - path));
+        if (!d)
+                return NULL;
+
+        return hashmap_get(d->time_ranges, slash + 1);
+}
+
 static const char *skip_slash(const char *p) {
 
         if (!p)
@@ -1260,6 +1576,13 @@ static int add_any_file(
         assert(fd >= 0 || path);
 
         if (fd < 0) {
+                /* If the directory's time index tells us we don't need the file, don't even open it */
+                if (has_time_window(j) &&
+                    skip_for_time_window(j, path, time_index_lookup(j, path))) {
+                        r = 0;
+                        goto finish;
+                }
+
                 if (j->toplevel_fd >= 0)
                         /* If there's a top-level fd defined make the path relative, explicitly, since otherwise
                          * openat() ignores the first argument. */
@@ -1319,12 +1642,25 @@ static int add_any_file(
                 goto finish;
         }
 
-        r = journal_file_open(fd, path, O_RDONLY, 0, false, 0, false, NULL, j->mmap, NULL, NULL, &f);
+        r = journal_file_open(fd, path, O_RDONLY, 0, 0, 0, false, NULL, j->mmap, NULL, NULL, &f);
         if (r < 0) {
                 log_debug_errno(r, "Failed to open journal file %s: %m", path);
                 goto finish;
         }
 
+        /* Not every archived file is in a time index, check the header of those that aren't */
+        if (has_time_window(j) &&
+            f->header->state == STATE_ARCHIVED &&
+            skip_for_time_window(j, f->path, &(JournalTimeRange) {
+                            .head_realtime = le64toh(f->header->head_entry_realtime),
+                            .tail_realtime = le64toh(f->header->tail_entry_realtime),
+                    })) {
+                f->close_fd = false; /* the fd is still the caller's or ours, see above */
+                (void) journal_file_close(f);
+                r = 0;
+                goto finish;
+        }
+
         /* journal_file_dump(f); */
 
         r = ordered_hashmap_put(j->files, f->path, f);
@@ -1406,6 +1742,7 @@ static void remove_file_real(sd_journal *j, JournalFile *f) {
         assert(f);
 
         (void) ordered_hashmap_remove(j->files, f->path);
+        file_lookahead_free(hashmap_remove(j->lookaheads, f));
 
         log_debug("File %s removed.", f->path);
 
@@ -1414,10 +1751,13 @@ static void remove_file_real(sd_journal *j, JournalFile *f) {
                 j->current_field = 0;
         }
 
+        (void) set_remove(j->unique_unindexed_files, f);
+
         if (j->unique_file == f) {
                 /* Jump to the next unique_file or NULL if that one was last */
                 j->unique_file = ordered_hashmap_next(j->files, j->unique_file->path);
                 j->unique_offset = 0;
+                j->unique_index_offset = 0;
                 if (!j->unique_file)
                         j->unique_file_lost = true;
         }
@@ -1492,11 +1832,20 @@ static int add_directory(sd_journal *j, const char *prefix, const char *dirname)
 
 static void directory_enumerate(sd_journal *j, Directory *m, DIR *d) {
         struct dirent *de;
+        int r;
 
         assert(j);
         assert(m);
         assert(d);
 
+        if (has_time_window(j)) {
+                m->time_ranges = hashmap_free_free_free(m->time_ranges);
+
+                r = journal_time_index_load(dirfd(d), &m->time_ranges);
+                if (r < 0 && r != -ENOENT)
+                        log_debug_errno(r, "Failed to read time index of %s, ignoring: %m", m->path);
+        }
+
         FOREACH_DIRENT_ALL(de, d, goto fail) {
 
                 if (dirent_is_journal_file(de))
@@ -1745,6 +2094,7 @@ static void remove_directory(sd_journal *j, Directory *d) {
         else
                 log_debug("Directory %s removed.", d->path);
 
+        hashmap_free_free_free(d->time_ranges);
         free(d->path);
         free(d);
 }
@@ -1820,6 +2170,7 @@ static sd_journal *journal_new(int flags, const char *path) {
         j->inotify_fd = -1;
         j->flags = flags;
         j->data_threshold = DEFAULT_DATA_THRESHOLD;
+        j->window_until = USEC_INFINITY;
 
         if (path) {
                 char *t;
@@ -1939,6 +2290,38 @@ _public_ int sd_journal_open_directory(sd_journal **ret, const char *path, int f
         return 0;
 }
 
+int journal_open_time_window(sd_journal **ret, const char *path, int flags, usec_t since, usec_t until) {
+        _cleanup_(sd_journal_closep) sd_journal *j = NULL;
+        int r;
+
+        assert(ret);
+        assert(since <= until);
+
+        /* Like sd_journal_open() if path is NULL, and like sd_journal_open_directory() otherwise, except that
+         * archived files without entries between since and until are not opened at all. On a long history
+         * most files are outside of any given time window, and we save mapping and searching them. */
+
+        if ((flags & ~(path ? OPEN_DIRECTORY_ALLOWED_FLAGS : OPEN_ALLOWED_FLAGS)) != 0)
+                return -EINVAL;
+
+        j = journal_new(flags, path);
+        if (!j)
+                return -ENOMEM;
+
+        j->window_since = since;
+        j->window_until = until;
+
+        if (!path || (flags & SD_JOURNAL_OS_ROOT))
+                r = add_search_paths(j);
+        else
+                r = add_root_directory(j, path, false);
+        if (r < 0)
+                return r;
+
+        *ret = TAKE_PTR(j);
+        return 0;
+}
+
 _public_ int sd_journal_open_files(sd_journal **ret, const char **paths, int flags) {
         _cleanup_(sd_journal_closep) sd_journal *j = NULL;
         const char **path;
@@ -2058,6 +2441,7 @@ _public_ void sd_journal_close(sd_journal *j) {
                 return;
 
         sd_journal_flush_matches(j);
+        free_lookaheads(j);
 
         ordered_hashmap_free_with_destructor(j->files, journal_file_close);
         iterated_cache_free(j->files_cache);
@@ -2074,7 +2458,8 @@ _public_ void sd_journal_close(sd_journal *j) {
         safe_close(j->inotify_fd);
 
         if (j->mmap) {
-                log_debug("mmap cache statistics: %u hit, %u miss", mmap_cache_get_hit(j->mmap), mmap_cache_get_missed(j->mmap));
+                log_debug("mmap cache statistics: %u hit, %u miss, %u unmapped",
+                          mmap_cache_get_hit(j->mmap), mmap_cache_get_missed(j->mmap), mmap_cache_get_unmapped(j->mmap));
                 mmap_cache_unref(j->mmap);
         }
 
@@ -2083,6 +2468,8 @@ _public_ void sd_journal_close(sd_journal *j) {
         free(j->path);
         free(j->prefix);
         free(j->unique_field);
+        set_free_free(j->unique_values);
+        set_free(j->unique_unindexed_files);
         free(j->fields_buffer);
         free(j);
 }
@@ -2223,11 +2610,14 @@ _public_ int sd_journal_get_data(sd_journal *j, const char *field, const void **
 
                 compression = o->object.flags & OBJECT_COMPRESSION_MASK;
                 if (compression) {
-#if HAVE_XZ || HAVE_LZ4
+#if HAVE_XZ || HAVE_LZ4 || HAVE_ZSTD
+                        (void) journal_file_load_dictionary(f);
+
                         r = decompress_startswith(compression,
                                                   o->data.payload, l,
                                                   &f->compress_buffer, &f->compress_buffer_size,
-                                                  field, field_length, '=');
+                                                  field, field_length, '=',
+                                                  f->compress_dictionary);
                         if (r < 0)
                                 log_debug_errno(r, "Cannot decompress %s object of length %"PRIu64" at offset "OFSfmt": %m",
                                                 object_compressed_to_string(compression), l, p);
@@ -2238,7 +2628,7 @@ _public_ int sd_journal_get_data(sd_journal *j, const char *field, const void **
                                 r = decompress_blob(compression,
                                                     o->data.payload, l,
                                                     &f->compress_buffer, &f->compress_buffer_size, &rsize,
-                                                    j->data_threshold);
+                                                    j->data_threshold, f->compress_dictionary);
                                 if (r < 0)
                                         return r;
 
@@ -2287,13 +2677,16 @@ static int return_data(sd_journal *j, JournalFile *f, Object *o, const void **da
 
         compression = o->object.flags & OBJECT_COMPRESSION_MASK;
         if (compression) {
-#if HAVE_XZ || HAVE_LZ4
+#if HAVE_XZ || HAVE_LZ4 || HAVE_ZSTD
                 size_t rsize;
                 int r;
 
+                (void) journal_file_load_dictionary(f);
+
                 r = decompress_blob(compression,
                                     o->data.payload, l, &f->compress_buffer,
-                                    &f->compress_buffer_size, &rsize, j->data_threshold);
+                                    &f->compress_buffer_size, &rsize, j->data_threshold,
+                                    f->compress_dictionary);
                 if (r < 0)
                         return r;
 
@@ -2355,6 +2748,47 @@ _public_ int sd_journal_enumerate_data(sd_journal *j, const void **data, size_t
         return 1;
 }
 
+int journal_peek_data(sd_journal *j, sd_id128_t *ret_file_id, uint64_t *ret_offset) {
+        JournalFile *f;
+        uint64_t n;
+        int r;
+        Object *o;
+
+        assert(j);
+        assert(ret_file_id);
+        assert(ret_offset);
+
+        /* Returns the position of the DATA object sd_journal_enumerate_data() would return next, without reading
+         * it. Together with the file ID this identifies a field value, hence callers may remember which ones they
+         * have seen already, and step over them with journal_skip_data(). */
+
+        f = j->current_file;
+        if (!f)
+                return -EADDRNOTAVAIL;
+
+        if (f->current_offset <= 0)
+                return -EADDRNOTAVAIL;
+
+        r = journal_file_move_to_object(f, OBJECT_ENTRY, f->current_offset, &o);
+        if (r < 0)
+                return r;
+
+        n = journal_file_entry_n_items(o);
+        if (j->current_field >= n)
+                return 0;
+
+        *ret_file_id = f->header->file_id;
+        *ret_offset = le64toh(o->entry.items[j->current_field].object_offset);
+
+        return 1;
+}
+
+void journal_skip_data(sd_journal *j) {
+        assert(j);
+
+        j->current_field++;
+}
+
 _public_ void sd_journal_restart_data(sd_journal *j) {
         if (!j)
                 return;
@@ -2654,6 +3088,17 @@ _public_ int sd_journal_get_cutoff_realtime_usec(sd_journal *j, uint64_t *from,
                 }
         }
 
+        if (j->skipped_range.head_realtime > 0) {
+                if (first) {
+                        fmin = j->skipped_range.head_realtime;
+                        tmax = j->skipped_range.tail_realtime;
+                        first = false;
+                } else {
+                        fmin = MIN(j->skipped_range.head_realtime, fmin);
+                        tmax = MAX(j->skipped_range.tail_realtime, tmax);
+                }
+        }
+
         if (from)
                 *from = fmin;
         if (to)
@@ -2716,6 +3161,10 @@ void journal_print_header(sd_journal *j) {
 
                 journal_file_print_header(f);
         }
+
+        if (newline)
+                printf("\nMMap cache statistics: %u hit, %u miss, %u unmapped\n",
+                       mmap_cache_get_hit(j->mmap), mmap_cache_get_missed(j->mmap), mmap_cache_get_unmapped(j->mmap));
 }
 
 _public_ int sd_journal_get_usage(sd_journal *j, uint64_t *bytes) {
@@ -2740,6 +3189,57 @@ _public_ int sd_journal_get_usage(sd_journal *j, uint64_t *bytes) {
         return 0;
 }
 
+typedef struct UniqueValue {
+        size_t size;
+        uint8_t data[];
+} UniqueValue;
+
+static void unique_value_hash_func(const void *p, struct siphash *state) {
+        const UniqueValue *v = p;
+
+        siphash24_compress(&v->size, sizeof(v->size), state);
+        siphash24_compress(v->data, v->size, state);
+}
+
+static int unique_value_compare_func(const void *a, const void *b) {
+        const UniqueValue *x = a, *y = b;
+
+        if (x->size != y->size)
+                return x->size < y->size ? -1 : 1;
+
+        return memcmp(x->data, y->data, x->size);
+}
+
+static const struct hash_ops unique_value_hash_ops = {
+        .hash = unique_value_hash_func,
+        .compare = unique_value_compare_func,
+};
+
+static UniqueValue* unique_value_new(const void *data, size_t size) {
+        UniqueValue *v;
+
+        v = malloc(offsetof(UniqueValue, data) + size);
+        if (!v)
+                return NULL;
+
+        v->size = size;
+        memcpy(v->data, data, size);
+
+        return v;
+}
+
+static void reset_unique(sd_journal *j) {
+        assert(j);
+
+        j->unique_file = NULL;
+        j->unique_offset = 0;
+        j->unique_index_offset = 0;
+        j->unique_file_lost = false;
+
+        set_clear_free(j->unique_values);
+        set_clear(j->unique_unindexed_files);
+}
+
 _public_ int sd_journal_query_unique(sd_journal *j, const char *field) {
         char *f;
 
@@ -2754,13 +3254,85 @@ _public_ int sd_journal_query_unique(sd_journal *j, const char *field) {
 
         free(j->unique_field);
         j->unique_field = f;
-        j->unique_file = NULL;
-        j->unique_offset = 0;
-        j->unique_file_lost = false;
+        reset_unique(j);
 
         return 0;
 }
 
+static int next_unique_from_index(sd_journal *j, const void **data, size_t *l, uint64_t *hash) {
+        FieldIndexItem *item;
+        Object *o;
+        int r;
+
+        assert(j);
+        assert(j->unique_file);
+        assert(j->unique_index_offset > 0);
+
+        r = journal_file_move_to_object(j->unique_file, OBJECT_FIELD_INDEX, j->unique_index_offset, &o);
+        if (r < 0)
+                return r;
+
+        r = journal_file_field_index_next_item(o, &j->unique_offset, &item);
+        if (r <= 0)
+                return r;
+
+        *data = item->payload;
+        *l = (size_t) le64toh(item->size);
+        *hash = le64toh(item->hash);
+
+        return 1;
+}
+
+static int next_unique_from_data(sd_journal *j, size_t k, const void **data, size_t *l, uint64_t *hash) {
+        Object *o;
+        int r;
+
+        assert(j);
+        assert(j->unique_file);
+
+        /* Proceed to next data object in the field's linked list */
+        if (j->unique_offset == 0) {
+                r = journal_file_find_field_object(j->unique_file, j->unique_field, k, &o, NULL);
+                if (r < 0)
+                        return r;
+
+                j->unique_offset = r > 0 ? le64toh(o->field.head_data_offset) : 0;
+        } else {
+                r = journal_file_move_to_object(j->unique_file, OBJECT_DATA, j->unique_offset, &o);
+                if (r < 0)
+                        return r;
+
+                j->unique_offset = le64toh(o->data.next_field_offset);
+        }
+
+        /* We reached the end of the list? */
+        if (j->unique_offset == 0)
+                return 0;
+
+        /* We do not use OBJECT_DATA context here, but OBJECT_UNUSED
+         * instead, so that we can look at this data object at the same
+         * time as one on another file */
+        r = journal_file_move_to_object(j->unique_file, OBJECT_UNUSED, j->unique_offset, &o);
+        if (r < 0)
+                return r;
+
+        /* Let's do the type check by hand, since we used 0 context above. */
+        if (o->object.type != OBJECT_DATA) {
+                log_debug("%s:offset " OFSfmt ": object has type %d, expected %d",
+                          j->unique_file->path, j->unique_offset,
+                          o->object.type, OBJECT_DATA);
+                return -EBADMSG;
+        }
+
+        r = return_data(j, j->unique_file, o, data, l);
+        if (r < 0)
+                return r;
+
+        *hash = le64toh(o->data.hash);
+
+        return 1;
+}
+
 _public_ int sd_journal_enumerate_unique(sd_journal *j, const void **data, size_t *l) {
         size_t k;
 
@@ -2781,60 +3353,56 @@ _public_ int sd_journal_enumerate_unique(sd_journal *j, const void **data, size_
                         return 0;
 
                 j->unique_offset = 0;
+                j->unique_index_offset = 0;
         }
 
         for (;;) {
                 JournalFile *of;
                 Iterator i;
-                Object *o;
                 const void *odata;
                 size_t ol;
+                uint64_t hash;
                 bool found;
                 int r;
 
-                /* Proceed to next data object in the field's linked list */
-                if (j->unique_offset == 0) {
-                        r = journal_file_find_field_object(j->unique_file, j->unique_field, k, &o, NULL);
-                        if (r < 0)
-                                return r;
-
-                        j->unique_offset = r > 0 ? le64toh(o->field.head_data_offset) : 0;
-                } else {
-                        r = journal_file_move_to_object(j->unique_file, OBJECT_DATA, j->unique_offset, &o);
+                /* Starting with a new file? Then check whether it comes with an index of the field's
+                 * values, which saves us from looking at all its data objects */
+                if (j->unique_offset == 0 && j->unique_index_offset == 0) {
+                        r = journal_file_find_field_index(j->unique_file, j->unique_field, k, NULL, &j->unique_index_offset);
                         if (r < 0)
                                 return r;
-
-                        j->unique_offset = le64toh(o->data.next_field_offset);
+                        if (r == 0)
+                                j->unique_index_offset = 0;
                 }
 
+                if (j->unique_index_offset > 0)
+                        r = next_unique_from_index(j, &odata, &ol, &hash);
+                else
+                        r = next_unique_from_data(j, k, &odata, &ol, &hash);
+                if (r < 0)
+                        return r;
+
                 /* We reached the end of the list? Then start again, with the next file */
-                if (j->unique_offset == 0) {
+                if (r == 0) {
+                        if (j->unique_index_offset == 0) {
+                                r = set_ensure_allocated(&j->unique_unindexed_files, NULL);
+                                if (r < 0)
+                                        return r;
+
+                                r = set_put(j->unique_unindexed_files, j->unique_file);
+                                if (r < 0)
+                                        return r;
+                        }
+
                         j->unique_file = ordered_hashmap_next(j->files, j->unique_file->path);
+                        j->unique_offset = 0;
+                        j->unique_index_offset = 0;
                         if (!j->unique_file)
                                 return 0;
 
                         continue;
                 }
 
-                /* We do not use OBJECT_DATA context here, but OBJECT_UNUSED
-                 * instead, so that we can look at this data object at the same
-                 * time as one on another file */
-                r = journal_file_move_to_object(j->unique_file, OBJECT_UNUSED, j->unique_offset, &o);
-                if (r < 0)
-                        return r;
-
-                /* Let's do the type check by hand, since we used 0 context above. */
-                if (o->object.type != OBJECT_DATA) {
-                        log_debug("%s:offset " OFSfmt ": object has type %d, expected %d",
-                                  j->unique_file->path, j->unique_offset,
-                                  o->object.type, OBJECT_DATA);
-                        return -EBADMSG;
-                }
-
-                r = return_data(j, j->unique_file, o, &odata, &ol);
-                if (r < 0)
-                        return r;
-
                 /* Check if we have at least the field name and "=". */
                 if (ol <= k) {
                         log_debug("%s:offset " OFSfmt ": object has size %zu, expected at least %zu",
@@ -2850,19 +3418,39 @@ _public_ int sd_journal_enumerate_unique(sd_journal *j, const void **data, size_
                         return -EBADMSG;
                 }
 
-                /* OK, now let's see if we already returned this data
-                 * object by checking if it exists in the earlier
-                 * traversed files. */
-                found = false;
-                ORDERED_HASHMAP_FOREACH(of, j->files, i) {
-                        if (of == j->unique_file)
-                                break;
+                /* OK, now let's see if we already returned this data object. Values of files we
+                 * enumerated via their index are all remembered, hence we only have to look up the
+                 * value in the earlier traversed files that had none. */
+                if (j->unique_index_offset > 0 || !set_isempty(j->unique_values)) {
+                        _cleanup_free_ UniqueValue *v = NULL;
+
+                        v = unique_value_new(odata, ol);
+                        if (!v)
+                                return -ENOMEM;
+
+                        if (set_contains(j->unique_values, v))
+                                continue;
+
+                        if (j->unique_index_offset > 0) {
+                                r = set_ensure_allocated(&j->unique_values, &unique_value_hash_ops);
+                                if (r < 0)
+                                        return r;
+
+                                r = set_put(j->unique_values, v);
+                                if (r < 0)
+                                        return r;
+
+                                TAKE_PTR(v);
+                        }
+                }
 
+                found = false;
+                SET_FOREACH(of, j->unique_unindexed_files, i) {
                         /* Skip this file it didn't have any fields indexed */
                         if (JOURNAL_HEADER_CONTAINS(of->header, n_fields) && le64toh(of->header->n_fields) <= 0)
                                 continue;
 
-                        r = journal_file_find_data_object_with_hash(of, odata, ol, le64toh(o->data.hash), NULL, NULL);
+                        r = journal_file_find_data_object_with_hash(of, odata, ol, hash, NULL, NULL);
                         if (r < 0)
                                 return r;
                         if (r > 0) {
@@ -2874,9 +3462,13 @@ _public_ int sd_journal_enumerate_unique(sd_journal *j, const void **data, size_
                 if (found)
                         continue;
 
-                r = return_data(j, j->unique_file, o, data, l);
-                if (r < 0)
-                        return r;
+                /* Indexes carry values in full, which are truncated only now, since the full value was
+                 * needed to tell it apart from others above */
+                if (j->unique_index_offset > 0 && j->data_threshold > 0)
+                        ol = MIN(ol, j->data_threshold);
+
+                *data = odata;
+                *l = ol;
 
                 return 1;
         }
@@ -2886,9 +3478,7 @@ _public_ void sd_journal_restart_unique(sd_journal *j) {
         if (!j)
                 return;
 
-        j->unique_file = NULL;
-        j->unique_offset = 0;
-        j->unique_file_lost = false;
+        reset_unique(j);
 }
 
 _public_ int sd_journal_enumerate_fields(sd_journal *j, const char **field) {
@@ -3,11 +3,13 @@
 #include "alloc-util.h"
 #include "compress.h"
 #include "env-util.h"
+#include "fileio.h"
 #include "macro.h"
 #include "parse-util.h"
 #include "process-util.h"
 #include "random-util.h"
 #include "string-util.h"
+#include "strv.h"
 #include "util.h"
 
 typedef int (compress_t)(const void *src, uint64_t src_size, void *dst,
@@ -15,10 +17,11 @@ typedef int (compress_t)(const void *src, uint64_t src_size, void *dst,
 typedef int (decompress_t)(const void *src, uint64_t src_size,
                            void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max);
 
-#if HAVE_XZ || HAVE_LZ4
+#if HAVE_XZ || HAVE_LZ4 || HAVE_ZSTD
 
 static usec_t arg_duration;
 static size_t arg_start;
+static const char *arg_sample;
 
 #define MAX_SIZE (1024*1024LU)
 #define PRIME 1048571  /* A prime close enough to one megabyte that mod 4 == 3 */
@@ -65,6 +68,17 @@ static char* make_buf(size_t count, const char *type) {
                 memzero(buf + 7*step, step);
                 random_bytes(buf + 8*step, step);
                 memzero(buf + 9*step, step);
+        } else if (streq(type, "sample")) {
+                _cleanup_free_ char *sample = NULL;
+                size_t size, i;
+
+                /* Fill the buffer by repeating the contents of a user supplied file, so that ratio and
+                 * speed can be compared on real data, e.g. the output of "journalctl -o export". */
+                assert_se(read_full_file(arg_sample, &sample, &size) >= 0);
+                assert_se(size > 0);
+
+                for (i = 0; i < count; i += size)
+                        memcpy(buf + i, sample, MIN(size, count - i));
         } else
                 assert_not_reached("here");
 
@@ -100,8 +114,8 @@ static void test_compress_decompress(const char* label, const char* type,
                 memzero(buf, MIN(size + 1000, MAX_SIZE));
 
                 r = compress(text, size, buf, size, &j);
-                /* assume compression must be successful except for small or random inputs */
-                assert_se(r == 0 || (size < 2048 && r == -ENOBUFS) || streq(type, "random"));
+                /* assume compression must be successful except for small, random or user supplied inputs */
+                assert_se(r == 0 || (size < 2048 && r == -ENOBUFS) || STR_IN_SET(type, "random", "sample"));
 
                 /* check for overwrites */
                 assert_se(buf[size] == 0);
@@ -141,7 +155,7 @@ static void test_compress_decompress(const char* label, const char* type,
 #endif
 
 int main(int argc, char *argv[]) {
-#if HAVE_XZ || HAVE_LZ4
+#if HAVE_XZ || HAVE_LZ4 || HAVE_ZSTD
         const char *i;
         int r;
 
@@ -161,17 +175,27 @@ int main(int argc, char *argv[]) {
                 arg_duration = slow ? 2 * USEC_PER_SEC : USEC_PER_SEC / 50;
         }
 
-        if (argc == 3)
+        if (argc >= 3)
                 (void) safe_atozu(argv[2], &arg_start);
         else
                 arg_start = getpid_cached();
 
-        NULSTR_FOREACH(i, "zeros\0simple\0random\0") {
+        /* An optional third argument names a file whose contents are used as an additional input type */
+        if (argc >= 4)
+                arg_sample = argv[3];
+
+        NULSTR_FOREACH(i, "zeros\0simple\0random\0sample\0") {
+                if (streq(i, "sample") && !arg_sample)
+                        continue;
+
 #if HAVE_XZ
                 test_compress_decompress("XZ", i, compress_blob_xz, decompress_blob_xz);
 #endif
 #if HAVE_LZ4
                 test_compress_decompress("LZ4", i, compress_blob_lz4, decompress_blob_lz4);
+#endif
+#if HAVE_ZSTD
+                test_compress_decompress("ZSTD", i, compress_blob_zstd, decompress_blob_zstd);
 #endif
         }
         return 0;
@@ -39,7 +39,7 @@ typedef int (decompress_sw_t)(const void *src, uint64_t src_size,
 typedef int (compress_stream_t)(int fdf, int fdt, uint64_t max_bytes);
 typedef int (decompress_stream_t)(int fdf, int fdt, uint64_t max_size);
 
-#if HAVE_XZ || HAVE_LZ4
+#if HAVE_XZ || HAVE_LZ4 || HAVE_ZSTD
 static void test_compress_decompress(int compression,
                                      compress_blob_t compress,
                                      decompress_blob_t decompress,
@@ -237,8 +237,127 @@ static void test_lz4_decompress_partial(void) {
 }
 #endif
 
+#if HAVE_LZ4 || HAVE_ZSTD
+static void test_compress_frames(int compression,
+                                 const char *first, size_t first_size,
+                                 const char *second, size_t second_size) {
+        _cleanup_(decompressor_freep) Decompressor *d = NULL;
+        _cleanup_free_ char *frames = NULL, *frame = NULL, *decompressed = NULL;
+        size_t alloc = 0, frame_alloc = 0, size, total, n = 0, i, src_size, out_size;
+        const void *src, *out;
+
+        log_info("/* testing %s frames */", content_encoding_to_string(compression));
+
+        /* Two frames back to back decode to the two inputs concatenated */
+        assert_se(compress_frame(compression, first, first_size, (void**) &frames, &alloc, &total) == 0);
+        assert_se(compress_frame(compression, second, second_size, (void**) &frame, &frame_alloc, &size) == 0);
+        assert_se(GREEDY_REALLOC(frames, alloc, total + size));
+        memcpy(frames + total, frame, size);
+        total += size;
+
+        log_info("Compressed %zu + %zu → %zu", first_size, second_size, total);
+
+        decompressed = malloc(first_size + second_size);
+        assert_se(decompressed);
+
+        /* Feed it in small pieces, like it arrives from the network */
+        assert_se(decompressor_new(compression, &d) == 0);
+        for (i = 0; i < total; i += 13) {
+                src = frames + i;
+                src_size = MIN(total - i, 13u);
+
+                do {
+                        assert_se(decompressor_run(d, &src, &src_size, &out, &out_size) == 0);
+                        assert_se(n + out_size <= first_size + second_size);
+                        memcpy(decompressed + n, out, out_size);
+                        n += out_size;
+                } while (src_size > 0 || out_size > 0);
+        }
+
+        assert_se(!decompressor_in_frame(d));
+        assert_se(n == first_size + second_size);
+        assert_se(memcmp(decompressed, first, first_size) == 0);
+        assert_se(memcmp(decompressed + first_size, second, second_size) == 0);
+
+        /* A truncated frame is noticed */
+        d = decompressor_free(d);
+        assert_se(decompressor_new(compression, &d) == 0);
+        src = frames;
+        src_size = total - 1;
+        do
+                assert_se(decompressor_run(d, &src, &src_size, &out, &out_size) == 0);
+        while (src_size > 0 || out_size > 0);
+        assert_se(decompressor_in_frame(d));
+
+        /* Garbage is refused */
+        d = decompressor_free(d);
+        assert_se(decompressor_new(compression, &d) == 0);
+        src = first;
+        src_size = first_size;
+        assert_se(decompressor_run(d, &src, &src_size, &out, &out_size) < 0);
+}
+#endif
+
+#if HAVE_ZSTD
+static void test_zstd_dictionary(void) {
+        _cleanup_(compress_dictionary_freep) CompressDictionary *dict = NULL;
+        _cleanup_free_ char *samples = NULL, *decompressed = NULL;
+        _cleanup_free_ void *d = NULL;
+        static const char field[] = "_SYSTEMD_UNIT=systemd-journald.service";
+        size_t sizes[2000], n = 0, total = 0, d_size, csize, csize_plain, usize = 0, alloc = 0;
+        char compressed[512];
+        unsigned i;
+
+        log_info("/* testing ZSTD dictionary compression */");
+
+        samples = malloc(sizeof(sizes)/sizeof(sizes[0]) * 128);
+        assert_se(samples);
+
+        for (i = 0; i < ELEMENTSOF(sizes); i++) {
+                int k;
+
+                k = sprintf(samples + total, "%s=%s-%u.%s",
+                            i % 3 == 0 ? "_SYSTEMD_UNIT" : i % 3 == 1 ? "_SYSTEMD_CGROUP" : "SYSLOG_IDENTIFIER",
+                            i % 2 ? "systemd" : "session", i * 7919 % 1000,
+                            i % 5 ? "service" : "scope");
+                sizes[n++] = k;
+                total += k;
+        }
+
+        assert_se(compress_dictionary_train(samples, sizes, n, 4096, &d, &d_size) == 0);
+        log_info("Trained %zu byte dictionary from %zu samples (%zu bytes)", d_size, n, total);
+
+        assert_se(compress_dictionary_new(d, d_size, true, &dict) == 0);
+
+        assert_se(compress_blob_zstd_with_dictionary(dict, field, sizeof(field) - 1,
+                                                     compressed, sizeof(compressed), &csize) == 0);
+        assert_se(compress_blob_zstd(field, sizeof(field) - 1,
+                                     compressed + csize, sizeof(compressed) - csize, &csize_plain) == 0);
+        log_info("Compressed %zu → %zu with dictionary, → %zu without", sizeof(field) - 1, csize, csize_plain);
+        assert_se(csize < csize_plain);
+
+        assert_se(decompress_blob(OBJECT_COMPRESSED_ZSTD, compressed, csize,
+                                  (void**) &decompressed, &alloc, &usize, 0, dict) == 0);
+        assert_se(usize == sizeof(field) - 1);
+        assert_se(memcmp(decompressed, field, usize) == 0);
+
+        assert_se(decompress_startswith(OBJECT_COMPRESSED_ZSTD, compressed, csize,
+                                        (void**) &decompressed, &alloc,
+                                        "_SYSTEMD_UNIT", STRLEN("_SYSTEMD_UNIT"), '=', dict) > 0);
+
+        /* Without the dictionary the blob can't be decoded */
+        assert_se(decompress_blob_zstd(compressed, csize, (void**) &decompressed, &alloc, &usize, 0) < 0);
+
+        /* Blobs compressed without dictionary can still be decoded with one */
+        assert_se(decompress_blob(OBJECT_COMPRESSED_ZSTD, compressed + csize, csize_plain,
+                                  (void**) &decompressed, &alloc, &usize, 0, dict) == 0);
+        assert_se(usize == sizeof(field) - 1);
+        assert_se(memcmp(decompressed, field, usize) == 0);
+}
+#endif
+
 int main(int argc, char *argv[]) {
-#if HAVE_XZ || HAVE_LZ4
+#if HAVE_XZ || HAVE_LZ4 || HAVE_ZSTD
         const char text[] =
                 "text\0foofoofoofoo AAAA aaaaaaaaa ghost busters barbarbar FFF"
                 "foofoofoofoo AAAA aaaaaaaaa ghost busters barbarbar FFF";
@@ -299,10 +418,38 @@ int main(int argc, char *argv[]) {
                              compress_stream_lz4, decompress_stream_lz4, srcfile);
 
         test_lz4_decompress_partial();
+
+        test_compress_frames(OBJECT_COMPRESSED_LZ4, text, sizeof(text), huge, sizeof(huge));
 #else
         log_info("/* LZ4 test skipped */");
 #endif
 
+#if HAVE_ZSTD
+        test_compress_decompress(OBJECT_COMPRESSED_ZSTD, compress_blob_zstd, decompress_blob_zstd,
+                                 text, sizeof(text), false);
+        test_compress_decompress(OBJECT_COMPRESSED_ZSTD, compress_blob_zstd, decompress_blob_zstd,
+                                 data, sizeof(data), true);
+
+        test_decompress_startswith(OBJECT_COMPRESSED_ZSTD,
+                                   compress_blob_zstd, decompress_startswith_zstd,
+                                   text, sizeof(text), false);
+        test_decompress_startswith(OBJECT_COMPRESSED_ZSTD,
+                                   compress_blob_zstd, decompress_startswith_zstd,
+                                   data, sizeof(data), true);
+        test_decompress_startswith(OBJECT_COMPRESSED_ZSTD,
+                                   compress_blob_zstd, decompress_startswith_zstd,
+                                   huge, sizeof(huge), true);
+
+        test_compress_stream(OBJECT_COMPRESSED_ZSTD, "zstdcat",
+                             compress_stream_zstd, decompress_stream_zstd, srcfile);
+
+        test_zstd_dictionary();
+
+        test_compress_frames(OBJECT_COMPRESSED_ZSTD, text, sizeof(text), huge, sizeof(huge));
+#else
+        log_info("/* ZSTD test skipped */");
+#endif
+
         return 0;
 #else
         return EXIT_TEST_SKIP;
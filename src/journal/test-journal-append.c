@@ -0,0 +1,176 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "alloc-util.h"
+#include "env-util.h"
+#include "io-util.h"
+#include "journal-file.h"
+#include "journal-verify.h"
+#include "log.h"
+#include "parse-util.h"
+#include "rm-rf.h"
+#include "stdio-util.h"
+#include "string-util.h"
+#include "util.h"
+
+#define BURST 64
+#define N_FIELDS 6
+
+static usec_t arg_duration;
+
+typedef struct Burst {
+        char buf[BURST][N_FIELDS][64];
+        struct iovec iovec[BURST][N_FIELDS];
+        JournalEntry entries[BURST];
+} Burst;
+
+static void make_burst(Burst *b, unsigned k) {
+        unsigned i, j;
+
+        /* Mimics what journald adds for a chatty service: a few fields that repeat, and a message that
+         * is different each time */
+        for (i = 0; i < BURST; i++) {
+                xsprintf(b->buf[i][0], "MESSAGE=Processing request %u", k * BURST + i);
+                xsprintf(b->buf[i][1], "PRIORITY=%u", i % 8);
+                xsprintf(b->buf[i][2], "_PID=%u", 1000 + k % 4);
+                xsprintf(b->buf[i][3], "_COMM=worker-%u", k % 4);
+                xsprintf(b->buf[i][4], "_SYSTEMD_UNIT=worker@%u.service", k % 4);
+                xsprintf(b->buf[i][5], "CODE_LINE=%u", i % 16);
+
+                for (j = 0; j < N_FIELDS; j++)
+                        b->iovec[i][j] = IOVEC_MAKE_STRING(b->buf[i][j]);
+
+                b->entries[i] = (JournalEntry) {
+                        .iovec = b->iovec[i],
+                        .n_iovec = N_FIELDS,
+                };
+        }
+}
+
+static void test_append_entries(void) {
+        _cleanup_free_ Burst *b = NULL;
+        JournalFile *one, *many;
+        dual_timestamp ts;
+        size_t n;
+        unsigned i;
+
+        log_info("/* %s */", __func__);
+
+        b = new(Burst, 1);
+        assert_se(b);
+        make_burst(b, 0);
+
+        assert_se(journal_file_open(-1, "one.journal", O_RDWR|O_CREAT, 0666, 0, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &one) == 0);
+        assert_se(journal_file_open(-1, "many.journal", O_RDWR|O_CREAT, 0666, 0, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &many) == 0);
+
+        dual_timestamp_get(&ts);
+
+        for (i = 0; i < BURST; i++)
+                assert_se(journal_file_append_entry(one, &ts, NULL, b->entries[i].iovec, b->entries[i].n_iovec, NULL, NULL, NULL) == 0);
+
+        assert_se(journal_file_append_entries(many, &ts, NULL, b->entries, BURST, NULL, &n) == 0);
+        assert_se(n == BURST);
+
+        /* Append a second batch, so that the entry array chain grows while a batch is in flight */
+        make_burst(b, 1);
+        for (i = 0; i < BURST; i++)
+                assert_se(journal_file_append_entry(one, &ts, NULL, b->entries[i].iovec, b->entries[i].n_iovec, NULL, NULL, NULL) == 0);
+        assert_se(journal_file_append_entries(many, &ts, NULL, b->entries, BURST, NULL, &n) == 0);
+        assert_se(n == BURST);
+
+        assert_se(le64toh(one->header->n_entries) == 2 * BURST);
+        assert_se(le64toh(many->header->n_entries) == 2 * BURST);
+        assert_se(le64toh(one->header->n_data) == le64toh(many->header->n_data));
+        assert_se(le64toh(one->header->n_entry_arrays) == le64toh(many->header->n_entry_arrays));
+        assert_se(le64toh(one->header->tail_object_offset) == le64toh(many->header->tail_object_offset));
+
+        assert_se(journal_file_verify(many, NULL, NULL, NULL, NULL, false) >= 0);
+
+        /* Invalid timestamps are refused before anything is written */
+        ts.realtime = 0;
+        assert_se(journal_file_append_entries(many, &ts, NULL, b->entries, BURST, NULL, &n) == -EBADMSG);
+        assert_se(n == 0);
+        assert_se(le64toh(many->header->n_entries) == 2 * BURST);
+
+        (void) journal_file_close(one);
+        (void) journal_file_close(many);
+}
+
+static void benchmark(const char *label, bool batched) {
+        _cleanup_free_ Burst *b = NULL;
+        JournalFile *f;
+        dual_timestamp ts;
+        usec_t n, n2;
+        size_t total = 0;
+        unsigned k;
+
+        b = new(Burst, 1);
+        assert_se(b);
+
+        assert_se(journal_file_open(-1, "benchmark.journal", O_RDWR|O_CREAT, 0666, 0, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &f) == 0);
+
+        n = n2 = now(CLOCK_MONOTONIC);
+
+        for (k = 0; n2 - n < arg_duration; k++) {
+                unsigned i;
+                size_t m;
+
+                make_burst(b, k);
+                dual_timestamp_get(&ts);
+
+                if (batched) {
+                        assert_se(journal_file_append_entries(f, &ts, NULL, b->entries, BURST, NULL, &m) == 0);
+                        assert_se(m == BURST);
+                } else
+                        for (i = 0; i < BURST; i++)
+                                assert_se(journal_file_append_entry(f, &ts, NULL, b->entries[i].iovec, b->entries[i].n_iovec, NULL, NULL, NULL) == 0);
+
+                total += BURST;
+                n2 = now(CLOCK_MONOTONIC);
+        }
+
+        log_info("%s: appended %zu entries in bursts of %u in %.2fs (%.0f entries/s)",
+                 label, total, BURST, (n2 - n) / 1e6, total / ((n2 - n) / 1e6));
+
+        (void) journal_file_close(f);
+        assert_se(unlink("benchmark.journal") >= 0);
+}
+
+int main(int argc, char *argv[]) {
+        char t[] = "/tmp/journal-append-XXXXXX";
+        int r;
+
+        log_set_max_level(LOG_INFO);
+
+        /* journal_file_open requires a valid machine id */
+        if (access("/etc/machine-id", F_OK) != 0)
+                return EXIT_TEST_SKIP;
+
+        if (argc >= 2) {
+                unsigned x;
+
+                assert_se(safe_atou(argv[1], &x) >= 0);
+                arg_duration = x * USEC_PER_SEC;
+        } else {
+                bool slow;
+
+                r = getenv_bool("SYSTEMD_SLOW_TESTS");
+                slow = r >= 0 ? r : SYSTEMD_SLOW_TESTS_DEFAULT;
+
+                arg_duration = slow ? 2 * USEC_PER_SEC : USEC_PER_SEC / 50;
+        }
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        test_append_entries();
+
+        benchmark("journal_file_append_entry", false);
+        benchmark("journal_file_append_entries", true);
+
+        assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        return 0;
+}
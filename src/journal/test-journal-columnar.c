@@ -0,0 +1,244 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "sd-journal.h"
+
+#include "alloc-util.h"
+#include "fd-util.h"
+#include "io-util.h"
+#include "journal-columnar.h"
+#include "journal-file.h"
+#include "log.h"
+#include "rm-rf.h"
+#include "sparse-endian.h"
+#include "stdio-util.h"
+#include "string-util.h"
+#include "strv.h"
+#include "util.h"
+
+#define N_ENTRIES 5000U
+
+typedef struct Value {
+        char *value;
+        uint32_t field;
+} Value;
+
+typedef struct Parsed {
+        char **fields;
+        Value *values;
+        size_t n_values, n_values_allocated;
+
+        unsigned n_streams, n_rows, n_dict;
+        char **messages;   /* The MESSAGE= of each entry, reassembled from the columns */
+        unsigned n_tags;   /* Entries with two TAG= values */
+} Parsed;
+
+static uint32_t read_le32(const uint8_t *p) {
+        le32_t le;
+
+        memcpy(&le, p, sizeof(le));
+        return le32toh(le);
+}
+
+static uint64_t read_le64(const uint8_t *p) {
+        le64_t le;
+
+        memcpy(&le, p, sizeof(le));
+        return le64toh(le);
+}
+
+static void parse(const uint8_t *p, size_t size, Parsed *ret) {
+        Parsed q = {};
+        const uint8_t *e = p + size;
+
+        while (p < e) {
+                const uint8_t *b, *next;
+                uint32_t n, i;
+
+                assert_se(p + 16 <= e);
+                n = read_le32(p + 4);
+                b = p + 16;
+                next = b + read_le64(p + 8);
+                assert_se(next <= e);
+
+                if (memcmp(p, "JCOL", 4) == 0) {
+                        assert_se(n == 1);
+                        assert_se(next == b);
+                        q.fields = strv_free(q.fields);
+                        while (q.n_values > 0)
+                                free(q.values[--q.n_values].value);
+                        q.n_streams++;
+
+                } else if (memcmp(p, "FLDS", 4) == 0) {
+                        for (i = 0; i < n; i++) {
+                                uint32_t k = read_le32(b);
+
+                                assert_se(strv_consume(&q.fields, strndup((const char*) b + 4, k)) >= 0);
+                                b += 4 + k;
+                        }
+
+                } else if (memcmp(p, "DICT", 4) == 0) {
+                        for (i = 0; i < n; i++) {
+                                uint32_t f = read_le32(b);
+                                uint64_t k = read_le64(b + 4);
+
+                                assert_se(f < strv_length(q.fields));
+                                assert_se(GREEDY_REALLOC(q.values, q.n_values_allocated, q.n_values + 1));
+                                assert_se(q.values[q.n_values].value = strndup((const char*) b + 12, k));
+                                q.values[q.n_values++].field = f;
+                                b += 12 + k;
+                        }
+                        q.n_dict += n;
+
+                } else {
+                        const uint8_t *columns;
+                        uint32_t c, n_columns;
+
+                        assert_se(memcmp(p, "ROWS", 4) == 0);
+
+                        for (i = 0; i < n; i++)
+                                assert_se(read_le64(b + 8 * i) > 0);
+
+                        columns = b + n * 32;
+                        n_columns = read_le32(columns);
+                        columns += 4;
+
+                        for (i = 0; i < n; i++) {
+                                unsigned n_tag = 0;
+                                char *message = NULL;
+
+                                for (c = 0; c < n_columns; c++) {
+                                        const uint8_t *column = columns + c * (4 + 4 * n);
+                                        uint32_t f = read_le32(column), v = read_le32(column + 4 + 4 * i);
+
+                                        if (v == UINT32_MAX)
+                                                continue;
+
+                                        assert_se(v < q.n_values);
+                                        assert_se(q.values[v].field == f);
+
+                                        if (streq(q.fields[f], "MESSAGE")) {
+                                                assert_se(!message);
+                                                message = q.values[v].value;
+                                        } else if (streq(q.fields[f], "TAG"))
+                                                n_tag++;
+                                }
+
+                                assert_se(message);
+                                assert_se(strv_extend(&q.messages, message) >= 0);
+                                if (n_tag == 2)
+                                        q.n_tags++;
+                        }
+
+                        assert_se(columns + n_columns * (4 + 4 * n) == next);
+                        q.n_rows += n;
+                }
+
+                assert_se(b <= next);
+                p = next;
+        }
+
+        while (q.n_values > 0)
+                free(q.values[--q.n_values].value);
+        free(q.values);
+        strv_free(q.fields);
+
+        *ret = q;
+}
+
+static void export(const char *path, char **output_fields, Parsed *ret) {
+        _cleanup_free_ char *buf = NULL;
+        _cleanup_fclose_ FILE *f = NULL;
+        _cleanup_(journal_columnar_freep) JournalColumnar *c = NULL;
+        sd_journal *j;
+        size_t size;
+        unsigned n = 0;
+        usec_t t;
+
+        assert_se(sd_journal_open_directory(&j, path, 0) >= 0);
+        assert_se(f = open_memstream(&buf, &size));
+        assert_se(journal_columnar_new(f, output_fields, &c) >= 0);
+
+        t = now(CLOCK_MONOTONIC);
+
+        SD_JOURNAL_FOREACH(j) {
+                assert_se(journal_columnar_add(c, j) >= 0);
+                n++;
+        }
+        assert_se(journal_columnar_flush(c) >= 0);
+        assert_se(fflush(f) == 0);
+
+        log_info("exported %u entries into %zu bytes in %.2fms", n, size, (now(CLOCK_MONOTONIC) - t) / 1e3);
+
+        parse((const uint8_t*) buf, size, ret);
+        assert_se(ret->n_rows == n);
+
+        sd_journal_close(j);
+}
+
+int main(int argc, char *argv[]) {
+        char t[] = "/tmp/journal-columnar-XXXXXX";
+        JournalFile *f;
+        Parsed p;
+        unsigned i;
+
+        /* journal_file_open requires a valid machine id */
+        if (access("/etc/machine-id", F_OK) != 0)
+                return EXIT_TEST_SKIP;
+
+        log_set_max_level(LOG_INFO);
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0644, 0, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &f) == 0);
+
+        for (i = 0; i < N_ENTRIES; i++) {
+                _cleanup_free_ char *message = NULL;
+                struct iovec iovec[5];
+                dual_timestamp ts;
+                unsigned n = 0;
+
+                assert_se(asprintf(&message, "MESSAGE=entry %u", i) >= 0);
+
+                iovec[n++] = IOVEC_MAKE_STRING(message);
+                iovec[n++] = IOVEC_MAKE_STRING((i % 2 ? "_SYSTEMD_UNIT=odd.service" : "_SYSTEMD_UNIT=even.service"));
+                iovec[n++] = IOVEC_MAKE_STRING("PRIORITY=6");
+                if (i % 3 == 0) {
+                        iovec[n++] = IOVEC_MAKE_STRING("TAG=a");
+                        iovec[n++] = IOVEC_MAKE_STRING("TAG=b");
+                }
+
+                dual_timestamp_get(&ts);
+                assert_se(journal_file_append_entry(f, &ts, NULL, iovec, n, NULL, NULL, NULL) == 0);
+        }
+
+        (void) journal_file_close(f);
+
+        /* Repeated values are in the dictionary only once */
+        export(t, NULL, &p);
+        assert_se(p.n_streams == 1);
+        assert_se(p.n_rows == N_ENTRIES);
+        assert_se(p.n_dict == N_ENTRIES + 2 + 1 + 2);
+        assert_se(p.n_tags == (N_ENTRIES + 2) / 3);
+        for (i = 0; i < N_ENTRIES; i++) {
+                char buf[DECIMAL_STR_MAX(unsigned) + 6];
+
+                xsprintf(buf, "entry %u", i);
+                assert_se(streq(p.messages[i], buf));
+        }
+        strv_free(p.messages);
+
+        /* Fields not asked for are not included */
+        export(t, STRV_MAKE("MESSAGE"), &p);
+        assert_se(p.n_rows == N_ENTRIES);
+        assert_se(p.n_dict == N_ENTRIES);
+        assert_se(p.n_tags == 0);
+        strv_free(p.messages);
+
+        assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        return 0;
+}
@@ -2,6 +2,7 @@
 
 #include <stdbool.h>
 
+#include "compress.h"
 #include "journald-server.h"
 
 #define _COMPRESS_PARSE_CHECK(str, enab, thresh, varname)               \
@@ -46,8 +47,28 @@ static void test_config_compress(void) {
         COMPRESS_PARSE_CHECK("", true, (uint64_t)-1);
 }
 
+#define COMPRESS_ALGORITHM_PARSE_CHECK(str, expected)                   \
+        do {                                                            \
+                int _a = -1;                                            \
+                config_parse_compress_algorithm("", "", 0, "", 0, "", 0, str, \
+                                                &_a, NULL);             \
+                assert_se(_a == (expected));                            \
+        } while (0)
+
+static void test_config_compress_algorithm(void) {
+        COMPRESS_ALGORITHM_PARSE_CHECK("", DEFAULT_COMPRESSION);
+        COMPRESS_ALGORITHM_PARSE_CHECK("xz", HAVE_XZ ? OBJECT_COMPRESSED_XZ : -1);
+        COMPRESS_ALGORITHM_PARSE_CHECK("LZ4", HAVE_LZ4 ? OBJECT_COMPRESSED_LZ4 : -1);
+        COMPRESS_ALGORITHM_PARSE_CHECK("zstd", HAVE_ZSTD ? OBJECT_COMPRESSED_ZSTD : -1);
+
+        /* Invalid Case */
+        COMPRESS_ALGORITHM_PARSE_CHECK("gzip", -1);
+        COMPRESS_ALGORITHM_PARSE_CHECK("yes", -1);
+}
+
 int main(int argc, char *argv[]) {
         test_config_compress();
+        test_config_compress_algorithm();
 
         return 0;
 }
@@ -0,0 +1,277 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <linux/audit.h>
+#include <linux/netlink.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "alloc-util.h"
+#include "env-util.h"
+#include "fd-util.h"
+#include "journal-importer.h"
+#include "journald-server.h"
+#include "log.h"
+#include "memfd-util.h"
+#include "parse-util.h"
+#include "socket-util.h"
+#include "stdio-util.h"
+#include "string-util.h"
+#include "util.h"
+
+#define BURST 256
+
+/* Larger than the buffers datagrams are received into in batches */
+#define LARGE_DATAGRAM_SIZE (17U*1024U*1024U)
+
+typedef enum Socket {
+        SOCKET_NATIVE,
+        SOCKET_SYSLOG,
+        SOCKET_AUDIT,
+} Socket;
+
+static usec_t arg_duration;
+
+static size_t make_message(Socket t, unsigned i, char *buf, size_t size) {
+        struct nlmsghdr *h;
+        int k;
+
+        switch (t) {
+
+        case SOCKET_NATIVE:
+                k = snprintf(buf, size, "MESSAGE=Processing request %u\nPRIORITY=6\nCODE_LINE=%u\n", i, i % 16);
+                break;
+
+        case SOCKET_SYSLOG:
+                k = snprintf(buf, size, "<30>Jan  1 00:00:00 worker[1000]: Processing request %u", i);
+                break;
+
+        case SOCKET_AUDIT:
+                h = (struct nlmsghdr*) buf;
+                k = snprintf(buf + NLMSG_HDRLEN, size - NLMSG_HDRLEN, "audit(1.0:%u): pid=1000 uid=0 msg='op=test'", i);
+                *h = (struct nlmsghdr) {
+                        .nlmsg_len = NLMSG_LENGTH(k),
+                        .nlmsg_type = AUDIT_USER,
+                };
+                k = NLMSG_LENGTH(k);
+                break;
+
+        default:
+                assert_not_reached("Unknown socket");
+        }
+
+        assert_se(k > 0 && (size_t) k < size);
+        return k;
+}
+
+static bool queue_is_empty(int fd) {
+        char c;
+
+        return recv(fd, &c, 1, MSG_PEEK|MSG_DONTWAIT) < 0 && errno == EAGAIN;
+}
+
+static void benchmark(const char *label, Socket t) {
+        _cleanup_close_pair_ int pair[2] = { -1, -1 };
+        Server s = {
+                .syslog_fd = -1,
+                .native_fd = -1,
+                .audit_fd = -1,
+                /* Stop right before anything would be written, we are only interested in receiving here */
+                .storage = STORAGE_NONE,
+                .max_level_store = LOG_DEBUG,
+                .line_max = 48*1024,
+        };
+        usec_t n, n2;
+        size_t total = 0;
+        unsigned i = 0;
+        int fd;
+
+        assert_se(socketpair(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0, pair) >= 0);
+        fd = pair[0];
+
+        switch (t) {
+        case SOCKET_NATIVE:
+                s.native_fd = fd;
+                break;
+        case SOCKET_SYSLOG:
+                s.syslog_fd = fd;
+                break;
+        case SOCKET_AUDIT:
+                s.audit_fd = fd;
+                break;
+        }
+
+        n = n2 = now(CLOCK_MONOTONIC);
+
+        while (n2 - n < arg_duration) {
+                unsigned k;
+
+                for (k = 0; k < BURST; k++, i++) {
+                        char buf[LINE_MAX];
+                        size_t l;
+
+                        l = make_message(t, i, buf, sizeof(buf));
+                        if (send(pair[1], buf, l, MSG_DONTWAIT) < 0) {
+                                assert_se(errno == EAGAIN);
+                                break;
+                        }
+                }
+
+                total += k;
+
+                while (!queue_is_empty(fd))
+                        assert_se(server_process_datagram(NULL, fd, EPOLLIN, &s) >= 0);
+
+                n2 = now(CLOCK_MONOTONIC);
+        }
+
+        log_info("%s: received %zu datagrams in %.2fs (%.0f datagrams/s)",
+                 label, total, (n2 - n) / 1e6, total / ((n2 - n) / 1e6));
+
+        free(s.buffer);
+        datagram_batch_free(s.datagram_batch);
+}
+
+static void test_large_datagram(void) {
+        _cleanup_close_pair_ int pair[2] = { -1, -1 };
+        Server s = {
+                .syslog_fd = -1,
+                .audit_fd = -1,
+                .storage = STORAGE_NONE,
+                .max_level_store = LOG_DEBUG,
+                .line_max = 48*1024,
+        };
+        _cleanup_free_ char *large = NULL;
+        size_t l = LARGE_DATAGRAM_SIZE;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(socketpair(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0, pair) >= 0);
+        s.native_fd = pair[0];
+
+        if (fd_inc_sndbuf(pair[1], l * 2) < 0) {
+                log_info("Can't set send buffer size, skipping.");
+                return;
+        }
+
+        large = malloc(l);
+        assert_se(large);
+        memset(large, 'x', l);
+        memcpy(large, "MESSAGE=", 8);
+        large[l - 1] = '\n';
+
+        if (send(pair[1], large, l, 0) < 0) {
+                log_info_errno(errno, "Can't send large datagram (%m), skipping.");
+                return;
+        }
+        assert_se(send(pair[1], "MESSAGE=small\n", 14, 0) == 14);
+
+        /* A datagram too large for the batch buffers at the head of the queue is received on its own, in full */
+        assert_se(server_process_datagram(NULL, pair[0], EPOLLIN, &s) >= 0);
+        assert_se(s.buffer_size > l);
+        assert_se(!s.datagram_batch);
+        assert_se(!queue_is_empty(pair[0]));
+
+        /* Everything else in batches */
+        assert_se(server_process_datagram(NULL, pair[0], EPOLLIN, &s) >= 0);
+        assert_se(s.datagram_batch);
+        assert_se(queue_is_empty(pair[0]));
+
+        free(s.buffer);
+        datagram_batch_free(s.datagram_batch);
+}
+
+static void test_large_datagram_in_batch(void) {
+        _cleanup_close_pair_ int pair[2] = { -1, -1 };
+        _cleanup_close_ int kmsg_fd = -1;
+        Server s = {
+                .syslog_fd = -1,
+                .audit_fd = -1,
+                .storage = STORAGE_NONE,
+                .max_level_store = LOG_DEBUG,
+                .line_max = 48*1024,
+                /* Forwarding to kmsg tells us which messages made it through */
+                .forward_to_kmsg = true,
+                .max_level_kmsg = LOG_DEBUG,
+        };
+        _cleanup_free_ char *large = NULL, *forwarded = NULL;
+        size_t l = NATIVE_DATAGRAM_SIZE_MAX * 2;
+        const char *p;
+        struct stat st;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(socketpair(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0, pair) >= 0);
+        s.native_fd = pair[0];
+
+        kmsg_fd = memfd_new("kmsg");
+        assert_se(kmsg_fd >= 0);
+        s.dev_kmsg_fd = kmsg_fd;
+
+        if (fd_inc_sndbuf(pair[1], l * 2) < 0) {
+                log_info("Can't set send buffer size, skipping.");
+                return;
+        }
+
+        large = malloc(l);
+        assert_se(large);
+        memset(large, 'x', l);
+        memcpy(large, "MESSAGE=", 8);
+        large[l - 1] = '\n';
+
+        /* As older clients send it: a large datagram that is not the first one queued */
+        assert_se(send(pair[1], "MESSAGE=first\n", 14, 0) == 14);
+        if (send(pair[1], large, l, 0) < 0) {
+                log_info_errno(errno, "Can't send large datagram (%m), skipping.");
+                return;
+        }
+        assert_se(send(pair[1], "MESSAGE=last\n", 13, 0) == 13);
+
+        assert_se(server_process_datagram(NULL, pair[0], EPOLLIN, &s) >= 0);
+        assert_se(s.datagram_batch);
+        assert_se(!s.buffer);
+        assert_se(queue_is_empty(pair[0]));
+
+        /* All three made it through, in full (with the priority and the user facility added) */
+        assert_se(fstat(kmsg_fd, &st) >= 0);
+        assert_se(forwarded = malloc(st.st_size + 1));
+        assert_se(pread(kmsg_fd, forwarded, st.st_size, 0) == st.st_size);
+        forwarded[st.st_size] = 0;
+
+        p = startswith(forwarded, "<14>first\n<14>");
+        assert_se(p);
+        assert_se(strspn(p, "x") == l - 9);
+        assert_se(streq(p + l - 9, "\n<14>last\n"));
+
+        datagram_batch_free(s.datagram_batch);
+}
+
+int main(int argc, char *argv[]) {
+        int r;
+
+        log_set_max_level(LOG_INFO);
+        log_parse_environment();
+        log_open();
+
+        if (argc >= 2) {
+                unsigned x;
+
+                assert_se(safe_atou(argv[1], &x) >= 0);
+                arg_duration = x * USEC_PER_SEC;
+        } else {
+                bool slow;
+
+                r = getenv_bool("SYSTEMD_SLOW_TESTS");
+                slow = r >= 0 ? r : SYSTEMD_SLOW_TESTS_DEFAULT;
+
+                arg_duration = slow ? 2 * USEC_PER_SEC : USEC_PER_SEC / 50;
+        }
+
+        test_large_datagram();
+        test_large_datagram_in_batch();
+
+        benchmark("native", SOCKET_NATIVE);
+        benchmark("syslog", SOCKET_SYSLOG);
+        benchmark("audit", SOCKET_AUDIT);
+
+        return 0;
+}
@@ -9,11 +9,16 @@
 #include "sd-journal.h"
 
 #include "alloc-util.h"
+#include "compress.h"
+#include "io-util.h"
 #include "journal-file.h"
+#include "journal-internal.h"
+#include "journal-time-index.h"
 #include "journal-vacuum.h"
 #include "log.h"
 #include "parse-util.h"
 #include "rm-rf.h"
+#include "stdio-util.h"
 #include "util.h"
 
 /* This program tests skipping around in a multi-file journal.
@@ -36,7 +41,7 @@ _noreturn_ static void log_assert_errno(const char *text, int error, const char
 
 static JournalFile *test_open(const char *name) {
         JournalFile *f;
-        assert_ret(journal_file_open(-1, name, O_RDWR|O_CREAT, 0644, true, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &f));
+        assert_ret(journal_file_open(-1, name, O_RDWR|O_CREAT, 0644, DEFAULT_COMPRESSION, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &f));
         return f;
 }
 
@@ -201,7 +206,7 @@ static void test_sequence_numbers(void) {
         assert_se(chdir(t) >= 0);
 
         assert_se(journal_file_open(-1, "one.journal", O_RDWR|O_CREAT, 0644,
-                                    true, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &one) == 0);
+                                    DEFAULT_COMPRESSION, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &one) == 0);
 
         append_number(one, 1, &seqnum);
         printf("seqnum=%"PRIu64"\n", seqnum);
@@ -218,7 +223,7 @@ static void test_sequence_numbers(void) {
         memcpy(&seqnum_id, &one->header->seqnum_id, sizeof(sd_id128_t));
 
         assert_se(journal_file_open(-1, "two.journal", O_RDWR|O_CREAT, 0644,
-                                    true, (uint64_t) -1, false, NULL, NULL, NULL, one, &two) == 0);
+                                    DEFAULT_COMPRESSION, (uint64_t) -1, false, NULL, NULL, NULL, one, &two) == 0);
 
         assert_se(two->header->state == STATE_ONLINE);
         assert_se(!sd_id128_equal(two->header->file_id, one->header->file_id));
@@ -249,7 +254,7 @@ static void test_sequence_numbers(void) {
         seqnum = 0;
 
         assert_se(journal_file_open(-1, "two.journal", O_RDWR, 0,
-                                    true, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &two) == 0);
+                                    DEFAULT_COMPRESSION, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &two) == 0);
 
         assert_se(sd_id128_equal(two->header->seqnum_id, seqnum_id));
 
@@ -273,6 +278,266 @@ static void test_sequence_numbers(void) {
         }
 }
 
+#define LOOKAHEAD_FILES 7U
+#define LOOKAHEAD_ENTRIES 20000U
+
+static usec_t lookahead_realtime_base;
+
+static void setup_lookahead(void) {
+        JournalFile *f[LOOKAHEAD_FILES];
+        unsigned i;
+
+        /* Entries are spread over the files round-robin, like the same service logging for months would be.
+         * All files but the last one are archived, i.e. eligible for the lookahead threads. */
+
+        for (i = 0; i < LOOKAHEAD_FILES; i++) {
+                char fn[STRLEN("lookahead-.journal") + DECIMAL_STR_MAX(unsigned)];
+
+                xsprintf(fn, "lookahead-%u.journal", i);
+                assert_ret(journal_file_open(-1, fn, O_RDWR|O_CREAT, 0644, DEFAULT_COMPRESSION, (uint64_t) -1, false,
+                                             NULL, NULL, NULL, i > 0 ? f[0] : NULL, f + i));
+        }
+
+        lookahead_realtime_base = now(CLOCK_REALTIME);
+
+        for (i = 0; i < LOOKAHEAD_ENTRIES; i++) {
+                char number[STRLEN("NUMBER=") + DECIMAL_STR_MAX(unsigned)],
+                        unit[STRLEN("UNIT=unit") + DECIMAL_STR_MAX(unsigned)],
+                        priority[STRLEN("PRIORITY=") + DECIMAL_STR_MAX(unsigned)];
+                struct iovec iovec[3];
+                dual_timestamp ts = {
+                        .realtime = lookahead_realtime_base + i,
+                        .monotonic = i + 1,
+                };
+
+                xsprintf(number, "NUMBER=%u", i + 1);
+                xsprintf(unit, "UNIT=unit%u", i % 13);
+                xsprintf(priority, "PRIORITY=%u", i % 7);
+
+                iovec[0] = IOVEC_MAKE_STRING(number);
+                iovec[1] = IOVEC_MAKE_STRING(unit);
+                iovec[2] = IOVEC_MAKE_STRING(priority);
+
+                assert_ret(journal_file_append_entry(f[i % LOOKAHEAD_FILES], &ts, NULL, iovec, ELEMENTSOF(iovec), NULL, NULL, NULL));
+        }
+
+        for (i = 0; i < LOOKAHEAD_FILES; i++) {
+                f[i]->archive = i < LOOKAHEAD_FILES - 1;
+                test_close(f[i]);
+        }
+}
+
+static int get_number(sd_journal *j) {
+        const void *d;
+        size_t l;
+        int x;
+
+        assert_ret(sd_journal_get_data(j, "NUMBER", &d, &l));
+        assert_se(l > STRLEN("NUMBER=") && l - STRLEN("NUMBER=") < DECIMAL_STR_MAX(int));
+
+        assert_se(safe_atoi(strndupa((const char*) d + STRLEN("NUMBER="), l - STRLEN("NUMBER=")), &x) >= 0);
+        return x;
+}
+
+static void walk_lookahead(const char *path, unsigned n_threads, int **ret, size_t *ret_n, usec_t *ret_usec) {
+        _cleanup_free_ int *numbers = NULL;
+        size_t n = 0, allocated = 0;
+        sd_journal *j;
+        usec_t start;
+        unsigned k;
+        int r;
+
+#define RECORD(j)                                                       \
+        do {                                                            \
+                assert_se(GREEDY_REALLOC(numbers, allocated, n + 1));   \
+                numbers[n++] = get_number(j);                           \
+        } while (false)
+
+        start = now(CLOCK_MONOTONIC);
+
+        assert_ret(sd_journal_open_directory(&j, path, 0));
+        journal_set_lookahead_threads(j, n_threads);
+
+        /* UNIT=unit3 OR (UNIT=unit5 AND PRIORITY=2) */
+        assert_ret(sd_journal_add_match(j, "UNIT=unit3", 0));
+        assert_ret(sd_journal_add_disjunction(j));
+        assert_ret(sd_journal_add_match(j, "UNIT=unit5", 0));
+        assert_ret(sd_journal_add_match(j, "PRIORITY=2", 0));
+
+        /* All the way down and up again */
+        assert_ret(sd_journal_seek_head(j));
+        while ((r = sd_journal_next(j)) > 0)
+                RECORD(j);
+        assert_ret(r);
+
+        assert_ret(sd_journal_seek_tail(j));
+        while ((r = sd_journal_previous(j)) > 0)
+                RECORD(j);
+        assert_ret(r);
+
+        /* Jump into the middle and change directions a couple of times */
+        assert_ret(sd_journal_seek_realtime_usec(j, lookahead_realtime_base + LOOKAHEAD_ENTRIES / 2));
+        for (k = 0; k < 10; k++) {
+                unsigned m;
+
+                for (m = 0; m < 20; m++) {
+                        assert_se(sd_journal_next(j) > 0);
+                        RECORD(j);
+                }
+
+                for (m = 0; m < 15; m++) {
+                        assert_se(sd_journal_previous(j) > 0);
+                        RECORD(j);
+                }
+        }
+
+        /* Change the matches while iterating */
+        assert_ret(sd_journal_add_match(j, "PRIORITY=4", 0));
+        while ((r = sd_journal_next(j)) > 0)
+                RECORD(j);
+        assert_ret(r);
+
+        /* The number of files with a handle of their own is bounded */
+        assert_se(hashmap_size(j->lookaheads) <= n_threads * 2);
+
+        sd_journal_close(j);
+
+#undef RECORD
+
+        *ret_usec = now(CLOCK_MONOTONIC) - start;
+        *ret_n = n;
+        *ret = TAKE_PTR(numbers);
+}
+
+static void test_lookahead(void) {
+        char t[] = "/tmp/journal-lookahead-XXXXXX";
+        _cleanup_free_ int *serial = NULL, *parallel = NULL;
+        char a[FORMAT_TIMESPAN_MAX], b[FORMAT_TIMESPAN_MAX];
+        size_t n_serial, n_parallel;
+        usec_t usec_serial, usec_parallel;
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        setup_lookahead();
+
+        /* Whether the worker threads search the archived files or we do, the results must be the same, in the
+         * same order */
+        walk_lookahead(t, 0, &serial, &n_serial, &usec_serial);
+        walk_lookahead(t, 4, &parallel, &n_parallel, &usec_parallel);
+
+        log_info("Walked %zu entries serially in %s, with 4 lookahead threads in %s.",
+                 n_serial, format_timespan(a, sizeof(a), usec_serial, 1), format_timespan(b, sizeof(b), usec_parallel, 1));
+
+        assert_se(n_serial > 0);
+        assert_se(n_serial == n_parallel);
+        assert_se(memcmp(serial, parallel, n_serial * sizeof(int)) == 0);
+
+        /* With a single thread only some of the archived files are searched ahead, the others serially */
+        parallel = mfree(parallel);
+        walk_lookahead(t, 1, &parallel, &n_parallel, &usec_parallel);
+
+        assert_se(n_serial == n_parallel);
+        assert_se(memcmp(serial, parallel, n_serial * sizeof(int)) == 0);
+
+        log_info("Done...");
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else {
+                journal_directory_vacuum(".", 3000000, 0, 0, NULL, true);
+
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+        }
+}
+
+static void append_number_at(JournalFile *f, int n, usec_t realtime) {
+        char p[STRLEN("NUMBER=") + DECIMAL_STR_MAX(int)];
+        struct iovec iovec;
+        dual_timestamp ts = {
+                .realtime = realtime,
+                .monotonic = realtime,
+        };
+
+        xsprintf(p, "NUMBER=%d", n);
+        iovec = IOVEC_MAKE_STRING(p);
+        assert_ret(journal_file_append_entry(f, &ts, NULL, &iovec, 1, NULL, NULL, NULL));
+}
+
+static size_t time_index_size(void) {
+        _cleanup_hashmap_free_free_free_ Hashmap *h = NULL;
+
+        assert_ret(journal_time_index_load(AT_FDCWD, &h));
+        return hashmap_size(h);
+}
+
+static void test_time_window(void) {
+        char t[] = "/tmp/journal-window-XXXXXX";
+        JournalFile *f;
+        sd_journal *j;
+        usec_t base, from, to;
+        int i;
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        /* Three files covering [base, base+9], [base+100, base+109], [base+200, base+209], the first two are
+         * archived and hence in the time index */
+        base = now(CLOCK_REALTIME) - USEC_PER_HOUR;
+
+        f = test_open("test.journal");
+        for (i = 0; i < 30; i++) {
+                if (i > 0 && i % 10 == 0)
+                        assert_ret(journal_file_rotate(&f, DEFAULT_COMPRESSION, (uint64_t) -1, false, NULL));
+
+                append_number_at(f, i + 1, base + (i / 10) * 100 + i % 10);
+        }
+        test_close(f);
+
+        assert_se(time_index_size() == 2);
+
+        /* Only the second archived file and the active one are opened, the rest of the journal still counts for
+         * the cutoff timestamps */
+        assert_ret(journal_open_time_window(&j, t, 0, base + 100, base + 150));
+        assert_se(ordered_hashmap_size(j->files) == 2);
+
+        assert_ret(sd_journal_get_cutoff_realtime_usec(j, &from, &to));
+        assert_se(from == base);
+        assert_se(to == base + 209);
+
+        assert_ret(sd_journal_seek_realtime_usec(j, base + 100));
+        for (i = 11; i <= 30; i++) {
+                assert_se(sd_journal_next(j) == 1);
+                test_check_number(j, i);
+        }
+        assert_se(sd_journal_next(j) == 0);
+        sd_journal_close(j);
+
+        /* Vacuuming drops the files that are gone from the index */
+        assert_ret(journal_directory_vacuum(".", 0, 2, 0, NULL, false));
+        assert_se(time_index_size() == 1);
+
+        /* Without the index we look at the headers of the archived files instead */
+        assert_se(unlink(JOURNAL_TIME_INDEX) >= 0);
+        assert_ret(journal_open_time_window(&j, t, 0, base + 205, USEC_INFINITY));
+        assert_se(ordered_hashmap_size(j->files) == 1);
+        sd_journal_close(j);
+
+        assert_ret(journal_open_time_window(&j, t, 0, 0, USEC_INFINITY));
+        assert_se(ordered_hashmap_size(j->files) == 2);
+        sd_journal_close(j);
+
+        log_info("Done...");
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else {
+                journal_directory_vacuum(".", 3000000, 0, 0, NULL, true);
+
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+        }
+}
+
 int main(int argc, char *argv[]) {
         log_set_max_level(LOG_DEBUG);
 
@@ -287,5 +552,9 @@ int main(int argc, char *argv[]) {
 
         test_sequence_numbers();
 
+        test_lookahead();
+
+        test_time_window();
+
         return 0;
 }
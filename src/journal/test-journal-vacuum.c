@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "alloc-util.h"
+#include "dirent-util.h"
+#include "fd-util.h"
+#include "io-util.h"
+#include "journal-file.h"
+#include "journal-vacuum.h"
+#include "log.h"
+#include "rm-rf.h"
+#include "string-util.h"
+#include "util.h"
+
+#define N_ROTATIONS 6
+
+static uint64_t directory_usage(const char *path, unsigned *ret_n_files) {
+        _cleanup_closedir_ DIR *d = NULL;
+        struct dirent *de;
+        uint64_t sum = 0;
+        unsigned n = 0;
+
+        assert_se(d = opendir(path));
+
+        FOREACH_DIRENT(de, d, assert_se(false)) {
+                struct stat st;
+
+                if (!endswith(de->d_name, ".journal"))
+                        continue;
+
+                assert_se(fstatat(dirfd(d), de->d_name, &st, 0) >= 0);
+                sum += 512UL * (uint64_t) st.st_blocks;
+                n++;
+        }
+
+        *ret_n_files = n;
+        return sum;
+}
+
+static void append(JournalFile *f, unsigned n) {
+        unsigned i;
+
+        for (i = 0; i < n; i++) {
+                struct iovec iovec = IOVEC_MAKE_STRING("MESSAGE=vacuum me");
+                dual_timestamp ts;
+
+                dual_timestamp_get(&ts);
+                assert_se(journal_file_append_entry(f, &ts, NULL, &iovec, 1, NULL, NULL, NULL) == 0);
+        }
+}
+
+int main(int argc, char *argv[]) {
+        _cleanup_(journal_vacuum_plan_freep) JournalVacuumPlan *plan = NULL;
+        char t[] = "/tmp/journal-vacuum-XXXXXX";
+        char *archived[N_ROTATIONS];
+        JournalFile *f;
+        uint64_t usage;
+        unsigned i, n;
+
+        /* journal_file_open requires a valid machine id */
+        if (access("/etc/machine-id", F_OK) != 0)
+                return EXIT_TEST_SKIP;
+
+        log_set_max_level(LOG_DEBUG);
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        assert_se(journal_vacuum_plan_new(t, true, &plan) >= 0);
+
+        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0644, 0, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &f) == 0);
+        append(f, 10);
+
+        /* Reads the directory */
+        assert_se(journal_vacuum_plan_get_usage(plan, &usage) >= 0);
+        assert_se(usage == directory_usage(t, &n));
+        assert_se(n == 1);
+
+        /* Files archived the way journald does it are added to the plan as they are */
+        for (i = 0; i < N_ROTATIONS; i++) {
+                assert_se(journal_vacuum_plan_validate(plan) > 0);
+                assert_se(journal_file_archived_path(f, &archived[i]) >= 0);
+                assert_se(journal_file_rotate(&f, false, (uint64_t) -1, false, NULL) >= 0);
+                assert_se(journal_vacuum_plan_add(plan, basename(archived[i])) >= 0);
+                append(f, 10);
+        }
+
+        assert_se(journal_vacuum_plan_validate(plan) > 0);
+        assert_se(journal_vacuum_plan_get_usage(plan, &usage) >= 0);
+        assert_se(usage == directory_usage(t, &n));
+        assert_se(n == N_ROTATIONS + 1);
+
+        /* The oldest files go first */
+        assert_se(journal_vacuum_plan_execute(plan, 0, 3, 0, NULL, true) >= 0);
+        assert_se(directory_usage(t, &n) > 0);
+        assert_se(n == 3);
+        for (i = 0; i < N_ROTATIONS; i++)
+                assert_se((access(archived[i], F_OK) >= 0) == (i >= N_ROTATIONS - 2));
+
+        assert_se(journal_vacuum_plan_validate(plan) > 0);
+
+        /* Changes made by others are noticed. The modification time of the directory is what tells, hence give it
+         * a chance to change. */
+        usleep(50 * USEC_PER_MSEC);
+        assert_se(unlink(archived[N_ROTATIONS - 2]) >= 0);
+        assert_se(journal_vacuum_plan_validate(plan) == 0);
+        assert_se(journal_vacuum_plan_get_usage(plan, &usage) >= 0);
+        assert_se(usage == directory_usage(t, &n));
+        assert_se(n == 2);
+
+        (void) journal_file_close(f);
+
+        for (i = 0; i < N_ROTATIONS; i++)
+                free(archived[i]);
+
+        assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        return 0;
+}
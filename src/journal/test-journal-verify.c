@@ -2,8 +2,10 @@
 
 #include <fcntl.h>
 #include <stdio.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include "compress.h"
 #include "fd-util.h"
 #include "journal-file.h"
 #include "journal-verify.h"
@@ -38,7 +40,7 @@ static int raw_verify(const char *fn, const char *verification_key) {
         JournalFile *f;
         int r;
 
-        r = journal_file_open(-1, fn, O_RDONLY, 0666, true, (uint64_t) -1, !!verification_key, NULL, NULL, NULL, NULL, &f);
+        r = journal_file_open(-1, fn, O_RDONLY, 0666, DEFAULT_COMPRESSION, (uint64_t) -1, !!verification_key, NULL, NULL, NULL, NULL, &f);
         if (r < 0)
                 return r;
 
@@ -48,6 +50,81 @@ static int raw_verify(const char *fn, const char *verification_key) {
         return r;
 }
 
+static int raw_scrub(const char *fn, uint64_t *offset, uint64_t max_bytes, usec_t until, uint64_t stop) {
+        _cleanup_(journal_file_scrub_freep) JournalFileScrub *scrub = NULL;
+        JournalFile *f;
+        int r;
+
+        r = journal_file_open(-1, fn, O_RDONLY, 0666, DEFAULT_COMPRESSION, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &f);
+        if (r < 0)
+                return r;
+
+        r = journal_file_scrub_new(f, *offset, &scrub);
+        if (r < 0)
+                goto finish;
+
+        do
+                r = journal_file_scrub_step(scrub, max_bytes, until);
+        while (r == 0 && journal_file_scrub_offset(scrub) < stop);
+
+        /* Return where we stopped, so that the next run continues from there */
+        *offset = journal_file_scrub_offset(scrub);
+
+finish:
+        (void) journal_file_close(f);
+        return r;
+}
+
+static void test_scrub(const char *fn) {
+        struct stat st, st2;
+        JournalFile *f;
+        Object *o;
+        uint64_t p, q, offset = 0, tail;
+
+        log_info("Scrubbing...");
+
+        assert_se(journal_file_open(-1, fn, O_RDONLY, 0666, DEFAULT_COMPRESSION, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &f) == 0);
+        assert_se(journal_file_find_data_object(f, "RANDOM=1", STRLEN("RANDOM=1"), &o, &p) > 0);
+        tail = le64toh(f->header->tail_object_offset);
+        (void) journal_file_close(f);
+
+        assert_se(stat(fn, &st) >= 0);
+
+        /* In steps, and in two runs */
+        assert_se(raw_scrub(fn, &offset, 4096, USEC_INFINITY, tail / 2) == 0);
+        assert_se(offset >= tail / 2 && offset <= tail);
+        assert_se(raw_scrub(fn, &offset, 4096, USEC_INFINITY, UINT64_MAX) == 1);
+        assert_se(offset > tail);
+
+        /* Nothing left to do */
+        assert_se(raw_scrub(fn, &offset, 4096, USEC_INFINITY, UINT64_MAX) == 1);
+
+        /* Scrubbing doesn't touch the file */
+        assert_se(stat(fn, &st2) >= 0);
+        assert_se(timespec_load(&st.st_mtim) == timespec_load(&st2.st_mtim));
+
+        /* Once past the deadline, a step checks a single object */
+        offset = 0;
+        assert_se(raw_scrub(fn, &offset, UINT64_MAX, 1, 0) == 0);
+        q = offset;
+        assert_se(raw_scrub(fn, &offset, UINT64_MAX, 1, 0) == 0);
+        assert_se(offset > q);
+        assert_se(journal_file_open(-1, fn, O_RDONLY, 0666, DEFAULT_COMPRESSION, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &f) == 0);
+        assert_se(journal_file_move_to_object(f, OBJECT_UNUSED, q, &o) >= 0);
+        assert_se(offset == q + ALIGN64(le64toh(o->object.size)));
+        (void) journal_file_close(f);
+
+        /* A data object that doesn't match its hash anymore, found when starting over */
+        bit_toggle(fn, (p + offsetof(Object, data.payload)) * 8);
+        offset = 0;
+        assert_se(raw_scrub(fn, &offset, 4096, USEC_INFINITY, UINT64_MAX) == -EBADMSG);
+        assert_se(offset == p);
+        bit_toggle(fn, (p + offsetof(Object, data.payload)) * 8);
+
+        offset = 0;
+        assert_se(raw_scrub(fn, &offset, UINT64_MAX, USEC_INFINITY, UINT64_MAX) == 1);
+}
+
 int main(int argc, char *argv[]) {
         char t[] = "/tmp/journal-XXXXXX";
         unsigned n;
@@ -71,7 +148,7 @@ int main(int argc, char *argv[]) {
 
         log_info("Generating...");
 
-        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, true, (uint64_t) -1, !!verification_key, NULL, NULL, NULL, NULL, &f) == 0);
+        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, DEFAULT_COMPRESSION, (uint64_t) -1, !!verification_key, NULL, NULL, NULL, NULL, &f) == 0);
 
         for (n = 0; n < N_ENTRIES; n++) {
                 struct iovec iovec;
@@ -94,7 +171,7 @@ int main(int argc, char *argv[]) {
 
         log_info("Verifying...");
 
-        assert_se(journal_file_open(-1, "test.journal", O_RDONLY, 0666, true, (uint64_t) -1, !!verification_key, NULL, NULL, NULL, NULL, &f) == 0);
+        assert_se(journal_file_open(-1, "test.journal", O_RDONLY, 0666, DEFAULT_COMPRESSION, (uint64_t) -1, !!verification_key, NULL, NULL, NULL, NULL, &f) == 0);
         /* journal_file_print_header(f); */
         journal_file_dump(f);
 
@@ -108,6 +185,8 @@ int main(int argc, char *argv[]) {
 
         (void) journal_file_close(f);
 
+        test_scrub("test.journal");
+
         if (verification_key) {
                 log_info("Toggling bits...");
 
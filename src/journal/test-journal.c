@@ -3,11 +3,20 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#include "sd-journal.h"
+
+#include "compress.h"
+#include "io-util.h"
 #include "journal-authenticate.h"
 #include "journal-file.h"
+#include "journal-internal.h"
 #include "journal-vacuum.h"
+#include "journal-verify.h"
 #include "log.h"
+#include "lookup3.h"
 #include "rm-rf.h"
+#include "set.h"
+#include "stdio-util.h"
 
 static bool arg_keep = false;
 
@@ -26,7 +35,7 @@ static void test_non_empty(void) {
         assert_se(mkdtemp(t));
         assert_se(chdir(t) >= 0);
 
-        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, true, (uint64_t) -1, true, NULL, NULL, NULL, NULL, &f) == 0);
+        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, DEFAULT_COMPRESSION, (uint64_t) -1, true, NULL, NULL, NULL, NULL, &f) == 0);
 
         assert_se(dual_timestamp_get(&ts));
         assert_se(sd_id128_randomize(&fake_boot_id) == 0);
@@ -90,8 +99,8 @@ static void test_non_empty(void) {
 
         assert_se(journal_file_move_to_entry_by_seqnum(f, 10, DIRECTION_DOWN, &o, NULL) == 0);
 
-        journal_file_rotate(&f, true, (uint64_t) -1, true, NULL);
-        journal_file_rotate(&f, true, (uint64_t) -1, true, NULL);
+        journal_file_rotate(&f, DEFAULT_COMPRESSION, (uint64_t) -1, true, NULL);
+        journal_file_rotate(&f, DEFAULT_COMPRESSION, (uint64_t) -1, true, NULL);
 
         (void) journal_file_close(f);
 
@@ -117,13 +126,13 @@ static void test_empty(void) {
         assert_se(mkdtemp(t));
         assert_se(chdir(t) >= 0);
 
-        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, false, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &f1) == 0);
+        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, 0, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &f1) == 0);
 
-        assert_se(journal_file_open(-1, "test-compress.journal", O_RDWR|O_CREAT, 0666, true, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &f2) == 0);
+        assert_se(journal_file_open(-1, "test-compress.journal", O_RDWR|O_CREAT, 0666, DEFAULT_COMPRESSION, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &f2) == 0);
 
-        assert_se(journal_file_open(-1, "test-seal.journal", O_RDWR|O_CREAT, 0666, false, (uint64_t) -1, true, NULL, NULL, NULL, NULL, &f3) == 0);
+        assert_se(journal_file_open(-1, "test-seal.journal", O_RDWR|O_CREAT, 0666, 0, (uint64_t) -1, true, NULL, NULL, NULL, NULL, &f3) == 0);
 
-        assert_se(journal_file_open(-1, "test-seal-compress.journal", O_RDWR|O_CREAT, 0666, true, (uint64_t) -1, true, NULL, NULL, NULL, NULL, &f4) == 0);
+        assert_se(journal_file_open(-1, "test-seal-compress.journal", O_RDWR|O_CREAT, 0666, DEFAULT_COMPRESSION, (uint64_t) -1, true, NULL, NULL, NULL, NULL, &f4) == 0);
 
         journal_file_print_header(f1);
         puts("");
@@ -150,7 +159,7 @@ static void test_empty(void) {
         (void) journal_file_close(f4);
 }
 
-#if HAVE_XZ || HAVE_LZ4
+#if HAVE_XZ || HAVE_LZ4 || HAVE_ZSTD
 static bool check_compressed(uint64_t compress_threshold, uint64_t data_size) {
         dual_timestamp ts;
         JournalFile *f;
@@ -169,7 +178,7 @@ static bool check_compressed(uint64_t compress_threshold, uint64_t data_size) {
         assert_se(mkdtemp(t));
         assert_se(chdir(t) >= 0);
 
-        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, true, compress_threshold, true, NULL, NULL, NULL, NULL, &f) == 0);
+        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, DEFAULT_COMPRESSION, compress_threshold, true, NULL, NULL, NULL, NULL, &f) == 0);
 
         dual_timestamp_get(&ts);
 
@@ -235,6 +244,367 @@ static void test_min_compress_size(void) {
 }
 #endif
 
+#if HAVE_ZSTD
+static void append_similar(JournalFile *f) {
+        dual_timestamp ts;
+        struct iovec iovec;
+        char data[128];
+        unsigned i;
+
+        /* Short, similar field values to train on */
+        for (i = 0; i < 2000; i++) {
+                dual_timestamp_get(&ts);
+
+                xsprintf(data, "_SYSTEMD_UNIT=%s-%u.service", i % 2 ? "systemd" : "session", i * 7919 % 1000);
+                iovec.iov_base = data;
+                iovec.iov_len = strlen(data);
+                assert_se(journal_file_append_entry(f, &ts, NULL, &iovec, 1, NULL, NULL, NULL) == 0);
+        }
+}
+
+static void test_dictionary(void) {
+        dual_timestamp ts;
+        JournalFile *f;
+        struct iovec iovec;
+        Object *o;
+        uint64_t p;
+        char t[] = "/tmp/journal-XXXXXX";
+        char data[128];
+
+        log_set_max_level(LOG_DEBUG);
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, OBJECT_COMPRESSED_ZSTD, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &f) == 0);
+        append_similar(f);
+
+        /* The first file was created from scratch, hence has no dictionary */
+        assert_se(journal_file_load_dictionary(f) == 0);
+        assert_se(!JOURNAL_HEADER_COMPRESSED_ZSTD_DICTIONARY(f->header));
+
+        /* Training on the first file happens in the background, for the file after the second one */
+        assert_se(journal_file_rotate(&f, OBJECT_COMPRESSED_ZSTD, (uint64_t) -1, false, NULL) >= 0);
+        assert_se(le64toh(f->header->dictionary_offset) == 0);
+        assert_se(!JOURNAL_HEADER_COMPRESSED_ZSTD_DICTIONARY(f->header));
+        append_similar(f);
+
+        assert_se(journal_file_rotate(&f, OBJECT_COMPRESSED_ZSTD, (uint64_t) -1, false, NULL) >= 0);
+        assert_se(le64toh(f->header->dictionary_offset) != 0);
+        assert_se(JOURNAL_HEADER_COMPRESSED_ZSTD_DICTIONARY(f->header));
+        assert_se(f->compress_dictionary);
+        assert_se(journal_file_load_dictionary(f) == 1);
+
+        /* A value shorter than the default threshold now gets compressed too */
+        dual_timestamp_get(&ts);
+        xsprintf(data, "_SYSTEMD_UNIT=%s-4242.service _SYSTEMD_UNIT=%s-4242.service", "systemd", "session");
+        iovec.iov_base = data;
+        iovec.iov_len = strlen(data);
+        assert_se(iovec.iov_len < 512);
+        assert_se(journal_file_append_entry(f, &ts, NULL, &iovec, 1, NULL, NULL, NULL) == 0);
+
+        assert_se(journal_file_find_data_object(f, data, strlen(data), &o, &p) == 1);
+        assert_se(o->object.flags & OBJECT_COMPRESSED_ZSTD);
+
+        /* The second file is trained on as well, but an explicitly configured threshold is kept */
+        assert_se(journal_file_rotate(&f, OBJECT_COMPRESSED_ZSTD, 512, false, NULL) >= 0);
+        assert_se(le64toh(f->header->dictionary_offset) != 0);
+        assert_se(f->compress_threshold_bytes == 512);
+
+        assert_se(journal_file_append_entry(f, &ts, NULL, &iovec, 1, NULL, NULL, NULL) == 0);
+        assert_se(journal_file_find_data_object(f, data, strlen(data), &o, &p) == 1);
+        assert_se(!(o->object.flags & OBJECT_COMPRESSED_ZSTD));
+
+        journal_file_dump(f);
+        journal_file_print_header(f);
+        assert_se(journal_file_verify(f, NULL, NULL, NULL, NULL, false) >= 0);
+
+        (void) journal_file_close(f);
+
+        log_info("Done...");
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else {
+                journal_directory_vacuum(".", 3000000, 0, 0, NULL, true);
+
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+        }
+
+        puts("------------------------------------------------------------");
+}
+#endif
+
+static void append_units(JournalFile *f, unsigned first, unsigned n) {
+        dual_timestamp ts;
+        struct iovec iovec[2];
+        char unit[64], message[512];
+        unsigned i;
+
+        for (i = 0; i < 500; i++) {
+                dual_timestamp_get(&ts);
+
+                xsprintf(unit, "_SYSTEMD_UNIT=unit-%u.service", first + i % n);
+                /* Too long to be indexed */
+                xsprintf(message, "MESSAGE=%0300u", i);
+
+                iovec[0] = IOVEC_MAKE_STRING(unit);
+                iovec[1] = IOVEC_MAKE_STRING(message);
+                assert_se(journal_file_append_entry(f, &ts, NULL, iovec, 2, NULL, NULL, NULL) == 0);
+        }
+}
+
+static unsigned count_unique(sd_journal *j, const char *field) {
+        const void *data;
+        size_t l;
+        unsigned n = 0;
+
+        assert_se(sd_journal_query_unique(j, field) >= 0);
+        SD_JOURNAL_FOREACH_UNIQUE(j, data, l)
+                n++;
+
+        return n;
+}
+
+static void test_field_index(void) {
+        _cleanup_(sd_journal_closep) sd_journal *j = NULL;
+        JournalFile *f;
+        Iterator i;
+        const void *data;
+        size_t l;
+        unsigned n_indexed = 0, n_unique = 0, n_full = 0, pos = 0, active_pos = 0, second_pos = 0;
+        uint64_t second_seqnum = 0;
+        char t[] = "/tmp/journal-XXXXXX";
+
+        log_set_max_level(LOG_DEBUG);
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, 0, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &f) == 0);
+
+        /* Two archived files with overlapping values, and an active one which shares some of them too */
+        append_units(f, 0, 10);
+        assert_se(journal_file_rotate(&f, 0, (uint64_t) -1, false, NULL) >= 0);
+        append_units(f, 5, 10);
+        assert_se(journal_file_rotate(&f, 0, (uint64_t) -1, false, NULL) >= 0);
+        append_units(f, 12, 10);
+        assert_se(f->header->field_index_offset == 0);
+
+        journal_file_dump(f);
+
+        (void) journal_file_close(f);
+
+        assert_se(sd_journal_open_directory(&j, t, 0) >= 0);
+
+        ORDERED_HASHMAP_FOREACH(f, j->files, i) {
+                Object *o;
+
+                if (journal_file_find_field_index(f, "_SYSTEMD_UNIT", STRLEN("_SYSTEMD_UNIT"), &o, NULL) > 0) {
+                        assert_se(le64toh(o->field_index.n_items) == 10);
+                        n_indexed++;
+                }
+
+                assert_se(journal_file_find_field_index(f, "MESSAGE", STRLEN("MESSAGE"), NULL, NULL) == 0);
+                assert_se(journal_file_verify(f, NULL, NULL, NULL, NULL, false) >= 0);
+
+                /* Remember where the active file and the second archived one are in the order of the directory */
+                if (f->header->field_index_offset == 0)
+                        active_pos = pos;
+                else if (le64toh(f->header->head_entry_seqnum) > second_seqnum) {
+                        second_seqnum = le64toh(f->header->head_entry_seqnum);
+                        second_pos = pos;
+                }
+                pos++;
+        }
+
+        assert_se(n_indexed == 2);
+
+        /* Each value is reported once, regardless whether it was found in an index or not */
+        assert_se(count_unique(j, "_SYSTEMD_UNIT") == 22);
+        assert_se(count_unique(j, "MESSAGE") == 500);
+        assert_se(count_unique(j, "_SYSTEMD_UNIT") == 22);
+
+        /* Values from indexes are truncated to the data threshold, but still told apart by their full
+         * contents. Only the values of the active file, which has no index and is not compressed, are
+         * returned in full. Three of them are also in the second archived file, and are hence only returned
+         * in full if the active file is enumerated first. */
+        assert_se(sd_journal_set_data_threshold(j, 16) >= 0);
+        assert_se(sd_journal_query_unique(j, "_SYSTEMD_UNIT") >= 0);
+        SD_JOURNAL_FOREACH_UNIQUE(j, data, l) {
+                if (l > 16)
+                        n_full++;
+                n_unique++;
+        }
+        assert_se(n_unique == 22);
+        assert_se(n_full == (active_pos < second_pos ? 10 : 7));
+
+        log_info("Done...");
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else {
+                journal_directory_vacuum(".", 3000000, 0, 0, NULL, true);
+
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+        }
+
+        puts("------------------------------------------------------------");
+}
+
+static void test_field_index_deferred(void) {
+        _cleanup_(set_freep) Set *deferred_closes = NULL;
+        JournalFile *f, *old;
+        sd_journal *j;
+        Iterator i;
+        unsigned n_indexed = 0;
+        char t[] = "/tmp/journal-XXXXXX";
+        int r;
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        assert_se(deferred_closes = set_new(NULL));
+        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, 0, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &f) == 0);
+
+        append_units(f, 0, 10);
+        assert_se(journal_file_rotate(&f, 0, (uint64_t) -1, false, deferred_closes) >= 0);
+        assert_se(set_size(deferred_closes) == 1);
+        assert_se(old = set_first(deferred_closes));
+
+        /* The file rotated away from is indexed in the background, and stays online until its index and
+         * bloom filter are appended. Until then readers go through its data objects. */
+        assert_se(old->header->state == STATE_ONLINE);
+        assert_se(old->header->bloom_filter_offset == 0);
+        assert_se(sd_journal_open_directory(&j, t, 0) >= 0);
+        assert_se(count_unique(j, "_SYSTEMD_UNIT") == 10);
+        sd_journal_close(j);
+
+        while ((r = journal_file_finish_indexing(old, false)) == -EAGAIN)
+                (void) usleep(USEC_PER_MSEC);
+        assert_se(r > 0);
+        assert_se(old->header->field_index_offset != 0);
+        assert_se(old->header->bloom_filter_offset != 0);
+        assert_se(journal_file_finish_indexing(old, false) == 0);
+
+        assert_se(journal_file_set_offline(old, false) >= 0);
+        assert_se(set_remove(deferred_closes, old) == old);
+        (void) journal_file_close(old);
+        (void) journal_file_close(f);
+
+        assert_se(sd_journal_open_directory(&j, t, 0) >= 0);
+
+        ORDERED_HASHMAP_FOREACH(f, j->files, i) {
+                if (journal_file_find_field_index(f, "_SYSTEMD_UNIT", STRLEN("_SYSTEMD_UNIT"), NULL, NULL) > 0) {
+                        assert_se(f->header->state == STATE_ARCHIVED);
+                        assert_se(f->header->bloom_filter_offset != 0);
+                        n_indexed++;
+                }
+
+                assert_se(journal_file_verify(f, NULL, NULL, NULL, NULL, false) >= 0);
+        }
+
+        assert_se(n_indexed == 1);
+        assert_se(count_unique(j, "_SYSTEMD_UNIT") == 10);
+
+        sd_journal_close(j);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else {
+                journal_directory_vacuum(".", 3000000, 0, 0, NULL, true);
+
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+        }
+}
+
+static unsigned count_matches(sd_journal *j, const char *match) {
+        unsigned n = 0;
+
+        sd_journal_flush_matches(j);
+        assert_se(sd_journal_add_match(j, match, 0) >= 0);
+
+        SD_JOURNAL_FOREACH(j)
+                n++;
+
+        return n;
+}
+
+static void test_bloom_filter(void) {
+        _cleanup_(sd_journal_closep) sd_journal *j = NULL;
+        JournalFile *f;
+        Iterator i;
+        unsigned n_filtered = 0;
+        char t[] = "/tmp/journal-XXXXXX";
+
+        log_set_max_level(LOG_DEBUG);
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, 0, (uint64_t) -1, false, NULL, NULL, NULL, NULL, &f) == 0);
+
+        /* Two archived files and an active one, with distinct values each */
+        append_units(f, 0, 10);
+        assert_se(journal_file_rotate(&f, 0, (uint64_t) -1, false, NULL) >= 0);
+        append_units(f, 10, 10);
+        assert_se(journal_file_rotate(&f, 0, (uint64_t) -1, false, NULL) >= 0);
+        append_units(f, 20, 10);
+        assert_se(f->header->bloom_filter_offset == 0);
+
+        (void) journal_file_close(f);
+
+        assert_se(sd_journal_open_directory(&j, t, 0) >= 0);
+
+        ORDERED_HASHMAP_FOREACH(f, j->files, i) {
+                unsigned k, n_false = 0;
+
+                if (f->header->bloom_filter_offset == 0)
+                        continue;
+
+                n_filtered++;
+                assert_se(journal_file_verify(f, NULL, NULL, NULL, NULL, false) >= 0);
+
+                /* Never wrong about values the file has, and rarely about those it hasn't */
+                for (k = 0; k < 1000; k++) {
+                        char unit[64];
+                        int r;
+
+                        xsprintf(unit, "_SYSTEMD_UNIT=unit-%u.service", k);
+
+                        r = journal_file_bloom_filter_test(f, hash64(unit, strlen(unit)));
+                        assert_se(r >= 0);
+
+                        if (journal_file_find_data_object(f, unit, strlen(unit), NULL, NULL) > 0)
+                                assert_se(r > 0);
+                        else if (r > 0)
+                                n_false++;
+                }
+
+                log_info("%s: %u false positives out of 990", f->path, n_false);
+                assert_se(n_false < 50);
+        }
+
+        assert_se(n_filtered == 2);
+
+        assert_se(count_matches(j, "_SYSTEMD_UNIT=unit-5.service") == 50);
+        assert_se(count_matches(j, "_SYSTEMD_UNIT=unit-15.service") == 50);
+        assert_se(count_matches(j, "_SYSTEMD_UNIT=unit-25.service") == 50);
+        assert_se(count_matches(j, "_SYSTEMD_UNIT=unit-35.service") == 0);
+
+        log_info("Done...");
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else {
+                journal_directory_vacuum(".", 3000000, 0, 0, NULL, true);
+
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+        }
+
+        puts("------------------------------------------------------------");
+}
+
 int main(int argc, char *argv[]) {
         arg_keep = argc > 1;
 
@@ -244,9 +614,15 @@ int main(int argc, char *argv[]) {
 
         test_non_empty();
         test_empty();
-#if HAVE_XZ || HAVE_LZ4
+#if HAVE_XZ || HAVE_LZ4 || HAVE_ZSTD
         test_min_compress_size();
 #endif
+#if HAVE_ZSTD
+        test_dictionary();
+#endif
+        test_field_index();
+        test_field_index_deferred();
+        test_bloom_filter();
 
         return 0;
 }
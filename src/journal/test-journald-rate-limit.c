@@ -0,0 +1,180 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <syslog.h>
+
+#include "alloc-util.h"
+#include "fileio.h"
+#include "fs-util.h"
+#include "journald-rate-limit.h"
+#include "macro.h"
+#include "string-util.h"
+
+/* The clock is passed in, so that refilling doesn't depend on how long the tests take. Pools that were never used
+ * before are identified by a zero timestamp, hence start with something else. */
+#define T0 USEC_PER_SEC
+
+static unsigned count_permitted(JournalRateLimit *r, const char *id, const char *slice, int priority, unsigned n, usec_t ts) {
+        unsigned i, k = 0;
+
+        for (i = 0; i < n; i++)
+                if (journal_rate_limit_test(r, NULL, id, slice, priority, 0, ts) > 0)
+                        k++;
+
+        return k;
+}
+
+static char *write_suppressed(JournalRateLimit *r) {
+        _cleanup_(unlink_tempfilep) char p[] = "/tmp/test-journald-rate-limit.XXXXXX";
+        char *contents;
+
+        assert_se(mkostemp_safe(p) >= 0);
+        assert_se(journal_rate_limit_write_suppressed(r, p) >= 0);
+        assert_se(read_full_file(p, &contents, NULL) >= 0);
+
+        return contents;
+}
+
+static void test_budgets(void) {
+        JournalRateLimit *r;
+
+        assert_se(r = journal_rate_limit_new(USEC_PER_HOUR, 10));
+
+        /* Own priority budget, then the one shared by the unit, then the one shared by the slice */
+        assert_se(count_permitted(r, "noisy.service", "x.slice", LOG_ERR, 100, T0) == 30);
+
+        /* Other units of the same slice keep what they are guaranteed */
+        assert_se(count_permitted(r, "quiet.service", "x.slice", LOG_ERR, 100, T0) == 20);
+
+        /* As do other priorities of the same unit */
+        assert_se(count_permitted(r, "noisy.service", "x.slice", LOG_INFO, 100, T0) == 10);
+
+        /* LOG_EMERG to LOG_CRIT share a budget */
+        assert_se(count_permitted(r, "other.service", "y.slice", LOG_EMERG, 5, T0) == 5);
+        assert_se(count_permitted(r, "other.service", "y.slice", LOG_CRIT, 5, T0) == 5);
+        assert_se(count_permitted(r, "other.service", "y.slice", LOG_ALERT, 100, T0) == 20);
+
+        /* Units without slice only have their own budgets */
+        assert_se(count_permitted(r, "lonely.service", NULL, LOG_DEBUG, 100, T0) == 20);
+
+        /* A unit logging at all priority classes gets up to seven times the burst */
+        assert_se(count_permitted(r, "loud.service", "z.slice", LOG_EMERG, 100, T0) == 30);
+        assert_se(count_permitted(r, "loud.service", "z.slice", LOG_ERR, 100, T0) == 10);
+        assert_se(count_permitted(r, "loud.service", "z.slice", LOG_WARNING, 100, T0) == 10);
+        assert_se(count_permitted(r, "loud.service", "z.slice", LOG_INFO, 100, T0) == 10);
+        assert_se(count_permitted(r, "loud.service", "z.slice", LOG_DEBUG, 100, T0) == 10);
+
+        journal_rate_limit_free(r);
+}
+
+static void test_cache(void) {
+        JournalRateLimitGroup *g = NULL;
+        JournalRateLimit *r;
+        unsigned i;
+
+        assert_se(r = journal_rate_limit_new(USEC_PER_HOUR, 10));
+
+        for (i = 0; i < 20; i++)
+                assert_se(journal_rate_limit_test(r, &g, "cached.service", "x.slice", LOG_INFO, 0, T0) == 1);
+        assert_se(g);
+
+        /* The cached group is the same one that is found by name */
+        assert_se(count_permitted(r, "cached.service", "x.slice", LOG_INFO, 100, T0) == 10);
+        assert_se(journal_rate_limit_test(r, &g, "cached.service", "x.slice", LOG_INFO, 0, T0) == 0);
+
+        g = journal_rate_limit_group_unref(g);
+        assert_se(!g);
+
+        journal_rate_limit_free(r);
+}
+
+static void test_refill(void) {
+        JournalRateLimit *r;
+
+        assert_se(r = journal_rate_limit_new(USEC_PER_SEC, 10));
+
+        assert_se(count_permitted(r, "a.service", NULL, LOG_INFO, 100, T0) == 20);
+        assert_se(count_permitted(r, "a.service", NULL, LOG_INFO, 100, T0) == 0);
+
+        /* Half an interval refills half of both the priority and the shared budget */
+        assert_se(count_permitted(r, "a.service", NULL, LOG_INFO, 100, T0 + USEC_PER_SEC / 2) == 10);
+
+        /* A clock going backwards refills nothing */
+        assert_se(count_permitted(r, "a.service", NULL, LOG_INFO, 100, T0) == 0);
+
+        /* And after a long time without messages the budgets are full, but not more than that */
+        assert_se(count_permitted(r, "a.service", NULL, LOG_INFO, 100, T0 + USEC_PER_HOUR) == 20);
+
+        journal_rate_limit_free(r);
+}
+
+static void test_report(void) {
+        _cleanup_free_ char *contents = NULL;
+        JournalRateLimit *r;
+        usec_t ts = T0;
+
+        /* A message is let through every 10ms once the budgets are used up */
+        assert_se(r = journal_rate_limit_new(USEC_PER_SEC, 100));
+
+        assert_se(count_permitted(r, "a.service", NULL, LOG_INFO, 201, ts) == 200);
+
+        /* The first message let through again reports about the suppressed ones... */
+        ts += 20 * USEC_PER_MSEC;
+        assert_se(journal_rate_limit_test(r, NULL, "a.service", NULL, LOG_INFO, 0, ts) == 2);
+
+        /* ... but only once per interval */
+        assert_se(count_permitted(r, "a.service", NULL, LOG_INFO, 10, ts) == 3);
+        ts += 20 * USEC_PER_MSEC;
+        assert_se(journal_rate_limit_test(r, NULL, "a.service", NULL, LOG_INFO, 0, ts) == 1);
+
+        assert_se(count_permitted(r, "a.service", NULL, LOG_INFO, 10, ts) == 3);
+        ts += USEC_PER_SEC;
+        assert_se(journal_rate_limit_test(r, NULL, "a.service", NULL, LOG_INFO, 0, ts) == 1 + 14);
+
+        assert_se(journal_rate_limit_test(r, NULL, "b.service", NULL, LOG_INFO, 0, ts) == 1);
+
+        contents = write_suppressed(r);
+        assert_se(streq(contents, "a.service 15\n"));
+
+        journal_rate_limit_free(r);
+}
+
+static void test_expire(void) {
+        _cleanup_free_ char *contents = NULL;
+        JournalRateLimit *r;
+        usec_t ts = T0;
+
+        assert_se(r = journal_rate_limit_new(USEC_PER_SEC, 10));
+
+        assert_se(count_permitted(r, "a.service", NULL, LOG_INFO, 30, ts) == 20);
+
+        /* Groups are only vacuumed when a new one is created. One that knows about suppressed messages is kept
+         * until they were written out, even if it was quiet for longer than an interval, */
+        ts += 2 * USEC_PER_SEC;
+        assert_se(count_permitted(r, "b.service", NULL, LOG_INFO, 1, ts) == 1);
+
+        contents = write_suppressed(r);
+        assert_se(streq(contents, "a.service 10\n"));
+        contents = mfree(contents);
+
+        /* but goes like any other afterwards */
+        ts += 2 * USEC_PER_SEC;
+        assert_se(count_permitted(r, "c.service", NULL, LOG_INFO, 1, ts) == 1);
+
+        contents = write_suppressed(r);
+        assert_se(isempty(contents));
+
+        /* Hence a.service starts from scratch */
+        assert_se(count_permitted(r, "a.service", NULL, LOG_INFO, 30, ts) == 20);
+
+        journal_rate_limit_free(r);
+}
+
+int main(int argc, char *argv[]) {
+        test_budgets();
+        test_cache();
+        test_refill();
+        test_report();
+        test_expire();
+
+        return 0;
+}
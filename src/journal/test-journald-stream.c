@@ -0,0 +1,198 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "env-util.h"
+#include "fd-util.h"
+#include "io-util.h"
+#include "journald-server.h"
+#include "journald-stream.h"
+#include "log.h"
+#include "memfd-util.h"
+#include "parse-util.h"
+#include "process-util.h"
+#include "string-util.h"
+#include "strv.h"
+#include "util.h"
+
+/* The header of the stream protocol, see stdout_stream_line(): identifier, unit, priority, level prefix, and whether
+ * to forward to syslog, kmsg and the console */
+#define HEADER "test\n\n6\n0\n0\n0\n0\n"
+#define HEADER_FORWARD_TO_KMSG "test\n\n6\n0\n0\n1\n0\n"
+
+static uint64_t arg_size;
+
+static void test_lines(void) {
+        /* Lines end in \n or NUL, are broken after the maximum line length, and the last one ends with the stream.
+         * Leading whitespace is kept, trailing whitespace dropped. */
+        static const char data[] =
+                "plain\n"
+                "  leading\n"
+                "trailing \t \n"
+                "crlf\r\n"
+                "nul\0"
+                "0123456789abcdefghij\n"
+                "eof";
+        _cleanup_close_pair_ int pair[2] = { -1, -1 };
+        _cleanup_close_ int kmsg_fd = -1;
+        Server s = {
+                .storage = STORAGE_NONE,
+                .max_level_store = LOG_DEBUG,
+                .line_max = 16,
+                /* Forwarding to kmsg tells us which messages were logged */
+                .max_level_kmsg = LOG_DEBUG,
+        };
+        _cleanup_free_ char *forwarded = NULL;
+        _cleanup_strv_free_ char **lines = NULL;
+        struct stat st;
+        char **l;
+
+        log_info("/* %s */", __func__);
+
+        kmsg_fd = memfd_new("kmsg");
+        assert_se(kmsg_fd >= 0);
+        s.dev_kmsg_fd = kmsg_fd;
+
+        assert_se(sd_event_default(&s.event) >= 0);
+        assert_se(socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, pair) >= 0);
+        assert_se(fd_nonblock(pair[0], true) >= 0);
+
+        assert_se(loop_write(pair[1], HEADER_FORWARD_TO_KMSG, strlen(HEADER_FORWARD_TO_KMSG), false) >= 0);
+        assert_se(loop_write(pair[1], data, sizeof(data) - 1, false) >= 0);
+        pair[1] = safe_close(pair[1]);
+
+        assert_se(stdout_stream_install(&s, pair[0], NULL) >= 0);
+        pair[0] = -1;
+
+        while (s.n_stdout_streams > 0)
+                assert_se(sd_event_run(s.event, (uint64_t) -1) >= 0);
+
+        assert_se(fstat(kmsg_fd, &st) >= 0);
+        assert_se(forwarded = malloc(st.st_size + 1));
+        assert_se(pread(kmsg_fd, forwarded, st.st_size, 0) == st.st_size);
+        forwarded[st.st_size] = 0;
+
+        lines = strv_split_newlines(forwarded);
+        assert_se(lines);
+
+        /* Drop the "<14>test[PID]: " prefix */
+        STRV_FOREACH(l, lines) {
+                const char *e;
+
+                assert_se(startswith(*l, "<14>test["));
+                assert_se(e = strstr(*l, "]: "));
+                memmove(*l, e + 3, strlen(e + 3) + 1);
+        }
+
+        assert_se(strv_equal(lines, STRV_MAKE("plain",
+                                              "  leading",
+                                              "trailing",
+                                              "crlf",
+                                              "nul",
+                                              "0123456789abcdef",
+                                              "ghij",
+                                              "eof")));
+
+        client_context_flush_all(&s);
+        sd_event_unref(s.event);
+}
+
+static void benchmark(void) {
+        _cleanup_close_pair_ int pair[2] = { -1, -1 };
+        Server s = {
+                /* Stop right before anything would be written, we are only interested in reading streams here */
+                .storage = STORAGE_NONE,
+                .max_level_store = LOG_DEBUG,
+                .line_max = 48*1024,
+        };
+        char block[64*1024];
+        size_t n = 0;
+        unsigned i = 0;
+        usec_t t;
+        pid_t pid;
+        int r;
+
+        log_info("/* %s */", __func__);
+
+        /* A block of full lines, as a busy service would write them */
+        for (;;) {
+                char line[LINE_MAX];
+                int k;
+
+                k = snprintf(line, sizeof(line), "Processing request %u, everything is fine.\n", i++);
+                assert_se(k > 0);
+                if (n + k > sizeof(block))
+                        break;
+
+                memcpy(block + n, line, k);
+                n += k;
+        }
+
+        assert_se(sd_event_default(&s.event) >= 0);
+        assert_se(socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, pair) >= 0);
+        assert_se(fd_nonblock(pair[0], true) >= 0);
+
+        t = now(CLOCK_MONOTONIC);
+
+        r = safe_fork("(writer)", FORK_DEATHSIG|FORK_LOG, &pid);
+        assert_se(r >= 0);
+        if (r == 0) {
+                uint64_t total;
+
+                pair[0] = safe_close(pair[0]);
+
+                assert_se(loop_write(pair[1], HEADER, strlen(HEADER), false) >= 0);
+
+                for (total = 0; total < arg_size; total += n)
+                        assert_se(loop_write(pair[1], block, n, false) >= 0);
+
+                _exit(EXIT_SUCCESS);
+        }
+
+        pair[1] = safe_close(pair[1]);
+
+        assert_se(stdout_stream_install(&s, pair[0], NULL) >= 0);
+        pair[0] = -1;
+
+        /* The stream is freed once the writer is done */
+        while (s.n_stdout_streams > 0)
+                assert_se(sd_event_run(s.event, (uint64_t) -1) >= 0);
+
+        t = now(CLOCK_MONOTONIC) - t;
+        assert_se(wait_for_terminate_and_check("(writer)", pid, WAIT_LOG) == EXIT_SUCCESS);
+
+        log_info("read %" PRIu64 " MiB in %.2fs (%.0f MiB/s)",
+                 arg_size / 1024 / 1024, t / 1e6, arg_size / 1024.0 / 1024.0 / (t / 1e6));
+
+        client_context_flush_all(&s);
+        sd_event_unref(s.event);
+}
+
+int main(int argc, char *argv[]) {
+        int r;
+
+        log_set_max_level(LOG_INFO);
+        log_parse_environment();
+        log_open();
+
+        if (argc >= 2) {
+                unsigned x;
+
+                assert_se(safe_atou(argv[1], &x) >= 0);
+                arg_size = (uint64_t) x * 1024 * 1024;
+        } else {
+                bool slow;
+
+                r = getenv_bool("SYSTEMD_SLOW_TESTS");
+                slow = r >= 0 ? r : SYSTEMD_SLOW_TESTS_DEFAULT;
+
+                arg_size = (uint64_t) (slow ? 1024 : 16) * 1024 * 1024;
+        }
+
+        test_lines();
+        benchmark();
+
+        return 0;
+}
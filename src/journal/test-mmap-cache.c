@@ -7,10 +7,76 @@
 
 #include "fd-util.h"
 #include "fileio.h"
+#include "log.h"
 #include "macro.h"
 #include "mmap-cache.h"
 #include "util.h"
 
+#define FILE_SIZE (48ULL*1024ULL*1024ULL)
+
+static void test_scan(MMapCache *m, int fd) {
+        MMapFileDescriptor *f;
+        unsigned missed;
+        struct stat st;
+        uint64_t offset;
+        size_t size = 0;
+        void *p;
+
+        assert_se(ftruncate(fd, FILE_SIZE) >= 0);
+        assert_se(fstat(fd, &st) >= 0);
+        assert_se(f = mmap_cache_add_fd(m, fd));
+
+        missed = mmap_cache_get_missed(m);
+
+        for (offset = 0; offset < FILE_SIZE; offset += 4096)
+                assert_se(mmap_cache_get(m, f, PROT_READ, 2, false, offset, 64, &st, &p, &size) > 0);
+
+#if !ENABLE_DEBUG_MMAP_CACHE
+        /* 8M, 16M, and then the remaining 24M of the file */
+        assert_se(mmap_cache_get_missed(m) - missed == 3);
+#endif
+
+        /* And back again */
+        missed = mmap_cache_get_missed(m);
+
+        assert_se(mmap_cache_get(m, f, PROT_READ, 3, false, FILE_SIZE - 4096, 64, &st, &p, &size) > 0);
+        for (offset = FILE_SIZE - 4096; offset > 0; offset -= 4096)
+                assert_se(mmap_cache_get(m, f, PROT_READ, 3, false, offset, 64, &st, &p, &size) > 0);
+
+        /* The windows of the forward scan are still around */
+        assert_se(mmap_cache_get_missed(m) == missed);
+
+        mmap_cache_free_fd(m, f);
+}
+
+static void test_probe(MMapCache *m, int fd) {
+        static const uint64_t offsets[] = { 1, 40, 20, 30, 10 };
+        MMapFileDescriptor *f;
+        struct stat st;
+        size_t size = 0, last = SIZE_MAX;
+        unsigned i;
+        void *p;
+
+        assert_se(ftruncate(fd, FILE_SIZE) >= 0);
+        assert_se(fstat(fd, &st) >= 0);
+        assert_se(f = mmap_cache_add_fd(m, fd));
+
+        /* Probing around at random makes windows smaller */
+        for (i = 0; i < ELEMENTSOF(offsets); i++) {
+                uint64_t offset = offsets[i] * 1024ULL * 1024ULL;
+
+                assert_se(mmap_cache_get(m, f, PROT_READ, 4, false, offset, 64, &st, &p, &size) > 0);
+                assert_se(size <= last);
+                last = size;
+        }
+
+#if !ENABLE_DEBUG_MMAP_CACHE
+        assert_se(size <= 1024ULL * 1024ULL);
+#endif
+
+        mmap_cache_free_fd(m, f);
+}
+
 int main(int argc, char *argv[]) {
         MMapFileDescriptor *fx;
         int x, y, z, r;
@@ -55,7 +121,14 @@ int main(int argc, char *argv[]) {
 
         assert_se((uint8_t*) p + 1 == (uint8_t*) q);
 
+        test_scan(m, y);
+        test_probe(m, z);
+
         mmap_cache_free_fd(m, fx);
+        assert_se(mmap_cache_get_unmapped(m) > 0);
+
+        log_info("mmap cache statistics: %u hit, %u miss, %u unmapped",
+                 mmap_cache_get_hit(m), mmap_cache_get_missed(m), mmap_cache_get_unmapped(m));
         mmap_cache_unref(m);
 
         safe_close(x);
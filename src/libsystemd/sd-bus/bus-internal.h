@@ -9,6 +9,7 @@
 #include "bus-error.h"
 #include "bus-kernel.h"
 #include "bus-match.h"
+#include "bus-pool.h"
 #include "def.h"
 #include "hashmap.h"
 #include "list.h"
@@ -92,6 +93,11 @@ struct node_vtable {
         const sd_bus_vtable *vtable;
         sd_bus_object_find_t find;
 
+        /* The methods and properties of the vtable, sorted by member name, so that dispatching a call does not
+         * need to hash the full path, interface and member */
+        struct vtable_member **methods, **properties;
+        size_t n_methods, n_properties;
+
         unsigned last_iteration;
 
         LIST_FIELDS(struct node_vtable, vtables);
@@ -209,6 +215,8 @@ struct sd_bus {
         bool watch_bind:1;
         bool is_monitor:1;
         bool accept_fd:1;
+        bool accept_memfd:1;
+        bool can_memfd:1;
         bool attach_timestamp:1;
         bool connected_signal:1;
 
@@ -216,6 +224,7 @@ struct sd_bus {
 
         void *rbuffer;
         size_t rbuffer_size;
+        size_t rbuffer_allocated;
 
         sd_bus_message **rqueue;
         unsigned rqueue_size;
@@ -240,6 +249,9 @@ struct sd_bus {
         Hashmap *vtable_methods;
         Hashmap *vtable_properties;
 
+        /* The fallback node the last method call was dispatched to */
+        struct node *last_fallback_node;
+
         union sockaddr_union sockaddr;
         socklen_t sockaddr_size;
 
@@ -285,6 +297,18 @@ struct sd_bus {
         struct memfd_cache memfd_cache[MEMFD_CACHE_MAX];
         unsigned n_memfd_cache;
 
+        /* Messages, body parts and buffers we keep around for reuse,
+         * so that a round trip doesn't need to go to the allocator
+         * each time. Like the memfd cache this is protected by a
+         * mutex, since messages are put back here when released. */
+        pthread_mutex_t pool_mutex;
+        sd_bus_message *message_pool[BUS_POOL_MAX];
+        unsigned n_message_pool;
+        struct bus_body_part *part_pool[BUS_POOL_MAX];
+        unsigned n_part_pool;
+        struct bus_pool_buffer buffer_pool[BUS_POOL_MAX];
+        unsigned n_buffer_pool;
+
         pid_t original_pid;
         pid_t busexec_pid;
 
@@ -326,6 +350,10 @@ struct sd_bus {
 #define BUS_AUTH_TIMEOUT ((usec_t) DEFAULT_TIMEOUT_USEC)
 
 #define BUS_WQUEUE_MAX (192*1024)
+
+/* When signals are emitted from within an event loop callback, we
+ * write out the queue whenever it grew by this many messages */
+#define BUS_WQUEUE_DEFER_MAX 128
 #define BUS_RQUEUE_MAX (192*1024)
 
 #define BUS_MESSAGE_SIZE_MAX (128*1024*1024)
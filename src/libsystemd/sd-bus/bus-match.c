@@ -53,10 +53,16 @@ static inline bool BUS_MATCH_IS_COMPARE(enum bus_match_node_type t) {
         return t >= BUS_MATCH_SENDER && t <= BUS_MATCH_ARG_HAS_LAST;
 }
 
+static inline bool BUS_MATCH_IS_NAMESPACE(enum bus_match_node_type t) {
+        return t == BUS_MATCH_PATH_NAMESPACE ||
+                (t >= BUS_MATCH_ARG_NAMESPACE && t <= BUS_MATCH_ARG_NAMESPACE_LAST);
+}
+
 static inline bool BUS_MATCH_CAN_HASH(enum bus_match_node_type t) {
         return (t >= BUS_MATCH_MESSAGE_TYPE && t <= BUS_MATCH_PATH) ||
                 (t >= BUS_MATCH_ARG && t <= BUS_MATCH_ARG_LAST) ||
-                (t >= BUS_MATCH_ARG_HAS && t <= BUS_MATCH_ARG_HAS_LAST);
+                (t >= BUS_MATCH_ARG_HAS && t <= BUS_MATCH_ARG_HAS_LAST) ||
+                BUS_MATCH_IS_NAMESPACE(t);
 }
 
 static void bus_match_node_free(struct bus_match_node *node) {
@@ -240,6 +246,62 @@ static bool value_node_same(
         }
 }
 
+static int bus_match_run_namespace(
+                sd_bus *bus,
+                struct bus_match_node *node,
+                const char *value,
+                sd_bus_message *m) {
+
+        _cleanup_free_ char *buffer = NULL;
+        char separator, *p;
+        size_t l, i;
+        int r;
+
+        assert(node);
+        assert(BUS_MATCH_IS_NAMESPACE(node->type));
+        assert(value);
+
+        /* A namespace matches all values it is a prefix of, as long
+         * as the prefix ends at a label boundary, see
+         * simple_pattern_check(). Instead of testing all namespaces
+         * against the value, we hence look up all prefixes of the
+         * value ending at a label boundary in the hash table. */
+
+        separator = node->type == BUS_MATCH_PATH_NAMESPACE ? '/' : '.';
+
+        l = strlen(value);
+        if (l < LINE_MAX)
+                p = strndupa(value, l);
+        else {
+                p = buffer = strndup(value, l);
+                if (!p)
+                        return -ENOMEM;
+        }
+
+        for (i = 0; i <= l; i++) {
+                struct bus_match_node *found;
+
+                if (i < l && value[i] != separator && (i == 0 || value[i-1] != separator))
+                        continue;
+
+                p[i] = 0;
+                found = hashmap_get(node->compare.children, p);
+                p[i] = value[i];
+
+                if (!found)
+                        continue;
+
+                r = bus_match_run(bus, found, m);
+                if (r != 0)
+                        return r;
+
+                if (bus && bus->match_callbacks_modified)
+                        return 0;
+        }
+
+        return 0;
+}
+
 int bus_match_run(
                 sd_bus *bus,
                 struct bus_match_node *node,
@@ -377,7 +439,13 @@ int bus_match_run(
 
                 /* Lookup via hash table, nice! So let's jump directly. */
 
-                if (test_str)
+                if (test_str && BUS_MATCH_IS_NAMESPACE(node->type)) {
+                        r = bus_match_run_namespace(bus, node, test_str, m);
+                        if (r != 0)
+                                return r;
+
+                        found = NULL;
+                } else if (test_str)
                         found = hashmap_get(node->compare.children, test_str);
                 else if (test_strv) {
                         char **i;
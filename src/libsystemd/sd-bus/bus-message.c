@@ -10,6 +10,7 @@
 #include "bus-gvariant.h"
 #include "bus-internal.h"
 #include "bus-message.h"
+#include "bus-pool.h"
 #include "bus-signature.h"
 #include "bus-type.h"
 #include "bus-util.h"
@@ -50,10 +51,10 @@ static void message_free_part(sd_bus_message *m, struct bus_body_part *part) {
         else if (part->munmap_this)
                 munmap(part->mmap_begin, part->mapped);
         else if (part->free_this)
-                free(part->data);
+                bus_pool_put_buffer(m->bus, part->data, part->allocated);
 
         if (part != &m->body)
-                free(part);
+                bus_pool_put_part(m->bus, part);
 }
 
 static void message_reset_parts(sd_bus_message *m) {
@@ -85,22 +86,48 @@ static void message_reset_containers(sd_bus_message *m) {
                 free(m->containers[i].offsets);
         }
 
-        m->containers = mfree(m->containers);
+        bus_pool_put_buffer(m->bus, m->containers, m->containers_allocated * sizeof(struct bus_container));
+        m->containers = NULL;
 
         m->n_containers = m->containers_allocated = 0;
         m->root_container.index = 0;
 }
 
+static int message_make_room_for_container(sd_bus_message *m) {
+        assert(m);
+
+        /* The container stack is taken from the buffer pool of the
+         * bus, and returned there by message_reset_containers() */
+        if (!m->containers) {
+                size_t a;
+
+                m->containers = bus_pool_get_buffer(m->bus, sizeof(struct bus_container), &a);
+                if (!m->containers)
+                        return -ENOMEM;
+
+                m->containers_allocated = a / sizeof(struct bus_container);
+        }
+
+        if (!GREEDY_REALLOC(m->containers, m->containers_allocated, m->n_containers + 1))
+                return -ENOMEM;
+
+        return 0;
+}
+
 static sd_bus_message* message_free(sd_bus_message *m) {
+        sd_bus *bus;
+
         assert(m);
 
-        if (m->free_header)
-                free(m->header);
+        if (m->free_header) {
+                if (m->header_allocated > 0)
+                        bus_pool_put_buffer(m->bus, m->header, m->header_allocated);
+                else
+                        free(m->header);
+        }
 
         message_reset_parts(m);
 
-        sd_bus_unref(m->bus);
-
         if (m->free_fds) {
                 close_many(m->fds, m->n_fds);
                 free(m->fds);
@@ -116,7 +143,18 @@ static sd_bus_message* message_free(sd_bus_message *m) {
         free(m->root_container.peeked_signature);
 
         bus_creds_done(&m->creds);
-        return mfree(m);
+
+        /* Only drop our reference to the bus at the very end, since
+         * that might free the bus and the pool along with it */
+        bus = m->bus;
+
+        if (m->poolable)
+                bus_pool_put_message(bus, m);
+        else
+                free(m);
+
+        sd_bus_unref(bus);
+        return NULL;
 }
 
 DEFINE_TRIVIAL_CLEANUP_FUNC(sd_bus_message*, message_free);
@@ -142,19 +180,31 @@ static void *message_extend_fields(sd_bus_message *m, size_t align, size_t sz, b
                 return (uint8_t*) m->header + old_size;
 
         if (m->free_header) {
-                np = realloc(m->header, ALIGN8(new_size));
-                if (!np)
-                        goto poison;
+                if (ALIGN8(new_size) <= m->header_allocated)
+                        np = m->header;
+                else {
+                        size_t a;
+
+                        a = MAX(ALIGN8(new_size), 2 * m->header_allocated);
+                        np = realloc(m->header, a);
+                        if (!np)
+                                goto poison;
+
+                        m->header_allocated = a;
+                }
         } else {
+                size_t a;
+
                 /* Initially, the header is allocated as part of
                  * the sd_bus_message itself, let's replace it by
                  * dynamic data */
 
-                np = malloc(ALIGN8(new_size));
+                np = bus_pool_get_buffer(m->bus, ALIGN8(new_size), &a);
                 if (!np)
                         goto poison;
 
                 memcpy(np, m->header, sizeof(struct bus_header));
+                m->header_allocated = a;
         }
 
         /* Zero out padding */
@@ -374,6 +424,72 @@ static int message_append_field_uint64(sd_bus_message *m, uint64_t h, uint64_t x
         return 0;
 }
 
+static bool message_part_can_pass_memfd(sd_bus_message *m, struct bus_body_part *part) {
+        assert(m);
+        assert(part);
+
+        return part->memfd >= 0 &&
+                part->sealed &&
+                (part->size >= MEMFD_MIN_SIZE || m->bus->use_memfd < 0);
+}
+
+static int message_append_field_memfds(sd_bus_message *m) {
+        struct bus_body_part *part;
+        uint64_t *table;
+        size_t begin = 0;
+        uint32_t n = 0;
+        unsigned i;
+        uint8_t *p;
+
+        assert(m);
+        assert(!BUS_MESSAGE_IS_GVARIANT(m));
+
+        /* Large sealed memfds are passed to the peer as they are,
+         * instead of copying their contents into the byte stream */
+
+        MESSAGE_FOREACH_PART(part, i, m)
+                if (message_part_can_pass_memfd(m, part))
+                        n++;
+
+        if (n == 0)
+                return 0;
+
+        m->memfds_field_begin = m->fields_size;
+
+        /* (field id byte + (signature length + signature 'a(ttt)' + NUL) + 3 byte padding + array size + array) */
+        p = message_extend_fields(m, 8, 4 + 4 + 4 + 4 + 24 * n, false);
+        if (!p)
+                return -ENOMEM;
+
+        m->memfds_field_end = m->fields_size;
+
+        p[0] = (uint8_t) BUS_MESSAGE_HEADER_MEMFDS;
+        p[1] = 6;
+        memcpy(p + 2, "a(ttt)", 7);
+        p[9] = 0;
+        p[10] = 0;
+        p[11] = 0;
+
+        ((uint32_t*) p)[3] = 24 * n;
+
+        table = (uint64_t*) (p + 16);
+        MESSAGE_FOREACH_PART(part, i, m) {
+                if (message_part_can_pass_memfd(m, part)) {
+                        *(table++) = begin;
+                        *(table++) = part->size;
+                        *(table++) = part->memfd_offset;
+
+                        part->pass_memfd = true;
+                        m->n_memfds++;
+                        m->memfd_body_size += part->size;
+                }
+
+                begin += part->size;
+        }
+
+        return 0;
+}
+
 static int message_append_reply_cookie(sd_bus_message *m, uint64_t cookie) {
         assert(m);
 
@@ -438,7 +554,10 @@ int bus_message_from_header(
                 a += label_sz + 1;
         }
 
-        m = malloc0(a);
+        if (label || extra > 0)
+                m = malloc0(a);
+        else
+                m = bus_pool_get_message(bus);
         if (!m)
                 return -ENOMEM;
 
@@ -564,7 +683,7 @@ _public_ int sd_bus_message_new(
         assert_return(m, -EINVAL);
         assert_return(type < _SD_BUS_MESSAGE_TYPE_MAX, -EINVAL);
 
-        t = malloc0(ALIGN(sizeof(sd_bus_message)) + sizeof(struct bus_header));
+        t = bus_pool_get_message(bus);
         if (!t)
                 return -ENOMEM;
 
@@ -1135,7 +1254,7 @@ struct bus_body_part *message_append_part(sd_bus_message *m) {
         } else {
                 assert(m->body_end);
 
-                part = new0(struct bus_body_part, 1);
+                part = bus_pool_get_part(m->bus);
                 if (!part) {
                         m->poisoned = true;
                         return NULL;
@@ -1184,7 +1303,10 @@ static int part_make_space(
                 size_t new_allocated;
 
                 new_allocated = sz > 0 ? 2 * sz : 64;
-                n = realloc(part->data, new_allocated);
+                if (part->data)
+                        n = realloc(part->data, new_allocated);
+                else
+                        n = bus_pool_get_buffer(m->bus, new_allocated, &new_allocated);
                 if (!n) {
                         m->poisoned = true;
                         return -ENOMEM;
@@ -1278,7 +1400,7 @@ static void *message_extend_body(
                         m->n_body_parts <= 0 ||
                         m->body_end->sealed ||
                         (padding != ALIGN_TO(m->body_end->size, align) - m->body_end->size) ||
-                        (force_inline && m->body_end->size > MEMFD_MIN_SIZE);
+                        (force_inline && m->body_end->size >= MEMFD_MIN_SIZE);
                         /* If this must be an inlined extension, let's create a new part if
                          * the previous part is large enough to be inlined. */
 
@@ -1960,9 +2082,10 @@ _public_ int sd_bus_message_open_container(
         assert_return(!m->poisoned, -ESTALE);
 
         /* Make sure we have space for one more container */
-        if (!GREEDY_REALLOC(m->containers, m->containers_allocated, m->n_containers + 1)) {
+        r = message_make_room_for_container(m);
+        if (r < 0) {
                 m->poisoned = true;
-                return -ENOMEM;
+                return r;
         }
 
         c = message_get_container(m);
@@ -2597,13 +2720,19 @@ _public_ int sd_bus_message_append_array_memfd(
         assert_return(!m->sealed, -EPERM);
         assert_return(!m->poisoned, -ESTALE);
 
-        r = memfd_set_sealed(memfd);
+        /* The same memfd may be appended to any number of messages */
+        r = memfd_get_sealed(memfd);
         if (r < 0)
                 return r;
+        if (r == 0) {
+                r = memfd_set_sealed(memfd);
+                if (r < 0)
+                        return r;
+        }
 
         copy_fd = fcntl(memfd, F_DUPFD_CLOEXEC, 3);
         if (copy_fd < 0)
-                return copy_fd;
+                return -errno;
 
         r = memfd_get_size(memfd, &real_size);
         if (r < 0)
@@ -2672,13 +2801,19 @@ _public_ int sd_bus_message_append_string_memfd(
         assert_return(!m->sealed, -EPERM);
         assert_return(!m->poisoned, -ESTALE);
 
-        r = memfd_set_sealed(memfd);
+        /* The same memfd may be appended to any number of messages */
+        r = memfd_get_sealed(memfd);
         if (r < 0)
                 return r;
+        if (r == 0) {
+                r = memfd_set_sealed(memfd);
+                if (r < 0)
+                        return r;
+        }
 
-        copy_fd = fcntl(memfd, FD_CLOEXEC, 3);
+        copy_fd = fcntl(memfd, F_DUPFD_CLOEXEC, 3);
         if (copy_fd < 0)
-                return copy_fd;
+                return -errno;
 
         r = memfd_get_size(memfd, &real_size);
         if (r < 0)
@@ -2826,7 +2961,7 @@ static int bus_message_close_header(sd_bus_message *m) {
                 m->footer_accessible = 1 + l + 2 + sz;
         } else {
                 m->header->dbus1.fields_size = m->fields_size;
-                m->header->dbus1.body_size = m->body_size;
+                m->header->dbus1.body_size = m->body_size - m->memfd_body_size;
         }
 
         return 0;
@@ -2879,6 +3014,12 @@ _public_ int sd_bus_message_seal(sd_bus_message *m, uint64_t cookie, uint64_t ti
                         return r;
         }
 
+        if (m->bus->can_memfd && m->bus->use_memfd != 0 && !BUS_MESSAGE_IS_GVARIANT(m)) {
+                r = message_append_field_memfds(m);
+                if (r < 0)
+                        return r;
+        }
+
         r = bus_message_close_header(m);
         if (r < 0)
                 return r;
@@ -2905,7 +3046,7 @@ _public_ int sd_bus_message_seal(sd_bus_message *m, uint64_t cookie, uint64_t ti
                 MESSAGE_FOREACH_PART(part, i, m)
                         if (part->memfd >= 0 &&
                             !part->sealed &&
-                            (part->size > MEMFD_MIN_SIZE || m->bus->use_memfd < 0) &&
+                            (part->size >= MEMFD_MIN_SIZE || m->bus->use_memfd < 0) &&
                             part != m->body_end) { /* The last part may never be sent as memfd */
                                 uint64_t sz;
 
@@ -4014,8 +4155,9 @@ _public_ int sd_bus_message_enter_container(sd_bus_message *m,
         if (m->n_containers >= BUS_CONTAINER_DEPTH)
                 return -EBADMSG;
 
-        if (!GREEDY_REALLOC(m->containers, m->containers_allocated, m->n_containers + 1))
-                return -ENOMEM;
+        r = message_make_room_for_container(m);
+        if (r < 0)
+                return r;
 
         if (message_end_of_signature(m))
                 return -ENXIO;
@@ -4988,12 +5130,13 @@ static int message_skip_fields(
 
                         assert(l >= 1);
                         {
-                                char sig[l-1], *s;
+                                char sig[l+1], *s;
+                                size_t begin;
                                 uint32_t nas;
                                 int alignment;
 
-                                strncpy(sig, *signature + 1, l-1);
-                                s = sig;
+                                strncpy(sig, *signature + 1, l);
+                                sig[l] = 0;
 
                                 alignment = bus_type_get_alignment(sig[0]);
                                 if (alignment < 0)
@@ -5009,9 +5152,15 @@ static int message_skip_fields(
                                 if (r < 0)
                                         return r;
 
-                                r = message_skip_fields(m, ri, nas, (const char**) &s);
-                                if (r < 0)
-                                        return r;
+                                /* Skip element by element, each takes at least one byte */
+                                for (begin = *ri; *ri - begin < nas; ) {
+                                        s = sig;
+                                        r = message_skip_fields(m, ri, (uint32_t) -1, (const char**) &s);
+                                        if (r < 0)
+                                                return r;
+                                }
+                                if (*ri - begin != nas)
+                                        return -EBADMSG;
                         }
 
                         (*signature) += 1 + l;
@@ -5029,7 +5178,7 @@ static int message_skip_fields(
 
                         (*signature)++;
 
-                } else if (IN_SET(t, SD_BUS_TYPE_STRUCT, SD_BUS_TYPE_DICT_ENTRY)) {
+                } else if (IN_SET(t, SD_BUS_TYPE_STRUCT_BEGIN, SD_BUS_TYPE_DICT_ENTRY_BEGIN)) {
 
                         r = signature_element_length(*signature, &l);
                         if (r < 0)
@@ -5038,9 +5187,14 @@ static int message_skip_fields(
                         assert(l >= 2);
                         {
                                 char sig[l-1], *s;
-                                strncpy(sig, *signature + 1, l-1);
+                                strncpy(sig, *signature + 1, l-2);
+                                sig[l-2] = 0;
                                 s = sig;
 
+                                r = message_peek_fields(m, ri, 8, 0, NULL);
+                                if (r < 0)
+                                        return r;
+
                                 r = message_skip_fields(m, ri, (uint32_t) -1, (const char**) &s);
                                 if (r < 0)
                                         return r;
@@ -5052,11 +5206,118 @@ static int message_skip_fields(
         }
 }
 
+static int message_attach_memfds(sd_bus_message *m, const uint64_t *table, uint32_t n) {
+        struct bus_body_part *part;
+        size_t wire_size, done = 0;
+        uint64_t begin = 0;
+        uint8_t *data;
+        uint32_t i;
+        int *fds, r;
+
+        assert(m);
+        assert(table);
+        assert(n > 0);
+        assert(m->n_fds >= n);
+
+        /* The body in the byte stream lacks the parts that were
+         * passed as memfds. Split it up at their offsets, and put
+         * the memfds in between. The memfds follow the fds of the
+         * message itself. Each fd is moved over to its part as soon
+         * as the part exists, and its slot in m->fds is invalidated,
+         * hence if a later entry fails, it is closed exactly once,
+         * when the part is freed with the message. */
+
+        data = (uint8_t*) m->header + BUS_MESSAGE_BODY_BEGIN(m);
+        wire_size = m->body_size;
+        fds = m->fds + m->n_fds - n;
+
+        m->n_body_parts = 0;
+        m->body_end = NULL;
+        m->cached_rindex_part = NULL;
+        m->cached_rindex_part_begin = 0;
+
+        for (i = 0; i < n; i++) {
+                uint64_t offset, size, memfd_offset, real_size;
+
+                offset = BUS_MESSAGE_BSWAP64(m, table[i*3]);
+                size = BUS_MESSAGE_BSWAP64(m, table[i*3+1]);
+                memfd_offset = BUS_MESSAGE_BSWAP64(m, table[i*3+2]);
+
+                /* Parts need to be ordered and may not overlap */
+                if (offset > UINT32_MAX || size > UINT32_MAX || size == 0)
+                        return -EBADMSG;
+                if (offset < begin || offset - begin > wire_size - done)
+                        return -EBADMSG;
+
+                if (offset > begin) {
+                        part = message_append_part(m);
+                        if (!part)
+                                return -ENOMEM;
+
+                        part->data = data + done;
+                        part->size = offset - begin;
+                        part->sealed = true;
+
+                        done += offset - begin;
+                }
+
+                /* Make sure the sender cannot modify the data under our feet */
+                r = memfd_get_sealed(fds[i]);
+                if (r < 0)
+                        return r;
+                if (r == 0)
+                        return -EBADMSG;
+
+                r = memfd_get_size(fds[i], &real_size);
+                if (r < 0)
+                        return r;
+                if (memfd_offset > real_size || size > real_size - memfd_offset)
+                        return -EBADMSG;
+
+                part = message_append_part(m);
+                if (!part)
+                        return -ENOMEM;
+
+                part->memfd = fds[i];
+                part->memfd_offset = memfd_offset;
+                part->size = size;
+                part->sealed = true;
+                part->pass_memfd = true;
+                fds[i] = -1;
+
+                m->n_memfds++;
+                m->memfd_body_size += size;
+
+                begin = offset + size;
+        }
+
+        if (done < wire_size) {
+                part = message_append_part(m);
+                if (!part)
+                        return -ENOMEM;
+
+                part->data = data + done;
+                part->size = wire_size - done;
+                part->sealed = true;
+        }
+
+        if ((uint64_t) wire_size + m->memfd_body_size > UINT32_MAX)
+                return -EBADMSG;
+
+        m->n_fds -= n;
+        m->body_size = wire_size + m->memfd_body_size;
+        m->user_body_size = m->body_size;
+
+        return 0;
+}
+
 int bus_message_parse_fields(sd_bus_message *m) {
         size_t ri;
         int r;
         uint32_t unix_fds = 0;
         bool unix_fds_set = false;
+        const uint64_t *memfds = NULL;
+        uint32_t n_memfds = 0;
         void *offsets = NULL;
         unsigned n_offsets = 0;
         size_t sz = 0;
@@ -5141,7 +5402,7 @@ int bus_message_parse_fields(sd_bus_message *m) {
                 _cleanup_free_ char *sig = NULL;
                 const char *signature;
                 uint64_t field_type;
-                size_t item_size = (size_t) -1;
+                size_t item_size = (size_t) -1, field_begin = 0;
 
                 if (BUS_MESSAGE_IS_GVARIANT(m)) {
                         uint64_t *u64;
@@ -5162,6 +5423,8 @@ int bus_message_parse_fields(sd_bus_message *m) {
                 } else {
                         uint8_t *u8;
 
+                        field_begin = ri;
+
                         r = message_peek_fields(m, &ri, 8, 1, (void**) &u8);
                         if (r < 0)
                                 return r;
@@ -5353,6 +5616,44 @@ int bus_message_parse_fields(sd_bus_message *m) {
                         unix_fds_set = true;
                         break;
 
+                case BUS_MESSAGE_HEADER_MEMFDS: {
+                        uint32_t l;
+                        void *q;
+
+                        /* Only means something on connections that negotiated it, elsewhere it is skipped
+                         * like any other unknown field. Any memfds sent along are then caught by the check
+                         * of the number of fds below. */
+                        if (BUS_MESSAGE_IS_GVARIANT(m) || !m->bus->can_memfd) {
+                                if (!BUS_MESSAGE_IS_GVARIANT(m))
+                                        r = message_skip_fields(m, &ri, (uint32_t) -1, (const char **) &signature);
+                                break;
+                        }
+
+                        if (memfds)
+                                return -EBADMSG;
+
+                        if (!streq(signature, "a(ttt)"))
+                                return -EBADMSG;
+
+                        r = message_peek_field_uint32(m, &ri, 4, &l);
+                        if (r < 0)
+                                return r;
+
+                        if (l == 0 || l % 24 != 0 || l / 24 > BUS_FDS_MAX)
+                                return -EBADMSG;
+
+                        r = message_peek_fields(m, &ri, 8, l, &q);
+                        if (r < 0)
+                                return r;
+
+                        memfds = q;
+                        n_memfds = l / 24;
+
+                        m->memfds_field_begin = field_begin;
+                        m->memfds_field_end = ri;
+                        break;
+                }
+
                 default:
                         if (!BUS_MESSAGE_IS_GVARIANT(m))
                                 r = message_skip_fields(m, &ri, (uint32_t) -1, (const char **) &signature);
@@ -5364,9 +5665,15 @@ int bus_message_parse_fields(sd_bus_message *m) {
                 i++;
         }
 
-        if (m->n_fds != unix_fds)
+        if (m->n_fds != unix_fds + n_memfds)
                 return -EBADMSG;
 
+        if (n_memfds > 0) {
+                r = message_attach_memfds(m, memfds, n_memfds);
+                if (r < 0)
+                        return r;
+        }
+
         switch (m->header->type) {
 
         case SD_BUS_MESSAGE_SIGNAL:
@@ -5449,7 +5756,8 @@ _public_ int sd_bus_message_set_sender(sd_bus_message *m, const char *sender) {
 }
 
 int bus_message_get_blob(sd_bus_message *m, void **buffer, size_t *sz) {
-        size_t total;
+        size_t total, fields_size, skip_begin = 0, skip_end = 0;
+        struct bus_header *h;
         void *p, *e;
         size_t i;
         struct bus_body_part *part;
@@ -5458,18 +5766,55 @@ int bus_message_get_blob(sd_bus_message *m, void **buffer, size_t *sz) {
         assert(buffer);
         assert(sz);
 
-        total = BUS_MESSAGE_SIZE(m);
+        /* The blob carries the contents of memfd parts inline, hence
+         * the field describing them is left out, and the header
+         * declares the full body size. The field begins where the
+         * one before it ends, plus padding. Fields are aligned to 8,
+         * hence one in the middle is dropped from its aligned start
+         * up to the aligned start of the next one, keeping the
+         * others aligned. The last one is dropped together with the
+         * padding before it. */
+        if (m->n_memfds > 0) {
+                if (m->memfds_field_end < m->fields_size) {
+                        skip_begin = ALIGN8(m->memfds_field_begin);
+                        skip_end = ALIGN8(m->memfds_field_end);
+                } else {
+                        skip_begin = m->memfds_field_begin;
+                        skip_end = m->fields_size;
+                }
+        }
+
+        fields_size = m->fields_size - (skip_end - skip_begin);
+        total = sizeof(struct bus_header) + ALIGN8(fields_size) + m->body_size;
 
         p = malloc(total);
         if (!p)
                 return -ENOMEM;
 
-        e = mempcpy(p, m->header, BUS_MESSAGE_BODY_BEGIN(m));
-        MESSAGE_FOREACH_PART(part, i, m)
+        e = mempcpy(p, m->header, sizeof(struct bus_header) + skip_begin);
+        e = mempcpy(e, (uint8_t*) m->header + sizeof(struct bus_header) + skip_end, m->fields_size - skip_end);
+        e = mempset(e, 0, ALIGN8(fields_size) - fields_size);
+
+        MESSAGE_FOREACH_PART(part, i, m) {
+                int r;
+
+                r = bus_body_part_map(part);
+                if (r < 0) {
+                        free(p);
+                        return r;
+                }
+
                 e = mempcpy(e, part->data, part->size);
+        }
 
         assert(total == (size_t) ((uint8_t*) e - (uint8_t*) p));
 
+        if (m->n_memfds > 0) {
+                h = p;
+                h->dbus1.fields_size = BUS_MESSAGE_BSWAP32(m, fields_size);
+                h->dbus1.body_size = BUS_MESSAGE_BSWAP32(m, m->body_size);
+        }
+
         *buffer = p;
         *sz = total;
 
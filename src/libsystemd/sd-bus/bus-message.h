@@ -45,6 +45,7 @@ struct bus_body_part {
         bool munmap_this:1;
         bool sealed:1;
         bool is_zero:1;
+        bool pass_memfd:1;
 };
 
 struct sd_bus_message {
@@ -76,6 +77,7 @@ struct sd_bus_message {
         bool free_header:1;
         bool free_fds:1;
         bool poisoned:1;
+        bool poolable:1;
 
         /* The first and last bytes of the message */
         struct bus_header *header;
@@ -85,6 +87,9 @@ struct sd_bus_message {
         size_t header_accessible;
         size_t footer_accessible;
 
+        /* If the header was taken from the bus buffer pool, how much was allocated for it */
+        size_t header_allocated;
+
         size_t fields_size;
         size_t body_size;
         size_t user_body_size;
@@ -100,6 +105,12 @@ struct sd_bus_message {
         uint32_t n_fds;
         int *fds;
 
+        /* Body parts that are passed as memfds, and are hence not part of the byte stream, and where in
+         * the fields they are described */
+        uint32_t n_memfds;
+        size_t memfd_body_size;
+        size_t memfds_field_begin, memfds_field_end;
+
         struct bus_container root_container, *containers;
         size_t n_containers;
         size_t containers_allocated;
@@ -151,6 +162,10 @@ static inline size_t BUS_MESSAGE_SIZE(sd_bus_message *m) {
                 m->body_size;
 }
 
+static inline size_t BUS_MESSAGE_WIRE_SIZE(sd_bus_message *m) {
+        return BUS_MESSAGE_SIZE(m) - m->memfd_body_size;
+}
+
 static inline size_t BUS_MESSAGE_BODY_BEGIN(sd_bus_message *m) {
         return
                 sizeof(struct bus_header) +
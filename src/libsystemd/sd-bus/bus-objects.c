@@ -1220,26 +1220,57 @@ static int process_get_managed_objects(
         return 1;
 }
 
+static int vtable_member_name_compare_func(struct vtable_member * const *a, struct vtable_member * const *b) {
+        return strcmp((*a)->member, (*b)->member);
+}
+
+static struct vtable_member *node_find_vtable_member(
+                struct node *n,
+                const char *interface,
+                const char *member,
+                bool property) {
+
+        struct vtable_member key = { .member = member }, *k = &key, **found;
+        struct node_vtable *c;
+
+        assert(n);
+        assert(interface);
+        assert(member);
+
+        /* There may be more than one vtable for the same interface on a node, but a member is only registered
+         * once per path and interface, hence the first match is the only one. */
+        LIST_FOREACH(vtables, c, n->vtables) {
+                if (!streq(c->interface, interface))
+                        continue;
+
+                if (property)
+                        found = bsearch_safe(&k, c->properties, c->n_properties, sizeof(struct vtable_member*),
+                                             (__compar_fn_t) vtable_member_name_compare_func);
+                else
+                        found = bsearch_safe(&k, c->methods, c->n_methods, sizeof(struct vtable_member*),
+                                             (__compar_fn_t) vtable_member_name_compare_func);
+                if (found)
+                        return *found;
+        }
+
+        return NULL;
+}
+
 static int object_find_and_run(
                 sd_bus *bus,
                 sd_bus_message *m,
-                const char *p,
+                struct node *n,
                 bool require_fallback,
                 bool *found_object) {
 
-        struct node *n;
-        struct vtable_member vtable_key, *v;
+        struct vtable_member *v;
         int r;
 
         assert(bus);
         assert(m);
-        assert(p);
+        assert(n);
         assert(found_object);
 
-        n = hashmap_get(bus->nodes, p);
-        if (!n)
-                return 0;
-
         /* First, try object callbacks */
         r = node_callbacks_run(bus, m, n->callbacks, require_fallback, found_object);
         if (r != 0)
@@ -1251,11 +1282,7 @@ static int object_find_and_run(
                 return 0;
 
         /* Then, look for a known method */
-        vtable_key.path = (char*) p;
-        vtable_key.interface = m->interface;
-        vtable_key.member = m->member;
-
-        v = hashmap_get(bus->vtable_methods, &vtable_key);
+        v = node_find_vtable_member(n, m->interface, m->member, false);
         if (v) {
                 r = method_callbacks_run(bus, m, v, require_fallback, found_object);
                 if (r != 0)
@@ -1271,18 +1298,17 @@ static int object_find_and_run(
                 get = streq(m->member, "Get");
 
                 if (get || streq(m->member, "Set")) {
+                        const char *iface, *member;
 
                         r = sd_bus_message_rewind(m, true);
                         if (r < 0)
                                 return r;
 
-                        vtable_key.path = (char*) p;
-
-                        r = sd_bus_message_read(m, "ss", &vtable_key.interface, &vtable_key.member);
+                        r = sd_bus_message_read(m, "ss", &iface, &member);
                         if (r < 0)
                                 return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_INVALID_ARGS, "Expected interface and member parameters");
 
-                        v = hashmap_get(bus->vtable_properties, &vtable_key);
+                        v = node_find_vtable_member(n, iface, member, true);
                         if (v) {
                                 r = property_get_set_callbacks_run(bus, m, v, require_fallback, get, found_object);
                                 if (r != 0)
@@ -1343,9 +1369,52 @@ static int object_find_and_run(
         return 0;
 }
 
+static struct node *bus_find_node(sd_bus *bus, const char *path, bool *ret_fallback) {
+        struct node *n;
+        const char *e;
+        char *prefix;
+
+        assert(bus);
+        assert(path);
+        assert(ret_fallback);
+
+        /* Returns the node of the object path itself, or otherwise the one of its longest prefix that has a
+         * node. All parents of a node have a node too, hence the remaining fallback prefixes can then be found
+         * by following the parent pointers. */
+
+        /* Calls for objects below a fallback usually come in bulk. As long as the fallback node of the last
+         * call has no children, it is the longest prefix with a node for every path below it, and we don't
+         * need to look up anything. */
+        n = bus->last_fallback_node;
+        if (n && !n->child) {
+                e = startswith(path, n->path);
+                if (e && *e == '/') {
+                        *ret_fallback = true;
+                        return n;
+                }
+        }
+
+        n = hashmap_get(bus->nodes, path);
+        if (n) {
+                *ret_fallback = false;
+                return n;
+        }
+
+        prefix = newa(char, strlen(path) + 1);
+        OBJECT_PATH_FOREACH_PREFIX(prefix, path) {
+                n = hashmap_get(bus->nodes, prefix);
+                if (n) {
+                        bus->last_fallback_node = n;
+                        *ret_fallback = true;
+                        return n;
+                }
+        }
+
+        return NULL;
+}
+
 int bus_process_object(sd_bus *bus, sd_bus_message *m) {
         int r;
-        size_t pl;
         bool found_object = false;
 
         assert(bus);
@@ -1367,25 +1436,20 @@ int bus_process_object(sd_bus *bus, sd_bus_message *m) {
         assert(m->path);
         assert(m->member);
 
-        pl = strlen(m->path);
         do {
-                char prefix[pl+1];
+                bool require_fallback;
+                struct node *n;
 
                 bus->nodes_modified = false;
 
-                r = object_find_and_run(bus, m, m->path, false, &found_object);
-                if (r != 0)
-                        return r;
-
-                /* Look for fallback prefixes */
-                OBJECT_PATH_FOREACH_PREFIX(prefix, m->path) {
-
+                for (n = bus_find_node(bus, m->path, &require_fallback); n; n = n->parent) {
+                        r = object_find_and_run(bus, m, n, require_fallback, &found_object);
+                        if (r != 0)
+                                return r;
                         if (bus->nodes_modified)
                                 break;
 
-                        r = object_find_and_run(bus, m, prefix, true, &found_object);
-                        if (r != 0)
-                                return r;
+                        require_fallback = true;
                 }
 
         } while (bus->nodes_modified);
@@ -1481,6 +1545,9 @@ void bus_node_gc(sd_bus *b, struct node *n) {
 
         assert_se(hashmap_remove(b->nodes, n->path) == n);
 
+        if (b->last_fallback_node == n)
+                b->last_fallback_node = NULL;
+
         if (n->parent)
                 LIST_REMOVE(siblings, n->parent->child, n);
 
@@ -1627,6 +1694,7 @@ static int add_object_vtable_internal(
 
         sd_bus_slot *s = NULL;
         struct node_vtable *i, *existing = NULL;
+        size_t n_methods = 0, n_properties = 0;
         const sd_bus_vtable *v;
         struct node *n;
         int r;
@@ -1689,6 +1757,20 @@ static int add_object_vtable_internal(
                 goto fail;
         }
 
+        for (v = s->node_vtable.vtable+1; v->type != _SD_BUS_VTABLE_END; v++)
+                if (v->type == _SD_BUS_VTABLE_METHOD)
+                        n_methods++;
+                else if (IN_SET(v->type, _SD_BUS_VTABLE_PROPERTY, _SD_BUS_VTABLE_WRITABLE_PROPERTY))
+                        n_properties++;
+
+        s->node_vtable.methods = new(struct vtable_member*, n_methods);
+        s->node_vtable.properties = new(struct vtable_member*, n_properties);
+        if ((n_methods > 0 && !s->node_vtable.methods) ||
+            (n_properties > 0 && !s->node_vtable.properties)) {
+                r = -ENOMEM;
+                goto fail;
+        }
+
         for (v = s->node_vtable.vtable+1; v->type != _SD_BUS_VTABLE_END; v++) {
 
                 switch (v->type) {
@@ -1723,6 +1805,8 @@ static int add_object_vtable_internal(
                                 goto fail;
                         }
 
+                        s->node_vtable.methods[s->node_vtable.n_methods++] = m;
+
                         break;
                 }
 
@@ -1771,6 +1855,8 @@ static int add_object_vtable_internal(
                                 goto fail;
                         }
 
+                        s->node_vtable.properties[s->node_vtable.n_properties++] = m;
+
                         break;
                 }
 
@@ -1791,6 +1877,9 @@ static int add_object_vtable_internal(
                 }
         }
 
+        typesafe_qsort(s->node_vtable.methods, s->node_vtable.n_methods, vtable_member_name_compare_func);
+        typesafe_qsort(s->node_vtable.properties, s->node_vtable.n_properties, vtable_member_name_compare_func);
+
         s->node_vtable.node = n;
         LIST_INSERT_AFTER(vtables, n->vtables, existing, &s->node_vtable);
         bus->nodes_modified = true;
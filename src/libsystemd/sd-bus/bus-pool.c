@@ -0,0 +1,145 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <pthread.h>
+
+#include "alloc-util.h"
+#include "bus-internal.h"
+#include "bus-message.h"
+#include "bus-pool.h"
+
+/* Every message we hand out from the pool has room for the fixed
+ * header right after it, see sd_bus_message_new() */
+#define BUS_POOL_MESSAGE_SIZE (ALIGN(sizeof(sd_bus_message)) + sizeof(struct bus_header))
+
+sd_bus_message *bus_pool_get_message(sd_bus *bus) {
+        sd_bus_message *m = NULL;
+
+        assert(bus);
+
+        assert_se(pthread_mutex_lock(&bus->pool_mutex) == 0);
+        if (bus->n_message_pool > 0)
+                m = bus->message_pool[--bus->n_message_pool];
+        assert_se(pthread_mutex_unlock(&bus->pool_mutex) == 0);
+
+        if (m)
+                memzero(m, BUS_POOL_MESSAGE_SIZE);
+        else {
+                m = malloc0(BUS_POOL_MESSAGE_SIZE);
+                if (!m)
+                        return NULL;
+        }
+
+        m->poolable = true;
+        return m;
+}
+
+void bus_pool_put_message(sd_bus *bus, sd_bus_message *m) {
+        assert(bus);
+        assert(m);
+        assert(m->poolable);
+
+        assert_se(pthread_mutex_lock(&bus->pool_mutex) == 0);
+        if (bus->n_message_pool < BUS_POOL_MAX) {
+                bus->message_pool[bus->n_message_pool++] = m;
+                m = NULL;
+        }
+        assert_se(pthread_mutex_unlock(&bus->pool_mutex) == 0);
+
+        free(m);
+}
+
+struct bus_body_part *bus_pool_get_part(sd_bus *bus) {
+        struct bus_body_part *part = NULL;
+
+        assert(bus);
+
+        assert_se(pthread_mutex_lock(&bus->pool_mutex) == 0);
+        if (bus->n_part_pool > 0)
+                part = bus->part_pool[--bus->n_part_pool];
+        assert_se(pthread_mutex_unlock(&bus->pool_mutex) == 0);
+
+        if (!part)
+                return new0(struct bus_body_part, 1);
+
+        zero(*part);
+        return part;
+}
+
+void bus_pool_put_part(sd_bus *bus, struct bus_body_part *part) {
+        assert(bus);
+        assert(part);
+
+        assert_se(pthread_mutex_lock(&bus->pool_mutex) == 0);
+        if (bus->n_part_pool < BUS_POOL_MAX) {
+                bus->part_pool[bus->n_part_pool++] = part;
+                part = NULL;
+        }
+        assert_se(pthread_mutex_unlock(&bus->pool_mutex) == 0);
+
+        free(part);
+}
+
+void *bus_pool_get_buffer(sd_bus *bus, size_t size, size_t *ret_allocated) {
+        void *p = NULL;
+        unsigned i;
+
+        assert(bus);
+        assert(ret_allocated);
+
+        assert_se(pthread_mutex_lock(&bus->pool_mutex) == 0);
+        for (i = 0; i < bus->n_buffer_pool; i++)
+                if (bus->buffer_pool[i].allocated >= size) {
+                        p = bus->buffer_pool[i].data;
+                        *ret_allocated = bus->buffer_pool[i].allocated;
+
+                        bus->buffer_pool[i] = bus->buffer_pool[--bus->n_buffer_pool];
+                        break;
+                }
+        assert_se(pthread_mutex_unlock(&bus->pool_mutex) == 0);
+
+        if (p)
+                return p;
+
+        size = MAX(size, (size_t) BUS_POOL_BUFFER_SIZE_MIN);
+
+        p = malloc(size);
+        if (!p)
+                return NULL;
+
+        *ret_allocated = size;
+        return p;
+}
+
+void bus_pool_put_buffer(sd_bus *bus, void *p, size_t allocated) {
+        assert(bus);
+
+        if (!p)
+                return;
+
+        if (allocated <= BUS_POOL_BUFFER_SIZE_MAX) {
+                assert_se(pthread_mutex_lock(&bus->pool_mutex) == 0);
+                if (bus->n_buffer_pool < BUS_POOL_MAX) {
+                        bus->buffer_pool[bus->n_buffer_pool++] = (struct bus_pool_buffer) {
+                                .data = p,
+                                .allocated = allocated,
+                        };
+                        p = NULL;
+                }
+                assert_se(pthread_mutex_unlock(&bus->pool_mutex) == 0);
+        }
+
+        free(p);
+}
+
+void bus_pool_flush(sd_bus *bus) {
+        assert(bus);
+
+        while (bus->n_message_pool > 0)
+                free(bus->message_pool[--bus->n_message_pool]);
+
+        while (bus->n_part_pool > 0)
+                free(bus->part_pool[--bus->n_part_pool]);
+
+        while (bus->n_buffer_pool > 0)
+                free(bus->buffer_pool[--bus->n_buffer_pool].data);
+}
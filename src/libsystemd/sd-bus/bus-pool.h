@@ -0,0 +1,35 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+#pragma once
+
+#include "sd-bus.h"
+
+/* How many messages, body parts and buffers we keep around per bus
+ * for reuse */
+#define BUS_POOL_MAX 16
+
+/* When we put a buffer back into the pool, we release it instead if
+ * it is larger than this, in order not to keep too much data
+ * around. */
+#define BUS_POOL_BUFFER_SIZE_MAX (64*1024)
+
+/* Buffers are allocated at least this large, so that they are useful
+ * for the next message too */
+#define BUS_POOL_BUFFER_SIZE_MIN 256
+
+struct bus_body_part;
+
+struct bus_pool_buffer {
+        void *data;
+        size_t allocated;
+};
+
+sd_bus_message *bus_pool_get_message(sd_bus *bus);
+void bus_pool_put_message(sd_bus *bus, sd_bus_message *m);
+
+struct bus_body_part *bus_pool_get_part(sd_bus *bus);
+void bus_pool_put_part(sd_bus *bus, struct bus_body_part *part);
+
+void *bus_pool_get_buffer(sd_bus *bus, size_t size, size_t *ret_allocated);
+void bus_pool_put_buffer(sd_bus *bus, void *p, size_t allocated);
+
+void bus_pool_flush(sd_bus *bus);
@@ -72,7 +72,13 @@ enum {
         BUS_MESSAGE_HEADER_SENDER,
         BUS_MESSAGE_HEADER_SIGNATURE,
         BUS_MESSAGE_HEADER_UNIX_FDS,
-        _BUS_MESSAGE_HEADER_MAX
+        _BUS_MESSAGE_HEADER_MAX,
+
+        /* sd-bus extension: body parts passed as sealed memfds instead of
+         * inline, as array of (body offset, size, memfd offset). Only used
+         * on connections that agreed on NEGOTIATE_MEMFD during
+         * authentication. */
+        BUS_MESSAGE_HEADER_MEMFDS = 0x80,
 };
 
 /* RequestName parameters */
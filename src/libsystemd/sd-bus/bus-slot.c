@@ -161,6 +161,8 @@ void bus_slot_disconnect(sd_bus_slot *slot) {
                 }
 
                 slot->node_vtable.interface = mfree(slot->node_vtable.interface);
+                slot->node_vtable.methods = mfree(slot->node_vtable.methods);
+                slot->node_vtable.properties = mfree(slot->node_vtable.properties);
 
                 if (slot->node_vtable.node) {
                         LIST_REMOVE(vtables, slot->node_vtable.node->vtables, &slot->node_vtable);
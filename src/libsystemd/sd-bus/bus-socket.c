@@ -11,6 +11,7 @@
 #include "alloc-util.h"
 #include "bus-internal.h"
 #include "bus-message.h"
+#include "bus-pool.h"
 #include "bus-socket.h"
 #include "fd-util.h"
 #include "format-util.h"
@@ -31,6 +32,10 @@
 
 #define SNDBUF_SIZE (8*1024*1024)
 
+/* How many iovecs we pass to a single sendmsg() at most when writing
+ * out multiple queued messages at once */
+#define WRITE_BATCH_IOVEC_MAX 256
+
 static void iovec_advance(struct iovec iov[], unsigned *idx, size_t size) {
 
         while (size > 0) {
@@ -76,8 +81,8 @@ static int bus_message_setup_iovec(sd_bus_message *m) {
 
         assert(!m->iovec);
 
-        n = 1 + m->n_body_parts;
-        if (n < ELEMENTSOF(m->iovec_fixed))
+        n = 1 + m->n_body_parts - m->n_memfds;
+        if (n <= ELEMENTSOF(m->iovec_fixed))
                 m->iovec = m->iovec_fixed;
         else {
                 m->iovec = new(struct iovec, n);
@@ -92,6 +97,10 @@ static int bus_message_setup_iovec(sd_bus_message *m) {
                 goto fail;
 
         MESSAGE_FOREACH_PART(part, i, m)  {
+                /* Passed as file descriptor, never mapped on our side */
+                if (part->pass_memfd)
+                        continue;
+
                 r = bus_body_part_map(part);
                 if (r < 0)
                         goto fail;
@@ -160,15 +169,15 @@ static int bus_socket_write_auth(sd_bus *b) {
 }
 
 static int bus_socket_auth_verify_client(sd_bus *b) {
-        char *e, *f, *start;
+        char *e, *f, *g, *start;
         sd_id128_t peer;
         unsigned i;
         int r;
 
         assert(b);
 
-        /* We expect two response lines: "OK" and possibly
-         * "AGREE_UNIX_FD" */
+        /* We expect up to three response lines: "OK" and possibly
+         * "AGREE_UNIX_FD" and "AGREE_MEMFD" */
 
         e = memmem_safe(b->rbuffer, b->rbuffer_size, "\r\n", 2);
         if (!e)
@@ -185,6 +194,17 @@ static int bus_socket_auth_verify_client(sd_bus *b) {
                 start = e + 2;
         }
 
+        if (b->accept_memfd) {
+                assert(f);
+
+                g = memmem(f + 2, b->rbuffer_size - (f - (char*) b->rbuffer) - 2, "\r\n", 2);
+                if (!g)
+                        return 0;
+
+                start = g + 2;
+        } else
+                g = NULL;
+
         /* Nice! We got all the lines we need. First check the OK
          * line */
 
@@ -214,7 +234,7 @@ static int bus_socket_auth_verify_client(sd_bus *b) {
 
         b->server_id = peer;
 
-        /* And possibly check the second line, too */
+        /* And possibly check the second and third line, too */
 
         if (f)
                 b->can_fds =
@@ -222,6 +242,13 @@ static int bus_socket_auth_verify_client(sd_bus *b) {
                         memcmp(e + 2, "AGREE_UNIX_FD",
                                STRLEN("AGREE_UNIX_FD")) == 0;
 
+        if (g)
+                b->can_memfd =
+                        b->can_fds &&
+                        (g - f == STRLEN("\r\nAGREE_MEMFD")) &&
+                        memcmp(f + 2, "AGREE_MEMFD",
+                               STRLEN("AGREE_MEMFD")) == 0;
+
         b->rbuffer_size -= (start - (char*) b->rbuffer);
         memmove(b->rbuffer, start, b->rbuffer_size);
 
@@ -464,6 +491,15 @@ static int bus_socket_auth_verify_server(sd_bus *b) {
                                 b->can_fds = true;
                                 r = bus_socket_auth_write(b, "AGREE_UNIX_FD\r\n");
                         }
+                } else if (line_equals(line, l, "NEGOTIATE_MEMFD")) {
+                        /* Memfds are passed like any other fd, hence
+                         * need to be negotiated after those */
+                        if (b->auth == _BUS_AUTH_INVALID || !b->can_fds || !b->accept_memfd)
+                                r = bus_socket_auth_write(b, "ERROR\r\n");
+                        else {
+                                b->can_memfd = true;
+                                r = bus_socket_auth_write(b, "AGREE_MEMFD\r\n");
+                        }
                 } else
                         r = bus_socket_auth_write(b, "ERROR\r\n");
 
@@ -518,6 +554,7 @@ static int bus_socket_read_auth(sd_bus *b) {
                 return -ENOMEM;
 
         b->rbuffer = p;
+        b->rbuffer_allocated = n;
 
         iov.iov_base = (uint8_t*) b->rbuffer + b->rbuffer_size;
         iov.iov_len = n - b->rbuffer_size;
@@ -632,7 +669,9 @@ static int bus_socket_start_auth_client(sd_bus *b) {
         if (!b->auth_buffer)
                 return -ENOMEM;
 
-        if (b->accept_fd)
+        if (b->accept_memfd)
+                auth_suffix = "\r\nNEGOTIATE_UNIX_FD\r\nNEGOTIATE_MEMFD\r\nBEGIN\r\n";
+        else if (b->accept_fd)
                 auth_suffix = "\r\nNEGOTIATE_UNIX_FD\r\nBEGIN\r\n";
         else
                 auth_suffix = "\r\nBEGIN\r\n";
@@ -662,6 +701,11 @@ int bus_socket_start_auth(sd_bus *b) {
                 if (sd_is_socket(b->output_fd, AF_UNIX, 0, 0) <= 0)
                         b->accept_fd = false;
 
+        /* Body parts are only passed as memfds on direct connections,
+         * since a broker would have to forward them */
+        if (!b->accept_fd || b->bus_client)
+                b->accept_memfd = false;
+
         if (b->is_server)
                 return bus_socket_read_auth(b);
         else
@@ -968,54 +1012,90 @@ int bus_socket_take_fd(sd_bus *b) {
         return bus_socket_start_auth(b);
 }
 
-int bus_socket_write_message(sd_bus *bus, sd_bus_message *m, size_t *idx) {
+int bus_socket_write_messages(sd_bus *bus, sd_bus_message **messages, size_t n, size_t *idx) {
         struct iovec *iov;
+        size_t i, n_iov = 0, k_iov = 0;
         ssize_t k;
-        size_t n;
         unsigned j;
         int r;
 
         assert(bus);
-        assert(m);
+        assert(messages);
+        assert(n > 0);
         assert(idx);
         assert(IN_SET(bus->state, BUS_RUNNING, BUS_HELLO));
 
-        if (*idx >= BUS_MESSAGE_SIZE(m))
+        if (*idx >= BUS_MESSAGE_WIRE_SIZE(messages[0]))
                 return 0;
 
-        r = bus_message_setup_iovec(m);
-        if (r < 0)
-                return r;
+        /* Figure out how many of the messages we can write out with
+         * a single syscall. The file descriptors passed along are
+         * attached to the first byte written, hence a message
+         * carrying fds or memfds always needs to start a new batch. */
+        for (i = 0; i < n; i++) {
+                r = bus_message_setup_iovec(messages[i]);
+                if (r < 0) {
+                        if (i == 0)
+                                return r;
 
-        n = m->n_iovec * sizeof(struct iovec);
-        iov = alloca(n);
-        memcpy_safe(iov, m->iovec, n);
+                        /* Let's report this when it's this message's turn */
+                        break;
+                }
+
+                if (i > 0 &&
+                    (messages[i]->n_fds > 0 ||
+                     messages[i]->n_memfds > 0 ||
+                     n_iov + messages[i]->n_iovec > WRITE_BATCH_IOVEC_MAX))
+                        break;
+
+                n_iov += messages[i]->n_iovec;
+        }
+
+        n = i;
+
+        iov = newa(struct iovec, n_iov);
+        for (i = 0; i < n; i++) {
+                memcpy_safe(iov + k_iov, messages[i]->iovec, messages[i]->n_iovec * sizeof(struct iovec));
+                k_iov += messages[i]->n_iovec;
+        }
 
         j = 0;
         iovec_advance(iov, &j, *idx);
 
         if (bus->prefer_writev)
-                k = writev(bus->output_fd, iov, m->n_iovec);
+                k = writev(bus->output_fd, iov + j, n_iov - j);
         else {
                 struct msghdr mh = {
-                        .msg_iov = iov,
-                        .msg_iovlen = m->n_iovec,
+                        .msg_iov = iov + j,
+                        .msg_iovlen = n_iov - j,
                 };
 
-                if (m->n_fds > 0 && *idx == 0) {
+                if (messages[0]->n_fds + messages[0]->n_memfds > 0 && *idx == 0) {
+                        size_t n_fds = messages[0]->n_fds + messages[0]->n_memfds;
+                        struct bus_body_part *part;
                         struct cmsghdr *control;
+                        unsigned k_part;
+                        int *fds;
 
-                        mh.msg_control = control = alloca(CMSG_SPACE(sizeof(int) * m->n_fds));
-                        mh.msg_controllen = control->cmsg_len = CMSG_LEN(sizeof(int) * m->n_fds);
+                        mh.msg_control = control = alloca(CMSG_SPACE(sizeof(int) * n_fds));
+                        mh.msg_controllen = control->cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
                         control->cmsg_level = SOL_SOCKET;
                         control->cmsg_type = SCM_RIGHTS;
-                        memcpy(CMSG_DATA(control), m->fds, sizeof(int) * m->n_fds);
+
+                        /* The memfds of the body parts follow the fds of the message itself */
+                        fds = (int*) CMSG_DATA(control);
+                        memcpy_safe(fds, messages[0]->fds, sizeof(int) * messages[0]->n_fds);
+                        fds += messages[0]->n_fds;
+
+                        MESSAGE_FOREACH_PART(part, k_part, messages[0])
+                                if (part->pass_memfd)
+                                        *(fds++) = part->memfd;
                 }
 
                 k = sendmsg(bus->output_fd, &mh, MSG_DONTWAIT|MSG_NOSIGNAL);
                 if (k < 0 && errno == ENOTSOCK) {
                         bus->prefer_writev = true;
-                        k = writev(bus->output_fd, iov, m->n_iovec);
+                        k = writev(bus->output_fd, iov + j, n_iov - j);
                 }
         }
 
@@ -1026,6 +1106,12 @@ int bus_socket_write_message(sd_bus *bus, sd_bus_message *m, size_t *idx) {
         return 1;
 }
 
+int bus_socket_write_message(sd_bus *bus, sd_bus_message *m, size_t *idx) {
+        assert(m);
+
+        return bus_socket_write_messages(bus, &m, 1, idx);
+}
+
 static int bus_socket_read_message_need(sd_bus *bus, size_t *need) {
         uint32_t a, b;
         uint8_t e;
@@ -1080,6 +1166,7 @@ static int bus_socket_read_message_need(sd_bus *bus, size_t *need) {
 
 static int bus_socket_make_message(sd_bus *bus, size_t size) {
         sd_bus_message *t;
+        size_t allocated = 0;
         void *b;
         int r;
 
@@ -1092,10 +1179,11 @@ static int bus_socket_make_message(sd_bus *bus, size_t size) {
                 return r;
 
         if (bus->rbuffer_size > size) {
-                b = memdup((const uint8_t*) bus->rbuffer + size,
-                           bus->rbuffer_size - size);
+                b = bus_pool_get_buffer(bus, bus->rbuffer_size - size, &allocated);
                 if (!b)
                         return -ENOMEM;
+
+                memcpy(b, (const uint8_t*) bus->rbuffer + size, bus->rbuffer_size - size);
         } else
                 b = NULL;
 
@@ -1105,12 +1193,17 @@ static int bus_socket_make_message(sd_bus *bus, size_t size) {
                                     NULL,
                                     &t);
         if (r < 0) {
-                free(b);
+                bus_pool_put_buffer(bus, b, allocated);
                 return r;
         }
 
+        /* The message owns the receive buffer now, and returns it to
+         * the pool when it is freed */
+        t->header_allocated = bus->rbuffer_allocated;
+
         bus->rbuffer = b;
         bus->rbuffer_size -= size;
+        bus->rbuffer_allocated = allocated;
 
         bus->fds = NULL;
         bus->n_fds = 0;
@@ -1143,11 +1236,20 @@ int bus_socket_read_message(sd_bus *bus) {
         if (bus->rbuffer_size >= need)
                 return bus_socket_make_message(bus, need);
 
-        b = realloc(bus->rbuffer, need);
-        if (!b)
-                return -ENOMEM;
+        if (!bus->rbuffer) {
+                b = bus_pool_get_buffer(bus, need, &bus->rbuffer_allocated);
+                if (!b)
+                        return -ENOMEM;
 
-        bus->rbuffer = b;
+                bus->rbuffer = b;
+        } else if (need > bus->rbuffer_allocated) {
+                b = realloc(bus->rbuffer, need);
+                if (!b)
+                        return -ENOMEM;
+
+                bus->rbuffer = b;
+                bus->rbuffer_allocated = need;
+        }
 
         iov.iov_base = (uint8_t*) bus->rbuffer + bus->rbuffer_size;
         iov.iov_len = need - bus->rbuffer_size;
@@ -220,8 +220,10 @@ static sd_bus* bus_free(sd_bus *b) {
         hashmap_free(b->nodes);
 
         bus_flush_memfd(b);
+        bus_pool_flush(b);
 
         assert_se(pthread_mutex_destroy(&b->memfd_cache_mutex) == 0);
+        assert_se(pthread_mutex_destroy(&b->pool_mutex) == 0);
 
         return mfree(b);
 }
@@ -247,6 +249,7 @@ _public_ int sd_bus_new(sd_bus **ret) {
         b->n_groups = (size_t) -1;
 
         assert_se(pthread_mutex_init(&b->memfd_cache_mutex, NULL) == 0);
+        assert_se(pthread_mutex_init(&b->pool_mutex, NULL) == 0);
 
         /* We guarantee that wqueue always has space for at least one entry */
         if (!GREEDY_REALLOC(b->wqueue, b->wqueue_allocated, 1))
@@ -1661,6 +1664,23 @@ int bus_seal_synthetic_message(sd_bus *b, sd_bus_message *m) {
         return sd_bus_message_seal(m, 0xFFFFFFFFULL, 0);
 }
 
+static void bus_log_sent_message(sd_bus_message *m) {
+        assert(m);
+
+        log_debug("Sent message type=%s sender=%s destination=%s path=%s interface=%s member=%s cookie=%" PRIu64 " reply_cookie=%" PRIu64 " signature=%s error-name=%s error-message=%s",
+                  bus_message_type_to_string(m->header->type),
+                  strna(sd_bus_message_get_sender(m)),
+                  strna(sd_bus_message_get_destination(m)),
+                  strna(sd_bus_message_get_path(m)),
+                  strna(sd_bus_message_get_interface(m)),
+                  strna(sd_bus_message_get_member(m)),
+                  BUS_MESSAGE_COOKIE(m),
+                  m->reply_cookie,
+                  strna(m->root_container.signature),
+                  strna(m->error.name),
+                  strna(m->error.message));
+}
+
 static int bus_write_message(sd_bus *bus, sd_bus_message *m, size_t *idx) {
         int r;
 
@@ -1671,19 +1691,8 @@ static int bus_write_message(sd_bus *bus, sd_bus_message *m, size_t *idx) {
         if (r <= 0)
                 return r;
 
-        if (*idx >= BUS_MESSAGE_SIZE(m))
-                log_debug("Sent message type=%s sender=%s destination=%s path=%s interface=%s member=%s cookie=%" PRIu64 " reply_cookie=%" PRIu64 " signature=%s error-name=%s error-message=%s",
-                          bus_message_type_to_string(m->header->type),
-                          strna(sd_bus_message_get_sender(m)),
-                          strna(sd_bus_message_get_destination(m)),
-                          strna(sd_bus_message_get_path(m)),
-                          strna(sd_bus_message_get_interface(m)),
-                          strna(sd_bus_message_get_member(m)),
-                          BUS_MESSAGE_COOKIE(m),
-                          m->reply_cookie,
-                          strna(m->root_container.signature),
-                          strna(m->error.name),
-                          strna(m->error.message));
+        if (*idx >= BUS_MESSAGE_WIRE_SIZE(m))
+                bus_log_sent_message(m);
 
         return r;
 }
@@ -1695,28 +1704,32 @@ static int dispatch_wqueue(sd_bus *bus) {
         assert(IN_SET(bus->state, BUS_RUNNING, BUS_HELLO));
 
         while (bus->wqueue_size > 0) {
+                unsigned n = 0;
 
-                r = bus_write_message(bus, bus->wqueue[0], &bus->windex);
+                /* Write out as many of the queued messages as we can
+                 * with a single syscall. bus->windex is the number of
+                 * bytes of the queue written so far, counted from the
+                 * beginning of the first message. */
+                r = bus_socket_write_messages(bus, bus->wqueue, bus->wqueue_size, &bus->windex);
                 if (r < 0)
                         return r;
                 else if (r == 0)
                         /* Didn't do anything this time */
                         return ret;
-                else if (bus->windex >= BUS_MESSAGE_SIZE(bus->wqueue[0])) {
-                        /* Fully written. Let's drop the entry from
-                         * the queue.
-                         *
-                         * This isn't particularly optimized, but
-                         * well, this is supposed to be our worst-case
-                         * buffer only, and the socket buffer is
-                         * supposed to be our primary buffer, and if
-                         * it got full, then all bets are off
-                         * anyway. */
-
-                        bus->wqueue_size--;
-                        sd_bus_message_unref(bus->wqueue[0]);
-                        memmove(bus->wqueue, bus->wqueue + 1, sizeof(sd_bus_message*) * bus->wqueue_size);
-                        bus->windex = 0;
+
+                /* Drop all fully written entries from the queue at
+                 * once */
+                while (n < bus->wqueue_size && bus->windex >= BUS_MESSAGE_WIRE_SIZE(bus->wqueue[n])) {
+                        bus->windex -= BUS_MESSAGE_WIRE_SIZE(bus->wqueue[n]);
+
+                        bus_log_sent_message(bus->wqueue[n]);
+                        sd_bus_message_unref(bus->wqueue[n]);
+                        n++;
+                }
+
+                if (n > 0) {
+                        bus->wqueue_size -= n;
+                        memmove(bus->wqueue, bus->wqueue + n, sizeof(sd_bus_message*) * bus->wqueue_size);
 
                         ret = 1;
                 }
@@ -1775,8 +1788,29 @@ static int dispatch_rqueue(sd_bus *bus, bool hint_priority, int64_t priority, sd
         }
 }
 
+static bool bus_defer_write(sd_bus *bus, sd_bus_message *m) {
+        assert(bus);
+        assert(m);
+
+        /* Signals emitted from within an event loop callback are
+         * only queued, and written out together with the ones
+         * following them once we are back in the event loop, so that
+         * a burst of them only takes a few syscalls. Everything else
+         * is written right away, since somebody might be waiting for
+         * it. */
+
+        if (m->header->type != SD_BUS_MESSAGE_SIGNAL)
+                return false;
+
+        if (!bus->event || !bus->input_io_event_source)
+                return false;
+
+        return sd_event_get_state(bus->event) == SD_EVENT_RUNNING;
+}
+
 _public_ int sd_bus_send(sd_bus *bus, sd_bus_message *_m, uint64_t *cookie) {
         _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = sd_bus_message_ref(_m);
+        bool defer;
         int r;
 
         assert_return(m, -EINVAL);
@@ -1817,7 +1851,9 @@ _public_ int sd_bus_send(sd_bus *bus, sd_bus_message *_m, uint64_t *cookie) {
         if (m->dont_send)
                 goto finish;
 
-        if (IN_SET(bus->state, BUS_RUNNING, BUS_HELLO) && bus->wqueue_size <= 0) {
+        defer = bus_defer_write(bus, m);
+
+        if (IN_SET(bus->state, BUS_RUNNING, BUS_HELLO) && bus->wqueue_size <= 0 && !defer) {
                 size_t idx = 0;
 
                 r = bus_write_message(bus, m, &idx);
@@ -1830,7 +1866,7 @@ _public_ int sd_bus_send(sd_bus *bus, sd_bus_message *_m, uint64_t *cookie) {
                         return r;
                 }
 
-                if (idx < BUS_MESSAGE_SIZE(m))  {
+                if (idx < BUS_MESSAGE_WIRE_SIZE(m))  {
                         /* Wasn't fully written. So let's remember how
                          * much was written. Note that the first entry
                          * of the wqueue array is always allocated so
@@ -1851,6 +1887,24 @@ _public_ int sd_bus_send(sd_bus *bus, sd_bus_message *_m, uint64_t *cookie) {
                         return -ENOMEM;
 
                 bus->wqueue[bus->wqueue_size++] = sd_bus_message_ref(m);
+
+                /* Write out the queue every now and then, so that
+                 * deferred signals don't pile up. Also write it out
+                 * right away if this message isn't deferred itself,
+                 * so that a reply doesn't wait for the event loop
+                 * behind signals queued before it. */
+                if (IN_SET(bus->state, BUS_RUNNING, BUS_HELLO) &&
+                    (!defer || bus->wqueue_size % BUS_WQUEUE_DEFER_MAX == 0)) {
+                        r = dispatch_wqueue(bus);
+                        if (r < 0) {
+                                if (IN_SET(r, -ENOTCONN, -ECONNRESET, -EPIPE, -ESHUTDOWN)) {
+                                        bus_enter_closing(bus);
+                                        return -ECONNRESET;
+                                }
+
+                                return r;
+                        }
+                }
         }
 
 finish:
@@ -1,8 +1,11 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 
 #include "sd-bus.h"
+#include "sd-event.h"
 
 #include "alloc-util.h"
 #include "bus-internal.h"
@@ -10,19 +13,58 @@
 #include "bus-util.h"
 #include "def.h"
 #include "fd-util.h"
+#include "memfd-util.h"
 #include "time-util.h"
 #include "util.h"
 
 #define MAX_SIZE (2*1024*1024)
 
+/* The range of payload sizes the "blob" mode sends, the upper end is the array size limit */
+#define BLOB_SIZE_MIN (1024*1024)
+#define BLOB_SIZE_MAX BUS_ARRAY_MAX_SIZE
+
+/* How many signals the "storm" mode emits before flushing the connection */
+#define STORM_BURST 1000
+
 static usec_t arg_loop_usec = 100 * USEC_PER_MSEC;
 
+/* Counts the calls into the allocator and the sendmsg() syscalls, so that we can tell how many of them a round trip
+ * takes. The server and the client are separate processes, hence each counts its own. */
+static uint64_t n_allocations = 0, n_sendmsg = 0;
+
+ssize_t sendmsg(int fd, const struct msghdr *mh, int flags) {
+        n_sendmsg++;
+        return syscall(SYS_sendmsg, fd, mh, flags);
+}
+
+#ifndef __SANITIZE_ADDRESS__
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+
+void *malloc(size_t size) {
+        n_allocations++;
+        return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+        n_allocations++;
+        return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+        n_allocations++;
+        return __libc_realloc(p, size);
+}
+#endif
+
 typedef enum Type {
         TYPE_LEGACY,
         TYPE_DIRECT,
 } Type;
 
-static void server(sd_bus *b, size_t *result) {
+static void server(sd_bus *b, size_t *result, uint64_t *ret_signals) {
+        uint64_t n_calls = 0, n_signals = 0, allocations = n_allocations;
         int r;
 
         for (;;) {
@@ -47,14 +89,23 @@ static void server(sd_bus *b, size_t *result) {
 
                         r = sd_bus_reply_method_return(m, NULL);
                         assert_se(r >= 0);
+
+                        n_calls++;
                 } else if (sd_bus_message_is_method_call(m, "benchmark.server", "Exit")) {
                         uint64_t res;
                         assert_se(sd_bus_message_read(m, "t", &res) > 0);
 
                         *result = res;
+                        *ret_signals = n_signals;
+
+                        if (n_calls > 0)
+                                printf("Server: %.1f allocations per call\n",
+                                       (double) (n_allocations - allocations) / n_calls);
                         return;
 
-                } else if (!sd_bus_message_is_signal(m, NULL, NULL))
+                } else if (sd_bus_message_is_signal(m, "benchmark.server", "Changed"))
+                        n_signals++;
+                else if (!sd_bus_message_is_signal(m, NULL, NULL))
                         assert_not_reached("Unknown method");
         }
 }
@@ -71,6 +122,15 @@ static void transaction(sd_bus *b, size_t sz, const char *server_name) {
         assert_se(sd_bus_call(b, m, 0, NULL, &reply) >= 0);
 }
 
+static void transaction_memfd(sd_bus *b, int fd, size_t sz) {
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL, *reply = NULL;
+
+        assert_se(sd_bus_message_new_method_call(b, &m, NULL, "/", "benchmark.server", "Work") >= 0);
+        assert_se(sd_bus_message_append_array_memfd(m, 'y', fd, 0, sz) >= 0);
+
+        assert_se(sd_bus_call(b, m, 0, NULL, &reply) >= 0);
+}
+
 static void client_bisect(const char *address, const char *server_name) {
         _cleanup_(sd_bus_message_unrefp) sd_bus_message *x = NULL;
         size_t lsize, rsize, csize;
@@ -173,19 +233,21 @@ static void client_chart(Type type, const char *address, const char *server_name
 
         switch (type) {
         case TYPE_LEGACY:
-                printf("SIZE\tLEGACY\n");
+                printf("SIZE\tLEGACY\tALLOCS\n");
                 break;
         case TYPE_DIRECT:
-                printf("SIZE\tDIRECT\n");
+                printf("SIZE\tDIRECT\tALLOCS\n");
                 break;
         }
 
         for (csize = 1; csize <= MAX_SIZE; csize *= 2) {
+                uint64_t allocations;
                 usec_t t;
                 unsigned n_memfd;
 
                 printf("%zu\t", csize);
 
+                allocations = n_allocations;
                 t = now(CLOCK_MONOTONIC);
                 for (n_memfd = 0;; n_memfd++) {
                         transaction(b, csize, server_name);
@@ -193,7 +255,9 @@ static void client_chart(Type type, const char *address, const char *server_name
                                 break;
                 }
 
-                printf("%u\n", (unsigned) ((n_memfd * USEC_PER_SEC) / arg_loop_usec));
+                printf("%u\t%.1f\n",
+                       (unsigned) ((n_memfd * USEC_PER_SEC) / arg_loop_usec),
+                       (double) (n_allocations - allocations) / (n_memfd + 1));
         }
 
         b->use_memfd = 1;
@@ -204,10 +268,152 @@ static void client_chart(Type type, const char *address, const char *server_name
         sd_bus_unref(b);
 }
 
+static void client_blob(int fd) {
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *x = NULL;
+        size_t csize;
+        sd_bus *b;
+        int r;
+
+        r = sd_bus_new(&b);
+        assert_se(r >= 0);
+
+        b->accept_memfd = true;
+
+        r = sd_bus_set_fd(b, fd, fd);
+        assert_se(r >= 0);
+
+        r = sd_bus_start(b);
+        assert_se(r >= 0);
+
+        r = sd_bus_call_method(b, NULL, "/", "benchmark.server", "Ping", NULL, NULL, NULL);
+        assert_se(r >= 0);
+
+        /* Sends the same sealed memfd over and over, once copied into the byte stream, once passed as it is */
+        printf("SIZE\tCOPY\tMEMFD\n");
+
+        for (csize = BLOB_SIZE_MIN; csize <= BLOB_SIZE_MAX; csize *= 4) {
+                _cleanup_close_ int memfd = -1;
+                unsigned n_copying, n_memfd;
+                usec_t t;
+                void *p;
+
+                memfd = memfd_new_and_map("benchmark", csize, &p);
+                assert_se(memfd >= 0);
+                memset(p, 0x80, csize);
+                assert_se(munmap(p, csize) >= 0);
+
+                printf("%zu\t", csize);
+
+                b->use_memfd = 0;
+
+                t = now(CLOCK_MONOTONIC);
+                for (n_copying = 0;; n_copying++) {
+                        transaction_memfd(b, memfd, csize);
+                        if (now(CLOCK_MONOTONIC) >= t + arg_loop_usec)
+                                break;
+                }
+                printf("%u\t", (unsigned) ((n_copying * USEC_PER_SEC) / arg_loop_usec));
+
+                b->use_memfd = -1;
+
+                t = now(CLOCK_MONOTONIC);
+                for (n_memfd = 0;; n_memfd++) {
+                        transaction_memfd(b, memfd, csize);
+                        if (now(CLOCK_MONOTONIC) >= t + arg_loop_usec)
+                                break;
+                }
+                printf("%u\n", (unsigned) ((n_memfd * USEC_PER_SEC) / arg_loop_usec));
+        }
+
+        b->use_memfd = 1;
+        assert_se(sd_bus_message_new_method_call(b, &x, NULL, "/", "benchmark.server", "Exit") >= 0);
+        assert_se(sd_bus_message_append(x, "t", csize) >= 0);
+        assert_se(sd_bus_send(b, x, NULL) >= 0);
+
+        sd_bus_unref(b);
+}
+
+typedef struct Storm {
+        sd_bus *bus;
+        usec_t until;
+        uint64_t n_signals;
+} Storm;
+
+static int storm_burst(sd_event_source *s, void *userdata) {
+        Storm *storm = userdata;
+        unsigned i;
+        int r;
+
+        /* Emit the signals in bursts from an event loop callback, like PID1 does when many units change state at
+         * once */
+        for (i = 0; i < STORM_BURST; i++, storm->n_signals++) {
+                r = sd_bus_emit_signal(storm->bus, "/", "benchmark.server", "Changed", "su", "waldo.service", i);
+                assert_se(r >= 0);
+        }
+
+        if (now(CLOCK_MONOTONIC) >= storm->until) {
+                _cleanup_(sd_bus_message_unrefp) sd_bus_message *x = NULL;
+
+                assert_se(sd_bus_message_new_method_call(storm->bus, &x, NULL, "/", "benchmark.server", "Exit") >= 0);
+                assert_se(sd_bus_message_append(x, "t", storm->n_signals) >= 0);
+                assert_se(sd_bus_send(storm->bus, x, NULL) >= 0);
+
+                return sd_event_exit(sd_event_source_get_event(s), 0);
+        }
+
+        return 0;
+}
+
+static void client_storm(int fd) {
+        _cleanup_(sd_event_source_unrefp) sd_event_source *s = NULL;
+        _cleanup_(sd_event_unrefp) sd_event *e = NULL;
+        Storm storm = {};
+        uint64_t syscalls;
+        usec_t t;
+        int r;
+
+        r = sd_bus_new(&storm.bus);
+        assert_se(r >= 0);
+
+        r = sd_bus_set_fd(storm.bus, fd, fd);
+        assert_se(r >= 0);
+
+        r = sd_bus_start(storm.bus);
+        assert_se(r >= 0);
+
+        r = sd_bus_call_method(storm.bus, NULL, "/", "benchmark.server", "Ping", NULL, NULL, NULL);
+        assert_se(r >= 0);
+
+        assert_se(sd_event_new(&e) >= 0);
+        assert_se(sd_bus_attach_event(storm.bus, e, SD_EVENT_PRIORITY_NORMAL) >= 0);
+        assert_se(sd_event_add_defer(e, &s, storm_burst, &storm) >= 0);
+        assert_se(sd_event_source_set_enabled(s, SD_EVENT_ON) >= 0);
+
+        printf("SIGNALS/s\tSENDMSG/SIGNAL\n");
+
+        syscalls = n_sendmsg;
+        t = now(CLOCK_MONOTONIC);
+        storm.until = t + arg_loop_usec;
+
+        /* The bus is flushed and closed when the event loop exits */
+        assert_se(sd_event_loop(e) >= 0);
+
+        t = now(CLOCK_MONOTONIC) - t;
+
+        printf("%" PRIu64 "\t%.3f\n",
+               storm.n_signals * USEC_PER_SEC / t,
+               (double) (n_sendmsg - syscalls) / storm.n_signals);
+
+        assert_se(sd_bus_detach_event(storm.bus) >= 0);
+        sd_bus_unref(storm.bus);
+}
+
 int main(int argc, char *argv[]) {
         enum {
                 MODE_BISECT,
                 MODE_CHART,
+                MODE_STORM,
+                MODE_BLOB,
         } mode = MODE_BISECT;
         Type type = TYPE_LEGACY;
         int i, pair[2] = { -1, -1 };
@@ -215,6 +421,7 @@ int main(int argc, char *argv[]) {
         _cleanup_close_ int bus_ref = -1;
         const char *unique;
         cpu_set_t cpuset;
+        uint64_t n_signals;
         size_t result;
         sd_bus *b;
         pid_t pid;
@@ -224,6 +431,16 @@ int main(int argc, char *argv[]) {
                 if (streq(argv[i], "chart")) {
                         mode = MODE_CHART;
                         continue;
+                } else if (streq(argv[i], "storm")) {
+                        /* Signals are sent over a direct connection, so that we measure sd-bus only */
+                        mode = MODE_STORM;
+                        type = TYPE_DIRECT;
+                        continue;
+                } else if (streq(argv[i], "blob")) {
+                        /* Payloads can only be passed as memfds over direct connections */
+                        mode = MODE_BLOB;
+                        type = TYPE_DIRECT;
+                        continue;
                 } else if (streq(argv[i], "legacy")) {
                         type = TYPE_LEGACY;
                         continue;
@@ -258,6 +475,8 @@ int main(int argc, char *argv[]) {
 
                 r = sd_bus_set_server(b, true, SD_ID128_NULL);
                 assert_se(r >= 0);
+
+                b->accept_memfd = true;
         } else {
                 r = sd_bus_set_address(b, address);
                 assert_se(r >= 0);
@@ -299,6 +518,14 @@ int main(int argc, char *argv[]) {
                 case MODE_CHART:
                         client_chart(type, address, server_name, pair[1]);
                         break;
+
+                case MODE_STORM:
+                        client_storm(pair[1]);
+                        break;
+
+                case MODE_BLOB:
+                        client_blob(pair[1]);
+                        break;
                 }
 
                 _exit(EXIT_SUCCESS);
@@ -308,10 +535,13 @@ int main(int argc, char *argv[]) {
         CPU_SET(1, &cpuset);
         pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
 
-        server(b, &result);
+        server(b, &result, &n_signals);
 
         if (mode == MODE_BISECT)
                 printf("Copying/memfd are equally fast at %zu bytes\n", result);
+        else if (mode == MODE_STORM)
+                /* No signal may be lost or merged into another */
+                assert_se(n_signals == result);
 
         assert_se(waitpid(pid, NULL, 0) == pid);
 
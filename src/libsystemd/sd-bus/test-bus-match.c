@@ -1,13 +1,20 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 
+#include "alloc-util.h"
 #include "bus-match.h"
 #include "bus-message.h"
 #include "bus-slot.h"
 #include "bus-util.h"
 #include "log.h"
 #include "macro.h"
+#include "stdio-util.h"
+#include "time-util.h"
+
+#define N_BENCHMARK_MATCHES 10000U
+#define N_BENCHMARK_MESSAGES 1000U
 
 static bool mask[32];
+static unsigned n_hits;
 
 static int filter(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
         log_info("Ran %u", PTR_TO_UINT(userdata));
@@ -57,6 +64,77 @@ static int match_add(sd_bus_slot *slots, struct bus_match_node *root, const char
         return r;
 }
 
+static int count_filter(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        n_hits++;
+        return 0;
+}
+
+static void benchmark_match(sd_bus *bus, bool arg0) {
+        struct bus_match_node root = {
+                .type = BUS_MATCH_ROOT,
+        };
+
+        _cleanup_free_ sd_bus_message **messages = NULL;
+        _cleanup_free_ sd_bus_slot *slots = NULL;
+        unsigned i;
+        usec_t t;
+
+        /* Many matches on distinct namespaces, like a monitoring agent watching every unit */
+
+        assert_se(slots = new0(sd_bus_slot, N_BENCHMARK_MATCHES));
+        assert_se(messages = new0(sd_bus_message*, N_BENCHMARK_MESSAGES));
+
+        for (i = 0; i < N_BENCHMARK_MATCHES; i++) {
+                struct bus_match_component *components = NULL;
+                unsigned n_components = 0;
+                char match[128];
+
+                if (arg0)
+                        xsprintf(match, "type='signal',member='NameOwnerChanged',arg0namespace='org.example.service%u'", i);
+                else
+                        xsprintf(match, "type='signal',member='PropertiesChanged',path_namespace='/org/example/unit%u'", i);
+
+                assert_se(bus_match_parse(match, &components, &n_components) >= 0);
+                slots[i].match_callback.callback = count_filter;
+                assert_se(bus_match_add(&root, components, n_components, &slots[i].match_callback) >= 0);
+                bus_match_parse_free(components, n_components);
+        }
+
+        /* Each message matches exactly one of the matches above */
+        for (i = 0; i < N_BENCHMARK_MESSAGES; i++) {
+                unsigned k = i * (N_BENCHMARK_MATCHES / N_BENCHMARK_MESSAGES);
+                char s[64];
+
+                if (arg0) {
+                        assert_se(sd_bus_message_new_signal(bus, &messages[i], "/org/freedesktop/DBus", "org.freedesktop.DBus", "NameOwnerChanged") >= 0);
+                        xsprintf(s, "org.example.service%u.Job", k);
+                        assert_se(sd_bus_message_append(messages[i], "sss", s, "", ":1.1") >= 0);
+                } else {
+                        xsprintf(s, "/org/example/unit%u/job", k);
+                        assert_se(sd_bus_message_new_signal(bus, &messages[i], s, "org.freedesktop.DBus.Properties", "PropertiesChanged") >= 0);
+                }
+
+                assert_se(sd_bus_message_seal(messages[i], i + 1, 0) >= 0);
+        }
+
+        n_hits = 0;
+        t = now(CLOCK_MONOTONIC);
+
+        for (i = 0; i < N_BENCHMARK_MESSAGES; i++)
+                assert_se(bus_match_run(NULL, &root, messages[i]) == 0);
+
+        t = now(CLOCK_MONOTONIC) - t;
+
+        log_info("%u %s matches: %.2f µs per message",
+                 N_BENCHMARK_MATCHES, arg0 ? "arg0namespace" : "path_namespace", (double) t / N_BENCHMARK_MESSAGES);
+        assert_se(n_hits == N_BENCHMARK_MESSAGES);
+
+        bus_match_free(&root);
+
+        for (i = 0; i < N_BENCHMARK_MESSAGES; i++)
+                sd_bus_message_unref(messages[i]);
+}
+
 static void test_match_scope(const char *match, enum bus_match_scope scope) {
         struct bus_match_component *components = NULL;
         unsigned n_components = 0;
@@ -74,7 +152,7 @@ int main(int argc, char *argv[]) {
         _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
         _cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
         enum bus_match_node_type i;
-        sd_bus_slot slots[19];
+        sd_bus_slot slots[25];
         int r;
 
         r = sd_bus_open_user(&bus);
@@ -99,6 +177,12 @@ int main(int argc, char *argv[]) {
         assert_se(match_add(slots, &root, "arg4has='pa'", 16) >= 0);
         assert_se(match_add(slots, &root, "arg4has='po'", 17) >= 0);
         assert_se(match_add(slots, &root, "arg4='pi'", 18) >= 0);
+        assert_se(match_add(slots, &root, "path_namespace='/'", 19) >= 0);
+        assert_se(match_add(slots, &root, "path_namespace='/fo'", 20) >= 0);
+        assert_se(match_add(slots, &root, "path_namespace='/foo/bar'", 21) >= 0);
+        assert_se(match_add(slots, &root, "arg3namespace='prefix.four'", 22) >= 0);
+        assert_se(match_add(slots, &root, "arg3namespace='prefix.fo'", 23) >= 0);
+        assert_se(match_add(slots, &root, "arg3namespace='prefix.four.five'", 24) >= 0);
 
         bus_match_dump(&root, 0);
 
@@ -108,7 +192,7 @@ int main(int argc, char *argv[]) {
 
         zero(mask);
         assert_se(bus_match_run(NULL, &root, m) == 0);
-        assert_se(mask_contains((unsigned[]) { 9, 8, 7, 5, 10, 12, 13, 14, 15, 16, 17 }, 11));
+        assert_se(mask_contains((unsigned[]) { 9, 8, 7, 5, 10, 12, 13, 14, 15, 16, 17, 19, 21, 22 }, 14));
 
         assert_se(bus_match_remove(&root, &slots[8].match_callback) >= 0);
         assert_se(bus_match_remove(&root, &slots[13].match_callback) >= 0);
@@ -117,7 +201,7 @@ int main(int argc, char *argv[]) {
 
         zero(mask);
         assert_se(bus_match_run(NULL, &root, m) == 0);
-        assert_se(mask_contains((unsigned[]) { 9, 5, 10, 12, 14, 7, 15, 16, 17 }, 9));
+        assert_se(mask_contains((unsigned[]) { 9, 5, 10, 12, 14, 7, 15, 16, 17, 19, 21, 22 }, 12));
 
         for (i = 0; i < _BUS_MATCH_NODE_TYPE_MAX; i++) {
                 char buf[32];
@@ -138,5 +222,8 @@ int main(int argc, char *argv[]) {
         test_match_scope("member='gurke',path='/org/freedesktop/DBus/Local'", BUS_MATCH_LOCAL);
         test_match_scope("arg2='piep',sender='org.freedesktop.DBus',member='waldo'", BUS_MATCH_DRIVER);
 
+        benchmark_match(bus, false);
+        benchmark_match(bus, true);
+
         return 0;
 }
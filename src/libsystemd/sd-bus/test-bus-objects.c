@@ -9,12 +9,20 @@
 #include "bus-dump.h"
 #include "bus-internal.h"
 #include "bus-message.h"
+#include "bus-objects.h"
 #include "bus-util.h"
+#include "fd-util.h"
 #include "log.h"
 #include "macro.h"
+#include "stdio-util.h"
 #include "strv.h"
+#include "time-util.h"
 #include "util.h"
 
+#define N_BENCHMARK_OBJECTS 1000U
+#define N_BENCHMARK_UNITS 1000U
+#define N_BENCHMARK_ROUNDS 50U
+
 struct context {
         int fds[2];
         bool quit;
@@ -502,6 +510,199 @@ static int client(struct context *c) {
         return 0;
 }
 
+static unsigned n_benchmark_calls = 0;
+
+static int benchmark_handler(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        n_benchmark_calls++;
+
+        return sd_bus_reply_method_return(m, NULL) >= 0 ? 1 : -EIO;
+}
+
+static int benchmark_find(sd_bus *bus, const char *path, const char *interface, void *userdata, void **found, sd_bus_error *error) {
+        *found = userdata;
+        return 1;
+}
+
+static const sd_bus_vtable benchmark_vtable[] = {
+        SD_BUS_VTABLE_START(0),
+        SD_BUS_METHOD("Start", "", "", benchmark_handler, 0),
+        SD_BUS_METHOD("Stop", "", "", benchmark_handler, 0),
+        SD_BUS_METHOD("Reload", "", "", benchmark_handler, 0),
+        SD_BUS_METHOD("Restart", "", "", benchmark_handler, 0),
+        SD_BUS_METHOD("Kill", "", "", benchmark_handler, 0),
+        SD_BUS_PROPERTY("Id", "s", NULL, offsetof(struct context, something), SD_BUS_VTABLE_PROPERTY_CONST),
+        SD_BUS_PROPERTY("Description", "s", NULL, offsetof(struct context, something), 0),
+        SD_BUS_PROPERTY("ActiveState", "s", NULL, offsetof(struct context, something), 0),
+        SD_BUS_PROPERTY("SubState", "s", NULL, offsetof(struct context, something), 0),
+        SD_BUS_VTABLE_END
+};
+
+static void *cache_handler_userdata = NULL;
+
+static int cache_handler(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+        cache_handler_userdata = userdata;
+
+        return sd_bus_reply_method_return(m, NULL) >= 0 ? 1 : -EIO;
+}
+
+static const sd_bus_vtable cache_vtable[] = {
+        SD_BUS_VTABLE_START(0),
+        SD_BUS_METHOD("Test", "", "", cache_handler, 0),
+        SD_BUS_VTABLE_END
+};
+
+static void *cache_dispatch(sd_bus *bus, const char *path) {
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+
+        /* Returns the userdata of the vtable that handled the call */
+
+        assert_se(sd_bus_message_new_method_call(bus, &m, NULL, path, "org.freedesktop.systemd.test", "Test") >= 0);
+        assert_se(sd_bus_message_set_expect_reply(m, false) >= 0);
+        assert_se(sd_bus_message_seal(m, 1, 0) >= 0);
+
+        cache_handler_userdata = NULL;
+        bus->iteration_counter++;
+        assert_se(bus_process_object(bus, m) > 0);
+
+        return cache_handler_userdata;
+}
+
+static void test_fallback_cache(void) {
+        sd_bus_slot *child_slot, *fallback_slot;
+        int pair[2] = { -1, -1 };
+        int fallback, child, fallback2;
+        sd_bus *bus;
+
+        /* Calls below a fallback are dispatched to the fallback node of the previous call directly, as long as
+         * it has no children. Check that this never hides an object registered later, nor outlives the node. */
+
+        assert_se(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) >= 0);
+
+        assert_se(sd_bus_new(&bus) >= 0);
+        assert_se(sd_bus_set_fd(bus, pair[0], pair[0]) >= 0);
+        assert_se(sd_bus_set_trusted(bus, true) >= 0);
+        assert_se(sd_bus_add_fallback_vtable(bus, NULL, "/cache", "org.freedesktop.systemd.test", cache_vtable, NULL, &fallback) >= 0);
+        assert_se(sd_bus_start(bus) >= 0);
+
+        assert_se(cache_dispatch(bus, "/cache/a/b") == &fallback);
+        assert_se(bus->last_fallback_node);
+        assert_se(streq(bus->last_fallback_node->path, "/cache"));
+        assert_se(cache_dispatch(bus, "/cache/a/b") == &fallback);
+
+        /* An object registered below the cached fallback node takes over its path right away, */
+        assert_se(sd_bus_add_object_vtable(bus, &child_slot, "/cache/a/b", "org.freedesktop.systemd.test", cache_vtable, &child) >= 0);
+        assert_se(cache_dispatch(bus, "/cache/a/b") == &child);
+
+        /* while the fallback still handles the paths around it */
+        assert_se(cache_dispatch(bus, "/cache/a/c") == &fallback);
+        assert_se(cache_dispatch(bus, "/cache/x") == &fallback);
+        assert_se(cache_dispatch(bus, "/cache/a/b") == &child);
+
+        /* When the object goes away, the fallback handles its path again */
+        child_slot = sd_bus_slot_unref(child_slot);
+        assert_se(cache_dispatch(bus, "/cache/a/b") == &fallback);
+
+        /* A fallback node that goes away is forgotten by the cache, too */
+        assert_se(sd_bus_add_fallback_vtable(bus, &fallback_slot, "/cache/a", "org.freedesktop.systemd.test", cache_vtable, NULL, &fallback2) >= 0);
+        assert_se(cache_dispatch(bus, "/cache/a/b") == &fallback2);
+        assert_se(bus->last_fallback_node);
+        assert_se(streq(bus->last_fallback_node->path, "/cache/a"));
+
+        fallback_slot = sd_bus_slot_unref(fallback_slot);
+        assert_se(!bus->last_fallback_node);
+        assert_se(cache_dispatch(bus, "/cache/a/b") == &fallback);
+
+        sd_bus_unref(bus);
+        safe_close(pair[1]);
+}
+
+static void benchmark_one(sd_bus *bus, sd_bus_message **messages, const char *what) {
+        unsigned i, j;
+        usec_t t;
+
+        n_benchmark_calls = 0;
+        t = now(CLOCK_MONOTONIC);
+
+        for (i = 0; i < N_BENCHMARK_ROUNDS; i++)
+                for (j = 0; j < N_BENCHMARK_UNITS; j++) {
+                        bus->iteration_counter++;
+                        assert_se(sd_bus_message_rewind(messages[j], true) >= 0);
+                        assert_se(bus_process_object(bus, messages[j]) > 0);
+                }
+
+        t = now(CLOCK_MONOTONIC) - t;
+
+        log_info("%s: %.0f ns per call", what, (double) t * NSEC_PER_USEC / (N_BENCHMARK_ROUNDS * N_BENCHMARK_UNITS));
+}
+
+static void benchmark_dispatch(void) {
+        static const char * const types[] = {
+                "Service", "Socket", "Target", "Device", "Mount", "Automount",
+                "Swap", "Timer", "Path", "Slice", "Scope",
+        };
+        sd_bus_message *calls[N_BENCHMARK_UNITS], *gets[N_BENCHMARK_UNITS];
+        struct context c = {};
+        int pair[2] = { -1, -1 };
+        sd_bus *bus;
+        unsigned i;
+
+        /* Dispatches calls to many objects that are all served by the same fallback vtables, like PID1 does for
+         * its units. The calls are handed to the object dispatcher directly, so that only it is measured. */
+
+        assert_se(c.something = strdup("waldo.service"));
+        assert_se(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) >= 0);
+
+        assert_se(sd_bus_new(&bus) >= 0);
+        assert_se(sd_bus_set_fd(bus, pair[0], pair[0]) >= 0);
+        assert_se(sd_bus_set_trusted(bus, true) >= 0);
+
+        assert_se(sd_bus_add_fallback_vtable(bus, NULL, "/org/freedesktop/systemd1/unit", "org.freedesktop.systemd1.Unit", benchmark_vtable, benchmark_find, &c) >= 0);
+        for (i = 0; i < ELEMENTSOF(types); i++) {
+                char interface[STRLEN("org.freedesktop.systemd1.") + 16];
+
+                xsprintf(interface, "org.freedesktop.systemd1.%s", types[i]);
+                assert_se(sd_bus_add_fallback_vtable(bus, NULL, "/org/freedesktop/systemd1/unit", interface, benchmark_vtable, benchmark_find, &c) >= 0);
+        }
+
+        for (i = 0; i < N_BENCHMARK_OBJECTS; i++) {
+                char path[STRLEN("/org/freedesktop/systemd1/job/") + DECIMAL_STR_MAX(unsigned)];
+
+                xsprintf(path, "/org/freedesktop/systemd1/job/%u", i);
+                assert_se(sd_bus_add_object_vtable(bus, NULL, path, "org.freedesktop.systemd1.Job", benchmark_vtable, &c) >= 0);
+        }
+
+        assert_se(sd_bus_start(bus) >= 0);
+
+        for (i = 0; i < N_BENCHMARK_UNITS; i++) {
+                char path[STRLEN("/org/freedesktop/systemd1/unit/unit_") + DECIMAL_STR_MAX(unsigned) + STRLEN("_2eservice")];
+
+                xsprintf(path, "/org/freedesktop/systemd1/unit/unit_%u_2eservice", i);
+
+                assert_se(sd_bus_message_new_method_call(bus, &calls[i], NULL, path, "org.freedesktop.systemd1.Service", "Reload") >= 0);
+                assert_se(sd_bus_message_set_expect_reply(calls[i], false) >= 0);
+                assert_se(sd_bus_message_seal(calls[i], 1, 0) >= 0);
+
+                assert_se(sd_bus_message_new_method_call(bus, &gets[i], NULL, path, "org.freedesktop.DBus.Properties", "Get") >= 0);
+                assert_se(sd_bus_message_append(gets[i], "ss", "org.freedesktop.systemd1.Unit", "ActiveState") >= 0);
+                assert_se(sd_bus_message_set_expect_reply(gets[i], false) >= 0);
+                assert_se(sd_bus_message_seal(gets[i], 1, 0) >= 0);
+        }
+
+        benchmark_one(bus, calls, "fallback method calls");
+        assert_se(n_benchmark_calls == N_BENCHMARK_ROUNDS * N_BENCHMARK_UNITS);
+
+        benchmark_one(bus, gets, "fallback property gets");
+
+        for (i = 0; i < N_BENCHMARK_UNITS; i++) {
+                sd_bus_message_unref(calls[i]);
+                sd_bus_message_unref(gets[i]);
+        }
+
+        sd_bus_unref(bus);
+        safe_close(pair[1]);
+        free(c.something);
+}
+
 int main(int argc, char *argv[]) {
         struct context c = {};
         pthread_t s;
@@ -532,5 +733,8 @@ int main(int argc, char *argv[]) {
         free(c.something);
         free(c.automatic_string_property);
 
+        test_fallback_cache();
+        benchmark_dispatch();
+
         return EXIT_SUCCESS;
 }
@@ -1,26 +1,82 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 
+#include <fcntl.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "sd-bus.h"
+#include "sd-event.h"
 
+#include "alloc-util.h"
 #include "bus-internal.h"
+#include "bus-kernel.h"
+#include "bus-message.h"
 #include "bus-util.h"
+#include "fd-util.h"
 #include "log.h"
 #include "macro.h"
+#include "memfd-util.h"
 #include "util.h"
 
+#define BLOB_SIZE (2 * MEMFD_MIN_SIZE)
+
+/* Signals queued up by test_wqueue(). Their payload is deliberately not a multiple of 8, so that the socket
+ * buffer fills up in the middle of a message rather than at a message boundary. */
+#define WQUEUE_N_SIGNALS 200
+#define WQUEUE_PAYLOAD_SIZE 777
+
 struct context {
         int fds[2];
 
         bool client_negotiate_unix_fds;
         bool server_negotiate_unix_fds;
 
+        bool client_negotiate_memfds;
+        bool server_negotiate_memfds;
+
         bool client_anonymous_auth;
         bool server_anonymous_auth;
 };
 
+static void check_blob(sd_bus_message *m) {
+        const uint8_t *p, *q;
+        const char *s;
+        size_t sz, sz2;
+        uint32_t u;
+
+        assert_se(sd_bus_message_read(m, "s", &s) > 0);
+        assert_se(streq(s, "first"));
+        assert_se(sd_bus_message_read_array(m, 'y', (const void**) &p, &sz) > 0);
+        assert_se(sd_bus_message_read(m, "u", &u) > 0);
+        assert_se(u == 4711);
+        assert_se(sd_bus_message_read_array(m, 'y', (const void**) &q, &sz2) > 0);
+        assert_se(sd_bus_message_read(m, "s", &s) > 0);
+        assert_se(streq(s, "last"));
+
+        assert_se(sz == BLOB_SIZE);
+        assert_se(sz2 == BLOB_SIZE / 2);
+        assert_se(p[0] == 'x' && p[BLOB_SIZE - 1] == 'x');
+        assert_se(memcmp(p + BLOB_SIZE / 2, q, BLOB_SIZE / 2) == 0);
+}
+
+static void check_get_blob(sd_bus_message *m) {
+        _cleanup_(sd_bus_unrefp) sd_bus *plain = NULL;
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *n = NULL;
+        void *blob;
+        size_t sz;
+
+        /* A blob is a message of its own, carrying the contents of the memfds inline, and lacking the field
+         * describing them */
+        assert_se(sd_bus_new(&plain) >= 0);
+        assert_se(bus_message_get_blob(m, &blob, &sz) >= 0);
+        assert_se(bus_message_from_malloc(plain, blob, sz, NULL, 0, NULL, &n) >= 0);
+        assert_se(n->n_memfds == 0);
+        assert_se(n->body_size == m->body_size);
+        check_blob(n);
+}
+
 static void *server(void *p) {
         struct context *c = p;
         sd_bus *bus = NULL;
@@ -35,6 +91,8 @@ static void *server(void *p) {
         assert_se(sd_bus_set_server(bus, 1, id) >= 0);
         assert_se(sd_bus_set_anonymous(bus, c->server_anonymous_auth) >= 0);
         assert_se(sd_bus_negotiate_fds(bus, c->server_negotiate_unix_fds) >= 0);
+        bus->accept_memfd = c->server_negotiate_memfds;
+        bus->use_memfd = c->server_negotiate_memfds;
         assert_se(sd_bus_start(bus) >= 0);
 
         while (!quit) {
@@ -61,10 +119,27 @@ static void *server(void *p) {
 
                 log_info("Got message! member=%s", strna(sd_bus_message_get_member(m)));
 
-                if (sd_bus_message_is_method_call(m, "org.freedesktop.systemd.test", "Exit")) {
+                if (sd_bus_message_is_method_call(m, "org.freedesktop.systemd.test", "Blob")) {
+
+                        /* Large memfds are passed as they are if the client agreed to it */
+                        assert_se(m->n_memfds == (bus->can_memfd ? 2 : 0));
+
+                        check_blob(m);
+                        check_get_blob(m);
+
+                        r = sd_bus_message_new_method_return(m, &reply);
+                        if (r < 0) {
+                                log_error_errno(r, "Failed to allocate return: %m");
+                                goto fail;
+                        }
+
+                } else if (sd_bus_message_is_method_call(m, "org.freedesktop.systemd.test", "Exit")) {
 
                         assert_se((sd_bus_can_send(bus, 'h') >= 1) ==
                                   (c->server_negotiate_unix_fds && c->client_negotiate_unix_fds));
+                        assert_se(bus->can_memfd ==
+                                  (c->server_negotiate_unix_fds && c->client_negotiate_unix_fds &&
+                                   c->server_negotiate_memfds && c->client_negotiate_memfds));
 
                         r = sd_bus_message_new_method_return(m, &reply);
                         if (r < 0) {
@@ -105,6 +180,83 @@ fail:
         return INT_TO_PTR(r);
 }
 
+static uint8_t *wire_copy(sd_bus_message *m, size_t *ret) {
+        struct bus_body_part *part;
+        uint8_t *wire, *e;
+        unsigned i;
+
+        /* What goes over the wire, without the memfds */
+        assert_se(wire = malloc(BUS_MESSAGE_WIRE_SIZE(m)));
+        e = mempcpy(wire, m->header, BUS_MESSAGE_BODY_BEGIN(m));
+        MESSAGE_FOREACH_PART(part, i, m)
+                if (!part->pass_memfd) {
+                        assert_se(bus_body_part_map(part) >= 0);
+                        e = mempcpy(e, part->data, part->size);
+                }
+
+        *ret = e - wire;
+        assert_se(*ret == BUS_MESSAGE_WIRE_SIZE(m));
+        return wire;
+}
+
+static void test_memfds_field(sd_bus_message *m, int memfd) {
+        _cleanup_(sd_bus_unrefp) sd_bus *plain = NULL;
+        sd_bus_message *n;
+        uint8_t *wire;
+        size_t sz;
+        int *fds;
+
+        assert_se(m->n_memfds == 2);
+        assert_se(sd_bus_new(&plain) >= 0);
+
+        check_get_blob(m);
+
+        /* Where memfds weren't negotiated, the field is skipped like any other unknown one, */
+        wire = wire_copy(m, &sz);
+        assert_se(bus_message_from_malloc(plain, wire, sz, NULL, 0, NULL, &n) >= 0);
+        assert_se(n->n_memfds == 0);
+        sd_bus_message_unref(n);
+
+        /* but memfds sent along anyway don't match the number of fds declared in the header */
+        wire = wire_copy(m, &sz);
+        assert_se(fds = new(int, 2));
+        assert_se((fds[0] = fcntl(memfd, F_DUPFD_CLOEXEC, 3)) >= 0);
+        assert_se((fds[1] = fcntl(memfd, F_DUPFD_CLOEXEC, 3)) >= 0);
+        assert_se(bus_message_from_malloc(plain, wire, sz, fds, 2, NULL, &n) == -EBADMSG);
+        close_many(fds, 2);
+        free(fds);
+        free(wire);
+}
+
+static int client_blob(sd_bus *bus) {
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL, *reply = NULL;
+        _cleanup_close_ int fd = -1;
+        void *p;
+        int r;
+
+        fd = memfd_new_and_map("test-blob", BLOB_SIZE, &p);
+        assert_se(fd >= 0);
+        memset(p, 'x', BLOB_SIZE);
+        assert_se(munmap(p, BLOB_SIZE) >= 0);
+
+        /* Two parts of the same memfd, with regular data before, in between and after them */
+        assert_se(sd_bus_message_new_method_call(bus, &m, "org.freedesktop.systemd.test", "/", "org.freedesktop.systemd.test", "Blob") >= 0);
+        assert_se(sd_bus_message_append(m, "s", "first") >= 0);
+        assert_se(sd_bus_message_append_array_memfd(m, 'y', fd, 0, BLOB_SIZE) >= 0);
+        assert_se(sd_bus_message_append(m, "u", 4711) >= 0);
+        assert_se(sd_bus_message_append_array_memfd(m, 'y', fd, BLOB_SIZE / 2, BLOB_SIZE / 2) >= 0);
+        assert_se(sd_bus_message_append(m, "s", "last") >= 0);
+
+        r = sd_bus_call(bus, m, 0, NULL, &reply);
+        if (r < 0)
+                return log_error_errno(r, "Failed to issue method call: %m");
+
+        if (bus->can_memfd)
+                test_memfds_field(m, fd);
+
+        return 0;
+}
+
 static int client(struct context *c) {
         _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL, *reply = NULL;
         _cleanup_(sd_bus_unrefp) sd_bus *bus = NULL;
@@ -114,9 +266,15 @@ static int client(struct context *c) {
         assert_se(sd_bus_new(&bus) >= 0);
         assert_se(sd_bus_set_fd(bus, c->fds[1], c->fds[1]) >= 0);
         assert_se(sd_bus_negotiate_fds(bus, c->client_negotiate_unix_fds) >= 0);
+        bus->accept_memfd = c->client_negotiate_memfds;
+        bus->use_memfd = c->client_negotiate_memfds;
         assert_se(sd_bus_set_anonymous(bus, c->client_anonymous_auth) >= 0);
         assert_se(sd_bus_start(bus) >= 0);
 
+        r = client_blob(bus);
+        if (r < 0)
+                return r;
+
         r = sd_bus_message_new_method_call(
                         bus,
                         &m,
@@ -136,7 +294,171 @@ static int client(struct context *c) {
         return 0;
 }
 
+static void make_pair(sd_bus **ret_a, sd_bus **ret_b) {
+        sd_bus *a, *b;
+        sd_id128_t id;
+        int fds[2];
+
+        /* A connected pair of buses, with the auth handshake done without a second thread */
+        assert_se(socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, fds) >= 0);
+        assert_se(sd_id128_randomize(&id) >= 0);
+
+        assert_se(sd_bus_new(&a) >= 0);
+        assert_se(sd_bus_set_fd(a, fds[0], fds[0]) >= 0);
+        assert_se(sd_bus_set_server(a, 1, id) >= 0);
+        assert_se(sd_bus_start(a) >= 0);
+
+        assert_se(sd_bus_new(&b) >= 0);
+        assert_se(sd_bus_set_fd(b, fds[1], fds[1]) >= 0);
+        assert_se(sd_bus_start(b) >= 0);
+
+        while (a->state != BUS_RUNNING || b->state != BUS_RUNNING) {
+                assert_se(sd_bus_process(a, NULL) >= 0);
+                assert_se(sd_bus_process(b, NULL) >= 0);
+        }
+
+        assert_se(sd_bus_can_send(a, 'h') > 0);
+
+        *ret_a = a;
+        *ret_b = b;
+}
+
+static void check_wqueue_signal(sd_bus_message *m, unsigned i, int fd) {
+        const void *p;
+        struct stat st, st2;
+        size_t sz;
+        uint32_t u;
+        int h;
+
+        assert_se(sd_bus_message_is_signal(m, "org.freedesktop.systemd.test", "Queued"));
+        assert_se(sd_bus_message_read(m, "u", &u) > 0);
+        assert_se(u == i);
+        assert_se(sd_bus_message_read_array(m, 'y', &p, &sz) > 0);
+        assert_se(sz == WQUEUE_PAYLOAD_SIZE);
+        assert_se(((const uint8_t*) p)[0] == (uint8_t) i && ((const uint8_t*) p)[sz - 1] == (uint8_t) i);
+
+        if (i % 50 != 25)
+                return;
+
+        /* The fd arrives with the message it was sent with, not with the batch around it */
+        assert_se(m->n_fds == 1);
+        assert_se(sd_bus_message_read(m, "h", &h) > 0);
+        assert_se(fstat(h, &st) >= 0);
+        assert_se(fstat(fd, &st2) >= 0);
+        assert_se(st.st_ino == st2.st_ino);
+}
+
+static void test_wqueue(void) {
+        _cleanup_(sd_bus_unrefp) sd_bus *a = NULL, *b = NULL;
+        _cleanup_close_ int fd = -1;
+        uint8_t payload[WQUEUE_PAYLOAD_SIZE];
+        bool partial = false;
+        unsigned i, n_received = 0;
+        int sndbuf = 4096;
+
+        make_pair(&a, &b);
+        assert_se((fd = open("/dev/null", O_RDONLY|O_CLOEXEC)) >= 0);
+
+        /* Make the socket buffer tiny, so that only a few messages fit, and the rest are queued */
+        assert_se(setsockopt(a->output_fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) >= 0);
+
+        for (i = 0; i < WQUEUE_N_SIGNALS; i++) {
+                _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+
+                memset(payload, i, sizeof(payload));
+
+                assert_se(sd_bus_message_new_signal(a, &m, "/", "org.freedesktop.systemd.test", "Queued") >= 0);
+                assert_se(sd_bus_message_append(m, "u", i) >= 0);
+                assert_se(sd_bus_message_append_array(m, 'y', payload, sizeof(payload)) >= 0);
+
+                /* Every now and then a message with an fd in the middle of the queue */
+                if (i % 50 == 25)
+                        assert_se(sd_bus_message_append(m, "h", fd) >= 0);
+
+                assert_se(sd_bus_send(a, m, NULL) >= 0);
+        }
+
+        assert_se(a->wqueue_size > 1);
+
+        /* Alternate between draining the socket on one end and writing out the queue on the other. Each
+         * write should end in the middle of a message at least once. */
+        while (n_received < WQUEUE_N_SIGNALS) {
+                for (;;) {
+                        _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+
+                        assert_se(sd_bus_process(b, &m) >= 0);
+                        if (!m)
+                                break;
+
+                        check_wqueue_signal(m, n_received++, fd);
+                }
+
+                assert_se(sd_bus_process(a, NULL) >= 0);
+
+                if (a->wqueue_size > 0 && a->windex > 0)
+                        partial = true;
+        }
+
+        assert_se(a->wqueue_size == 0);
+        assert_se(partial);
+}
+
+static int emit_signals_and_call(sd_event_source *s, void *userdata) {
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+        sd_bus *a = userdata;
+        unsigned i;
+
+        for (i = 0; i < 3; i++)
+                assert_se(sd_bus_emit_signal(a, "/", "org.freedesktop.systemd.test", "Deferred", "u", i) >= 0);
+
+        /* Signals emitted from an event loop callback are only queued, */
+        assert_se(a->wqueue_size == 3);
+
+        /* but anything else is written right away, together with the signals queued before it */
+        assert_se(sd_bus_message_new_method_call(a, &m, "org.freedesktop.systemd.test", "/", "org.freedesktop.systemd.test", "Ping") >= 0);
+        assert_se(sd_bus_send(a, m, NULL) >= 0);
+        assert_se(a->wqueue_size == 0);
+
+        return sd_event_exit(sd_event_source_get_event(s), 0);
+}
+
+static void test_wqueue_defer(void) {
+        _cleanup_(sd_event_source_unrefp) sd_event_source *s = NULL;
+        _cleanup_(sd_event_unrefp) sd_event *e = NULL;
+        _cleanup_(sd_bus_unrefp) sd_bus *a = NULL, *b = NULL;
+        unsigned i;
+
+        make_pair(&a, &b);
+
+        assert_se(sd_event_new(&e) >= 0);
+        assert_se(sd_bus_attach_event(a, e, 0) >= 0);
+        assert_se(sd_event_add_defer(e, &s, emit_signals_and_call, a) >= 0);
+        assert_se(sd_event_loop(e) >= 0);
+
+        /* Everything arrives in the order it was sent */
+        for (i = 0; i < 4; ) {
+                _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+                uint32_t u;
+
+                assert_se(sd_bus_process(b, &m) >= 0);
+                if (!m)
+                        continue;
+
+                if (i < 3) {
+                        assert_se(sd_bus_message_is_signal(m, "org.freedesktop.systemd.test", "Deferred"));
+                        assert_se(sd_bus_message_read(m, "u", &u) > 0);
+                        assert_se(u == i);
+                } else
+                        assert_se(sd_bus_message_is_method_call(m, "org.freedesktop.systemd.test", "Ping"));
+
+                i++;
+        }
+
+        assert_se(sd_bus_detach_event(a) >= 0);
+}
+
 static int test_one(bool client_negotiate_unix_fds, bool server_negotiate_unix_fds,
+                    bool client_negotiate_memfds, bool server_negotiate_memfds,
                     bool client_anonymous_auth, bool server_anonymous_auth) {
 
         struct context c;
@@ -150,6 +472,8 @@ static int test_one(bool client_negotiate_unix_fds, bool server_negotiate_unix_f
 
         c.client_negotiate_unix_fds = client_negotiate_unix_fds;
         c.server_negotiate_unix_fds = server_negotiate_unix_fds;
+        c.client_negotiate_memfds = client_negotiate_memfds;
+        c.server_negotiate_memfds = server_negotiate_memfds;
         c.client_anonymous_auth = client_anonymous_auth;
         c.server_anonymous_auth = server_anonymous_auth;
 
@@ -175,26 +499,42 @@ static int test_one(bool client_negotiate_unix_fds, bool server_negotiate_unix_f
 int main(int argc, char *argv[]) {
         int r;
 
-        r = test_one(true, true, false, false);
+        r = test_one(true, true, false, false, false, false);
+        assert_se(r >= 0);
+
+        r = test_one(true, false, false, false, false, false);
+        assert_se(r >= 0);
+
+        r = test_one(false, true, false, false, false, false);
+        assert_se(r >= 0);
+
+        r = test_one(false, false, false, false, false, false);
         assert_se(r >= 0);
 
-        r = test_one(true, false, false, false);
+        r = test_one(true, true, true, true, false, false);
         assert_se(r >= 0);
 
-        r = test_one(false, true, false, false);
+        /* Memfds are copied if the peer doesn't agree to them, or fds can't be passed at all */
+        r = test_one(true, true, true, false, false, false);
         assert_se(r >= 0);
 
-        r = test_one(false, false, false, false);
+        r = test_one(true, true, false, true, false, false);
         assert_se(r >= 0);
 
-        r = test_one(true, true, true, true);
+        r = test_one(false, true, true, true, false, false);
         assert_se(r >= 0);
 
-        r = test_one(true, true, false, true);
+        r = test_one(true, true, false, false, true, true);
         assert_se(r >= 0);
 
-        r = test_one(true, true, true, false);
+        r = test_one(true, true, false, false, false, true);
+        assert_se(r >= 0);
+
+        r = test_one(true, true, false, false, true, false);
         assert_se(r == -EPERM);
 
+        test_wqueue();
+        test_wqueue_defer();
+
         return EXIT_SUCCESS;
 }
@@ -0,0 +1,553 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "alloc-util.h"
+#include "hashmap.h"
+#include "journal-columnar.h"
+#include "journal-internal.h"
+#include "log.h"
+#include "siphash24.h"
+#include "sparse-endian.h"
+#include "string-util.h"
+#include "strv.h"
+
+/* The stream consists of blocks, each starting with a four character tag, followed by a le32 item count and the
+ * le64 size of the payload that follows:
+ *
+ * "JCOL" starts the stream (the count is the version, currently 1). It may be repeated later on, in which case
+ *        the field and value tables are emptied.
+ * "FLDS" appends field names to the field table. Each is written as le32 length and the name.
+ * "DICT" appends values to the value table. Each is written as le32 field index, le64 length and the value.
+ * "ROWS" contains a batch of entries: the le64 realtime timestamps, the le64 monotonic timestamps and the 16 byte
+ *        boot IDs of all entries, then a le32 count of columns. Each column is written as le32 field index and the
+ *        le32 value index for each entry, 0xFFFFFFFF if the entry doesn't have the field. An entry which carries a
+ *        field more than once has its further values in further columns of the same field.
+ *
+ * Values are identified by the DATA objects they are stored in, hence they are read from the journal files only
+ * the first time they are referenced. The same value may still end up in the table more than once if it is
+ * referenced from more than one file. */
+
+#define BATCH_MAX 4096U
+#define VALUES_MAX (1024U*1024U)
+#define RECENT_MAX 1021U
+
+#define FIELD_NONE UINT32_MAX
+#define VALUE_NONE UINT32_MAX
+
+typedef struct ColumnarValue {
+        /* Key */
+        sd_id128_t file_id;
+        uint64_t offset;
+
+        uint32_t field; /* FIELD_NONE if not included in the output */
+        uint32_t index;
+} ColumnarValue;
+
+typedef struct ColumnarField {
+        char *name;
+        uint32_t index;
+
+        size_t column;      /* First column of the field in the current batch, or SIZE_MAX */
+        uint64_t entry;     /* The entry we last saw the field in... */
+        size_t n_seen;      /* ...and how often */
+} ColumnarField;
+
+typedef struct ColumnarColumn {
+        uint32_t field;
+        size_t next;        /* Column with the next value of the same field, or SIZE_MAX */
+        le32_t *values;     /* BATCH_MAX items */
+} ColumnarColumn;
+
+typedef struct ColumnarBuffer {
+        uint8_t *data;
+        size_t size, allocated;
+        uint32_t n;
+} ColumnarBuffer;
+
+struct JournalColumnar {
+        FILE *file;
+        char **output_fields;
+        bool header_written;
+
+        Hashmap *values;          /* ColumnarValue → ColumnarValue */
+        uint32_t n_values;
+
+        /* Most values are referenced by entries close to each other, hence we look them up here first, by
+         * their position only */
+        ColumnarValue *recent[RECENT_MAX];
+
+        Hashmap *fields_by_name;  /* name → ColumnarField */
+        ColumnarField **fields;
+        size_t n_fields, n_fields_allocated;
+
+        ColumnarBuffer pending_fields, pending_values;
+
+        ColumnarColumn *columns;
+        size_t n_columns, n_columns_allocated;
+
+        le64_t realtime[BATCH_MAX];
+        le64_t monotonic[BATCH_MAX];
+        sd_id128_t boot_id[BATCH_MAX];
+        size_t n_rows;
+
+        uint64_t n_entries;
+};
+
+static void columnar_value_hash_func(const void *p, struct siphash *state) {
+        const ColumnarValue *v = p;
+
+        siphash24_compress(&v->file_id, sizeof(v->file_id), state);
+        siphash24_compress(&v->offset, sizeof(v->offset), state);
+}
+
+static int columnar_value_compare_func(const void *a, const void *b) {
+        const ColumnarValue *x = a, *y = b;
+
+        if (x->offset != y->offset)
+                return x->offset < y->offset ? -1 : 1;
+
+        return memcmp(&x->file_id, &y->file_id, sizeof(x->file_id));
+}
+
+static const struct hash_ops columnar_value_hash_ops = {
+        .hash = columnar_value_hash_func,
+        .compare = columnar_value_compare_func,
+};
+
+static int buffer_append(ColumnarBuffer *b, const void *p, size_t n) {
+        assert(b);
+
+        if (!GREEDY_REALLOC(b->data, b->allocated, b->size + n))
+                return -ENOMEM;
+
+        memcpy(b->data + b->size, p, n);
+        b->size += n;
+
+        return 0;
+}
+
+static int buffer_append_le32(ColumnarBuffer *b, uint32_t v) {
+        le32_t le = htole32(v);
+
+        return buffer_append(b, &le, sizeof(le));
+}
+
+static int buffer_append_le64(ColumnarBuffer *b, uint64_t v) {
+        le64_t le = htole64(v);
+
+        return buffer_append(b, &le, sizeof(le));
+}
+
+static void write_block_header(FILE *f, const char tag[4], uint32_t n, uint64_t size) {
+        le32_t le32 = htole32(n);
+        le64_t le64 = htole64(size);
+
+        fwrite(tag, 4, 1, f);
+        fwrite(&le32, sizeof(le32), 1, f);
+        fwrite(&le64, sizeof(le64), 1, f);
+}
+
+static void write_buffer(FILE *f, const char tag[4], ColumnarBuffer *b) {
+        assert(f);
+        assert(b);
+
+        if (b->n == 0)
+                return;
+
+        write_block_header(f, tag, b->n, b->size);
+        fwrite(b->data, b->size, 1, f);
+
+        b->size = 0;
+        b->n = 0;
+}
+
+int journal_columnar_new(FILE *f, char **output_fields, JournalColumnar **ret) {
+        _cleanup_(journal_columnar_freep) JournalColumnar *c = NULL;
+
+        assert(f);
+        assert(ret);
+
+        c = new0(JournalColumnar, 1);
+        if (!c)
+                return -ENOMEM;
+
+        c->file = f;
+
+        if (output_fields) {
+                c->output_fields = strv_copy(output_fields);
+                if (!c->output_fields)
+                        return -ENOMEM;
+        }
+
+        c->values = hashmap_new(&columnar_value_hash_ops);
+        c->fields_by_name = hashmap_new(&string_hash_ops);
+        if (!c->values || !c->fields_by_name)
+                return -ENOMEM;
+
+        *ret = TAKE_PTR(c);
+        return 0;
+}
+
+static void columnar_reset(JournalColumnar *c) {
+        size_t i;
+
+        assert(c);
+
+        /* Forgets about all fields and values, the next batch starts a new stream */
+
+        hashmap_clear_free(c->values);
+        c->n_values = 0;
+        zero(c->recent);
+
+        hashmap_clear(c->fields_by_name);
+        for (i = 0; i < c->n_fields; i++) {
+                free(c->fields[i]->name);
+                free(c->fields[i]);
+        }
+        c->n_fields = 0;
+
+        c->header_written = false;
+}
+
+JournalColumnar* journal_columnar_free(JournalColumnar *c) {
+        size_t i;
+
+        if (!c)
+                return NULL;
+
+        columnar_reset(c);
+
+        hashmap_free(c->values);
+        hashmap_free(c->fields_by_name);
+        free(c->fields);
+
+        free(c->pending_fields.data);
+        free(c->pending_values.data);
+
+        for (i = 0; i < c->n_columns_allocated; i++)
+                free(c->columns[i].values);
+        free(c->columns);
+
+        strv_free(c->output_fields);
+
+        return mfree(c);
+}
+
+static int columnar_get_field(JournalColumnar *c, const char *name, size_t n, uint32_t *ret) {
+        _cleanup_free_ ColumnarField *field = NULL;
+        ColumnarField *existing;
+        const char *s;
+        int r;
+
+        assert(c);
+        assert(name);
+        assert(ret);
+
+        s = strndupa(name, n);
+
+        existing = hashmap_get(c->fields_by_name, s);
+        if (existing) {
+                *ret = existing->index;
+                return 0;
+        }
+
+        if (c->n_fields >= FIELD_NONE)
+                return -E2BIG;
+
+        if (!GREEDY_REALLOC(c->fields, c->n_fields_allocated, c->n_fields + 1))
+                return -ENOMEM;
+
+        field = new0(ColumnarField, 1);
+        if (!field)
+                return -ENOMEM;
+
+        field->name = strdup(s);
+        if (!field->name)
+                return -ENOMEM;
+
+        field->index = c->n_fields;
+        field->column = SIZE_MAX;
+        field->entry = UINT64_MAX;
+
+        r = buffer_append_le32(&c->pending_fields, n);
+        if (r < 0)
+                goto fail;
+
+        r = buffer_append(&c->pending_fields, name, n);
+        if (r < 0)
+                goto fail;
+
+        r = hashmap_put(c->fields_by_name, field->name, field);
+        if (r < 0)
+                goto fail;
+
+        c->pending_fields.n++;
+
+        *ret = field->index;
+        c->fields[c->n_fields++] = TAKE_PTR(field);
+
+        return 0;
+
+fail:
+        free(field->name);
+        return r;
+}
+
+static int columnar_add_value(
+                JournalColumnar *c,
+                const ColumnarValue *key,
+                const void *data,
+                size_t length,
+                ColumnarValue **ret) {
+
+        _cleanup_free_ ColumnarValue *v = NULL;
+        const char *eq;
+        size_t n;
+        int r;
+
+        assert(c);
+        assert(key);
+        assert(data);
+        assert(ret);
+
+        eq = memchr(data, '=', length);
+        if (!eq)
+                return -EBADMSG;
+
+        n = eq - (const char*) data;
+
+        v = newdup(ColumnarValue, key, 1);
+        if (!v)
+                return -ENOMEM;
+
+        v->field = FIELD_NONE;
+        v->index = VALUE_NONE;
+
+        /* The boot ID is part of each row already */
+        if (!memory_startswith(data, length, "_BOOT_ID=") &&
+            (!c->output_fields || strv_contains(c->output_fields, strndupa(data, n)))) {
+                r = columnar_get_field(c, data, n, &v->field);
+                if (r < 0)
+                        return r;
+
+                r = buffer_append_le32(&c->pending_values, v->field);
+                if (r < 0)
+                        return r;
+
+                r = buffer_append_le64(&c->pending_values, length - n - 1);
+                if (r < 0)
+                        return r;
+
+                r = buffer_append(&c->pending_values, eq + 1, length - n - 1);
+                if (r < 0)
+                        return r;
+
+                v->index = c->n_values++;
+                c->pending_values.n++;
+        }
+
+        r = hashmap_put(c->values, v, v);
+        if (r < 0)
+                return r;
+
+        *ret = TAKE_PTR(v);
+        return 0;
+}
+
+static ColumnarColumn* columnar_get_column(JournalColumnar *c, uint32_t f) {
+        ColumnarField *field;
+        ColumnarColumn *column;
+        size_t *p;
+        size_t k;
+
+        assert(c);
+        assert(f < c->n_fields);
+
+        field = c->fields[f];
+
+        if (field->entry != c->n_entries) {
+                field->entry = c->n_entries;
+                field->n_seen = 0;
+        }
+
+        /* The n-th value of a field in an entry goes into the n-th column of the field */
+        for (p = &field->column, k = 0; *p != SIZE_MAX; p = &c->columns[*p].next, k++)
+                if (k == field->n_seen) {
+                        field->n_seen++;
+                        return c->columns + *p;
+                }
+
+        if (!GREEDY_REALLOC0(c->columns, c->n_columns_allocated, c->n_columns + 1))
+                return NULL;
+
+        column = c->columns + c->n_columns;
+        if (!column->values) {
+                column->values = new(le32_t, BATCH_MAX);
+                if (!column->values)
+                        return NULL;
+        }
+
+        memset(column->values, 0xFF, BATCH_MAX * sizeof(le32_t));
+        column->field = f;
+        column->next = SIZE_MAX;
+
+        /* Note that the array might have moved, hence look up the link again */
+        for (p = &field->column; *p != SIZE_MAX; p = &c->columns[*p].next)
+                ;
+        *p = c->n_columns++;
+
+        field->n_seen++;
+        return column;
+}
+
+static void columnar_drop_row(JournalColumnar *c) {
+        size_t i;
+
+        assert(c);
+
+        for (i = 0; i < c->n_columns; i++)
+                c->columns[i].values[c->n_rows] = htole32(VALUE_NONE);
+}
+
+int journal_columnar_add(JournalColumnar *c, sd_journal *j) {
+        usec_t realtime, monotonic;
+        sd_id128_t boot_id;
+        int r;
+
+        assert(c);
+        assert(j);
+
+        if (c->n_rows >= BATCH_MAX) {
+                r = journal_columnar_flush(c);
+                if (r < 0)
+                        return r;
+        }
+
+        if (c->n_values >= VALUES_MAX) {
+                r = journal_columnar_flush(c);
+                if (r < 0)
+                        return r;
+
+                columnar_reset(c);
+        }
+
+        sd_journal_set_data_threshold(j, 0);
+
+        r = sd_journal_get_realtime_usec(j, &realtime);
+        if (r < 0)
+                return log_error_errno(r, "Failed to get realtime timestamp: %m");
+
+        r = sd_journal_get_monotonic_usec(j, &monotonic, &boot_id);
+        if (r < 0)
+                return log_error_errno(r, "Failed to get monotonic timestamp: %m");
+
+        c->n_entries++;
+
+        for (sd_journal_restart_data(j);;) {
+                ColumnarValue key, *v, **recent;
+                ColumnarColumn *column;
+
+                r = journal_peek_data(j, &key.file_id, &key.offset);
+                if (r < 0)
+                        break;
+                if (r == 0)
+                        break;
+
+                recent = c->recent + key.offset / 8 % RECENT_MAX;
+                v = *recent;
+                if (!v || v->offset != key.offset || !sd_id128_equal(v->file_id, key.file_id))
+                        v = hashmap_get(c->values, &key);
+                if (v)
+                        journal_skip_data(j);
+                else {
+                        const void *data;
+                        size_t length;
+
+                        r = sd_journal_enumerate_data(j, &data, &length);
+                        if (r < 0)
+                                break;
+                        assert(r > 0);
+
+                        r = columnar_add_value(c, &key, data, length, &v);
+                        if (r < 0)
+                                break;
+                }
+
+                *recent = v;
+
+                if (v->field == FIELD_NONE)
+                        continue;
+
+                column = columnar_get_column(c, v->field);
+                if (!column) {
+                        r = -ENOMEM;
+                        break;
+                }
+
+                column->values[c->n_rows] = htole32(v->index);
+        }
+        if (r < 0) {
+                columnar_drop_row(c);
+
+                if (r == -EBADMSG) {
+                        log_debug_errno(r, "Skipping message we can't read: %m");
+                        return 0;
+                }
+
+                return r;
+        }
+
+        c->realtime[c->n_rows] = htole64(realtime);
+        c->monotonic[c->n_rows] = htole64(monotonic);
+        c->boot_id[c->n_rows] = boot_id;
+        c->n_rows++;
+
+        return 0;
+}
+
+int journal_columnar_flush(JournalColumnar *c) {
+        uint64_t size;
+        le32_t le32;
+        size_t i, n;
+
+        assert(c);
+
+        if (!c->header_written) {
+                write_block_header(c->file, "JCOL", 1, 0);
+                c->header_written = true;
+        }
+
+        write_buffer(c->file, "FLDS", &c->pending_fields);
+        write_buffer(c->file, "DICT", &c->pending_values);
+
+        n = c->n_rows;
+        if (n == 0)
+                return 0;
+
+        size = n * (sizeof(le64_t) * 2 + sizeof(sd_id128_t)) + sizeof(le32_t) +
+                c->n_columns * (sizeof(le32_t) + n * sizeof(le32_t));
+
+        write_block_header(c->file, "ROWS", n, size);
+        fwrite(c->realtime, sizeof(le64_t), n, c->file);
+        fwrite(c->monotonic, sizeof(le64_t), n, c->file);
+        fwrite(c->boot_id, sizeof(sd_id128_t), n, c->file);
+
+        le32 = htole32(c->n_columns);
+        fwrite(&le32, sizeof(le32), 1, c->file);
+
+        for (i = 0; i < c->n_columns; i++) {
+                le32 = htole32(c->columns[i].field);
+                fwrite(&le32, sizeof(le32), 1, c->file);
+                fwrite(c->columns[i].values, sizeof(le32_t), n, c->file);
+        }
+
+        /* The columns are set up anew for each batch, as fields come and go */
+        for (i = 0; i < c->n_fields; i++)
+                c->fields[i]->column = SIZE_MAX;
+        c->n_columns = 0;
+        c->n_rows = 0;
+
+        return ferror(c->file) ? -EIO : 0;
+}
@@ -0,0 +1,21 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+#pragma once
+
+#include <stdio.h>
+
+#include "sd-journal.h"
+
+#include "macro.h"
+
+/* Writes journal entries in batches, with one column per field. Each distinct field value is written only once
+ * into a dictionary, and referred to by its index from then on. See the "export-columnar" output mode. */
+
+typedef struct JournalColumnar JournalColumnar;
+
+int journal_columnar_new(FILE *f, char **output_fields, JournalColumnar **ret);
+JournalColumnar* journal_columnar_free(JournalColumnar *c);
+
+int journal_columnar_add(JournalColumnar *c, sd_journal *j);
+int journal_columnar_flush(JournalColumnar *c);
+
+DEFINE_TRIVIAL_CLEANUP_FUNC(JournalColumnar*, journal_columnar_free);
@@ -20,6 +20,7 @@
 #include "hashmap.h"
 #include "hostname-util.h"
 #include "io-util.h"
+#include "journal-columnar.h"
 #include "journal-internal.h"
 #include "log.h"
 #include "logs-show.h"
@@ -695,6 +696,41 @@ static int output_export(
         return 0;
 }
 
+static int output_export_columnar(
+                FILE *f,
+                sd_journal *j,
+                OutputMode mode,
+                unsigned n_columns,
+                OutputFlags flags,
+                Set *output_fields,
+                size_t highlight[2]) {
+
+        _cleanup_(journal_columnar_freep) JournalColumnar *c = NULL;
+        _cleanup_free_ char **fields = NULL;
+        int r;
+
+        assert(j);
+
+        /* Writes a stream of its own for each entry. Bulk exports should keep a JournalColumnar object around
+         * instead, so that values are written only once, see journalctl. */
+
+        if (output_fields) {
+                fields = set_get_strv(output_fields);
+                if (!fields)
+                        return log_oom();
+        }
+
+        r = journal_columnar_new(f, fields, &c);
+        if (r < 0)
+                return log_oom();
+
+        r = journal_columnar_add(c, j);
+        if (r < 0)
+                return r;
+
+        return journal_columnar_flush(c);
+}
+
 void json_escape(
                 FILE *f,
                 const char* p,
@@ -1034,6 +1070,7 @@ static int (*output_funcs[_OUTPUT_MODE_MAX])(
         [OUTPUT_SHORT_FULL] = output_short,
         [OUTPUT_VERBOSE] = output_verbose,
         [OUTPUT_EXPORT] = output_export,
+        [OUTPUT_EXPORT_COLUMNAR] = output_export_columnar,
         [OUTPUT_JSON] = output_json,
         [OUTPUT_JSON_PRETTY] = output_json,
         [OUTPUT_JSON_SSE] = output_json,
@@ -13,6 +13,7 @@ typedef enum OutputMode {
         OUTPUT_SHORT_UNIX,
         OUTPUT_VERBOSE,
         OUTPUT_EXPORT,
+        OUTPUT_EXPORT_COLUMNAR,
         OUTPUT_JSON,
         OUTPUT_JSON_PRETTY,
         OUTPUT_JSON_SSE,